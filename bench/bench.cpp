@@ -0,0 +1,789 @@
+// Benchmarks of every parsing stage of the dump and of emfat sector
+// generation, run against synthetic images of several shapes and sizes.
+//
+// Images are generated with emfat into sparse files in a temporary directory,
+// so nothing but the build is needed. Results go to stdout (or --out) as JSON
+// in the layout of Google Benchmark, progress goes to stderr.
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "CLI/CLI.hpp"
+
+#include "fat_dump.h"
+#include "fat_find.h"
+#include "merkle.h"
+#include "owner_map.h"
+#include "quick_check.h"
+#include "sha256.h"
+#include "synth_image.h"
+#include "timeline.h"
+#include "tree_walk.h"
+
+// discards output but keeps the formatting work
+class NullBuffer : public std::streambuf {
+protected:
+  int overflow(int c) override { return c; }
+  std::streamsize xsputn(const char *, std::streamsize n) override {
+    return n;
+  }
+};
+
+struct ImageSpec {
+  const char *name;
+  unsigned files_per_dir;
+  unsigned dirs_per_level;
+  unsigned depth;
+  uint32_t file_size;
+};
+
+// small: a bit of everything, wide: one huge directory, deep: a long path,
+// large: 64 GiB volume with a 64 MiB FAT
+static const ImageSpec IMAGES[] = {
+    {"small", 64, 8, 1, 64 * 1024},
+    {"wide", 50000, 0, 0, 4096},
+    {"deep", 8, 1, 128, 16 * 1024},
+    {"large", 256, 16, 1, 16 * 1024 * 1024},
+};
+
+static constexpr size_t PATTERN_SIZE = 64 * 1024;
+static uint8_t pattern[PATTERN_SIZE];
+
+static void read_pattern(uint8_t *dest, int size, uint32_t offset, size_t) {
+  size_t pos = offset % PATTERN_SIZE;
+  while (size > 0) {
+    auto n = std::min<size_t>(size, PATTERN_SIZE - pos);
+    std::memcpy(dest, &pattern[pos], n);
+    dest += n;
+    size -= n;
+    pos = 0;
+  }
+}
+
+static const uint8_t *map_pattern(uint32_t offset, uint32_t *size, size_t) {
+  size_t pos = offset % PATTERN_SIZE;
+  *size = (uint32_t)std::min<size_t>(*size, PATTERN_SIZE - pos);
+  return pattern + pos;
+}
+
+struct Image {
+  const ImageSpec &spec;
+  std::string path;
+  std::deque<std::string> names;
+  std::vector<emfat_entry_t> entries;
+  std::unique_ptr<emfat_t> emfat;
+  uint64_t directory_sectors = 0;
+
+  explicit Image(const ImageSpec &spec) : spec(spec) {}
+  ~Image() {
+    if (!path.empty()) {
+      ::unlink(path.c_str());
+    }
+  }
+
+  void add_dir(int level, unsigned depth) {
+    for (unsigned i = 0; i < spec.files_per_dir; ++i) {
+      std::stringstream ss;
+      ss << 'F' << std::setw(5) << std::setfill('0') << i << ".BIN";
+      emfat_entry_t e{};
+      e.name = names.emplace_back(ss.str()).c_str();
+      e.level = level;
+      e.curr_size = e.max_size = spec.file_size;
+      e.readcb = read_pattern;
+      e.mapcb = map_pattern;
+      entries.emplace_back(e);
+    }
+    for (unsigned i = 0; depth && i < spec.dirs_per_level; ++i) {
+      emfat_entry_t e{};
+      e.name = names.emplace_back("D" + std::to_string(i)).c_str();
+      e.level = level;
+      e.dir = true;
+      entries.emplace_back(e);
+      add_dir(level + 1, depth - 1);
+    }
+  }
+
+  bool generate(const std::string &dir) {
+    emfat_entry_t root{};
+    root.name = "";
+    root.dir = true;
+    entries.emplace_back(root);
+    add_dir(1, spec.depth);
+    entries.emplace_back(emfat_entry_t{});
+
+    emfat = std::make_unique<emfat_t>();
+    if (!emfat_init(emfat.get(), "BENCH", entries.data())) {
+      return false;
+    }
+
+    path = dir + "/fat32_bench_" + spec.name + "." +
+           std::to_string(::getpid()) + ".img";
+    auto fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ::ftruncate(fd, (off_t)emfat->vol_size) != 0) {
+      return false;
+    }
+
+    // metadata and directories only, file data stays a hole
+    emfat_cursor_t cursor;
+    emfat_cursor_init(emfat.get(), &cursor);
+    std::vector<uint8_t> buf(1024 * SECT);
+    auto put = [&](uint32_t first, uint32_t count) {
+      while (count) {
+        auto n = std::min<uint32_t>(count, 1024);
+        emfat_read_r(emfat.get(), &cursor, buf.data(), first, n);
+        if (::pwrite(fd, buf.data(), (size_t)n * SECT,
+                     (off_t)first * SECT) != (ssize_t)n * SECT) {
+          return false;
+        }
+        first += n;
+        count -= n;
+      }
+      return true;
+    };
+
+    bool ok = put(0, emfat->priv.root_lba);
+    for (auto &e : entries) {
+      if (ok && e.name != nullptr && e.dir) {
+        auto count = (e.priv.last_clust - e.priv.first_clust + 1) *
+                     SECT_PER_CLUST;
+        ok = put(emfat->priv.root_lba +
+                     (e.priv.first_clust - 2) * SECT_PER_CLUST,
+                 count);
+        directory_sectors += count;
+      }
+    }
+    return ::close(fd) == 0 && ok;
+  }
+};
+
+struct Result {
+  std::string name;
+  uint64_t iterations;
+  double real_ns;
+  double cpu_ns;
+  uint64_t bytes;
+  uint64_t items;
+};
+
+static double thread_cpu_seconds() {
+  timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+class Bench {
+public:
+  Bench(double min_time, std::string filter)
+      : min_time_(min_time), filter_(std::move(filter)) {}
+
+  // f() returns something derived from its work so it is not optimised out;
+  // bytes and items are per call
+  template <typename F>
+  void run(const std::string &name, uint64_t bytes, uint64_t items, F &&f) {
+    if (!filter_.empty() && name.find(filter_) == std::string::npos) {
+      return;
+    }
+
+    sink_ += f(); // warm up caches and page tables
+
+    uint64_t iterations = 1;
+    while (true) {
+      auto start = std::chrono::steady_clock::now();
+      auto cpu_start = thread_cpu_seconds();
+      for (uint64_t i = 0; i < iterations; ++i) {
+        sink_ += f();
+      }
+      auto cpu = thread_cpu_seconds() - cpu_start;
+      auto real = std::chrono::duration<double>(
+                      std::chrono::steady_clock::now() - start)
+                      .count();
+
+      if (real >= min_time_ || iterations >= (1ull << 40)) {
+        results_.push_back({name, iterations, real * 1e9 / iterations,
+                            cpu * 1e9 / iterations, bytes, items});
+        report(results_.back());
+        return;
+      }
+      // aim a bit above min_time to avoid another round
+      auto scale = real > 0 ? min_time_ * 1.4 / real : 100.0;
+      iterations = std::max<uint64_t>(iterations * 2,
+                                      (uint64_t)(iterations * scale));
+    }
+  }
+
+  void write_json(std::ostream &os) const {
+    auto now = std::time(nullptr);
+    char date[64];
+    std::strftime(date, sizeof(date), "%FT%T%z", std::localtime(&now));
+
+    os << "{\n  \"context\": {\n"
+       << "    \"date\": \"" << date << "\",\n"
+       << "    \"num_cpus\": " << std::thread::hardware_concurrency() << ",\n"
+#ifdef NDEBUG
+       << "    \"library_build_type\": \"release\",\n"
+#else
+       << "    \"library_build_type\": \"debug\",\n"
+#endif
+       << "    \"min_time\": " << min_time_ << "\n  },\n"
+       << "  \"benchmarks\": [";
+    for (size_t i = 0; i < results_.size(); ++i) {
+      auto &r = results_[i];
+      auto per_second = 1e9 / r.real_ns;
+      os << (i ? ",\n" : "\n") << "    {\"name\": \"" << r.name
+         << "\", \"iterations\": " << r.iterations
+         << ", \"real_time\": " << r.real_ns
+         << ", \"cpu_time\": " << r.cpu_ns << ", \"time_unit\": \"ns\""
+         << ", \"bytes_per_second\": " << r.bytes * per_second
+         << ", \"items_per_second\": " << r.items * per_second << "}";
+    }
+    os << "\n  ]\n}" << std::endl;
+  }
+
+private:
+  static void report(const Result &r) {
+    std::cerr << std::left << std::setw(28) << r.name << std::right
+              << std::setw(14) << std::fixed << std::setprecision(0)
+              << r.real_ns << " ns" << std::setw(12) << r.iterations;
+    if (r.bytes) {
+      std::cerr << std::setw(12) << std::setprecision(1)
+                << r.bytes * 1e9 / r.real_ns / (1024 * 1024) << " MiB/s";
+    }
+    if (r.items) {
+      std::cerr << std::setw(14) << std::setprecision(0)
+                << r.items * 1e9 / r.real_ns << " items/s";
+    }
+    std::cerr << std::defaultfloat << std::endl;
+  }
+
+  double min_time_;
+  std::string filter_;
+  std::vector<Result> results_;
+  volatile uint64_t sink_ = 0;
+};
+
+static bool bench_image(Bench &bench, const Image &image) {
+  auto &emfat = *image.emfat;
+  auto &path = image.path;
+  auto suffix = std::string("/") + image.spec.name;
+
+  NullBuffer null_buffer;
+  std::ostream null(&null_buffer);
+
+  const auto fat_sectors = emfat.priv.fat2_lba - emfat.priv.fat1_lba;
+
+  std::error_code err;
+  fat32::Image disk;
+  fat32::Volume volume;
+  if (!disk.open(path, err) ||
+      !disk.volume(disk.partitions(err).at(0), volume, err)) {
+    std::cerr << "Failed to open " << path << ": " << err.message()
+              << std::endl;
+    return false;
+  }
+  const auto fat = volume.fat();
+  const auto root = volume.root_cluster();
+
+  // directory statistics used to normalise the results
+  std::vector<uint32_t> file_starts;
+  uint64_t entries = 0;
+  fat32::walk_tree(volume, root, [&](const fat32::Entry &e, int) {
+    ++entries;
+    if (!e.is_dir() && !e.is_volume_label()) {
+      file_starts.push_back(e.first_cluster());
+    }
+  });
+  uint64_t chain_clusters = 0;
+  uint64_t extents = 0;
+  for (auto c : file_starts) {
+    for (auto &x : fat.extents(c)) {
+      chain_clusters += x.count;
+      ++extents;
+    }
+  }
+
+  bench.run("mbr" + suffix, SECT, 1, [&] {
+    dump_mbr(disk.mbr(), null);
+    return 1;
+  });
+  const auto partitions = disk.partitions(err);
+  bench.run("partitions" + suffix, SECT, partitions.size(),
+            [&] { return (uint64_t)disk.partitions(err).size(); });
+  bench.run("volume_open" + suffix, SECT, 1, [&] {
+    fat32::Volume v;
+    return (uint64_t)disk.volume(partitions[0], v, err);
+  });
+  bench.run("boot_sector" + suffix, SECT, 1, [&] {
+    dump_boot_sect(volume, null);
+    return 1;
+  });
+  bench.run("fsinfo" + suffix, SECT, 1, [&] {
+    dump_fsinfo(volume, null);
+    return 1;
+  });
+  bench.run("fat_scan" + suffix, fat.bytes(), fat.count(),
+            [&] { return fat.summary().used; });
+  // chains with the entry width fixed at compile time, as walk_chain and
+  // summary() run them, and decoded by the width at run time
+  bench.run("chain_walk" + suffix, chain_clusters * 4, chain_clusters, [&] {
+    return fat.visit([&](const auto &typed) {
+      uint64_t n = 0;
+      for (auto c : file_starts) {
+        for (auto cl : typed.chain(c)) {
+          n += cl;
+        }
+      }
+      return n;
+    });
+  });
+  bench.run("chain_walk_any" + suffix, chain_clusters * 4, chain_clusters,
+            [&] {
+              uint64_t n = 0;
+              for (auto c : file_starts) {
+                for (auto cl : fat.chain(c)) {
+                  n += cl;
+                }
+              }
+              return n;
+            });
+  // the same through FAT windows within 1 MiB
+  fat32::FatWindows windows;
+  if (!windows.open(path, volume, 0, fat32::FatWindows::DEFAULT_WINDOW,
+                    1024 * 1024, err)) {
+    std::cerr << "Failed to open " << path << ": " << err.message()
+              << std::endl;
+    return false;
+  }
+  bench.run("fat_scan_windowed" + suffix, fat.bytes(), fat.count(),
+            [&] { return windows.summary().used; });
+  bench.run("chain_walk_windowed" + suffix, chain_clusters * 4,
+            chain_clusters, [&] {
+              return windows.visit([&](const auto &typed) {
+                uint64_t n = 0;
+                for (auto c : file_starts) {
+                  for (auto cl : typed.chain(c)) {
+                    n += cl;
+                  }
+                }
+                return n;
+              });
+            });
+  bench.run("extent_walk" + suffix, chain_clusters * 4, extents, [&] {
+    return fat.visit([&](const auto &typed) {
+      uint64_t n = 0;
+      for (auto c : file_starts) {
+        for (auto &x : typed.extents(c)) {
+          n += x.count;
+        }
+      }
+      return n;
+    });
+  });
+  bench.run("dir_walk" + suffix, image.directory_sectors * SECT, entries, [&] {
+    uint64_t n = 0;
+    fat32::walk_tree(volume, root, [&n](const fat32::Entry &e, int depth) {
+      n += e.size() + depth;
+    });
+    return n;
+  });
+  // the same walk with directories read on a WorkPool, one per core, and
+  // names not decoded as dir_walk does not
+  for (bool ordered : {true, false}) {
+    WalkOptions walk;
+    walk.ordered = ordered;
+    walk.names = false;
+    auto name = ordered ? "dir_walk_parallel" : "dir_walk_unordered";
+    bench.run(name + suffix, image.directory_sectors * SECT, entries, [&] {
+      uint64_t n = 0;
+      parallel_walk(volume, root, walk, nullptr, [&n](const WalkEntry &e) {
+        n += e.raw->size + e.depth();
+        return true;
+      });
+      return n;
+    });
+  }
+  // consumers that stop early only pay for what they read
+  bench.run("tree_first" + suffix, sizeof(dir_entry), 1, [&] {
+    auto tree = volume.tree();
+    return (uint64_t)(*tree.begin()).size();
+  });
+  bench.run("tree_first_100" + suffix, 0, 100, [&] {
+    uint64_t n = 0;
+    auto tree = volume.tree();
+    auto it = tree.begin();
+    for (int i = 0; i < 100 && it != tree.end(); ++i, ++it) {
+      n += (*it).size();
+    }
+    return n;
+  });
+  bench.run("short_names" + suffix, image.directory_sectors * SECT, entries,
+            [&] {
+              uint64_t n = 0;
+              fat32::walk_tree(volume, root,
+                               [&n](const fat32::Entry &e, int) {
+                                 n += e.short_name().size;
+                               });
+              return n;
+            });
+  // find: a raw field test over every slot, then a path glob that keeps
+  // one top level directory and prunes the rest
+  auto find = [&](const FindQuery &query, FindStats *stats = nullptr) {
+    FindFilter filter;
+    std::string error;
+    filter.compile(query, error);
+    uint64_t n = 0;
+    filter.run(
+        volume,
+        [&n](const fat32::TreeIterator &, const std::string &path) {
+          n += path.size();
+          return true;
+        },
+        stats);
+    return n;
+  };
+  FindQuery by_size;
+  by_size.min_size = image.spec.file_size + 1;
+  bench.run("find_size" + suffix, image.directory_sectors * SECT, entries,
+            [&] { return find(by_size); });
+  FindQuery by_path;
+  by_path.path = "D0/**/F00000.BIN";
+  FindStats path_stats;
+  find(by_path, &path_stats);
+  bench.run("find_path" + suffix, 0, path_stats.matches,
+            [&] { return find(by_path); });
+  bench.run("format" + suffix, 0, image.spec.files_per_dir, [&] {
+    dump_fat(volume, 0, null);
+    return 1;
+  });
+  bench.run("dump_image" + suffix, 0, 1,
+            [&] { return (uint64_t)dump_image(path, null); });
+  // open, map and check, what triage pays per image
+  bench.run("quick_check" + suffix, 0, 1,
+            [&] { return (uint64_t)quick_check(path).findings.size(); });
+
+  // every cluster hashed in one thread, holes of the sparse image skipped
+  MerkleStats merkle;
+  merkle_index(path, path + ".merkle", 1, merkle, err);
+  bench.run("merkle_index" + suffix, merkle.bytes_read, merkle.leaves, [&] {
+    merkle_index(path, path + ".merkle", 1, merkle, err);
+    return merkle.leaves;
+  });
+  ::unlink((path + ".merkle").c_str());
+
+  OwnerMap owners;
+  bench.run("owner_map" + suffix, fat.bytes(), entries, [&] {
+    owners.build(volume);
+    return (uint64_t)owners.entries();
+  });
+  // a batch of lookups, one per file, through the map built above
+  bench.run("whois" + suffix, 0, file_starts.size(), [&] {
+    uint64_t sum = 0;
+    for (auto c : file_starts) {
+      auto o = owners.owner(c);
+      uint64_t before = 0;
+      if (o < owners.entries() && owners.position(fat, o, c, before)) {
+        sum += o + before;
+      }
+    }
+    return sum;
+  });
+
+  // emfat sector generation
+  emfat_cursor_t cursor;
+  emfat_cursor_init(&emfat, &cursor);
+  std::vector<uint8_t> buf(1024 * SECT);
+
+  bench.run("emfat_fat" + suffix, (uint64_t)fat_sectors * SECT, fat_sectors,
+            [&] {
+              for (uint32_t s = 0; s < fat_sectors; s += 1024) {
+                auto n = std::min<uint32_t>(1024, fat_sectors - s);
+                emfat_read_r(&emfat, &cursor, buf.data(),
+                             emfat.priv.fat1_lba + s, n);
+              }
+              return buf[0];
+            });
+  bench.run("emfat_dir" + suffix, image.directory_sectors * SECT,
+            image.directory_sectors, [&] {
+              for (auto &e : image.entries) {
+                if (e.name == nullptr || !e.dir) {
+                  continue;
+                }
+                auto first = emfat.priv.root_lba +
+                             (e.priv.first_clust - 2) * SECT_PER_CLUST;
+                auto count = (e.priv.last_clust - e.priv.first_clust + 1) *
+                             SECT_PER_CLUST;
+                for (uint32_t s = 0; s < count; s += 1024) {
+                  emfat_read_r(&emfat, &cursor, buf.data(), first + s,
+                               std::min<uint32_t>(1024, count - s));
+                }
+              }
+              return buf[0];
+            });
+
+  // file data, capped so the big image does not dominate the run time
+  const uint32_t data_sectors = std::min<uint64_t>(
+      emfat.disk_sectors - emfat.priv.root_lba, 256 * 1024 * 1024 / SECT);
+  bench.run("emfat_data" + suffix, (uint64_t)data_sectors * SECT,
+            data_sectors, [&] {
+              for (uint32_t s = 0; s < data_sectors; s += 1024) {
+                emfat_read_r(&emfat, &cursor, buf.data(),
+                             emfat.priv.root_lba + s,
+                             std::min<uint32_t>(1024, data_sectors - s));
+              }
+              return buf[0];
+            });
+  // the same data described instead of copied
+  std::vector<emfat_seg_t> segs(1024);
+  bench.run("emfat_readv" + suffix, (uint64_t)data_sectors * SECT,
+            data_sectors, [&] {
+              uint64_t sum = 0;
+              for (uint32_t s = 0; s < data_sectors;) {
+                int num_segs = 0;
+                s += emfat_readv_r(&emfat, &cursor, segs.data(), 1024,
+                                   &num_segs, buf.data(), 1024,
+                                   emfat.priv.root_lba + s,
+                                   std::min<uint32_t>(1024, data_sectors - s));
+                sum += num_segs;
+              }
+              return sum;
+            });
+  return true;
+}
+
+// emfat writes 8.3 names only, long names get a synth volume of their own:
+// one directory with 200000 files, each name in 3 long name slots
+static bool bench_long_names(Bench &bench, const std::string &tmpdir) {
+  SynthSpec spec;
+  spec.files_per_dir = 200000;
+  spec.dirs_per_dir = 0;
+  spec.depth = 0;
+  spec.mean_file_clusters = 1;
+  spec.long_names = true;
+
+  auto path = tmpdir + "/fat32_bench_lfn." + std::to_string(::getpid()) +
+              ".img";
+  SynthStats stats;
+  std::error_code err;
+  fat32::Image disk;
+  fat32::Volume volume;
+  bool ok = synth_image(spec, path, stats, err) && disk.open(path, err) &&
+            disk.volume(disk.partitions(err).at(0), volume, err);
+  // the mapping outlives the name
+  ::unlink(path.c_str());
+  if (!ok) {
+    std::cerr << "Failed to generate image lfn in " << tmpdir << ": "
+              << err.message() << std::endl;
+    return false;
+  }
+  std::cerr << "# lfn: " << stats.volume_size << " bytes, " << stats.files
+            << " entries" << std::endl;
+
+  const auto root = volume.root_cluster();
+  const uint64_t bytes = stats.files * 4 * sizeof(dir_entry);
+  bench.run("short_names/lfn", bytes, stats.files, [&] {
+    uint64_t n = 0;
+    fat32::walk_tree(volume, root, [&n](const fat32::Entry &e, int) {
+      n += e.short_name().size;
+    });
+    return n;
+  });
+  bench.run("long_names/lfn", bytes, stats.files, [&] {
+    uint64_t n = 0;
+    fat32::walk_tree(volume, root, [&n](const fat32::Entry &e, int) {
+      n += e.name().size;
+    });
+    return n;
+  });
+  FindQuery query;
+  query.name = "*7.data";
+  FindFilter filter;
+  std::string error;
+  filter.compile(query, error);
+  bench.run("find_name/lfn", bytes, stats.files, [&] {
+    uint64_t n = 0;
+    filter.run(volume, [&n](const fat32::TreeIterator &, const std::string &) {
+      ++n;
+      return true;
+    });
+    return n;
+  });
+  bench.run("timeline/lfn", bytes, stats.files * 3, [&] {
+    Timeline timeline;
+    timeline.add(volume, 0);
+    timeline.sort(0);
+    return (uint64_t)timeline.events();
+  });
+  return true;
+}
+
+// FAT12/16 volumes are small by definition, their tables are scanned and
+// walked with the decoder of their width
+static bool bench_fat_width(Bench &bench, const std::string &tmpdir,
+                            unsigned bits) {
+  SynthSpec spec;
+  spec.fat_bits = bits;
+  spec.clusters = bits == 12 ? 4084 : 65524;
+  spec.sectors_per_cluster = bits == 12 ? 1 : 4;
+  spec.files_per_dir = bits == 12 ? 16 : 64;
+  spec.dirs_per_dir = 4;
+  spec.depth = 2;
+  spec.mean_file_clusters = bits == 12 ? 2 : 8;
+  spec.fragmentation = 0.2;
+
+  auto name = "fat" + std::to_string(bits);
+  auto path = tmpdir + "/fat32_bench_" + name + "." +
+              std::to_string(::getpid()) + ".img";
+  SynthStats stats;
+  std::error_code err;
+  fat32::Image disk;
+  fat32::Volume volume;
+  bool ok = synth_image(spec, path, stats, err) && disk.open(path, err) &&
+            disk.volume(disk.partitions(err).at(0), volume, err);
+  ::unlink(path.c_str());
+  if (!ok) {
+    std::cerr << "Failed to generate image " << name << " in " << tmpdir
+              << ": " << err.message() << std::endl;
+    return false;
+  }
+  std::cerr << "# " << name << ": " << stats.volume_size << " bytes, "
+            << stats.files << " files" << std::endl;
+
+  const auto suffix = "/" + name;
+  const auto fat = volume.fat();
+  std::vector<uint32_t> file_starts;
+  uint64_t entries = 0;
+  fat32::walk_tree(volume, volume.root_cluster(),
+                   [&](const fat32::Entry &e, int) {
+                     ++entries;
+                     if (!e.is_dir() && !e.is_volume_label()) {
+                       file_starts.push_back(e.first_cluster());
+                     }
+                   });
+  uint64_t chain_clusters = 0;
+  for (auto c : file_starts) {
+    fat32::walk_chain(fat, c, [&](uint32_t) { ++chain_clusters; });
+  }
+
+  bench.run("fat_scan" + suffix, fat.bytes(), fat.count(),
+            [&] { return fat.summary().used; });
+  bench.run("chain_walk" + suffix, chain_clusters * bits / 8, chain_clusters,
+            [&] {
+              return fat.visit([&](const auto &typed) {
+                uint64_t n = 0;
+                for (auto c : file_starts) {
+                  for (auto cl : typed.chain(c)) {
+                    n += cl;
+                  }
+                }
+                return n;
+              });
+            });
+  bench.run("chain_walk_any" + suffix, chain_clusters * bits / 8,
+            chain_clusters, [&] {
+              uint64_t n = 0;
+              for (auto c : file_starts) {
+                for (auto cl : fat.chain(c)) {
+                  n += cl;
+                }
+              }
+              return n;
+            });
+  bench.run("dir_walk" + suffix, entries * sizeof(dir_entry), entries, [&] {
+    uint64_t n = 0;
+    fat32::walk_tree(volume, volume.root_cluster(),
+                     [&n](const fat32::Entry &e, int depth) {
+                       n += e.size() + depth;
+                     });
+    return n;
+  });
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  double min_time = 0.5;
+  std::string filter;
+  std::string out;
+  std::string tmpdir = ::getenv("TMPDIR") ? ::getenv("TMPDIR") : "/tmp";
+  std::vector<std::string> only;
+
+  CLI::App app{"fat32_bench"};
+  app.add_option("--min-time", min_time, "Seconds to run each benchmark.");
+  app.add_option("--filter", filter, "Run benchmarks containing this text.");
+  app.add_option("--out", out, "Write JSON results here instead of stdout.");
+  app.add_option("--tmpdir", tmpdir, "Where to generate the images.");
+  app.add_option("--image", only,
+                 "small, wide, deep, large, lfn, fat12 or fat16; all if "
+                 "unset.");
+  CLI11_PARSE(app, argc, argv);
+
+  uint32_t x = 2463534242;
+  for (auto &b : pattern) {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    b = x;
+  }
+
+  Bench bench(min_time, filter);
+  bench.run("sha256", PATTERN_SIZE, 1, [&] {
+    return (uint64_t)Sha256::hash(pattern, PATTERN_SIZE)[0];
+  });
+  for (auto &spec : IMAGES) {
+    if (!only.empty() &&
+        std::find(only.begin(), only.end(), spec.name) == only.end()) {
+      continue;
+    }
+
+    Image image(spec);
+    if (!image.generate(tmpdir)) {
+      std::cerr << "Failed to generate image " << spec.name << " in "
+                << tmpdir << std::endl;
+      return 1;
+    }
+    std::cerr << "# " << spec.name << ": " << image.emfat->vol_size
+              << " bytes, " << image.entries.size() - 2 << " entries"
+              << std::endl;
+    if (!bench_image(bench, image)) {
+      return 1;
+    }
+  }
+  if ((only.empty() ||
+       std::find(only.begin(), only.end(), "lfn") != only.end()) &&
+      !bench_long_names(bench, tmpdir)) {
+    return 1;
+  }
+  for (unsigned bits : {12u, 16u}) {
+    auto name = "fat" + std::to_string(bits);
+    if ((only.empty() ||
+         std::find(only.begin(), only.end(), name) != only.end()) &&
+        !bench_fat_width(bench, tmpdir, bits)) {
+      return 1;
+    }
+  }
+
+  if (out.empty()) {
+    bench.write_json(std::cout);
+  } else {
+    std::ofstream os(out);
+    bench.write_json(os);
+    if (!os) {
+      std::cerr << "Failed to write " << out << std::endl;
+      return 1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,306 @@
+// Sequential read throughput of NbdServer over a local Unix socket.
+//
+// Builds a synthetic emfat volume in memory, serves it from a background
+// thread and reads it end to end with a pipelined NBD client in the same
+// process, so no nbd-client, kernel module or files on disk are needed.
+//
+// usage: nbd_throughput [volume MiB] [request KiB] [queue depth] [workers]
+
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "emfat1.h"
+
+#include "nbd_server.h"
+
+static constexpr uint32_t FILE_SIZE = 256 * 1024 * 1024;
+static constexpr size_t PATTERN_SIZE = 1024 * 1024;
+
+static std::vector<uint8_t> pattern;
+
+// file contents repeat a random pattern, shifted per file
+static void read_pattern(uint8_t *dest, int size, uint32_t offset,
+                         size_t userdata) {
+  size_t pos = (offset + userdata * 4099) % PATTERN_SIZE;
+  while (size > 0) {
+    auto n = std::min<size_t>(size, PATTERN_SIZE - pos);
+    std::memcpy(dest, &pattern[pos], n);
+    dest += n;
+    size -= n;
+    pos = 0;
+  }
+}
+
+// the pattern is not sector aligned per file, so where it wraps the server
+// falls back to read_pattern for a sector
+static const uint8_t *map_pattern(uint32_t offset, uint32_t *size,
+                                  size_t userdata) {
+  size_t pos = (offset + userdata * 4099) % PATTERN_SIZE;
+  *size = (uint32_t)std::min<size_t>(*size, PATTERN_SIZE - pos);
+  return &pattern[pos];
+}
+
+static void put_be32(uint8_t *p, uint32_t v) {
+  for (int i = 3; i >= 0; --i, v >>= 8) {
+    p[i] = v;
+  }
+}
+
+static void put_be64(uint8_t *p, uint64_t v) {
+  for (int i = 7; i >= 0; --i, v >>= 8) {
+    p[i] = v;
+  }
+}
+
+static uint32_t get_be32(const uint8_t *p) {
+  return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static bool recv_all(int fd, void *buf, size_t size) {
+  auto p = static_cast<uint8_t *>(buf);
+  while (size) {
+    auto r = ::recv(fd, p, size, MSG_WAITALL);
+    if (r <= 0) {
+      return false;
+    }
+    p += r;
+    size -= r;
+  }
+  return true;
+}
+
+static bool send_all(int fd, const void *buf, size_t size) {
+  auto p = static_cast<const uint8_t *>(buf);
+  while (size) {
+    auto r = ::send(fd, p, size, MSG_NOSIGNAL);
+    if (r <= 0) {
+      return false;
+    }
+    p += r;
+    size -= r;
+  }
+  return true;
+}
+
+static int connect_and_go(const std::string &path) {
+  auto fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  std::strcpy(addr.sun_path, path.c_str());
+  if (::connect(fd, (const sockaddr *)&addr, sizeof(addr)) != 0) {
+    ::close(fd);
+    return -1;
+  }
+
+  uint8_t hello[18];
+  uint8_t flags[4];
+  put_be32(flags, 3); // fixed newstyle, no zeroes
+  if (!recv_all(fd, hello, sizeof(hello)) ||
+      !send_all(fd, flags, sizeof(flags))) {
+    ::close(fd);
+    return -1;
+  }
+
+  // NBD_OPT_GO with an empty export name and no info requests
+  uint8_t go[16 + 6] = {};
+  put_be64(go, 0x49484156454f5054);
+  put_be32(go + 8, 7);
+  put_be32(go + 12, 6);
+  if (!send_all(fd, go, sizeof(go))) {
+    ::close(fd);
+    return -1;
+  }
+  while (true) {
+    uint8_t rep[20];
+    if (!recv_all(fd, rep, sizeof(rep))) {
+      ::close(fd);
+      return -1;
+    }
+    std::vector<uint8_t> data(get_be32(rep + 16));
+    if (!data.empty() && !recv_all(fd, data.data(), data.size())) {
+      ::close(fd);
+      return -1;
+    }
+    auto type = get_be32(rep + 12);
+    if (type == 1) { // NBD_REP_ACK
+      return fd;
+    }
+    if (type & 0x80000000) {
+      ::close(fd);
+      return -1;
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  uint64_t volume_mib = argc > 1 ? std::stoull(argv[1]) : 2048;
+  uint32_t request = (argc > 2 ? std::stoul(argv[2]) : 1024) * 1024;
+  unsigned depth = argc > 3 ? std::stoul(argv[3]) : 16;
+  unsigned workers = argc > 4 ? std::stoul(argv[4]) : 0;
+
+  pattern.resize(PATTERN_SIZE);
+  uint32_t x = 2463534242;
+  for (auto &b : pattern) {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    b = x;
+  }
+
+  auto files = (size_t)((volume_mib * 1024 * 1024 + FILE_SIZE - 1) / FILE_SIZE);
+  std::vector<std::string> names;
+  for (size_t i = 0; i < files; ++i) {
+    names.emplace_back("file" + std::to_string(i) + ".bin");
+  }
+  std::vector<emfat_entry_t> entries;
+  emfat_entry_t root{};
+  root.name = "";
+  root.dir = true;
+  entries.emplace_back(root);
+  for (size_t i = 0; i < files; ++i) {
+    emfat_entry_t e{};
+    e.name = names[i].c_str();
+    e.level = 1;
+    e.curr_size = e.max_size = FILE_SIZE;
+    e.user_data = i;
+    e.readcb = read_pattern;
+    e.mapcb = map_pattern;
+    entries.emplace_back(e);
+  }
+  entries.emplace_back(emfat_entry_t{});
+
+  auto emfat = std::make_unique<emfat_t>();
+  if (!emfat_init(emfat.get(), "BENCH", entries.data())) {
+    std::cerr << "Failed to build volume" << std::endl;
+    return 1;
+  }
+
+  auto socket_path =
+      "/tmp/nbd_throughput." + std::to_string(::getpid()) + ".sock";
+  NbdServer server(*emfat, true, workers);
+  std::error_code err;
+  std::thread serving([&] { server.serve(socket_path, err); });
+  while (!server.listening() && !err) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  auto fd = err ? -1 : connect_and_go(socket_path);
+  if (fd < 0) {
+    std::cerr << "Failed to connect: " << err.message() << std::endl;
+    server.stop();
+    serving.join();
+    return 1;
+  }
+
+  auto size = emfat->vol_size;
+  auto requests = (size + request - 1) / request;
+  std::vector<uint8_t> expected(request), data(request);
+  emfat_cursor_t cursor;
+  emfat_cursor_init(emfat.get(), &cursor);
+
+  std::mutex window_lock;
+  std::condition_variable window_cv;
+  uint64_t completed = 0;
+  bool failed = false;
+
+  auto start = std::chrono::steady_clock::now();
+
+  // requests are pipelined up to the queue depth
+  std::thread sender([&] {
+    for (uint64_t i = 0; i < requests; ++i) {
+      {
+        std::unique_lock<std::mutex> lock(window_lock);
+        window_cv.wait(lock, [&] { return failed || i - completed < depth; });
+        if (failed) {
+          return;
+        }
+      }
+      uint8_t req[28] = {};
+      put_be32(req, 0x25609513);
+      put_be64(req + 8, i);
+      put_be64(req + 16, i * request);
+      put_be32(req + 24, (uint32_t)std::min<uint64_t>(request, size - i * request));
+      if (!send_all(fd, req, sizeof(req))) {
+        return;
+      }
+    }
+  });
+
+  uint64_t verified = 0;
+  for (uint64_t n = 0; n < requests; ++n) {
+    uint8_t rep[16];
+    uint64_t handle;
+    if (!recv_all(fd, rep, sizeof(rep)) || get_be32(rep + 4) != 0) {
+      failed = true;
+      break;
+    }
+    std::memcpy(&handle, rep + 8, sizeof(handle));
+    // the handle went out in host order, see the sender
+    uint64_t index = 0;
+    for (int i = 0; i < 8; ++i) {
+      index = index << 8 | ((uint8_t *)&handle)[i];
+    }
+    auto len = (uint32_t)std::min<uint64_t>(request, size - index * request);
+    if (!recv_all(fd, data.data(), len)) {
+      failed = true;
+      break;
+    }
+    // spot check every 64th reply against a direct emfat read
+    if (index % 64 == 0) {
+      emfat_read_r(emfat.get(), &cursor, expected.data(),
+                   (uint32_t)(index * request / SECT), (len + SECT - 1) / SECT);
+      if (std::memcmp(expected.data(), data.data(), len) != 0) {
+        std::cerr << "Data mismatch at offset " << index * request << std::endl;
+        failed = true;
+        break;
+      }
+      ++verified;
+    }
+    {
+      std::lock_guard<std::mutex> lock(window_lock);
+      ++completed;
+    }
+    window_cv.notify_one();
+  }
+
+  auto seconds = std::chrono::duration<double>(
+                     std::chrono::steady_clock::now() - start)
+                     .count();
+
+  {
+    std::lock_guard<std::mutex> lock(window_lock);
+    failed = failed || completed != requests;
+  }
+  window_cv.notify_one();
+  sender.join();
+
+  uint8_t disc[28] = {};
+  put_be32(disc, 0x25609513);
+  disc[7] = 2; // NBD_CMD_DISC
+  send_all(fd, disc, sizeof(disc));
+  ::close(fd);
+  server.stop();
+  serving.join();
+
+  if (failed) {
+    std::cerr << "Throughput test failed" << std::endl;
+    return 1;
+  }
+
+  auto mib = size / (1024.0 * 1024.0);
+  std::cout << "nbd_throughput: " << mib << " MiB in " << seconds << " s, "
+            << mib / seconds << " MiB/s (request " << request / 1024
+            << " KiB, depth " << depth << ", " << verified
+            << " replies verified)" << std::endl;
+  return 0;
+}
@@ -0,0 +1,355 @@
+// Query latency of QueryServer under load.
+//
+// Connects to the socket of a running daemon, or, given an image, serves it
+// from a background thread in the same process. Collects the files of every
+// volume, then each connection keeps depth requests in flight for the given
+// time, a mix of stat, read of 4 KiB, list of the parent directory and
+// health, and the latency of every reply is kept.
+//
+// usage: query_load <socket or image> [connections] [seconds] [depth]
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "query_server.h"
+
+using Clock = std::chrono::steady_clock;
+
+static bool send_all(int fd, const std::string &data) {
+  size_t done = 0;
+  while (done < data.size()) {
+    auto n = ::send(fd, data.data() + done, data.size() - done, MSG_NOSIGNAL);
+    if (n <= 0) {
+      return false;
+    }
+    done += n;
+  }
+  return true;
+}
+
+static int connect_to(const std::string &path) {
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || ::connect(fd, (sockaddr *)&addr, sizeof(addr)) != 0) {
+    if (fd >= 0) {
+      ::close(fd);
+    }
+    return -1;
+  }
+  return fd;
+}
+
+// Reads replies off one connection through a buffer
+class ReplyReader {
+public:
+  explicit ReplyReader(int fd) : fd_(fd) {}
+
+  bool next(uint64_t &id, bool &ok, std::string &body) {
+    size_t eol;
+    while ((eol = buffer_.find('\n', pos_)) == std::string::npos) {
+      if (!fill()) {
+        return false;
+      }
+    }
+    auto line = buffer_.substr(pos_, eol - pos_);
+    pos_ = eol + 1;
+    auto tab1 = line.find('\t');
+    auto tab2 = line.find('\t', tab1 + 1);
+    if (tab1 == std::string::npos || tab2 == std::string::npos) {
+      return false;
+    }
+    id = std::stoull(line.substr(0, tab1));
+    ok = line.compare(tab1 + 1, tab2 - tab1 - 1, "ok") == 0;
+    auto size = std::stoull(line.substr(tab2 + 1));
+    while (buffer_.size() - pos_ < size) {
+      if (!fill()) {
+        return false;
+      }
+    }
+    body.assign(buffer_, pos_, size);
+    pos_ += size;
+    return true;
+  }
+
+private:
+  bool fill() {
+    if (pos_ > 0) {
+      buffer_.erase(0, pos_);
+      pos_ = 0;
+    }
+    char chunk[64 * 1024];
+    auto n = ::recv(fd_, chunk, sizeof(chunk), 0);
+    if (n <= 0) {
+      return false;
+    }
+    buffer_.append(chunk, n);
+    return true;
+  }
+
+  int fd_;
+  std::string buffer_;
+  size_t pos_ = 0;
+};
+
+// Strings of a JSON array as find returns them; names with escapes past
+// ASCII are skipped, there are plenty of others.
+static std::vector<std::string> parse_paths(const std::string &json) {
+  std::vector<std::string> paths;
+  for (size_t i = 0; i < json.size(); ++i) {
+    if (json[i] != '"') {
+      continue;
+    }
+    std::string path;
+    bool usable = true;
+    for (++i; i < json.size() && json[i] != '"'; ++i) {
+      if (json[i] != '\\') {
+        path += json[i];
+        continue;
+      }
+      if (++i >= json.size()) {
+        break;
+      }
+      if (json[i] == 'u') {
+        auto code = std::stoul(json.substr(i + 1, 4), nullptr, 16);
+        usable = usable && code < 0x80;
+        path += (char)code;
+        i += 4;
+      } else {
+        path += json[i];
+      }
+    }
+    if (usable) {
+      paths.push_back(path);
+    }
+  }
+  return paths;
+}
+
+static size_t count_volumes(const std::string &json) {
+  size_t count = 0;
+  for (auto pos = json.find("\"volume\""); pos != std::string::npos;
+       pos = json.find("\"volume\"", pos + 1)) {
+    ++count;
+  }
+  return count;
+}
+
+struct Target {
+  unsigned volume;
+  std::string path;
+  std::string parent;
+};
+
+struct Result {
+  std::vector<uint32_t> latencies; // in microseconds
+  uint64_t errors = 0;
+  bool failed = false;
+};
+
+static void run_connection(const std::string &socket_path,
+                           const std::vector<Target> &targets,
+                           unsigned depth, Clock::time_point end,
+                           unsigned seed, Result &result) {
+  int fd = connect_to(socket_path);
+  if (fd < 0) {
+    result.failed = true;
+    return;
+  }
+  ReplyReader reader(fd);
+  std::mt19937 rng(seed);
+  std::uniform_int_distribution<size_t> pick(0, targets.size() - 1);
+  std::uniform_int_distribution<int> mix(0, 99);
+  std::unordered_map<uint64_t, Clock::time_point> sent;
+  uint64_t next_id = 0;
+
+  auto send_one = [&] {
+    auto &t = targets[pick(rng)];
+    auto id = next_id++;
+    auto line = std::to_string(id) + "\t";
+    auto m = mix(rng);
+    if (m < 50) {
+      line += "stat\t" + std::to_string(t.volume) + "\t" + t.path;
+    } else if (m < 80) {
+      line += "read\t" + std::to_string(t.volume) + "\t" + t.path + "\t0\t4096";
+    } else if (m < 95) {
+      line += "list\t" + std::to_string(t.volume) + "\t" + t.parent;
+    } else {
+      line += "health\t" + std::to_string(t.volume);
+    }
+    sent[id] = Clock::now();
+    return send_all(fd, line + "\n");
+  };
+
+  for (unsigned i = 0; i < depth; ++i) {
+    if (!send_one()) {
+      result.failed = true;
+    }
+  }
+  uint64_t id;
+  bool ok;
+  std::string body;
+  while (!result.failed && !sent.empty()) {
+    if (!reader.next(id, ok, body)) {
+      result.failed = true;
+      break;
+    }
+    auto now = Clock::now();
+    auto it = sent.find(id);
+    if (it == sent.end()) {
+      result.failed = true;
+      break;
+    }
+    result.latencies.push_back(
+        (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(
+            now - it->second)
+            .count());
+    sent.erase(it);
+    result.errors += ok ? 0 : 1;
+    if (now < end && !send_one()) {
+      result.failed = true;
+    }
+  }
+  ::close(fd);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    std::cerr << "usage: query_load <socket or image> [connections] "
+                 "[seconds] [depth]"
+              << std::endl;
+    return 2;
+  }
+  std::string target = argv[1];
+  unsigned connections = argc > 2 ? std::stoul(argv[2]) : 4;
+  double seconds = argc > 3 ? std::stod(argv[3]) : 5;
+  unsigned depth = argc > 4 ? std::stoul(argv[4]) : 1;
+
+  // an image is served here, from a background thread
+  std::unique_ptr<QueryServer> server;
+  std::thread serving;
+  std::string socket_path = target;
+  struct stat st;
+  if (::stat(target.c_str(), &st) != 0) {
+    std::cerr << "Can't open " << target << std::endl;
+    return 1;
+  }
+  if (!S_ISSOCK(st.st_mode)) {
+    server = std::make_unique<QueryServer>();
+    std::error_code err;
+    if (!server->add_image(target, err)) {
+      std::cerr << "Can't index " << target << ": " << err.message()
+                << std::endl;
+      return 1;
+    }
+    socket_path = "/tmp/query_load." + std::to_string(::getpid()) + ".sock";
+    serving = std::thread([&] {
+      std::error_code err;
+      server->serve(socket_path, err);
+      if (err) {
+        std::cerr << "Serve failed: " << err.message() << std::endl;
+      }
+    });
+    while (!server->listening()) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+
+  std::vector<Target> targets;
+  {
+    int fd = connect_to(socket_path);
+    if (fd < 0) {
+      std::cerr << "Can't connect to " << socket_path << std::endl;
+      return 1;
+    }
+    ReplyReader reader(fd);
+    uint64_t id;
+    bool ok;
+    std::string body;
+    send_all(fd, "0\tvolumes\n");
+    if (!reader.next(id, ok, body)) {
+      std::cerr << "No reply from " << socket_path << std::endl;
+      return 1;
+    }
+    auto volumes = count_volumes(body);
+    for (unsigned v = 0; v < volumes; ++v) {
+      send_all(fd, "0\tfind\t" + std::to_string(v) + "\t**\t10000\tf\n");
+      if (!reader.next(id, ok, body) || !ok) {
+        continue;
+      }
+      for (auto &path : parse_paths(body)) {
+        auto slash = path.rfind('/');
+        auto parent = slash == 0 ? "/" : path.substr(0, slash);
+        targets.push_back({v, path, parent});
+      }
+    }
+    ::close(fd);
+  }
+  if (targets.empty()) {
+    std::cerr << "No files to query" << std::endl;
+    return 1;
+  }
+
+  auto start = Clock::now();
+  auto end = start + std::chrono::duration_cast<Clock::duration>(
+                         std::chrono::duration<double>(seconds));
+  std::vector<Result> results(connections);
+  std::vector<std::thread> threads;
+  for (unsigned c = 0; c < connections; ++c) {
+    threads.emplace_back(run_connection, std::cref(socket_path),
+                         std::cref(targets), depth, end, c + 1,
+                         std::ref(results[c]));
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  auto elapsed =
+      std::chrono::duration<double>(Clock::now() - start).count();
+
+  if (server) {
+    server->stop();
+    serving.join();
+  }
+
+  std::vector<uint32_t> latencies;
+  uint64_t errors = 0;
+  bool failed = false;
+  for (auto &r : results) {
+    latencies.insert(latencies.end(), r.latencies.begin(), r.latencies.end());
+    errors += r.errors;
+    failed = failed || r.failed;
+  }
+  if (failed || latencies.empty()) {
+    std::cerr << "Load test failed" << std::endl;
+    return 1;
+  }
+  std::sort(latencies.begin(), latencies.end());
+  auto percentile = [&](double p) {
+    return latencies[std::min(latencies.size() - 1,
+                              (size_t)(p * latencies.size()))];
+  };
+
+  std::cout << "query_load: " << latencies.size() << " queries in " << elapsed
+            << " s, " << (uint64_t)(latencies.size() / elapsed)
+            << " queries/s, latency p50 " << percentile(0.5) << " us, p99 "
+            << percentile(0.99) << " us, max " << latencies.back()
+            << " us (" << targets.size() << " files, " << connections
+            << " connections, depth " << depth << ", " << errors
+            << " errors)" << std::endl;
+  return errors ? 1 : 0;
+}
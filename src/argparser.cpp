@@ -49,11 +49,337 @@ std::string generate_default_str<bool>(std::string &default_str,
                              : " [Default: " + default_str + "]";
 }
 
-static void configureArgumentParcer(CLI::App &app, Options &options) {
-  app.add_option("file", options.file, "WAV-file to process.")
+static void configureNbd(CLI::App &app, Options::Nbd &options) {
+  app.add_option("dir", options.dir, "Directory to export as FAT32 volume.")
+      ->expected(1)
+      ->required()
+      ->check(CLI::ExistingDirectory);
+  app.add_option("-s,--socket", options.socket, "Unix socket to listen on.")
+      ->expected(1)
+      ->required();
+  newOption(app, "-l,--label", options.label, "Volume label.");
+  newOption(app, "-j,--threads", options.threads,
+            "Worker threads, 0 - one per core.");
+  newFlag(app, "-w,--writable", options.writable,
+          "Pass writes through to the host files.");
+}
+
+static void configureMkImage(CLI::App &app, Options::MkImage &options) {
+  app.add_option("dir", options.dir, "Directory to put into the image.")
+      ->expected(1)
+      ->required()
+      ->check(CLI::ExistingDirectory);
+  app.add_option("out", options.out, "Image file to create.")
+      ->expected(1)
+      ->required();
+  newOption(app, "-l,--label", options.label, "Volume label.");
+  newOption(app, "-j,--threads", options.threads,
+            "Files copied in parallel, 0 - one per core.");
+}
+
+static void configureSynth(CLI::App &app, Options::Synth &options) {
+  app.add_option("out", options.out, "Image file to create.")
+      ->expected(1)
+      ->required();
+  newOption(app, "--seed", options.seed, "Random seed.");
+  newOption(app, "-c,--clusters", options.clusters, "Data clusters.");
+  newOption(app, "--size", options.size_mb,
+            "Volume size in MiB, overrides --clusters if set.");
+  newOption(app, "--sectors-per-cluster", options.sectors_per_cluster,
+            "Cluster size in sectors, a power of two up to 128.");
+  newOption(app, "--fat", options.fat,
+            "FAT type, 12 and 16 need up to 4084 and 65524 clusters.")
+      ->check(CLI::IsMember(std::vector<std::string>{"12", "16", "32"}));
+  newOption(app, "--root-entries", options.root_entries,
+            "Slots of the fixed FAT12/16 root directory, a multiple of 16.");
+  newOption(app, "-f,--files", options.files, "Files in every directory.");
+  newOption(app, "-d,--dirs", options.dirs,
+            "Subdirectories in every directory above --depth.");
+  newOption(app, "--depth", options.depth, "Directory levels below root.");
+  newOption(app, "--mean-size", options.mean_size,
+            "Mean file size in clusters, exponentially distributed.");
+  newOption(app, "--fragmentation", options.fragmentation,
+            "Chance, 0..1, that the next cluster of a chain is placed "
+            "randomly.")
+      ->check(CLI::Range(0.0, 1.0));
+  newOption(app, "--bad", options.bad, "Free clusters to mark bad.");
+  newOption(app, "--cross-links", options.cross_links,
+            "Files whose tail is linked into another file.");
+  newOption(app, "--loops", options.loops,
+            "Files whose tail is linked back to their start.");
+  newOption(app, "--lost", options.lost,
+            "Allocated chains not referenced by any directory.");
+  newFlag(app, "--long-names", options.long_names,
+          "Give every file and directory a long name.");
+  newOption(app, "-l,--label", options.label, "Volume label.");
+}
+
+static void configureBatch(CLI::App &app, Options::Batch &options) {
+  app.add_option("files", options.files, "Disk images to inspect.");
+  app.add_option("-m,--manifest", options.manifest,
+                 "File with one image path per line, - for stdin.")
+      ->expected(1);
+  app.add_option("-o,--out", options.out,
+                 "Write the JSON report here instead of stdout.")
+      ->expected(1);
+  newOption(app, "-j,--threads", options.threads,
+            "Worker threads, 0 - one per core.");
+  newFlag(app, "-q,--quick", options.quick,
+          "Health check of the boot structures only, see the top level "
+          "--quick. Exits with the worst verdict.");
+}
+
+static void configureFind(CLI::App &app, Options::Find &options) {
+  app.add_option("file", options.file, "Disk image to search.")
+      ->expected(1)
+      ->required();
+  newOption(app, "-p,--partition", options.partition,
+            "Partition number as the dump shows it, -1 - all.");
+  app.add_option("-n,--name", options.name,
+                 "Glob on the entry name: * ? [a-z] [!a-z].")
+      ->expected(1);
+  app.add_option("--path", options.path,
+                 "Glob on the path from the root, ** spans directories. "
+                 "Directories it can not match are not read.")
+      ->expected(1);
+  newOption(app, "--min-size", options.min_size, "Smallest size in bytes.");
+  app.add_option("--max-size", options.max_size, "Largest size in bytes.")
+      ->expected(1);
+  app.add_option("--newer", options.newer,
+                 "Modified at or after YYYY-MM-DD[ HH:MM[:SS]].")
+      ->expected(1);
+  app.add_option("--older", options.older,
+                 "Modified before YYYY-MM-DD[ HH:MM[:SS]].")
+      ->expected(1);
+  app.add_option("-a,--attr", options.attr,
+                 "Attributes that must be set, letters of rhsad.")
+      ->expected(1);
+  app.add_option("-A,--not-attr", options.not_attr,
+                 "Attributes that must be clear, letters of rhsad.")
+      ->expected(1);
+  app.add_option("-t,--type", options.type, "f - files, d - directories.")
+      ->expected(1);
+  newOption(app, "--max-depth", options.max_depth,
+            "Directory levels below the root to search, -1 - all.");
+  newOption(app, "--limit", options.limit, "Stop after that many, 0 - all.");
+  newFlag(app, "-l,--long", options.long_format,
+          "Print attributes, size and time before the path.");
+  newOption(app, "-j,--threads", options.threads,
+            "Threads reading directories, 1 - this one, 0 - one per core.");
+  newFlag(app, "--unordered", options.unordered,
+          "Print a directory's matches as soon as it is read, not in tree "
+          "order.");
+}
+
+static void configureTimeline(CLI::App &app, Options::Timeline &options) {
+  app.add_option("file", options.file, "Disk image to read.")
+      ->expected(1)
+      ->required();
+  newOption(app, "-p,--partition", options.partition,
+            "Partition number as the dump shows it, -1 - all.");
+  newOption(app, "-f,--format", options.format,
+            "csv - with a header line, ndjson - a JSON object per line.")
+      ->check(CLI::IsMember(std::vector<std::string>{"csv", "ndjson"}));
+  app.add_option("-o,--out", options.out,
+                 "Write the timeline here instead of stdout.")
+      ->expected(1);
+  newOption(app, "-j,--threads", options.threads,
+            "Sort threads, 0 - one per core.");
+}
+
+static void configureWhois(CLI::App &app, Options::Whois &options) {
+  app.add_option("file", options.file, "Disk image to look into.")
+      ->expected(1)
+      ->required();
+  app.add_option("targets", options.targets,
+                 "Offsets or clusters, decimal or 0x hex, - reads more from "
+                 "stdin.")
+      ->required();
+  newOption(app, "-p,--partition", options.partition,
+            "Partition number as the dump shows it, -1 - all.");
+  newOption(app, "-u,--unit", options.unit,
+            "byte or sector (512 bytes) of the image, cluster of the "
+            "partition.")
+      ->check(CLI::IsMember(
+          std::vector<std::string>{"byte", "sector", "cluster"}));
+  app.add_option("-m,--map", options.map,
+                 "Keep the owner map in this file and map it from there "
+                 "while the FAT stays the same, .N is appended with "
+                 "several partitions.")
+      ->expected(1);
+}
+
+static void configureWatch(CLI::App &app, Options::Watch &options) {
+  app.add_option("file", options.file, "Disk image to watch.")
+      ->expected(1)
+      ->required();
+  newOption(app, "-p,--partition", options.partition,
+            "Partition number as the dump shows it, -1 - all.");
+  newOption(app, "--interval", options.interval_ms,
+            "A pass at least every that many ms, also for writes inotify "
+            "does not see, such as through a shared mapping. 0 - only on "
+            "change.");
+  newOption(app, "--settle", options.settle_ms,
+            "Quiet ms after a change before the pass starts.");
+  newOption(app, "--passes", options.passes,
+            "Stop after that many passes, 0 - run until the image is gone.");
+}
+
+static void configureCompact(CLI::App &app, Options::Compact &options) {
+  app.add_option("in", options.in, "Disk image to read.")
+      ->expected(1)
+      ->required()
+      ->check(CLI::ExistingFile);
+  app.add_option("out", options.out, "Image file to create.")
+      ->expected(1)
+      ->required();
+  newOption(app, "-p,--partition", options.partition,
+            "Partition number as the dump shows it, -1 - all. The others "
+            "are copied as they are.");
+}
+
+static void configureTrimCopy(CLI::App &app, Options::TrimCopy &options) {
+  app.add_option("in", options.in, "Disk image to read.")
       ->expected(1)
       ->required()
       ->check(CLI::ExistingFile);
+  app.add_option("out", options.out, "Image file to create.")->expected(1);
+  newOption(app, "-p,--partition", options.partition,
+            "Partition number as the dump shows it, -1 - all. The others "
+            "are copied whole.");
+  newFlag(app, "--punch", options.punch,
+          "Punch the free clusters out of in itself instead of copying. "
+          "Deleted files in them are lost.");
+}
+
+static void configureIndex(CLI::App &app, Options::Index &options) {
+  app.add_option("file", options.file, "Disk image to hash.")
+      ->expected(1)
+      ->required()
+      ->check(CLI::ExistingFile);
+  app.add_option("-o,--out", options.out,
+                 "Sidecar to write, file.merkle if not given.")
+      ->expected(1);
+  newOption(app, "-j,--threads", options.threads,
+            "Hashing threads, 0 - one per core.");
+}
+
+static void configureVerify(CLI::App &app, Options::Verify &options) {
+  app.add_option("file", options.file, "Disk image to check.")
+      ->expected(1)
+      ->required()
+      ->check(CLI::ExistingFile);
+  app.add_option("-i,--index", options.index,
+                 "Sidecar index made of it, file.merkle if not given.")
+      ->expected(1);
+  newOption(app, "-j,--threads", options.threads,
+            "Hashing threads, 0 - one per core.");
+}
+
+static void configureDaemon(CLI::App &app, Options::Daemon &options) {
+  app.add_option("files", options.files, "Disk images to keep mapped.")
+      ->required()
+      ->check(CLI::ExistingFile);
+  app.add_option("-s,--socket", options.socket,
+                 "Unix domain socket path to listen on.")
+      ->expected(1)
+      ->required();
+  newOption(app, "-j,--threads", options.threads,
+            "Worker threads for requests, 0 - four per core.");
+}
+
+static void configureArgumentParcer(CLI::App &app, Options &options) {
+  app.add_option("file", options.file, "Disk image to process.")
+      ->expected(1)
+      ->check(CLI::ExistingFile);
+  newFlag(app, "--stats", options.stats,
+          "Print time, page faults and I/O of every stage to stderr.");
+  newFlag(app, "--stats-json", options.stats_json,
+          "Same as --stats, as JSON.");
+  newOption(app, "-j,--threads", options.threads,
+            "Partitions to dump at once, 0 - one per core.");
+  newOption(app, "--fat-budget", options.fat_budget_mb,
+            "MiB of FAT mapped at a time, in windows, 0 - every FAT copy "
+            "mapped as a whole.");
+  newOption(app, "--fat-window", options.fat_window_kb,
+            "KiB per FAT window of --fat-budget.");
+  newFlag(app, "-q,--quick", options.quick,
+          "Instead of the dump, check the MBR, boot sectors, fsinfo and FAT "
+          "heads and print a JSON verdict. Exit code 0 - ok, 1 - warnings, "
+          "2 - errors.");
+
+  auto nbd = app.add_subcommand(
+      "nbd", "Serve a host directory as FAT32 disk over NBD protocol.");
+  configureNbd(*nbd, options.nbd);
+  nbd->callback([&options]() { options.mode = Options::Mode::Nbd; });
+
+  auto mkimage = app.add_subcommand(
+      "mkimage", "Build a sparse FAT32 disk image from a host directory.");
+  configureMkImage(*mkimage, options.mkimage);
+  mkimage->callback([&options]() { options.mode = Options::Mode::MkImage; });
+
+  auto synth = app.add_subcommand(
+      "synth", "Generate a synthetic FAT test image from a seed.");
+  configureSynth(*synth, options.synth);
+  synth->callback([&options]() { options.mode = Options::Mode::Synth; });
+
+  auto batch = app.add_subcommand(
+      "batch", "Summarise many disk images at once into a JSON report.");
+  configureBatch(*batch, options.batch);
+  batch->callback([&options]() { options.mode = Options::Mode::Batch; });
+
+  auto find = app.add_subcommand(
+      "find", "List entries of a disk image that match all given conditions.");
+  configureFind(*find, options.find);
+  find->callback([&options]() { options.mode = Options::Mode::Find; });
+
+  auto timeline = app.add_subcommand(
+      "timeline", "List the creation, modification and access times of "
+                  "every entry in time order.");
+  configureTimeline(*timeline, options.timeline);
+  timeline->callback([&options]() { options.mode = Options::Mode::Timeline; });
+
+  auto whois = app.add_subcommand(
+      "whois", "Tell which file owns an offset, sector or cluster.");
+  configureWhois(*whois, options.whois);
+  whois->callback([&options]() { options.mode = Options::Mode::Whois; });
+
+  auto watch = app.add_subcommand(
+      "watch", "Print what changes in an image while something writes to "
+               "it, as JSON lines.");
+  configureWatch(*watch, options.watch);
+  watch->callback([&options]() { options.mode = Options::Mode::Watch; });
+
+  auto compact = app.add_subcommand(
+      "compact", "Copy an image with every file and directory rewritten "
+                 "into one contiguous run of clusters.");
+  configureCompact(*compact, options.compact);
+  compact->callback([&options]() { options.mode = Options::Mode::Compact; });
+
+  auto trim_copy = app.add_subcommand(
+      "trim-copy", "Copy an image with the clusters its FATs mark free left "
+                   "as holes.");
+  configureTrimCopy(*trim_copy, options.trim_copy);
+  trim_copy->callback(
+      [&options]() { options.mode = Options::Mode::TrimCopy; });
+
+  auto index = app.add_subcommand(
+      "index", "Hash every cluster of an image into a Merkle tree kept in a "
+               "sidecar file.");
+  configureIndex(*index, options.index);
+  index->callback([&options]() { options.mode = Options::Mode::Index; });
+
+  auto verify = app.add_subcommand(
+      "verify", "Hash an image again and list the clusters that changed "
+                "since its index was made, and their files.");
+  configureVerify(*verify, options.verify);
+  verify->callback([&options]() { options.mode = Options::Mode::Verify; });
+
+  auto daemon = app.add_subcommand(
+      "daemon", "Keep images mapped and indexed and answer stat, list, find, "
+                "read and FAT health queries on a Unix domain socket.");
+  configureDaemon(*daemon, options.daemon);
+  daemon->callback([&options]() { options.mode = Options::Mode::Daemon; });
 }
 
 void Options::dump(std::ostream &os) const {
@@ -63,8 +389,24 @@ void Options::dump(std::ostream &os) const {
 }
 
 int parseArguments(int argc, char *argv[], Options &options) {
-  CLI::App app{"SampleRateModificator"};
+  CLI::App app{"Fat32DiskImagerParcer"};
   configureArgumentParcer(app, options);
   CLI11_PARSE(app, argc, argv);
+
+  if (options.mode == Options::Mode::Dump && options.file.empty()) {
+    std::cerr << "file is required" << std::endl << app.help();
+    return 1;
+  }
+  if (options.mode == Options::Mode::Batch && options.batch.files.empty() &&
+      options.batch.manifest.empty()) {
+    std::cerr << "files or --manifest is required" << std::endl << app.help();
+    return 1;
+  }
+  if (options.mode == Options::Mode::TrimCopy &&
+      options.trim_copy.out.empty() == !options.trim_copy.punch) {
+    std::cerr << "out or --punch is required, not both" << std::endl
+              << app.help();
+    return 1;
+  }
   return 0;
 }
@@ -1,14 +1,171 @@
 #ifndef ARGPARSER_H
 #define ARGPARSER_H
 
+#include <cstdint>
 #include <string>
+#include <vector>
 
 namespace CLI {
 class App;
 }
 
 struct Options {
+  enum class Mode {
+    Dump,
+    Nbd,
+    MkImage,
+    Synth,
+    Batch,
+    Find,
+    Timeline,
+    Whois,
+    Watch,
+    Compact,
+    TrimCopy,
+    Index,
+    Verify,
+    Daemon
+  };
+
+  struct Nbd {
+    std::string dir;
+    std::string socket;
+    std::string label = "EMFAT";
+    bool writable = false;
+    unsigned threads = 0;
+  };
+
+  struct MkImage {
+    std::string dir;
+    std::string out;
+    std::string label = "EMFAT";
+    unsigned threads = 0;
+  };
+
+  struct Synth {
+    std::string out;
+    uint64_t seed = 1;
+    uint64_t size_mb = 0;
+    uint32_t clusters = 1 << 20;
+    unsigned sectors_per_cluster = 8;
+    unsigned fat = 32;
+    uint16_t root_entries = 512;
+    uint32_t files = 64;
+    uint32_t dirs = 4;
+    uint32_t depth = 2;
+    double mean_size = 4;
+    double fragmentation = 0;
+    uint32_t bad = 0;
+    uint32_t cross_links = 0;
+    uint32_t loops = 0;
+    uint32_t lost = 0;
+    bool long_names = false;
+    std::string label = "SYNTH";
+  };
+
+  struct Batch {
+    std::vector<std::string> files;
+    std::string manifest;
+    std::string out;
+    unsigned threads = 0;
+    bool quick = false;
+  };
+
+  struct Find {
+    std::string file;
+    int partition = -1;
+    std::string name;
+    std::string path;
+    uint64_t min_size = 0;
+    uint64_t max_size = UINT64_MAX;
+    std::string newer;
+    std::string older;
+    std::string attr;
+    std::string not_attr;
+    std::string type;
+    int max_depth = -1;
+    uint64_t limit = 0;
+    bool long_format = false;
+    unsigned threads = 1;
+    bool unordered = false;
+  };
+
+  struct Timeline {
+    std::string file;
+    int partition = -1;
+    std::string format = "csv";
+    std::string out;
+    unsigned threads = 0;
+  };
+
+  struct Whois {
+    std::string file;
+    std::vector<std::string> targets;
+    int partition = -1;
+    std::string unit = "byte";
+    std::string map;
+  };
+
+  struct Watch {
+    std::string file;
+    int partition = -1;
+    unsigned interval_ms = 0;
+    unsigned settle_ms = 50;
+    uint64_t passes = 0;
+  };
+
+  struct Compact {
+    std::string in;
+    std::string out;
+    int partition = -1;
+  };
+
+  struct TrimCopy {
+    std::string in;
+    std::string out;
+    int partition = -1;
+    bool punch = false;
+  };
+
+  struct Index {
+    std::string file;
+    std::string out;
+    unsigned threads = 0;
+  };
+
+  struct Verify {
+    std::string file;
+    std::string index;
+    unsigned threads = 0;
+  };
+
+  struct Daemon {
+    std::vector<std::string> files;
+    std::string socket;
+    unsigned threads = 0;
+  };
+
+  Mode mode = Mode::Dump;
   std::string file;
+  bool stats = false;
+  bool stats_json = false;
+  bool quick = false;
+  unsigned threads = 0;
+  uint64_t fat_budget_mb = 0;
+  uint32_t fat_window_kb = 64;
+  Nbd nbd;
+  MkImage mkimage;
+  Synth synth;
+  Batch batch;
+  Find find;
+  Timeline timeline;
+  Whois whois;
+  Watch watch;
+  Compact compact;
+  TrimCopy trim_copy;
+  Index index;
+  Verify verify;
+  Daemon daemon;
 
   void dump(std::ostream &os) const;
 };
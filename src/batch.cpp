@@ -0,0 +1,207 @@
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <new>
+
+#include "fat32parse.h"
+#include "json.h"
+
+#include "batch.h"
+#include "work_pool.h"
+
+static void inspect_partition(const fat32::PartitionVolume &opened,
+                              PartitionReport &report) {
+  auto start = std::chrono::steady_clock::now();
+
+  if (opened.err) {
+    report.error = opened.err.message();
+    return;
+  }
+  auto &volume = opened.volume;
+
+  report.fat_bits = volume.fat_type() == fat32::FatType::Fat12   ? 12
+                    : volume.fat_type() == fat32::FatType::Fat16 ? 16
+                                                                 : 32;
+  report.cluster_size = volume.cluster_size();
+  report.clusters = volume.cluster_count() - 2;
+
+  auto fat = volume.fat();
+  auto summary = fat.summary();
+  report.free = summary.free;
+  report.used = summary.used;
+  report.bad = summary.bad;
+  report.chains = summary.chains;
+
+  for (auto e : volume.tree()) {
+    if (e.is_volume_label()) {
+      continue;
+    }
+    if (e.is_dir()) {
+      ++report.dirs;
+      continue;
+    }
+
+    ++report.files;
+    report.bytes += e.size();
+
+    uint64_t expected = (e.size() + volume.cluster_size() - 1) /
+                        volume.cluster_size();
+    uint64_t clusters = 0;
+    auto end = fat32::walk_chain(fat, e.first_cluster(),
+                                 [&clusters](uint32_t) { ++clusters; });
+    if (e.first_cluster() == 0
+            ? e.size() != 0
+            : end != fat32::ChainEnd::End || clusters != expected) {
+      ++report.broken;
+    }
+  }
+
+  report.seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+}
+
+std::vector<ImageReport> inspect_images(const std::vector<std::string> &files,
+                                        unsigned threads) {
+  std::vector<ImageReport> reports(files.size());
+
+  WorkPool pool(threads);
+  for (size_t i = 0; i < files.size(); ++i) {
+    reports[i].path = files[i];
+    pool.submit([&pool, &report = reports[i]] {
+      try {
+        auto image = std::make_shared<fat32::Image>();
+        std::error_code err;
+        if (!image->open(report.path, err)) {
+          report.error = err.message();
+          return;
+        }
+        report.size = image->size();
+
+        // a table read halfway is an error, the partitions found are still
+        // inspected
+        auto parts = std::make_shared<std::vector<fat32::PartitionVolume>>(
+            image->volumes(-1, err));
+        if (err) {
+          report.error = "partition table: " + err.message();
+        }
+
+        // sized before any partition task runs, they fill their own slot
+        report.partitions.resize(parts->size());
+        for (size_t n = 0; n < parts->size(); ++n) {
+          auto &pr = report.partitions[n];
+          auto &p = (*parts)[n].partition;
+          pr.index = p.index;
+          pr.scheme = p.scheme == fat32::Scheme::Gpt   ? "gpt"
+                      : p.scheme == fat32::Scheme::Ebr ? "ebr"
+                                                       : "mbr";
+          pr.type = p.type;
+          pr.start_lba = p.start_lba;
+          pr.size_lba = p.size_lba;
+          // the image and its volumes stay alive until the last partition
+          // is done
+          pool.submit([image, parts, &v = (*parts)[n], &pr] {
+            try {
+              inspect_partition(v, pr);
+            } catch (const std::exception &e) {
+              pr.error = e.what();
+            }
+          });
+        }
+      } catch (const std::exception &e) {
+        report.error = e.what();
+      }
+    });
+  }
+  pool.wait();
+  return reports;
+}
+
+std::vector<QuickReport>
+quick_check_images(const std::vector<std::string> &files, unsigned threads) {
+  std::vector<QuickReport> reports(files.size());
+  WorkPool pool(threads);
+  for (size_t i = 0; i < files.size(); ++i) {
+    pool.submit([&file = files[i], &report = reports[i]] {
+      try {
+        report = quick_check(file);
+      } catch (const std::exception &e) {
+        report.path = file;
+        report.verdict = Verdict::Error;
+        report.findings.push_back({-1, Verdict::Error, "exception", e.what()});
+      }
+    });
+  }
+  pool.wait();
+  return reports;
+}
+
+size_t write_report(const std::vector<ImageReport> &reports, double seconds,
+                    std::ostream &os) {
+  size_t failed = 0;
+  uint64_t partitions = 0, files = 0, dirs = 0, bytes = 0, broken = 0;
+
+  os << "{\"images\": [";
+  for (size_t i = 0; i < reports.size(); ++i) {
+    auto &r = reports[i];
+    bool ok = r.error.empty();
+
+    os << (i ? ",\n  " : "\n  ") << "{\"path\": " << json_string(r.path)
+       << ", \"size\": " << r.size << ", \"error\": "
+       << (r.error.empty() ? "null" : json_string(r.error))
+       << ", \"partitions\": [";
+    for (size_t n = 0; n < r.partitions.size(); ++n) {
+      auto &p = r.partitions[n];
+      ok = ok && p.error.empty();
+      ++partitions;
+      files += p.files;
+      dirs += p.dirs;
+      bytes += p.bytes;
+      broken += p.broken;
+
+      os << (n ? ", " : "") << "{\"index\": " << p.index
+         << ", \"scheme\": " << json_string(p.scheme)
+         << ", \"type\": " << (int)p.type << ", \"start_lba\": " << p.start_lba
+         << ", \"size_lba\": " << p.size_lba << ", \"error\": "
+         << (p.error.empty() ? "null" : json_string(p.error));
+      if (p.error.empty()) {
+        os << ", \"fat\": " << p.fat_bits
+           << ", \"cluster_size\": " << p.cluster_size
+           << ", \"clusters\": " << p.clusters << ", \"free\": " << p.free
+           << ", \"used\": " << p.used << ", \"bad\": " << p.bad
+           << ", \"chains\": " << p.chains << ", \"files\": " << p.files
+           << ", \"dirs\": " << p.dirs << ", \"bytes\": " << p.bytes
+           << ", \"broken\": " << p.broken << ", \"seconds\": " << p.seconds;
+      }
+      os << "}";
+    }
+    os << "]}";
+    failed += !ok;
+  }
+
+  os << "\n ],\n \"summary\": {\"images\": " << reports.size()
+     << ", \"failed\": " << failed << ", \"partitions\": " << partitions
+     << ", \"files\": " << files << ", \"dirs\": " << dirs
+     << ", \"bytes\": " << bytes << ", \"broken\": " << broken
+     << ", \"seconds\": " << seconds << "}}" << std::endl;
+  return failed;
+}
+
+Verdict write_quick_reports(const std::vector<QuickReport> &reports,
+                            double seconds, std::ostream &os) {
+  size_t counts[3] = {};
+  auto worst = Verdict::Ok;
+  os << "{\"images\": [";
+  for (size_t i = 0; i < reports.size(); ++i) {
+    os << (i ? ",\n  " : "\n  ");
+    write_quick_report(reports[i], os);
+    ++counts[(int)reports[i].verdict];
+    worst = std::max(worst, reports[i].verdict);
+  }
+  os << "\n ],\n \"summary\": {\"images\": " << reports.size()
+     << ", \"ok\": " << counts[(int)Verdict::Ok]
+     << ", \"warning\": " << counts[(int)Verdict::Warning]
+     << ", \"error\": " << counts[(int)Verdict::Error]
+     << ", \"seconds\": " << seconds << "}}" << std::endl;
+  return worst;
+}
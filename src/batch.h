@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "quick_check.h"
+
+struct PartitionReport {
+  unsigned index = 0; // partition number as the dump shows it
+  std::string scheme; // "mbr", "ebr" or "gpt"
+  uint8_t type = 0;   // MBR partition type, 0 for GPT
+  uint64_t start_lba = 0;
+  uint64_t size_lba = 0;
+  std::string error; // empty if the partition was read
+
+  unsigned fat_bits = 0; // 12, 16 or 32
+  uint32_t cluster_size = 0;
+  uint32_t clusters = 0; // data clusters
+  uint32_t free = 0;
+  uint32_t used = 0;
+  uint32_t bad = 0;
+  uint32_t chains = 0;
+  uint64_t files = 0;
+  uint64_t dirs = 0;
+  uint64_t bytes = 0;  // sum of file sizes
+  uint64_t broken = 0; // files whose chain does not match their size
+  double seconds = 0;
+};
+
+struct ImageReport {
+  std::string path;
+  uint64_t size = 0;
+  std::string error; // empty if the image and its partition tables were read
+  std::vector<PartitionReport> partitions;
+};
+
+// Summarises every partition of every image. Images and their partitions are
+// spread over a work-stealing pool of threads (0 - one per core). A failure
+// is recorded in the report of the image or partition it happened in and
+// does not stop the others.
+std::vector<ImageReport> inspect_images(const std::vector<std::string> &files,
+                                        unsigned threads);
+
+// JSON report with totals, returns the number of images with any error
+size_t write_report(const std::vector<ImageReport> &reports, double seconds,
+                    std::ostream &os);
+
+// quick_check() of every image on the pool, in the order of files
+std::vector<QuickReport>
+quick_check_images(const std::vector<std::string> &files, unsigned threads);
+
+// JSON report, one line per image, with counts per verdict. Returns the
+// worst verdict.
+Verdict write_quick_reports(const std::vector<QuickReport> &reports,
+                            double seconds, std::ostream &os);
@@ -0,0 +1,612 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "compact.h"
+#include "fat32parse.h"
+
+// regions copied as they are and the FATs go out in blocks, all-zero ones
+// stay holes
+static constexpr size_t COPY_BLOCK = 64 * 1024;
+// the data region goes out in writes of up to that much and that many
+// spans, IOV_MAX on Linux
+static constexpr size_t MAX_WRITE = 8 * 1024 * 1024;
+static constexpr size_t MAX_SPANS = 1024;
+// a directory holds at most 65536 slots, a chain past that loops
+static constexpr uint64_t MAX_DIR_BYTES = 65536 * sizeof(dir_entry);
+
+static constexpr uint32_t NONE = 0xffffffff;
+
+static std::error_code last_error() {
+  return std::error_code(errno, std::system_category());
+}
+
+static bool is_zero(const uint8_t *p, size_t size) {
+  return p[0] == 0 && std::equal(p, p + size - 1, p + 1);
+}
+
+static bool pwrite_all(int fd, const uint8_t *data, size_t size,
+                       uint64_t offset) {
+  while (size) {
+    auto r = ::pwrite(fd, data, size, (off_t)offset);
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r <= 0) {
+      return false;
+    }
+    data += r;
+    size -= r;
+    offset += r;
+  }
+  return true;
+}
+
+// Writes [data, data + size) to offset, blocks of zeroes skipped
+static bool write_sparse(int fd, const uint8_t *data, uint64_t size,
+                         uint64_t offset, uint64_t &written) {
+  for (uint64_t pos = 0; pos < size; pos += COPY_BLOCK) {
+    auto n = (size_t)std::min<uint64_t>(COPY_BLOCK, size - pos);
+    if (is_zero(data + pos, n)) {
+      continue;
+    }
+    if (!pwrite_all(fd, data + pos, n, offset + pos)) {
+      return false;
+    }
+    written += n;
+  }
+  return true;
+}
+
+// Sequential writer of the data region. Spans point into the source mapping
+// and go out with one pwritev for many of them, a span that continues the
+// last one in both files only makes it longer. Blocks built on the fly are
+// copied into a buffer that lives until the write.
+class DataWriter {
+public:
+  explicit DataWriter(int fd) : fd_(fd) { copied_.reserve(MAX_WRITE); }
+
+  bool put(uint64_t offset, const uint8_t *data, size_t size) {
+    if (!reserve(offset, size, 0)) {
+      return false;
+    }
+    append(data, size);
+    return true;
+  }
+
+  bool put_copy(uint64_t offset, const uint8_t *data, size_t size) {
+    if (!reserve(offset, size, size)) {
+      return false;
+    }
+    auto p = copied_.data() + copied_.size();
+    copied_.insert(copied_.end(), data, data + size);
+    append(p, size);
+    return true;
+  }
+
+  bool flush() {
+    auto iov = spans_.data();
+    auto count = spans_.size();
+    auto offset = offset_;
+    while (count) {
+      auto r = ::pwritev(fd_, iov, (int)count, (off_t)offset);
+      if (r < 0 && errno == EINTR) {
+        continue;
+      }
+      if (r <= 0) {
+        return false;
+      }
+      offset += r;
+      written_ += r;
+      for (; count && (size_t)r >= iov->iov_len; ++iov, --count) {
+        r -= iov->iov_len;
+      }
+      if (count) {
+        iov->iov_base = (uint8_t *)iov->iov_base + r;
+        iov->iov_len -= r;
+      }
+    }
+    spans_.clear();
+    copied_.clear();
+    pending_ = 0;
+    return true;
+  }
+
+  uint64_t written() const { return written_; }
+
+private:
+  // writes what is pending unless size bytes at offset continue it and fit
+  bool reserve(uint64_t offset, size_t size, size_t copy) {
+    if (!spans_.empty() &&
+        (offset != offset_ + pending_ || spans_.size() >= MAX_SPANS ||
+         pending_ + size > MAX_WRITE ||
+         copied_.size() + copy > copied_.capacity()) &&
+        !flush()) {
+      return false;
+    }
+    if (spans_.empty()) {
+      offset_ = offset;
+    }
+    return true;
+  }
+
+  void append(const uint8_t *data, size_t size) {
+    if (!spans_.empty() &&
+        (const uint8_t *)spans_.back().iov_base + spans_.back().iov_len ==
+            data) {
+      spans_.back().iov_len += size;
+    } else {
+      spans_.push_back({(void *)data, size});
+    }
+    pending_ += size;
+  }
+
+  int fd_;
+  uint64_t offset_ = 0; // of the first pending byte
+  size_t pending_ = 0;
+  std::vector<iovec> spans_;
+  std::vector<uint8_t> copied_;
+  uint64_t written_ = 0;
+};
+
+// One volume: plan() reads the tree and lays the chains out again, write()
+// puts the volume with the new layout into the destination
+class Compactor {
+public:
+  Compactor(const fat32::Volume &volume, uint64_t image_size,
+            CompactStats &stats)
+      : volume_(volume), fat_(volume.fat()), stats_(stats),
+        cluster_size_(volume.cluster_size()), image_size_(image_size),
+        page_((uint64_t)::sysconf(_SC_PAGESIZE)) {
+    // clusters that end past the image can not be written to
+    auto data = volume.data_offset();
+    limit_ = volume.cluster_count();
+    if (image_size < volume.cluster_offset(limit_)) {
+      limit_ = image_size < data + cluster_size_
+                   ? 2
+                   : (uint32_t)((image_size - data) / cluster_size_ + 2);
+    }
+  }
+
+  uint64_t begin() const { return volume_.offset(); }
+  // past the last cluster that fits in the image
+  uint64_t end() const { return volume_.cluster_offset(limit_); }
+
+  bool plan(std::error_code &err);
+  bool write(int fd, std::error_code &err);
+
+private:
+  struct Item {
+    uint32_t dir;       // in dirs_, NONE for files
+    uint32_t parent;    // the directory it is in, NONE for the root
+    uint32_t same;      // an ancestor it links back to, NONE if none
+    uint32_t size;      // for its slot, cut to the chain
+    uint32_t extents;   // its first fragment in extents_
+    uint32_t fragments; // of the chain, cut to what is copied
+    uint32_t clusters;  // to copy
+    uint32_t first;     // new first cluster, 0 - none
+  };
+
+  struct Dir {
+    uint32_t item;
+    // image offset of the slot of every child and the child, in slot order
+    std::vector<std::pair<uint64_t, uint32_t>> slots;
+  };
+
+  void collect(Item &item, uint32_t first, uint64_t limit);
+  bool allocate(Item &item);
+  void patch(const Item &item, uint8_t *block, size_t size, uint64_t source,
+             size_t &next) const;
+  bool copy_chain(DataWriter &writer, const Item &item);
+  bool write_reserved(int fd, std::error_code &err);
+
+  fat32::Volume volume_;
+  fat32::FatView fat_;
+  CompactStats &stats_;
+  uint32_t cluster_size_;
+  uint32_t limit_; // clusters below it fit in the image
+  uint64_t image_size_;
+  uint64_t page_;
+
+  std::vector<Item> items_; // the root first, then in traversal order
+  std::vector<Dir> dirs_;   // the root first
+  std::vector<fat32::Extent> extents_;
+
+  std::vector<uint32_t> table_; // the new FAT, widened like the decoders
+  uint32_t next_ = 2;           // next cluster to hand out
+  uint32_t last_ = NONE;        // handed out last
+  std::vector<uint8_t> block_;  // a directory being patched
+};
+
+void Compactor::collect(Item &item, uint32_t first, uint64_t limit) {
+  item.extents = (uint32_t)extents_.size();
+  uint64_t clusters = 0;
+  fat_.visit([&](const auto &typed) {
+    for (auto extent : typed.extents(first)) {
+      if (clusters >= limit) {
+        break;
+      }
+      extent.count = (uint32_t)std::min<uint64_t>(extent.count,
+                                                  limit - clusters);
+      extents_.push_back(extent);
+      clusters += extent.count;
+    }
+  });
+  item.fragments = (uint32_t)(extents_.size() - item.extents);
+  item.clusters = (uint32_t)clusters;
+}
+
+bool Compactor::plan(std::error_code &err) {
+  const uint64_t dir_limit =
+      (MAX_DIR_BYTES + cluster_size_ - 1) / cluster_size_;
+
+  items_.push_back({0, NONE, NONE, 0, 0, 0, 0, 0});
+  dirs_.push_back({0, {}});
+  if (volume_.root_cluster() != 0) {
+    collect(items_[0], volume_.root_cluster(), dir_limit);
+  }
+
+  // directory of every depth on the way to the current entry
+  std::vector<uint32_t> stack{0};
+  auto tree = volume_.tree();
+  for (auto it = tree.begin(); it != tree.end(); ++it) {
+    auto e = *it;
+    auto depth = (size_t)it.depth();
+    stack.resize(depth + 1);
+    auto parent = stack[depth];
+    if (e.is_volume_label()) {
+      continue;
+    }
+    if (dirs_[parent].slots.size() >= MAX_DIR_BYTES / sizeof(dir_entry)) {
+      // more entries than a directory holds, its chain loops
+      it.skip_children();
+      continue;
+    }
+
+    auto index = (uint32_t)items_.size();
+    Item item{NONE, parent, NONE, e.size(), 0, 0, 0, 0};
+    if (e.is_dir()) {
+      item.size = 0;
+      // a link back up keeps pointing at the copy of that directory
+      for (auto d : stack) {
+        auto &up = items_[dirs_[d].item];
+        if (up.fragments != 0 &&
+            extents_[up.extents].first == e.first_cluster()) {
+          item.same = dirs_[d].item;
+        }
+      }
+      if (item.same == NONE) {
+        item.dir = (uint32_t)dirs_.size();
+        dirs_.push_back({index, {}});
+        stack.push_back(item.dir);
+        collect(item, e.first_cluster(), dir_limit);
+        ++stats_.dirs;
+      }
+    } else {
+      collect(item, e.first_cluster(),
+              ((uint64_t)e.size() + cluster_size_ - 1) / cluster_size_);
+      if ((uint64_t)item.clusters * cluster_size_ < item.size) {
+        item.size = item.clusters * cluster_size_;
+        ++stats_.truncated;
+      }
+      ++stats_.files;
+    }
+    dirs_[parent].slots.push_back({it.offset(), index});
+    items_.push_back(item);
+  }
+
+  // the new table keeps the bad marks and nothing else
+  table_.assign(volume_.cluster_count(), 0);
+  fat_.visit([&](const auto &typed) {
+    for (uint32_t c = 2; c < typed.count(); ++c) {
+      if (typed[c] == CLUST_BAD) {
+        table_[c] = CLUST_BAD;
+      }
+    }
+  });
+
+  // directories first, then files, both in traversal order
+  for (auto &dir : dirs_) {
+    if (!allocate(items_[dir.item])) {
+      err = std::make_error_code(std::errc::no_space_on_device);
+      return false;
+    }
+  }
+  for (auto &item : items_) {
+    if (item.dir == NONE && !allocate(item)) {
+      err = std::make_error_code(std::errc::no_space_on_device);
+      return false;
+    }
+  }
+  return true;
+}
+
+bool Compactor::allocate(Item &item) {
+  if (item.same != NONE) {
+    item.first = items_[item.same].first;
+    return true;
+  }
+  uint32_t prev = 0;
+  for (uint32_t i = 0; i < item.clusters; ++i) {
+    while (next_ < limit_ && table_[next_] == CLUST_BAD) {
+      ++next_;
+    }
+    if (next_ >= limit_) {
+      return false;
+    }
+    if (prev == 0) {
+      item.first = next_;
+    } else {
+      table_[prev] = next_;
+    }
+    if (prev + 1 != next_) {
+      ++stats_.extents;
+    }
+    prev = last_ = next_++;
+  }
+  if (prev != 0) {
+    table_[prev] = CLUST_EOF;
+  }
+  stats_.clusters += item.clusters;
+  stats_.fragments += item.fragments;
+  return true;
+}
+
+// Points the slots of a directory block read from source at the new
+// chains. next is the first child of the directory not yet found.
+void Compactor::patch(const Item &item, uint8_t *block, size_t size,
+                      uint64_t source, size_t &next) const {
+  auto &slots = dirs_[item.dir].slots;
+  for (size_t pos = 0; pos + sizeof(dir_entry) <= size;
+       pos += sizeof(dir_entry)) {
+    auto e = (dir_entry *)(block + pos);
+    uint32_t first;
+    if (next < slots.size() && slots[next].first == source + pos) {
+      auto &child = items_[slots[next++].second];
+      first = child.first;
+      e->size = child.size;
+    } else if (e->name[0] == DOT_DIR_ENTRY && (e->attr & ATTR_DIR) &&
+               e->attr != ATTR_LONG_FNAME) {
+      // "." is the directory, ".." its parent, 0 for the root
+      first = e->name[1] != DOT_DIR_ENTRY ? item.first
+              : item.parent == 0          ? 0
+                                 : items_[dirs_[item.parent].item].first;
+    } else {
+      continue;
+    }
+    e->strt_clus_hword = (uint16_t)(first >> 16);
+    e->strt_clus_lword = (uint16_t)first;
+  }
+}
+
+bool Compactor::copy_chain(DataWriter &writer, const Item &item) {
+  const bool dir = item.dir != NONE;
+  size_t next = 0;
+  auto target = item.first;
+  for (uint32_t f = 0; f < item.fragments; ++f) {
+    auto &extent = extents_[item.extents + f];
+    // a fragment is read in with one request, not a fault per page
+    auto begin = volume_.cluster_offset(extent.first) & ~(page_ - 1);
+    auto end = std::min(volume_.cluster_offset(extent.first + extent.count),
+                        image_size_);
+    if (begin < end) {
+      ::posix_madvise((void *)(volume_.image() + begin), end - begin,
+                      POSIX_MADV_WILLNEED);
+    }
+    for (uint32_t i = 0; i < extent.count; ++i) {
+      auto source = extent.first + i;
+      auto data = volume_.cluster(source);
+      auto offset = volume_.cluster_offset(target);
+      target = table_[target];
+      if (dir) {
+        block_.assign(cluster_size_, 0);
+        if (data != nullptr) {
+          std::memcpy(block_.data(), data, cluster_size_);
+        }
+        patch(item, block_.data(), cluster_size_,
+              volume_.cluster_offset(source), next);
+        if (!writer.put_copy(offset, block_.data(), cluster_size_)) {
+          return false;
+        }
+      } else if (data != nullptr && !is_zero(data, cluster_size_) &&
+                 !writer.put(offset, data, cluster_size_)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+bool Compactor::write_reserved(int fd, std::error_code &err) {
+  auto sector = volume_.sector_size();
+  auto reserved = (size_t)volume_.fat_sector(0) * sector;
+  std::vector<uint8_t> buf(volume_.image() + volume_.offset(),
+                           volume_.image() + volume_.offset() + reserved);
+
+  if (volume_.fat_type() == fat32::FatType::Fat32) {
+    uint32_t free = 0;
+    for (uint32_t c = 2; c < table_.size(); ++c) {
+      free += table_[c] == 0;
+    }
+    // the boot sector and its backup, and the FSInfo after each
+    auto &boot = volume_.boot();
+    for (uint64_t base : {(uint64_t)0, (uint64_t)boot.backup_boot_sector}) {
+      if (base != 0 && (base == 0xffff || (base + 1) * sector > reserved)) {
+        continue;
+      }
+      auto copy = (boot_sector *)(buf.data() + base * sector);
+      if (base != 0 && copy->bytes_per_sec != boot.bytes_per_sec) {
+        continue;
+      }
+      copy->root_dir_strt_cluster = items_[0].first;
+      auto at = (base + boot.fs_info_sector) * sector;
+      if (at + sizeof(fsinfo_t) > reserved) {
+        continue;
+      }
+      auto fsinfo = (fsinfo_t *)(buf.data() + at);
+      if (fsinfo->signature1 == 0x41615252 &&
+          fsinfo->signature2 == 0x61417272) {
+        fsinfo->free_clusters = free;
+        fsinfo->next_cluster = last_;
+      }
+    }
+  }
+
+  uint64_t written = 0;
+  if (!write_sparse(fd, buf.data(), buf.size(), volume_.offset(), written)) {
+    err = last_error();
+    return false;
+  }
+  stats_.bytes_written += written;
+  return true;
+}
+
+bool Compactor::write(int fd, std::error_code &err) {
+  if (!write_reserved(fd, err)) {
+    return false;
+  }
+
+  // the table in the width of the volume, entries 0 and 1 as they were
+  auto type = volume_.fat_type();
+  std::vector<uint8_t> fat((size_t)volume_.fat_sectors() *
+                           volume_.sector_size());
+  for (uint32_t c = 2; c < table_.size(); ++c) {
+    auto v = table_[c];
+    if (type == fat32::FatType::Fat32) {
+      std::memcpy(&fat[(size_t)c * 4], &v, sizeof(v));
+    } else if (type == fat32::FatType::Fat16) {
+      auto v16 = (uint16_t)v;
+      std::memcpy(&fat[(size_t)c * 2], &v16, sizeof(v16));
+    } else {
+      // two entries in three bytes, the odd one in the upper 12 bits
+      auto p = &fat[c + c / 2];
+      v &= 0xfff;
+      if (c & 1) {
+        p[0] = (uint8_t)((p[0] & 0x0f) | v << 4);
+        p[1] = (uint8_t)(v >> 4);
+      } else {
+        p[0] = (uint8_t)v;
+        p[1] = (uint8_t)((p[1] & 0xf0) | v >> 8);
+      }
+    }
+  }
+  std::memcpy(fat.data(), fat_.data(),
+              (size_t)fat32::AnyEntries{type}.bytes(2));
+  for (unsigned copy = 0; copy < volume_.fat_copies(); ++copy) {
+    uint64_t written = 0;
+    if (!write_sparse(fd, fat.data(), fat.size(), volume_.fat_offset(copy),
+                      written)) {
+      err = last_error();
+      return false;
+    }
+    stats_.bytes_written += written;
+  }
+
+  // the fixed root of FAT12/16 stays where it is
+  if (type != fat32::FatType::Fat32) {
+    auto offset = volume_.root_offset();
+    auto size = (size_t)(volume_.data_offset() - offset);
+    std::vector<uint8_t> root(volume_.image() + offset,
+                              volume_.image() + offset + size);
+    size_t next = 0;
+    patch(items_[0], root.data(), size, offset, next);
+    uint64_t written = 0;
+    if (!write_sparse(fd, root.data(), size, offset, written)) {
+      err = last_error();
+      return false;
+    }
+    stats_.bytes_written += written;
+  }
+
+  DataWriter writer(fd);
+  bool ok = true;
+  for (auto &dir : dirs_) {
+    ok = ok && copy_chain(writer, items_[dir.item]);
+  }
+  for (auto &item : items_) {
+    ok = ok && (item.dir != NONE || copy_chain(writer, item));
+  }
+  ok = ok && writer.flush();
+  stats_.bytes_written += writer.written();
+  if (!ok) {
+    err = last_error();
+  }
+  return ok;
+}
+
+bool compact_image(const std::string &in, const std::string &out,
+                   int partition, CompactStats &stats, std::error_code &err) {
+  err.clear();
+  stats = CompactStats();
+
+  // truncating the destination would pull the source away under the
+  // mapping
+  struct stat a, b;
+  if (::stat(in.c_str(), &a) == 0 && ::stat(out.c_str(), &b) == 0 &&
+      a.st_dev == b.st_dev && a.st_ino == b.st_ino) {
+    err = std::make_error_code(std::errc::invalid_argument);
+    return false;
+  }
+
+  fat32::Image image;
+  if (!image.open(in, err)) {
+    return false;
+  }
+  // chains are read fragment by fragment, readahead around every fault
+  // would read mostly what is not needed
+  ::posix_madvise((void *)image.data(), image.size(), POSIX_MADV_RANDOM);
+  // a table that can not be followed to its end is compacted as far as it
+  // goes, the rest is copied
+  std::error_code table_err;
+  std::vector<std::unique_ptr<Compactor>> volumes;
+  for (auto &v : image.volumes(partition, table_err)) {
+    if (v.err) {
+      continue;
+    }
+    auto c = std::make_unique<Compactor>(v.volume, image.size(), stats);
+    if (!c->plan(err)) {
+      return false;
+    }
+    volumes.push_back(std::move(c));
+  }
+  std::sort(volumes.begin(), volumes.end(),
+            [](const auto &a, const auto &b) { return a->begin() < b->begin(); });
+
+  auto fd = ::open(out.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    err = last_error();
+    return false;
+  }
+  bool ok = ::ftruncate(fd, (off_t)image.size()) == 0;
+
+  // what lies between the volumes as it is
+  uint64_t pos = 0;
+  for (auto &v : volumes) {
+    if (!ok || v->begin() < pos) {
+      continue; // overlaps the one before, copied as part of it
+    }
+    ok = write_sparse(fd, image.data() + pos, v->begin() - pos, pos,
+                      stats.bytes_written) &&
+         v->write(fd, err);
+    pos = v->end();
+    ++stats.volumes;
+  }
+  ok = ok && write_sparse(fd, image.data() + pos, image.size() - pos, pos,
+                          stats.bytes_written);
+  if (!ok && !err) {
+    err = last_error();
+  }
+  if (::close(fd) != 0 && ok) {
+    err = last_error();
+    ok = false;
+  }
+  return ok;
+}
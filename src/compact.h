@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <system_error>
+
+struct CompactStats {
+  unsigned volumes = 0; // rewritten, the rest is copied as it is
+  uint64_t files = 0;
+  uint64_t dirs = 0;
+  uint64_t clusters = 0;   // copied to their new place
+  uint64_t fragments = 0;  // of those chains before
+  uint64_t extents = 0;    // and after, more than one per chain only
+                           // where a bad cluster is in the way
+  uint64_t truncated = 0;  // files whose chain was shorter than their size
+  uint64_t bytes_written = 0;
+};
+
+// Writes a copy of the image in which every file and directory of the FAT
+// volumes is one contiguous run of clusters: the root and the directories
+// first, then the files, both in traversal order. Chains, the first
+// cluster in every directory entry, "." and "..", the FAT32 root cluster
+// and FSInfo are rewritten to match, and every FAT copy gets the new
+// table. Clusters marked bad stay bad and are stepped over. Everything
+// outside the volumes, and the volumes of other partitions when partition
+// is not -1, is copied as it is.
+//
+// Data goes straight from the mapping of the source to the destination in
+// large sequential writes. All-zero blocks and free clusters are not
+// written and stay holes, the destination is sparse. A chain longer than
+// its file needs is cut to the size, a shorter one cuts the size, and a
+// cluster linked into two chains is copied to both.
+bool compact_image(const std::string &in, const std::string &out,
+                   int partition, CompactStats &stats, std::error_code &err);
@@ -0,0 +1,121 @@
+#include <iomanip>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+#include "dump_stats.h"
+
+static const char *const STAGE_NAMES[DumpStats::STAGE_COUNT] = {
+    "mbr", "boot_sector", "fsinfo", "fat", "directories"};
+
+// cpu seconds and page faults of the calling thread
+static void sample(double &cpu, uint64_t &major_faults,
+                   uint64_t &minor_faults) {
+#ifdef _WIN32
+  cpu = 0;
+  major_faults = minor_faults = 0;
+#else
+  rusage usage{};
+#ifdef RUSAGE_THREAD
+  getrusage(RUSAGE_THREAD, &usage);
+#else
+  getrusage(RUSAGE_SELF, &usage);
+#endif
+  cpu = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+        (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1e-6;
+  major_faults = usage.ru_majflt;
+  minor_faults = usage.ru_minflt;
+#endif
+}
+
+DumpStats::Scope::Scope(DumpStats *stats, Stage stage)
+    : stats_(stats), stage_(stage) {
+  if (stats_ != nullptr) {
+    sample(cpu_, major_faults_, minor_faults_);
+    start_ = std::chrono::steady_clock::now();
+  }
+}
+
+DumpStats::Scope::~Scope() {
+  if (stats_ == nullptr) {
+    return;
+  }
+  auto wall = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                            start_)
+                  .count();
+  double cpu;
+  uint64_t major_faults, minor_faults;
+  sample(cpu, major_faults, minor_faults);
+
+  auto &c = (*stats_)[stage_];
+  c.wall += wall;
+  c.cpu += cpu - cpu_;
+  c.major_faults += major_faults - major_faults_;
+  c.minor_faults += minor_faults - minor_faults_;
+}
+
+DumpStats &DumpStats::operator+=(const DumpStats &o) {
+  for (int i = 0; i < STAGE_COUNT; ++i) {
+    auto &c = stages_[i];
+    auto &x = o.stages_[i];
+    c.wall += x.wall;
+    c.cpu += x.cpu;
+    c.major_faults += x.major_faults;
+    c.minor_faults += x.minor_faults;
+    c.mappings += x.mappings;
+    c.bytes += x.bytes;
+    c.clusters += x.clusters;
+    c.entries += x.entries;
+  }
+  return *this;
+}
+
+void DumpStats::print(std::ostream &os) const {
+  using std::endl;
+  using std::setw;
+
+  auto flags = os.flags();
+  os << std::left << setw(12) << "stage" << std::right << setw(11)
+     << "wall ms" << setw(11) << "cpu ms" << setw(8) << "majflt" << setw(9)
+     << "minflt" << setw(6) << "maps" << setw(13) << "bytes" << setw(11)
+     << "clusters" << setw(10) << "entries" << endl;
+
+  Counters total;
+  auto row = [&os](const char *name, const Counters &c) {
+    os << std::left << setw(12) << name << std::right << std::fixed
+       << std::setprecision(3) << setw(11) << c.wall * 1e3 << setw(11)
+       << c.cpu * 1e3 << setw(8) << c.major_faults << setw(9)
+       << c.minor_faults << setw(6) << c.mappings << setw(13) << c.bytes
+       << setw(11) << c.clusters << setw(10) << c.entries << endl;
+  };
+  for (int i = 0; i < STAGE_COUNT; ++i) {
+    auto &c = stages_[i];
+    row(STAGE_NAMES[i], c);
+    total.wall += c.wall;
+    total.cpu += c.cpu;
+    total.major_faults += c.major_faults;
+    total.minor_faults += c.minor_faults;
+    total.mappings += c.mappings;
+    total.bytes += c.bytes;
+    total.clusters += c.clusters;
+    total.entries += c.entries;
+  }
+  row("total", total);
+  os.flags(flags);
+}
+
+void DumpStats::print_json(std::ostream &os) const {
+  os << "{\"stages\": [";
+  for (int i = 0; i < STAGE_COUNT; ++i) {
+    auto &c = stages_[i];
+    os << (i ? ", " : "") << "{\"name\": \"" << STAGE_NAMES[i]
+       << "\", \"wall_s\": " << c.wall << ", \"cpu_s\": " << c.cpu
+       << ", \"major_faults\": " << c.major_faults
+       << ", \"minor_faults\": " << c.minor_faults
+       << ", \"mappings\": " << c.mappings << ", \"bytes\": " << c.bytes
+       << ", \"clusters\": " << c.clusters << ", \"entries\": " << c.entries
+       << "}";
+  }
+  os << "]}" << std::endl;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+
+// Per stage counters of the default mode, filled only when --stats is given.
+// Stages run more than once (every partition, every FAT copy) accumulate.
+// Partitions are dumped in parallel, so wall time is the sum over threads.
+class DumpStats {
+public:
+  enum Stage { Mbr, BootSector, FsInfo, Fat, Directories, STAGE_COUNT };
+
+  struct Counters {
+    double wall = 0; // seconds
+    double cpu = 0;  // seconds, user + system of the calling thread
+    uint64_t major_faults = 0;
+    uint64_t minor_faults = 0;
+    uint64_t mappings = 0;
+    uint64_t bytes = 0; // bytes of the image the parser read
+    uint64_t clusters = 0;
+    uint64_t entries = 0;
+  };
+
+  // Adds the time and page faults between construction and destruction to
+  // a stage. Does nothing if stats is null.
+  class Scope {
+  public:
+    Scope(DumpStats *stats, Stage stage);
+    ~Scope();
+
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
+
+  private:
+    DumpStats *stats_;
+    Stage stage_;
+    std::chrono::steady_clock::time_point start_;
+    double cpu_;
+    uint64_t major_faults_;
+    uint64_t minor_faults_;
+  };
+
+  // adds the counters of a partition dumped on another thread
+  DumpStats &operator+=(const DumpStats &o);
+
+  Counters &operator[](Stage stage) { return stages_[stage]; }
+  const Counters &operator[](Stage stage) const { return stages_[stage]; }
+
+  void print(std::ostream &os) const;
+  void print_json(std::ostream &os) const;
+
+private:
+  Counters stages_[STAGE_COUNT];
+};
@@ -0,0 +1,3 @@
+// The only translation unit that compiles the emfat implementation
+#define EMFAT_IMPLEMENTATION
+#include "emfat1.h"
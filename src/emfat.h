@@ -40,12 +40,27 @@ extern "C" {
 
 typedef void (*emfat_readcb_t)(uint8_t *dest, int size, uint32_t offset, size_t userdata);
 typedef void (*emfat_writecb_t)(const uint8_t *data, int size, uint32_t offset, size_t userdata);
+/* Points at the file data at offset where it already sits in memory, for
+ * emfat_readv(). *size is the length wanted on entry and the length the
+ * pointer covers on return, which may be less. NULL: not in memory, readcb
+ * is used. The data must stay in place while the segments are in use. */
+typedef const uint8_t *(*emfat_mapcb_t)(uint32_t offset, uint32_t *size, size_t userdata);
 
 typedef struct emfat_entry emfat_entry_t;
 
+/* Size of the write-back buffer: sequential data sectors of one file are
+ * collected here and passed to writecb in one call */
+#ifndef EMFAT_WRITE_BUF_SIZE
+#define EMFAT_WRITE_BUF_SIZE (64 * 1024)
+#endif
+
 struct emfat_entry
 {
 	const char     *name;
+	/* 8.3 alias "NAME.EXT", unique in its directory, when name is not an
+	 * upper case 8.3 name itself; name then goes into VFAT long name slots
+	 * in front of it. NULL: name is the short name. */
+	const char     *short_name;
 	bool            dir;
 	int             level;
 	uint32_t        offset;
@@ -55,12 +70,14 @@ struct emfat_entry
 	uint32_t        cma_time[3]; /**< create/mod/access time in unix format */
 	emfat_readcb_t  readcb;
 	emfat_writecb_t writecb;
+	emfat_mapcb_t   mapcb;
 	struct
 	{
 		uint32_t       first_clust;
 		uint32_t       last_clust;
 		uint32_t       last_reserved;
-		uint32_t       num_subentry;
+		uint32_t       num_slots;   /**< of the entries of a directory */
+		uint8_t        lfn_slots;   /**< in front of this entry */
 		emfat_entry_t *top;
 		emfat_entry_t *sub;
 		emfat_entry_t *next;
@@ -83,12 +100,48 @@ typedef struct
 		emfat_entry_t *entries;
 		emfat_entry_t *last_entry;
 		int            num_entries;
+		struct
+		{
+			emfat_entry_t *entry;  /**< owner of the buffered data, NULL if empty */
+			uint32_t       offset; /**< offset of data[0] inside the file */
+			uint32_t       size;
+			uint8_t        data[EMFAT_WRITE_BUF_SIZE];
+		} wbuf;
 	} priv;
 } emfat_t;
 
+/* Lookup position of one reader. emfat_read() keeps its own in emfat->priv,
+ * threads serving the same volume concurrently must use one cursor each
+ * with emfat_read_r(). */
+typedef struct
+{
+	emfat_entry_t *last_entry;
+} emfat_cursor_t;
+
+/* A piece of the volume emfat_readv() describes, laid out like struct
+ * iovec so that an array of them can go to writev() as it is */
+typedef struct
+{
+	const void *base;
+	size_t      len;
+} emfat_seg_t;
+
 bool emfat_init(emfat_t *emfat, const char *label, emfat_entry_t *entries);
+void emfat_cursor_init(const emfat_t *emfat, emfat_cursor_t *cursor);
 void emfat_read(emfat_t *emfat, uint8_t *data, uint32_t sector, int num_sectors);
+void emfat_read_r(const emfat_t *emfat, emfat_cursor_t *cursor, uint8_t *data, uint32_t sector, int num_sectors);
+/* Describes sectors instead of copying them: file data from mapcb as
+ * pointers into where it is, everything else (boot sectors, FATs,
+ * directories, data of files without mapcb, sectors mapcb does not cover
+ * in whole) generated into scratch, which holds scratch_sectors sectors.
+ * Up to max_segs segments go to segs and their count to num_segs. Returns
+ * the number of sectors described, less than num_sectors when segs or
+ * scratch ran out: call again for the rest with another scratch, or after
+ * the segments have been sent. */
+int emfat_readv(emfat_t *emfat, emfat_seg_t *segs, int max_segs, int *num_segs, uint8_t *scratch, int scratch_sectors, uint32_t sector, int num_sectors);
+int emfat_readv_r(const emfat_t *emfat, emfat_cursor_t *cursor, emfat_seg_t *segs, int max_segs, int *num_segs, uint8_t *scratch, int scratch_sectors, uint32_t sector, int num_sectors);
 void emfat_write(emfat_t *emfat, const uint8_t *data, uint32_t sector, int num_sectors);
+void emfat_flush(emfat_t *emfat);
 
 #define EMFAT_ENCODE_CMA_TIME(D,M,Y,h,m,s) \
     ((((((Y)-1980) << 9) | ((M) << 5) | (D)) << 16) | \
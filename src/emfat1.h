@@ -26,6 +26,11 @@
  * version: 1.1 (2.04.2017)
  */
 
+#ifndef EMFAT1_H
+#define EMFAT1_H
+
+#include <limits.h>
+
 #include "emfat.h"
 
 #ifdef __cplusplus
@@ -37,6 +42,7 @@ extern "C" {
 #define SECT_PER_CLUST    (CLUST / SECT)
 #define SIZE_TO_NSECT(s)  ((s) == 0 ? 1 : ((s) + SECT - 1) / SECT)
 #define SIZE_TO_NCLUST(s) ((s) == 0 ? 1 : ((s) + CLUST - 1) / CLUST)
+#define FILE_NCLUST(s) (((s) + CLUST - 1) / CLUST)
 
 #define CLUST_FREE     0x00000000
 #define CLUST_RESERVED 0x00000001
@@ -176,6 +182,32 @@ typedef struct
 	uint8_t file_system_type[FILE_SYS_TYPE_LENGTH];
 } boot_sector;
 
+/* FAT12/16 boot sector: the same BPB up to tol_sector_cnt, followed by the
+ * extended fields that FAT32 moves past its own */
+typedef struct
+{
+	uint8_t jump[JUMP_INS_LEN];
+	uint8_t OEM_name[OEM_NAME_LEN];
+	uint16_t bytes_per_sec;
+	uint8_t sec_per_clus;
+	uint16_t reserved_sec_cnt;
+	uint8_t fat_cnt;
+	uint16_t root_dir_max_cnt;
+	uint16_t tot_sectors;
+	uint8_t media_desc;
+	uint16_t sec_per_fat_fat16;
+	uint16_t sec_per_track;
+	uint16_t number_of_heads;
+	uint32_t hidden_sec_cnt;
+	uint32_t tol_sector_cnt;
+	uint8_t drive_number;
+	uint8_t reserved1;
+	uint8_t boot_sig;
+	uint8_t volume_id[VOL_ID_LEN];
+	uint8_t volume_label[VOL_LABEL_LEN];
+	uint8_t file_system_type[FILE_SYS_TYPE_LENGTH];
+} boot_sector16;
+
 typedef struct
 {
 	uint32_t signature1;     /* 0x41615252L */
@@ -218,6 +250,52 @@ typedef struct
 
 #pragma pack(pop)
 
+/* On-disk structures above are shared, the implementation below is built
+ * once, in emfat.cpp */
+#ifdef EMFAT_IMPLEMENTATION
+
+// UTF-8 to UCS-2, characters past the BMP as surrogate pairs, bad
+// sequences as U+FFFD. Returns the number of UCS-2 units, at most max.
+static int utf8_to_ucs2(const char *s, uint16_t *out, int max)
+{
+	const uint8_t *p;
+	uint32_t c;
+	int more, n;
+
+	p = (const uint8_t *)s;
+	n = 0;
+	while (*p != 0 && n < max)
+	{
+		c = *p++;
+		more = c >= 0xF8 ? -1 : c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : c >= 0xC0 ? 1 : c >= 0x80 ? -1 : 0;
+		if (more > 0)
+			c &= 0x3F >> more;
+		for (; more > 0 && (*p & 0xC0) == 0x80; more--)
+			c = (c << 6) | (*p++ & 0x3F);
+		if (more != 0 || c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF))
+			c = 0xFFFD;
+		if (c > 0xFFFF)
+		{
+			if (n + 2 > max) break;
+			c -= 0x10000;
+			out[n++] = (uint16_t)(0xD800 | (c >> 10));
+			c = 0xDC00 | (c & 0x3FF);
+		}
+		out[n++] = (uint16_t)c;
+	}
+	return n;
+}
+
+static uint8_t lfn_slot_count(const emfat_entry_t *e)
+{
+	uint16_t ucs2[LONG_FILE_NAME_LEN];
+	int len;
+
+	if (e->short_name == NULL) return 0;
+	len = utf8_to_ucs2(e->name, ucs2, LONG_FILE_NAME_LEN);
+	return (uint8_t)((len + LFN_LEN_PER_ENTRY - 1) / LFN_LEN_PER_ENTRY);
+}
+
 bool emfat_init_entries(emfat_entry_t *entries)
 {
 	emfat_entry_t *e;
@@ -229,7 +307,8 @@ bool emfat_init_entries(emfat_entry_t *entries)
 	e->priv.top = NULL;
 	e->priv.next = NULL;
 	e->priv.sub = NULL;
-	e->priv.num_subentry = 0;
+	e->priv.num_slots = 0;
+	e->priv.lfn_slots = 0;
 
 	n = 0;
 	for (i = 1; entries[i].name != NULL; i++)
@@ -237,16 +316,19 @@ bool emfat_init_entries(emfat_entry_t *entries)
 		entries[i].priv.top = NULL;
 		entries[i].priv.next = NULL;
 		entries[i].priv.sub = NULL;
-		entries[i].priv.num_subentry = 0;
-		if (entries[i].level == n - 1)
+		entries[i].priv.num_slots = 0;
+		entries[i].priv.lfn_slots = lfn_slot_count(&entries[i]);
+		// back up to the parent level, possibly several steps at once
+		while (entries[i].level < n)
 		{
-			if (n == 0) return false;
+			if (entries[i].level < 1) return false;
 			e = e->priv.top;
 			n--;
 		}
 		if (entries[i].level == n + 1)
 		{
 			if (!e->dir) return false;
+			e->priv.num_slots += 1 + entries[i].priv.lfn_slots;
 			e->priv.sub = &entries[i];
 			entries[i].priv.top = e;
 			e = &entries[i];
@@ -256,7 +338,7 @@ bool emfat_init_entries(emfat_entry_t *entries)
 		if (entries[i].level == n)
 		{
 			if (n == 0) return false;
-			e->priv.top->priv.num_subentry++;
+			e->priv.top->priv.num_slots += 1 + entries[i].priv.lfn_slots;
 			entries[i].priv.top = e->priv.top;
 			e->priv.next = &entries[i];
 			e = &entries[i];
@@ -308,13 +390,15 @@ bool emfat_init(emfat_t *emfat, const char *label, emfat_entry_t *entries)
 			e->curr_size = 0;
 			e->max_size = 0;
 			e->priv.first_clust = clust;
-			e->priv.last_clust = clust + SIZE_TO_NCLUST(e->priv.num_subentry * sizeof(dir_entry)) - 1;
+			// the volume label or "." and ".." take slots too
+			e->priv.last_clust = clust + SIZE_TO_NCLUST((e->priv.num_slots + (e->priv.top == NULL ? 1 : 2)) * sizeof(dir_entry)) - 1;
 			e->priv.last_reserved = e->priv.last_clust;
 		}
 		else
 		{
+			// an empty file has no chain, its cluster is a reserved tail
 			e->priv.first_clust = clust;
-			e->priv.last_clust = e->priv.first_clust + SIZE_TO_NCLUST(entries[i].curr_size) - 1;
+			e->priv.last_clust = e->priv.first_clust + FILE_NCLUST(entries[i].curr_size) - 1;
 			e->priv.last_reserved = e->priv.first_clust + SIZE_TO_NCLUST(entries[i].max_size) - 1;
 		}
 		clust = e->priv.last_reserved + 1;
@@ -336,6 +420,9 @@ bool emfat_init(emfat_t *emfat, const char *label, emfat_entry_t *entries)
 	emfat->priv.root_lba = emfat->priv.fat2_lba + sect_per_fat;
 	emfat->priv.entries = entries;
 	emfat->priv.last_entry = entries;
+	emfat->priv.wbuf.entry = NULL;
+	emfat->priv.wbuf.offset = 0;
+	emfat->priv.wbuf.size = 0;
 	emfat->disk_sectors = clust * SECT_PER_CLUST + emfat->priv.root_lba;
 	emfat->vol_size = (uint64_t)emfat->disk_sectors * SECT;
 	/* calc cyl number */
@@ -407,39 +494,53 @@ void read_boot_sector(const emfat_t *emfat, uint8_t *sect)
 
 emfat_entry_t *find_entry(const emfat_t *emfat, uint32_t clust, emfat_entry_t *nearest)
 {
-	if (nearest == NULL)
-		nearest = emfat->priv.entries;
+	emfat_entry_t *lo, *hi, *mid;
 
-	if (nearest->priv.first_clust > clust)
-		while (nearest >= emfat->priv.entries) // backward finding
-		{
-			if (IS_CLUST_OF(clust, nearest))
-				return nearest;
-			nearest--;
-		}
-	else
-		while (nearest->name != NULL) // forward finding
-		{
-			if (IS_CLUST_OF(clust, nearest))
-				return nearest;
-			nearest++;
-		}
+	if (nearest != NULL)
+	{
+		if (IS_CLUST_OF(clust, nearest))
+			return nearest;
+		// sequential access: the next entry is the most likely one
+		if (nearest[1].name != NULL && IS_CLUST_OF(clust, &nearest[1]))
+			return &nearest[1];
+	}
+
+	// entries are laid out in ascending cluster order, so bisect
+	lo = emfat->priv.entries;
+	hi = emfat->priv.entries + emfat->priv.num_entries;
+	while (lo < hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		if (mid->priv.last_reserved < clust)
+			lo = mid + 1; else
+			hi = mid;
+	}
+	if (lo < emfat->priv.entries + emfat->priv.num_entries && IS_CLUST_OF(clust, lo))
+		return lo;
 	return NULL;
 }
 
 void read_fsinfo_sector(const emfat_t *emfat, uint8_t *sect)
 {
 	fsinfo_t *info = (fsinfo_t *)sect;
+	const emfat_entry_t *e;
+	uint32_t free_clusters = 0;
+
+	// the only free clusters are the reserved tails of files, read_fat_sector
+	// reports them free
+	for (e = emfat->priv.entries; e < emfat->priv.entries + emfat->priv.num_entries; e++)
+		if (!e->dir)
+			free_clusters += e->priv.last_reserved - e->priv.last_clust;
 	info->signature1 = 0x41615252L;
 	info->signature2 = 0x61417272L;
-	info->free_clusters = 0;
-	info->next_cluster = emfat->priv.num_clust + 2;
+	info->free_clusters = free_clusters;
+	info->next_cluster = 0xFFFFFFFF; // no hint
 	memset(info->reserved1, 0, sizeof(info->reserved1));
 	memset(info->reserved2, 0, sizeof(info->reserved2));
 	info->signature3 = 0xAA550000;
 }
 
-void read_fat_sector(emfat_t *emfat, uint8_t *sect, uint32_t index)
+void read_fat_sector(const emfat_t *emfat, emfat_cursor_t *cursor, uint8_t *sect, uint32_t index)
 {
 	emfat_entry_t *le;
 	uint32_t *values;
@@ -458,7 +559,7 @@ void read_fat_sector(emfat_t *emfat, uint8_t *sect, uint32_t index)
 		curr += 2;
 	}
 
-	le = emfat->priv.last_entry;
+	le = cursor->last_entry;
 	while (count != 0)
 	{
 		if (!IS_CLUST_OF(curr, le))
@@ -466,7 +567,7 @@ void read_fat_sector(emfat_t *emfat, uint8_t *sect, uint32_t index)
 			le = find_entry(emfat, curr, le);
 			if (le == NULL)
 			{
-				le = emfat->priv.last_entry;
+				le = cursor->last_entry;
 				*values = CLUST_RESERVED;
 				values++;
 				count--;
@@ -492,7 +593,7 @@ void read_fat_sector(emfat_t *emfat, uint8_t *sect, uint32_t index)
 		count--;
 		curr++;
 	}
-	emfat->priv.last_entry = le;
+	cursor->last_entry = le;
 }
 
 void fill_entry(dir_entry *entry, const char *name, uint8_t attr, uint32_t clust, const uint32_t cma[3], uint32_t size)
@@ -513,7 +614,8 @@ void fill_entry(dir_entry *entry, const char *name, uint8_t attr, uint32_t clust
 
 	l = strlen(name);
 	dot_pos = -1;
-	if ((attr & ATTR_DIR) == 0)
+	// "." and ".." are names of their own
+	if (name[0] != '.')
 		for (i = l - 1; i >= 0; i--)
 			if (name[i] == '.')
 			{
@@ -532,12 +634,16 @@ void fill_entry(dir_entry *entry, const char *name, uint8_t attr, uint32_t clust
 		l2 = l - dot_pos - 1;
 		l2 = l2 > FILE_NAME_EXTN_LEN ? FILE_NAME_EXTN_LEN : l2;
 	}
-	memset(entry->name, ' ', FILE_NAME_SHRT_LEN + FILE_NAME_EXTN_LEN);
+	memset(entry->name, ' ', FILE_NAME_SHRT_LEN);
+	memset(entry->extn, ' ', FILE_NAME_EXTN_LEN);
 	memcpy(entry->name, name, l1);
 	memcpy(entry->extn, name + dot_pos + 1, l2);
-	for (i = 0; i < FILE_NAME_SHRT_LEN + FILE_NAME_EXTN_LEN; i++)
+	for (i = 0; i < FILE_NAME_SHRT_LEN; i++)
 		if (entry->name[i] >= 'a' && entry->name[i] <= 'z')
 			entry->name[i] -= 0x20;
+	for (i = 0; i < FILE_NAME_EXTN_LEN; i++)
+		if (entry->extn[i] >= 'a' && entry->extn[i] <= 'z')
+			entry->extn[i] -= 0x20;
 
 	entry->attr = attr;
 	entry->reserved = 24;
@@ -547,62 +653,122 @@ void fill_entry(dir_entry *entry, const char *name, uint8_t attr, uint32_t clust
 	return;
 }
 
-void fill_dir_sector(emfat_t *emfat, uint8_t *data, emfat_entry_t *entry, uint32_t rel_sect)
+static uint8_t short_name_checksum(const dir_entry *de)
+{
+	uint8_t sum;
+	int i;
+
+	sum = 0;
+	for (i = 0; i < FILE_NAME_SHRT_LEN; i++)
+		sum = (uint8_t)(((sum & 1) << 7) + (sum >> 1) + de->name[i]);
+	for (i = 0; i < FILE_NAME_EXTN_LEN; i++)
+		sum = (uint8_t)(((sum & 1) << 7) + (sum >> 1) + de->extn[i]);
+	return sum;
+}
+
+static void fill_short_entry(dir_entry *de, const emfat_entry_t *entry)
+{
+	const char *name;
+
+	name = entry->short_name != NULL ? entry->short_name : entry->name;
+	if (entry->dir)
+		fill_entry(de, name, ATTR_DIR | ATTR_READ, entry->priv.first_clust, entry->cma_time, 0); else
+		// a file without clusters starts nowhere, even with a tail reserved
+		fill_entry(de, name, ATTR_ARCHIVE | ATTR_READ,
+			entry->priv.last_clust < entry->priv.first_clust ? 0 : entry->priv.first_clust,
+			entry->cma_time, entry->curr_size);
+}
+
+// Long name slot ord, counted from 1 at the start of the name
+static void fill_lfn(lfn_entry *lfn, const char *name, int ord, bool last, uint8_t sum)
+{
+	uint16_t ucs2[LONG_FILE_NAME_LEN];
+	uint16_t chars[LFN_LEN_PER_ENTRY];
+	int len, i, at;
+
+	len = utf8_to_ucs2(name, ucs2, LONG_FILE_NAME_LEN);
+	for (i = 0; i < LFN_LEN_PER_ENTRY; i++)
+	{
+		at = (ord - 1) * LFN_LEN_PER_ENTRY + i;
+		chars[i] = at < len ? ucs2[at] : at == len ? LFN_TERM_MARK : LFN_END_MARK;
+	}
+	memset(lfn, 0, sizeof(lfn_entry));
+	lfn->ord_field = (uint8_t)(ord | (last ? LAST_ORD_FIELD_SEQ : 0));
+	lfn->flag = ATTR_LONG_FNAME;
+	lfn->chksum = sum;
+	memcpy(lfn->fname0_4, chars, LFN_FIRST_SET_LEN);
+	memcpy(lfn->fname6_11, chars + LFN_FIRST_SET_CNT, LFN_SEC_SET_LEN);
+	memcpy(lfn->fname12_13, chars + LFN_FIRST_SET_CNT + LFN_SEC_SET_CNT, LFN_THIRD_SET_LEN);
+}
+
+// Slot k of an entry: its long name slots, the end of the name first, then
+// the short entry
+static void fill_slot(dir_entry *de, const emfat_entry_t *entry, int k)
+{
+	dir_entry sfn;
+	int slots;
+
+	slots = entry->priv.lfn_slots;
+	if (k == slots)
+	{
+		fill_short_entry(de, entry);
+		return;
+	}
+	fill_short_entry(&sfn, entry);
+	fill_lfn((lfn_entry *)de, entry->name, slots - k, k == 0, short_name_checksum(&sfn));
+}
+
+void fill_dir_sector(const emfat_t *emfat, uint8_t *data, emfat_entry_t *entry, uint32_t rel_sect)
 {
 	dir_entry *de;
-	uint32_t avail;
+	uint32_t first, last, slot;
+	int k, n;
 
 	memset(data, 0, SECT);
 	de = (dir_entry *)data;
-	avail = SECT;
+	// slots of the directory in this sector
+	first = rel_sect * (SECT / sizeof(dir_entry));
+	last = first + SECT / sizeof(dir_entry);
 
-	if (rel_sect == 0)
-	// 1. first sector of directory
+	if (first == 0)
 	{
 		if (entry->priv.top == NULL)
-		{
-			fill_entry(de++, emfat->vol_label, ATTR_VOL_LABEL, 0, 0, 0);
-			avail -= sizeof(dir_entry);
-		}
+			fill_entry(de, emfat->vol_label, ATTR_VOL_LABEL, 0, 0, 0);
 		else
 		{
-			fill_entry(de++, ".", ATTR_DIR | ATTR_READ, entry->priv.first_clust, 0, 0);
-			fill_entry(de++, "..", ATTR_DIR | ATTR_READ, entry->priv.top->priv.first_clust, 0, 0);
-			avail -= sizeof(dir_entry) * 2;
+			fill_entry(de, ".", ATTR_DIR | ATTR_READ, entry->priv.first_clust, 0, 0);
+			// ".." of a child of the root is cluster 0, on FAT32 too
+			fill_entry(de + 1, "..", ATTR_DIR | ATTR_READ,
+				entry->priv.top->priv.top == NULL ? 0 : entry->priv.top->priv.first_clust, 0, 0);
 		}
-		entry = entry->priv.sub;
 	}
-	else
-	// 2. not a first sector
+	slot = entry->priv.top == NULL ? 1 : 2;
+	entry = entry->priv.sub;
+
+	// entries that end before the sector
+	while (entry != NULL && slot + entry->priv.lfn_slots + 1 <= first)
 	{
-		int n;
-		n = rel_sect * (SECT / sizeof(dir_entry));
-		n -= entry->priv.top == NULL ? 1 : 2;
-		entry = entry->priv.sub;
-		while (n > 0 && entry != NULL)
-		{
-			entry = entry->priv.next;
-			n--;
-		}
+		slot += entry->priv.lfn_slots + 1;
+		entry = entry->priv.next;
 	}
-	while (entry != NULL && avail >= sizeof(dir_entry))
+	while (entry != NULL && slot < last)
 	{
-		if (entry->dir)
-			fill_entry(de++, entry->name, ATTR_DIR | ATTR_READ, entry->priv.first_clust, entry->cma_time, 0); else
-			fill_entry(de++, entry->name, ATTR_ARCHIVE | ATTR_READ, entry->priv.first_clust, entry->cma_time, entry->curr_size);
+		n = entry->priv.lfn_slots + 1;
+		for (k = 0; k < n; k++, slot++)
+			if (slot >= first && slot < last)
+				fill_slot(de + (slot - first), entry, k);
 		entry = entry->priv.next;
-		avail -= sizeof(dir_entry);
 	}
 }
 
-void read_data_sector(emfat_t *emfat, uint8_t *data, uint32_t rel_sect)
+void read_data_sector(const emfat_t *emfat, emfat_cursor_t *cursor, uint8_t *data, uint32_t rel_sect)
 {
 	emfat_entry_t *le;
 	uint32_t cluster;
 	cluster = rel_sect / 8 + 2;
 	rel_sect = rel_sect % 8;
 
-	le = emfat->priv.last_entry;
+	le = cursor->last_entry;
 	if (!IS_CLUST_OF(cluster, le))
 	{
 		le = find_entry(emfat, cluster, le);
@@ -613,30 +779,83 @@ void read_data_sector(emfat_t *emfat, uint8_t *data, uint32_t rel_sect)
 				((uint32_t *)data)[i] = 0xEFBEADDE;
 			return;
 		}
-		emfat->priv.last_entry = le;
+		cursor->last_entry = le;
 	}
 	if (le->dir)
 	{
-		fill_dir_sector(emfat, data, le, rel_sect);
+		// sector within the whole directory, not within the cluster
+		fill_dir_sector(emfat, data, le, (cluster - le->priv.first_clust) * SECT_PER_CLUST + rel_sect);
 		return;
 	}
-	if (le->readcb == NULL)
-		memset(data, 0, SECT);
-	else
 	{
 		uint32_t offset = cluster - le->priv.first_clust;
 		offset = offset * CLUST + rel_sect * SECT;
-		le->readcb(data, SECT, offset + le->offset, le->user_data);
+		// not yet flushed data must be seen by the host
+		if (emfat->priv.wbuf.entry == le &&
+			offset >= emfat->priv.wbuf.offset &&
+			offset < emfat->priv.wbuf.offset + emfat->priv.wbuf.size)
+			memcpy(data, &emfat->priv.wbuf.data[offset - emfat->priv.wbuf.offset], SECT);
+		else
+		if (le->readcb == NULL)
+			memset(data, 0, SECT);
+		else
+			le->readcb(data, SECT, offset + le->offset, le->user_data);
 	}
 	return;
 }
 
-void emfat_read(emfat_t *emfat, uint8_t *data, uint32_t sector, int num_sectors)
+// Reads as many sectors of one file as possible with a single readcb call
+static int read_data_run(const emfat_t *emfat, emfat_cursor_t *cursor, uint8_t *data, uint32_t rel_sect, int num_sectors)
 {
+	emfat_entry_t *le;
+	uint32_t cluster;
+	uint32_t offset;
+	uint32_t end;
+	int n;
+
+	cluster = rel_sect / SECT_PER_CLUST + 2;
+	le = find_entry(emfat, cluster, cursor->last_entry);
+	if (num_sectors == 1 || le == NULL || le->dir || le->readcb == NULL ||
+		emfat->priv.wbuf.entry == le)
+	{
+		read_data_sector(emfat, cursor, data, rel_sect);
+		return 1;
+	}
+	cursor->last_entry = le;
+
+	// first sector after the reserved clusters of the file
+	end = (le->priv.last_reserved + 1 - 2) * SECT_PER_CLUST;
+	n = end - rel_sect;
+	if (n > num_sectors)
+		n = num_sectors;
+	if (n > INT_MAX / SECT)
+		n = INT_MAX / SECT;
+
+	offset = cluster - le->priv.first_clust;
+	offset = offset * CLUST + (rel_sect % SECT_PER_CLUST) * SECT;
+	le->readcb(data, n * SECT, offset + le->offset, le->user_data);
+	return n;
+}
+
+void emfat_cursor_init(const emfat_t *emfat, emfat_cursor_t *cursor)
+{
+	cursor->last_entry = emfat->priv.entries;
+}
+
+void emfat_read_r(const emfat_t *emfat, emfat_cursor_t *cursor, uint8_t *data, uint32_t sector, int num_sectors)
+{
+	int n;
+
 	while (num_sectors > 0)
 	{
 		if (sector >= emfat->priv.root_lba)
-			read_data_sector(emfat, data, sector - emfat->priv.root_lba);
+		{
+			n = read_data_run(emfat, cursor, data, sector - emfat->priv.root_lba, num_sectors);
+			data += n * SECT;
+			num_sectors -= n;
+			sector += n;
+			continue;
+		}
 		else
 		if (sector == 0)
 			read_mbr_sector(emfat, data);
@@ -648,10 +867,10 @@ void emfat_read(emfat_t *emfat, uint8_t *data, uint32_t sector, int num_sectors)
 			read_boot_sector(emfat, data);
 		else
 		if (sector >= emfat->priv.fat1_lba && sector < emfat->priv.fat2_lba)
-			read_fat_sector(emfat, data, sector - emfat->priv.fat1_lba);
+			read_fat_sector(emfat, cursor, data, sector - emfat->priv.fat1_lba);
 		else
 		if (sector >= emfat->priv.fat2_lba && sector < emfat->priv.root_lba)
-			read_fat_sector(emfat, data, sector - emfat->priv.fat2_lba);
+			read_fat_sector(emfat, cursor, data, sector - emfat->priv.fat2_lba);
 		else
 			memset(data, 0, SECT);
 		data += SECT;
@@ -660,10 +879,219 @@ void emfat_read(emfat_t *emfat, uint8_t *data, uint32_t sector, int num_sectors)
 	}
 }
 
+void emfat_read(emfat_t *emfat, uint8_t *data, uint32_t sector, int num_sectors)
+{
+	emfat_cursor_t cursor;
+	cursor.last_entry = emfat->priv.last_entry;
+	emfat_read_r(emfat, &cursor, data, sector, num_sectors);
+	emfat->priv.last_entry = cursor.last_entry;
+}
+
+// Appends a segment, or makes the last one longer if it continues in memory
+static bool add_seg(emfat_seg_t *segs, int max_segs, int *num_segs, const void *base, size_t len)
+{
+	emfat_seg_t *last;
+
+	if (*num_segs > 0)
+	{
+		last = &segs[*num_segs - 1];
+		if ((const uint8_t *)last->base + last->len == (const uint8_t *)base)
+		{
+			last->len += len;
+			return true;
+		}
+	}
+	if (*num_segs >= max_segs)
+		return false;
+	segs[*num_segs].base = base;
+	segs[*num_segs].len = len;
+	(*num_segs)++;
+	return true;
+}
+
+int emfat_readv_r(const emfat_t *emfat, emfat_cursor_t *cursor, emfat_seg_t *segs, int max_segs, int *num_segs, uint8_t *scratch, int scratch_sectors, uint32_t sector, int num_sectors)
+{
+	emfat_entry_t *le;
+	const uint8_t *p;
+	uint32_t rel_sect;
+	uint32_t cluster;
+	uint32_t offset;
+	uint32_t size;
+	int used = 0;
+	int done = 0;
+	int n;
+
+	*num_segs = 0;
+	while (done < num_sectors)
+	{
+		n = num_sectors - done;
+		if (sector < emfat->priv.root_lba)
+		{
+			// boot sectors and FATs, generated up to the data region
+			if ((uint32_t)n > emfat->priv.root_lba - sector)
+				n = emfat->priv.root_lba - sector;
+		}
+		else
+		{
+			rel_sect = sector - emfat->priv.root_lba;
+			cluster = rel_sect / SECT_PER_CLUST + 2;
+			le = find_entry(emfat, cluster, cursor->last_entry);
+			if (le == NULL)
+			{
+				if (n > (int)(SECT_PER_CLUST - rel_sect % SECT_PER_CLUST))
+					n = SECT_PER_CLUST - rel_sect % SECT_PER_CLUST;
+			}
+			else
+			{
+				cursor->last_entry = le;
+				if ((uint32_t)n > (le->priv.last_reserved + 1 - 2) * SECT_PER_CLUST - rel_sect)
+					n = (le->priv.last_reserved + 1 - 2) * SECT_PER_CLUST - rel_sect;
+			}
+			// not yet flushed data is in wbuf, not where mapcb points
+			if (le != NULL && !le->dir && le->mapcb != NULL && emfat->priv.wbuf.entry != le)
+			{
+				if (n > INT_MAX / SECT)
+					n = INT_MAX / SECT;
+				offset = cluster - le->priv.first_clust;
+				offset = offset * CLUST + (rel_sect % SECT_PER_CLUST) * SECT;
+				size = (uint32_t)n * SECT;
+				p = le->mapcb(offset + le->offset, &size, le->user_data);
+				size /= SECT;
+				if (size > (uint32_t)n)
+					size = n;
+				if (p != NULL && size != 0)
+				{
+					if (!add_seg(segs, max_segs, num_segs, p, size * SECT))
+						break;
+					done += size;
+					sector += size;
+					continue;
+				}
+				// where the mapping ends, a sector at a time through readcb
+				n = 1;
+			}
+		}
+		if (n > scratch_sectors - used)
+			n = scratch_sectors - used;
+		if (n == 0 || !add_seg(segs, max_segs, num_segs, scratch + used * SECT, n * SECT))
+			break;
+		emfat_read_r(emfat, cursor, scratch + used * SECT, sector, n);
+		used += n;
+		done += n;
+		sector += n;
+	}
+	return done;
+}
+
+int emfat_readv(emfat_t *emfat, emfat_seg_t *segs, int max_segs, int *num_segs, uint8_t *scratch, int scratch_sectors, uint32_t sector, int num_sectors)
+{
+	emfat_cursor_t cursor;
+	int n;
+	cursor.last_entry = emfat->priv.last_entry;
+	n = emfat_readv_r(emfat, &cursor, segs, max_segs, num_segs, scratch, scratch_sectors, sector, num_sectors);
+	emfat->priv.last_entry = cursor.last_entry;
+	return n;
+}
+
+void emfat_flush(emfat_t *emfat)
+{
+	emfat_entry_t *le = emfat->priv.wbuf.entry;
+	uint32_t size = emfat->priv.wbuf.size;
+	uint64_t chain;
+
+	// data in the reserved tail goes to the file only if its chain has
+	// grown over it by now, else the clusters may be another file's
+	if (le != NULL && !le->dir)
+	{
+		chain = (uint64_t)(le->priv.last_clust + 1 - le->priv.first_clust) * CLUST;
+		if (emfat->priv.wbuf.offset >= chain)
+			size = 0; else
+		if (size > chain - emfat->priv.wbuf.offset)
+			size = (uint32_t)(chain - emfat->priv.wbuf.offset);
+	}
+	if (le != NULL && size != 0)
+		le->writecb(emfat->priv.wbuf.data, size,
+			emfat->priv.wbuf.offset + le->offset, le->user_data);
+	emfat->priv.wbuf.entry = NULL;
+	emfat->priv.wbuf.size = 0;
+}
+
+static void buffer_data_sector(emfat_t *emfat, emfat_entry_t *le, const uint8_t *data, uint32_t offset)
+{
+	uint32_t end;
+
+	// overwrite of an already buffered sector
+	end = emfat->priv.wbuf.offset + emfat->priv.wbuf.size;
+	if (emfat->priv.wbuf.entry == le && offset >= emfat->priv.wbuf.offset && offset < end)
+	{
+		memcpy(&emfat->priv.wbuf.data[offset - emfat->priv.wbuf.offset], data, SECT);
+		return;
+	}
+	if (emfat->priv.wbuf.entry != le || offset != end ||
+		emfat->priv.wbuf.size + SECT > EMFAT_WRITE_BUF_SIZE)
+	{
+		emfat_flush(emfat);
+		emfat->priv.wbuf.entry = le;
+		emfat->priv.wbuf.offset = offset;
+	}
+	memcpy(&emfat->priv.wbuf.data[emfat->priv.wbuf.size], data, SECT);
+	emfat->priv.wbuf.size += SECT;
+}
+
+static void update_file_entry(emfat_entry_t *e, const dir_entry *de)
+{
+	uint32_t size;
+	uint32_t last;
+	uint64_t reserved;
+
+	size = de->size;
+	if (size > e->max_size)
+		size = e->max_size;
+	// nor past a tail given up to another chain
+	reserved = (uint64_t)(e->priv.last_reserved + 1 - e->priv.first_clust) * CLUST;
+	if (size > reserved)
+		size = (uint32_t)reserved;
+	e->curr_size = size;
+	// the host may write the directory entry before the FAT
+	last = e->priv.first_clust + FILE_NCLUST(size) - 1;
+	if (last > e->priv.last_clust)
+		e->priv.last_clust = last;
+	e->cma_time[0] = ((uint32_t)de->crt_date << 16) | de->crt_time;
+	e->cma_time[1] = ((uint32_t)de->lst_mod_date << 16) | de->lst_mod_time;
+	e->cma_time[2] = (uint32_t)de->lst_access_date << 16;
+}
+
+void write_dir_sector(emfat_t *emfat, const uint8_t *data, emfat_entry_t *dir)
+{
+	const dir_entry *de;
+	emfat_entry_t *e;
+	uint32_t clust;
+	int i;
+
+	(void)emfat;
+	de = (const dir_entry *)data;
+	for (i = 0; i < SECT / DIR_ENTRY_LEN; i++, de++)
+	{
+		if (de->name[0] == FREE_DIR_ENTRY) break;
+		if (de->name[0] == DEL_DIR_ENTRY || de->name[0] == DOT_DIR_ENTRY) continue;
+		if ((de->attr & LONG_FNAME_MASK) == ATTR_LONG_FNAME) continue;
+		if (de->attr & (ATTR_DIR | ATTR_VOL_LABEL)) continue;
+		// entries are matched by start cluster, new files are not supported
+		clust = ((uint32_t)de->strt_clus_hword << 16) | de->strt_clus_lword;
+		for (e = dir->priv.sub; e != NULL; e = e->priv.next)
+			if (!e->dir && e->priv.first_clust == clust)
+			{
+				update_file_entry(e, de);
+				break;
+			}
+	}
+}
+
 void write_data_sector(emfat_t *emfat, const uint8_t *data, uint32_t rel_sect)
 {
 	emfat_entry_t *le;
 	uint32_t cluster;
+	uint32_t offset;
 	cluster = rel_sect / 8 + 2;
 	rel_sect = rel_sect % 8;
 
@@ -676,15 +1104,90 @@ void write_data_sector(emfat_t *emfat, const uint8_t *data, uint32_t rel_sect)
 	}
 	if (le->dir)
 	{
-		// TODO: handle changing a filesize
+		write_dir_sector(emfat, data, le);
 		return;
 	}
-	if (le->writecb != NULL)
-		le->writecb(data, SECT, rel_sect * SECT + le->offset, le->user_data);
+	if (le->writecb == NULL)
+		return;
+	offset = cluster - le->priv.first_clust;
+	offset = offset * CLUST + rel_sect * SECT;
+	buffer_data_sector(emfat, le, data, offset);
 }
 
-void write_fat_sector(emfat_t *emfat, const uint8_t *data, uint32_t rel_sect)
+// A chain of another entry, or one of the host's own, links into the
+// reserved tail of le at clust: the tail from clust on is no longer le's
+static void give_up_tail(emfat_entry_t *le, uint32_t clust)
 {
+	if (le->dir || clust <= le->priv.last_clust || clust > le->priv.last_reserved)
+		return;
+	le->priv.last_reserved = clust - 1;
+}
+
+void write_fat_sector(emfat_t *emfat, const uint8_t *data, uint32_t index)
+{
+	emfat_entry_t *le;
+	emfat_entry_t *target;
+	const uint32_t *values;
+	uint32_t count;
+	uint32_t curr;
+	uint32_t val;
+
+	values = (const uint32_t *)data;
+	curr = index * 128;
+	count = 128;
+
+	if (curr == 0)
+	{
+		values += 2;
+		count -= 2;
+		curr += 2;
+	}
+
+	le = emfat->priv.last_entry;
+	for (; count != 0; values++, count--, curr++)
+	{
+		if (!IS_CLUST_OF(curr, le))
+		{
+			le = find_entry(emfat, curr, le);
+			if (le == NULL)
+			{
+				le = emfat->priv.last_entry;
+				continue;
+			}
+		}
+		val = *values & CLUST_EOF;
+		// a link that is not the next cluster of the same entry takes
+		// the tail it lands in away from its owner
+		if (val >= 2 && val < CLUST_ROOT_END && !(val == curr + 1 && IS_CLUST_OF(val, le)))
+		{
+			target = find_entry(emfat, val, le);
+			if (target != NULL)
+				give_up_tail(target, val);
+		}
+		// directories have a fixed size
+		if (le->dir) continue;
+		// the link may have cut the tail short of curr
+		if (curr > le->priv.last_reserved) continue;
+		if (val >= CLUST_ROOT_END)
+		{
+			// an end mark truncates; growth comes by the link to the
+			// cluster, an end mark alone may be another chain's
+			if (curr <= le->priv.last_clust)
+				le->priv.last_clust = curr; /* new end of chain */
+		}
+		else
+		if (val == CLUST_FREE)
+		{
+			// truncation, the first cluster always stays allocated
+			if (curr > le->priv.first_clust && curr <= le->priv.last_clust)
+				le->priv.last_clust = curr - 1;
+		}
+		else
+		if (val == curr + 1 && curr == le->priv.last_clust && val <= le->priv.last_reserved)
+			le->priv.last_clust = val; /* growth, the end mark follows */
+		// chains leaving the reserved area of the file are ignored
+	}
+	emfat->priv.last_entry = le;
 }
 
 void emfat_write(emfat_t *emfat, const uint8_t *data, uint32_t sector, int num_sectors)
@@ -711,9 +1214,9 @@ void emfat_write(emfat_t *emfat, const uint8_t *data, uint32_t sector, int num_s
 #define SECYR			(SECDAY * 365)
 #define	leapyear(year)		((year) % 4 == 0)
 #define	days_in_year(a)		(leapyear(a) ? 366 : 365)
-#define	days_in_month(a)	(month_days[(a) - 1])
+#define	days_in_month(a, y)	((a) == FEBRUARY && leapyear(y) ? 29 : month_days[(a) - 1])
 
-static int month_days[12] = {
+static const int month_days[12] = {
 	31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31
 };
 
@@ -739,13 +1242,9 @@ uint32_t emfat_cma_time_from_unix(uint32_t tim)
 	ymd[0] = i;
 
 	/* Number of months in days left */
-	if (leapyear(ymd[0])) {
-		days_in_month(FEBRUARY) = 29;
-	}
-	for (i = 1; day >= days_in_month(i); i++) {
-		day -= days_in_month(i);
+	for (i = 1; day >= days_in_month(i, ymd[0]); i++) {
+		day -= days_in_month(i, ymd[0]);
 	}
-	days_in_month(FEBRUARY) = 28;
 	ymd[1] = i;
 
 	/* Days are what is left over (+1) from all that. */
@@ -754,6 +1253,10 @@ uint32_t emfat_cma_time_from_unix(uint32_t tim)
     return EMFAT_ENCODE_CMA_TIME(ymd[2], ymd[1], ymd[0], hms[0], hms[1], hms[2]);
 }
 
+#endif /* EMFAT_IMPLEMENTATION */
+
 #ifdef __cplusplus
 }
-#endif
\ No newline at end of file
+#endif
+
+#endif /* EMFAT1_H */
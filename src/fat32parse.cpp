@@ -0,0 +1,877 @@
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "fat32parse.h"
+
+namespace fat32 {
+
+namespace {
+
+class Category : public std::error_category {
+public:
+  const char *name() const noexcept override { return "fat32"; }
+
+  std::string message(int e) const override {
+    switch ((error)e) {
+    case error::truncated:
+      return "structure extends past the end of the image";
+    case error::bad_boot_sector:
+      return "invalid boot sector";
+    case error::bad_fat_type:
+      return "boot sector fields do not match the FAT type";
+    case error::bad_partition_table:
+      return "invalid partition table";
+    }
+    return "unknown error";
+  }
+};
+
+bool is_pow2(uint32_t v) { return v && (v & (v - 1)) == 0; }
+
+constexpr uint8_t PART_EXTENDED_CHS = 0x05;
+constexpr uint8_t PART_EXTENDED_LBA = 0x0f;
+constexpr uint8_t PART_EXTENDED_LINUX = 0x85;
+constexpr uint8_t PART_GPT_PROTECTIVE = 0xee;
+
+// an EBR chain longer than this is taken for a loop
+constexpr unsigned MAX_LOGICAL_PARTITIONS = 1024;
+
+bool is_extended(uint8_t type) {
+  return type == PART_EXTENDED_CHS || type == PART_EXTENDED_LBA ||
+         type == PART_EXTENDED_LINUX;
+}
+
+constexpr size_t GPT_NAME_LEN = 36;
+
+#pragma pack(push, 1)
+struct GptHeader {
+  char signature[8];
+  uint32_t revision;
+  uint32_t header_size;
+  uint32_t header_crc;
+  uint32_t reserved;
+  uint64_t my_lba;
+  uint64_t alternate_lba;
+  uint64_t first_usable_lba;
+  uint64_t last_usable_lba;
+  uint8_t disk_guid[16];
+  uint64_t entries_lba;
+  uint32_t entry_count;
+  uint32_t entry_size;
+  uint32_t entries_crc;
+};
+
+struct GptEntry {
+  uint8_t type_guid[16];
+  uint8_t unique_guid[16];
+  uint64_t first_lba;
+  uint64_t last_lba;
+  uint64_t attributes;
+  uint16_t name[GPT_NAME_LEN];
+};
+#pragma pack(pop)
+
+// a GPT may list more, but not in a sane image
+constexpr uint32_t MAX_GPT_ENTRIES = 16384;
+
+// CRC-32 as GPT uses it: reflected 0x04c11db7, inverted in and out
+uint32_t crc32(const uint8_t *p, size_t n) {
+  static const auto table = [] {
+    std::array<uint32_t, 256> t{};
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; ++k) {
+        c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+      }
+      t[i] = c;
+    }
+    return t;
+  }();
+
+  uint32_t crc = 0xffffffff;
+  for (size_t i = 0; i < n; ++i) {
+    crc = table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+// The GPT header at lba if it is there, consistent and its entries are
+// intact, nullptr otherwise
+const GptHeader *gpt_header(const uint8_t *image, uint64_t image_size,
+                            uint64_t lba, uint32_t sector_size) {
+  auto offset = lba * sector_size;
+  if (offset + sector_size > image_size || offset / sector_size != lba) {
+    return nullptr;
+  }
+  auto h = (const GptHeader *)(image + offset);
+  if (std::memcmp(h->signature, "EFI PART", sizeof(h->signature)) != 0 ||
+      h->header_size < sizeof(GptHeader) || h->header_size > sector_size ||
+      h->my_lba != lba) {
+    return nullptr;
+  }
+
+  // the CRC is taken with its own field zeroed
+  uint8_t copy[4096];
+  std::memcpy(copy, h, h->header_size);
+  ((GptHeader *)copy)->header_crc = 0;
+  if (crc32(copy, h->header_size) != h->header_crc) {
+    return nullptr;
+  }
+
+  if (h->entry_size < sizeof(GptEntry) || h->entry_size % 8 != 0 ||
+      h->entry_count > MAX_GPT_ENTRIES) {
+    return nullptr;
+  }
+  auto entries = h->entries_lba * sector_size;
+  auto bytes = (uint64_t)h->entry_count * h->entry_size;
+  if (entries / sector_size != h->entries_lba || entries + bytes > image_size ||
+      crc32(image + entries, bytes) != h->entries_crc) {
+    return nullptr;
+  }
+  return h;
+}
+
+// Copies the leading characters in 1..0x7f as bytes, 8 at a time, and
+// returns how many were copied. Names are almost always ASCII, the caller
+// converts whatever stops the run one character at a time.
+size_t copy_ascii(const uint16_t *src, size_t count, char *out) {
+  size_t i = 0;
+#if defined(__SSE2__)
+  const auto high = _mm_set1_epi16((short)0xff80);
+  const auto zero = _mm_setzero_si128();
+  for (; i + 8 <= count; i += 8) {
+    auto v = _mm_loadu_si128((const __m128i *)(src + i));
+    auto ascii = _mm_cmpeq_epi16(_mm_and_si128(v, high), zero);
+    auto ok = _mm_andnot_si128(_mm_cmpeq_epi16(v, zero), ascii);
+    if (_mm_movemask_epi8(ok) != 0xffff) {
+      break;
+    }
+    _mm_storel_epi64((__m128i *)(out + i), _mm_packus_epi16(v, v));
+  }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  for (; i + 8 <= count; i += 8) {
+    auto v = vld1q_u16(src + i);
+    auto ok = vandq_u16(vcltq_u16(v, vdupq_n_u16(0x80)), vtstq_u16(v, v));
+    if (vminvq_u16(ok) == 0) {
+      break;
+    }
+    vst1_u8((uint8_t *)(out + i), vmovn_u16(v));
+  }
+#endif
+  for (; i < count && src[i] != 0 && src[i] < 0x80; ++i) {
+    out[i] = (char)src[i];
+  }
+  return i;
+}
+
+} // namespace
+
+const std::error_category &error_category() {
+  static const Category category;
+  return category;
+}
+
+std::error_code make_error_code(error e) {
+  return std::error_code((int)e, error_category());
+}
+
+template <typename Entries>
+FatSummary BasicFatView<Entries>::summary() const {
+  if constexpr (std::is_same_v<Entries, AnyEntries>) {
+    return visit([](const auto &fat) { return fat.summary(); });
+  } else {
+    FatSummary res{};
+    for (uint32_t i = 2; i < count_; ++i) {
+      auto v = entries_(data_, i);
+      if (v == CLUST_FREE) {
+        ++res.free;
+      } else if (v == CLUST_BAD) {
+        ++res.bad;
+      } else {
+        ++res.used;
+        if (v >= CLUST_ROOT_END) {
+          ++res.chains;
+        }
+      }
+    }
+    return res;
+  }
+}
+
+template class BasicFatView<Fat12Entries>;
+template class BasicFatView<Fat16Entries>;
+template class BasicFatView<Fat32Entries>;
+template class BasicFatView<AnyEntries>;
+template class BasicFatView<WindowedEntries<Fat12Entries>>;
+template class BasicFatView<WindowedEntries<Fat16Entries>>;
+template class BasicFatView<WindowedEntries<Fat32Entries>>;
+
+ShortName Entry::short_name() const {
+  ShortName res{};
+  auto put = [&res](const uint8_t *p, size_t n) {
+    while (n && p[n - 1] == ' ') {
+      --n;
+    }
+    for (size_t i = 0; i < n; ++i) {
+      res.text[res.size++] = (char)p[i];
+    }
+  };
+
+  // a label is 11 characters without the dot, name and extn are adjacent
+  if (is_volume_label()) {
+    put(raw_->name, SHRT_FILE_NAME_LEN);
+    return res;
+  }
+
+  put(raw_->name, FILE_NAME_SHRT_LEN);
+  // 0x05 stands for a leading 0xE5, which marks deleted entries
+  if (res.size && raw_->name[0] == 0x05) {
+    res.text[0] = (char)DEL_DIR_ENTRY;
+  }
+  if (raw_->extn[0] != ' ') {
+    res.text[res.size++] = EXTN_DELIMITER;
+    put(raw_->extn, FILE_NAME_EXTN_LEN);
+  }
+  return res;
+}
+
+uint8_t lfn_checksum(const dir_entry &e) {
+  uint8_t sum = 0;
+  auto p = e.name;
+  for (int i = 0; i < SHRT_FILE_NAME_LEN; ++i) {
+    // name and extn are adjacent
+    sum = (uint8_t)(((sum & 1) << 7) + (sum >> 1) + p[i]);
+  }
+  return sum;
+}
+
+void decode_ucs2(const uint16_t *ucs2, size_t count, Name &name) {
+  count = std::min<size_t>(count, LONG_FILE_NAME_LEN);
+  auto out = name.text;
+  for (size_t i = 0; i < count;) {
+    auto n = copy_ascii(ucs2 + i, count - i, out);
+    out += n;
+    i += n;
+    if (i == count || ucs2[i] == LFN_TERM_MARK) {
+      break;
+    }
+
+    uint32_t c = ucs2[i++];
+    if (c < 0x800) {
+      *out++ = (char)(0xc0 | c >> 6);
+    } else {
+      if (c >= 0xd800 && c < 0xdc00 && i < count && ucs2[i] >= 0xdc00 &&
+          ucs2[i] < 0xe000) {
+        c = 0x10000 + ((c - 0xd800) << 10) + (ucs2[i++] - 0xdc00);
+        *out++ = (char)(0xf0 | c >> 18);
+        *out++ = (char)(0x80 | (c >> 12 & 0x3f));
+      } else {
+        if (c >= 0xd800 && c < 0xe000) {
+          c = 0xfffd;
+        }
+        *out++ = (char)(0xe0 | c >> 12);
+      }
+      *out++ = (char)(0x80 | (c >> 6 & 0x3f));
+    }
+    *out++ = (char)(0x80 | (c & 0x3f));
+  }
+  name.size = (uint16_t)(out - name.text);
+}
+
+static char *two_digits(char *out, unsigned v) {
+  out[0] = (char)('0' + v / 10 % 10);
+  out[1] = (char)('0' + v % 10);
+  return out + 2;
+}
+
+size_t format_date(uint16_t date, char *out) {
+  unsigned year = 1980 + (date >> 9);
+  auto p = two_digits(out, year / 100);
+  p = two_digits(p, year % 100);
+  *p++ = '-';
+  p = two_digits(p, date >> 5 & 0xf);
+  *p++ = '-';
+  p = two_digits(p, date & 0x1f);
+  return p - out;
+}
+
+size_t format_time(uint16_t time, int tenth, char *out) {
+  // 2 s resolution, the creation time adds up to 1.99 s on top
+  unsigned seconds = (time & 0x1f) * 2 + (tenth > 0 ? tenth / 100 : 0);
+  auto p = two_digits(out, time >> 11);
+  *p++ = ':';
+  p = two_digits(p, time >> 5 & 0x3f);
+  *p++ = ':';
+  p = two_digits(p, seconds);
+  if (tenth >= 0) {
+    *p++ = '.';
+    p = two_digits(p, tenth % 100);
+  }
+  return p - out;
+}
+
+uint64_t hash_bytes(const uint8_t *data, uint64_t size) {
+  // FNV-1a over 8 byte words with the upper half folded down
+  const uint64_t prime = 0x100000001b3ull;
+  uint64_t h = 0xcbf29ce484222325ull;
+  uint64_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t w;
+    std::memcpy(&w, data + i, sizeof(w));
+    h = (h ^ w) * prime;
+    h ^= h >> 32;
+  }
+  for (; i < size; ++i) {
+    h = (h ^ data[i]) * prime;
+  }
+  return h;
+}
+
+std::string hex(uint64_t v) {
+  char text[24];
+  auto n = std::snprintf(text, sizeof(text), "0x%llx", (unsigned long long)v);
+  return std::string(text, n);
+}
+
+Name Entry::name() const {
+  Name res;
+  if (!has_long_name()) {
+    auto s = short_name();
+    std::memcpy(res.text, s.text, s.size);
+    res.size = s.size;
+    return res;
+  }
+
+  // the three parts of every slot in a row, ord 1 is stored last
+  uint16_t ucs2[MAX_LFN_SLOTS * LFN_LEN_PER_ENTRY];
+  auto p = ucs2;
+  for (int i = lfn_->count - 1; i >= 0; --i) {
+    auto l = lfn_->slot[i];
+    std::memcpy(p, l->fname0_4, LFN_FIRST_SET_LEN);
+    std::memcpy(p + LFN_FIRST_SET_CNT, l->fname6_11, LFN_SEC_SET_LEN);
+    std::memcpy(p + LFN_FIRST_SET_CNT + LFN_SEC_SET_CNT, l->fname12_13,
+                LFN_THIRD_SET_LEN);
+    p += LFN_LEN_PER_ENTRY;
+  }
+  decode_ucs2(ucs2, p - ucs2, res);
+  return res;
+}
+
+DirectoryIterator::DirectoryIterator(const Volume &volume, uint32_t first,
+                                     unsigned fat_copy, bool all)
+    : volume_(&volume), all_(all) {
+  if (first == 0 && volume.fat_type() != FatType::Fat32) {
+    // one run of slots with no chain after it, checked to be in the image
+    slot_ = (const dir_entry *)(volume.image() + volume.root_offset());
+    cluster_end_ = slot_ + volume.root_entries();
+    settle();
+    return;
+  }
+  chain_ = volume.fat(fat_copy).chain(first).begin();
+  if (chain_ != ChainIterator()) {
+    enter(*chain_);
+    settle();
+  }
+}
+
+void DirectoryIterator::enter(uint32_t cluster) {
+  slot_ = (const dir_entry *)volume_->cluster(cluster);
+  cluster_end_ = slot_ == nullptr
+                     ? nullptr
+                     : slot_ + volume_->cluster_size() / sizeof(dir_entry);
+}
+
+uint64_t DirectoryIterator::offset() const {
+  return (const uint8_t *)slot_ - volume_->image();
+}
+
+// moves to the next slot to yield, starting at the current one
+void DirectoryIterator::settle() {
+  while (slot_ != nullptr) {
+    if (slot_ == cluster_end_) {
+      if (chain_ == ChainIterator()) {
+        slot_ = nullptr;
+        return;
+      }
+      ++chain_;
+      if (chain_ == ChainIterator()) {
+        slot_ = nullptr;
+      } else {
+        enter(*chain_);
+      }
+      continue;
+    }
+    if (slot_->name[0] == FREE_DIR_ENTRY) {
+      slot_ = nullptr;
+      return;
+    }
+    collect();
+    Entry e(slot_);
+    if (all_ || !(e.is_lfn() || e.is_deleted() || e.is_dot())) {
+      return;
+    }
+    ++slot_;
+  }
+}
+
+// Every slot passes here once. A run starts at the slot flagged last, with
+// ord n, and is complete when the slots n-1 .. 1 follow it with the same
+// checksum. Anything else in between drops the run.
+void DirectoryIterator::collect() {
+  Entry e(slot_);
+  if (e.is_lfn() && !e.is_deleted()) {
+    auto l = (const lfn_entry *)slot_;
+    unsigned ord = l->ord_field & (LAST_ORD_FIELD_SEQ - 1);
+    if (l->ord_field & LAST_ORD_FIELD_SEQ) {
+      collected_ = 0;
+      if (ord >= 1 && ord <= MAX_LFN_SLOTS) {
+        lfn_.slot[collected_++] = l;
+        expected_ = (uint8_t)(ord - 1);
+      }
+    } else if (collected_ && ord >= 1 && ord == expected_ &&
+               l->chksum == lfn_.slot[0]->chksum) {
+      lfn_.slot[collected_++] = l;
+      --expected_;
+    } else {
+      collected_ = 0;
+    }
+    lfn_.count = 0;
+    return;
+  }
+
+  lfn_.count = collected_ && expected_ == 0 && !e.is_deleted() &&
+                       lfn_checksum(*slot_) == lfn_.slot[0]->chksum
+                   ? collected_
+                   : 0;
+  collected_ = 0;
+}
+
+TreeIterator::TreeIterator(const Volume &volume, uint32_t first,
+                           unsigned fat_copy)
+    : volume_(&volume), fat_copy_(fat_copy) {
+  auto dir = volume.directory(first, fat_copy);
+  if (dir.begin() != dir.end()) {
+    stack_.push_back({dir.begin(), first, nullptr, {}});
+  }
+}
+
+TreeIterator &TreeIterator::operator++() {
+  auto &top = stack_.back();
+  auto e = *top.it;
+
+  auto sub = e.first_cluster();
+  bool enter = !skip_ && e.is_dir() && sub >= 2 &&
+               (int)stack_.size() <= MAX_TREE_DEPTH;
+  for (size_t i = 0; enter && i < stack_.size(); ++i) {
+    enter = stack_[i].first != sub;
+  }
+  skip_ = false;
+
+  if (enter) {
+    auto dir = volume_->directory(sub, fat_copy_);
+    if (dir.begin() != dir.end()) {
+      // the long name slots are kept before the parent moves past them
+      Level level{dir.begin(), sub, &e.raw(), top.it.long_name_slots()};
+      ++top.it;
+      stack_.push_back(level);
+      return *this;
+    }
+  }
+  ++top.it;
+  pop_finished();
+  return *this;
+}
+
+void TreeIterator::pop_finished() {
+  while (!stack_.empty() && stack_.back().it == DirectoryIterator()) {
+    stack_.pop_back();
+  }
+}
+
+std::string TreeIterator::path() const {
+  std::string res;
+  for (size_t i = 1; i < stack_.size(); ++i) {
+    res += std::string_view(Entry(stack_[i].entry, &stack_[i].lfn).name());
+    res += '/';
+  }
+  res += std::string_view((*stack_.back().it).name());
+  return res;
+}
+
+size_t TreePaths::append(std::string &out, int depth, std::string_view name,
+                         bool is_dir) {
+  auto start = out.size();
+  out.append(dirs_[depth]).append(name);
+  if (is_dir) {
+    dirs_.resize(depth + 2);
+    dirs_[depth + 1].assign(out, start, std::string::npos).append("/");
+  }
+  return out.size() - start;
+}
+
+bool Volume::open(const uint8_t *image, uint64_t image_size, uint64_t offset,
+                  std::error_code &err) {
+  err.clear();
+  if (offset + SECT > image_size) {
+    err = error::truncated;
+    return false;
+  }
+
+  auto boot = (const boot_sector *)(image + offset);
+  auto bps = boot->bytes_per_sec;
+  if (bps < SECT || bps > 4096 || !is_pow2(bps) ||
+      !is_pow2(boot->sec_per_clus) || boot->fat_cnt == 0 ||
+      boot->reserved_sec_cnt == 0) {
+    err = error::bad_boot_sector;
+    return false;
+  }
+
+  image_ = image;
+  image_size_ = image_size;
+  offset_ = offset;
+  boot_ = boot;
+  cluster_size_ = (uint32_t)bps * boot->sec_per_clus;
+  // the 16 bit fields are used unless they are 0, as they are on FAT32
+  fat_sectors_ = boot->sec_per_fat_fat16 != 0 ? boot->sec_per_fat_fat16
+                                              : boot->sectors_per_fat;
+  uint64_t sectors =
+      boot->tot_sectors != 0 ? boot->tot_sectors : boot->tol_sector_cnt;
+  if (fat_sectors_ == 0 || sectors <= data_sector()) {
+    err = error::bad_boot_sector;
+    return false;
+  }
+
+  auto clusters = (sectors - data_sector()) / boot->sec_per_clus;
+  // FAT32 is told by its fields, no fixed root and the FAT size in the 32
+  // bit field, as drivers do: small FAT32 volumes below the FAT16 limit are
+  // common. The width of the others follows from the cluster count.
+  bool fat32 = boot->root_dir_max_cnt == 0 && boot->sec_per_fat_fat16 == 0;
+  if (!fat32 && (boot->root_dir_max_cnt == 0 ||
+                 boot->sec_per_fat_fat16 == 0 ||
+                 clusters > MAX_FAT16_CLUSTERS)) {
+    err = error::bad_fat_type;
+    return false;
+  }
+  type_ = fat32                            ? FatType::Fat32
+          : clusters <= MAX_FAT12_CLUSTERS ? FatType::Fat12
+                                           : FatType::Fat16;
+
+  // the FAT may have slack past the last cluster, but never less entries
+  auto entries = (uint64_t)fat_sectors_ * bps * 8 /
+                 (type_ == FatType::Fat12   ? 12
+                  : type_ == FatType::Fat16 ? 16
+                                            : 32);
+  cluster_count_ = (uint32_t)std::min<uint64_t>(
+      std::min(clusters + 2, entries), (uint64_t)CLUST_BAD);
+
+  if (fat_offset(fat_copies() - 1) + fat().bytes() > image_size ||
+      data_offset() > image_size) {
+    err = error::truncated;
+    return false;
+  }
+  return true;
+}
+
+const fsinfo_t *Volume::fsinfo() const {
+  if (type_ != FatType::Fat32 ||
+      fsinfo_offset() + sizeof(fsinfo_t) > image_size_) {
+    return nullptr;
+  }
+  return (const fsinfo_t *)(image_ + fsinfo_offset());
+}
+
+std::vector<Partition> Image::partitions(std::error_code &err) const {
+  err.clear();
+  std::vector<Partition> res;
+  auto &table = mbr().PartTable;
+
+  for (auto &p : table) {
+    if (p.PartType == PART_GPT_PROTECTIVE) {
+      read_gpt(res, err);
+      return res;
+    }
+  }
+
+  // primaries first, then logical partitions, as they are numbered
+  for (auto &p : table) {
+    if (p.StartLBA != 0 && !is_extended(p.PartType)) {
+      Partition part;
+      part.index = (unsigned)res.size();
+      part.type = p.PartType;
+      part.start_lba = p.StartLBA;
+      part.size_lba = p.SizeLBA;
+      res.push_back(part);
+    }
+  }
+  for (auto &p : table) {
+    if (p.StartLBA != 0 && is_extended(p.PartType)) {
+      std::error_code chain_err;
+      read_ebr_chain(p, res, chain_err);
+      if (chain_err && !err) {
+        err = chain_err;
+      }
+    }
+  }
+  return res;
+}
+
+std::vector<PartitionVolume> Image::volumes(int partition,
+                                            std::error_code &table_err) const {
+  std::vector<PartitionVolume> res;
+  for (auto &p : partitions(table_err)) {
+    if (partition >= 0 && (unsigned)partition != p.index) {
+      continue;
+    }
+    PartitionVolume v;
+    v.partition = p;
+    volume(p, v.volume, v.err);
+    res.push_back(std::move(v));
+  }
+  return res;
+}
+
+// Every EBR describes one logical partition relative to itself and links
+// the next EBR relative to the start of the extended partition
+void Image::read_ebr_chain(const mbr_part_t &extended,
+                           std::vector<Partition> &partitions,
+                           std::error_code &err) const {
+  uint64_t base = extended.StartLBA;
+  uint64_t ebr = base;
+  std::vector<uint64_t> seen;
+  while (true) {
+    if (std::find(seen.begin(), seen.end(), ebr) != seen.end() ||
+        seen.size() == MAX_LOGICAL_PARTITIONS) {
+      err = error::bad_partition_table;
+      return;
+    }
+    seen.push_back(ebr);
+
+    if ((ebr + 1) * SECT > size()) {
+      err = error::truncated;
+      return;
+    }
+    auto &sector = *(const mbr_t *)(data() + ebr * SECT);
+    if (sector.BootSignature[0] != 0x55 || sector.BootSignature[1] != 0xaa) {
+      err = error::bad_partition_table;
+      return;
+    }
+
+    auto &logical = sector.PartTable[0];
+    if (logical.StartLBA != 0 && logical.SizeLBA != 0) {
+      Partition part;
+      part.index = (unsigned)partitions.size();
+      part.scheme = Scheme::Ebr;
+      part.type = logical.PartType;
+      part.start_lba = ebr + logical.StartLBA;
+      part.size_lba = logical.SizeLBA;
+      partitions.push_back(part);
+    }
+
+    auto &next = sector.PartTable[1];
+    if (next.StartLBA == 0 || !is_extended(next.PartType)) {
+      return;
+    }
+    ebr = base + next.StartLBA;
+  }
+}
+
+void Image::read_gpt(std::vector<Partition> &partitions,
+                     std::error_code &err) const {
+  // the header is in the second logical sector, whatever size that is
+  const GptHeader *h = nullptr;
+  uint32_t sector_size = 0;
+  for (uint32_t ss : {(uint32_t)SECT, 4096u}) {
+    h = gpt_header(data(), size(), 1, ss);
+    if (h == nullptr && size() / ss > 1) {
+      // the backup is in the last sector of the disk
+      h = gpt_header(data(), size(), size() / ss - 1, ss);
+    }
+    if (h != nullptr) {
+      sector_size = ss;
+      break;
+    }
+  }
+  if (h == nullptr) {
+    err = error::bad_partition_table;
+    return;
+  }
+
+  auto entries = data() + h->entries_lba * sector_size;
+  for (uint32_t i = 0; i < h->entry_count; ++i) {
+    auto e = (const GptEntry *)(entries + (uint64_t)i * h->entry_size);
+    static const uint8_t unused[16] = {};
+    if (std::memcmp(e->type_guid, unused, sizeof(unused)) == 0) {
+      continue;
+    }
+    if (e->last_lba < e->first_lba) {
+      err = error::bad_partition_table;
+      continue;
+    }
+
+    Partition part;
+    part.index = (unsigned)partitions.size();
+    part.scheme = Scheme::Gpt;
+    std::memcpy(part.type_guid, e->type_guid, sizeof(part.type_guid));
+    part.start_lba = e->first_lba;
+    part.size_lba = e->last_lba - e->first_lba + 1;
+    part.sector_size = sector_size;
+
+    uint16_t name[GPT_NAME_LEN];
+    std::memcpy(name, e->name, sizeof(name));
+    Name utf8;
+    decode_ucs2(name, GPT_NAME_LEN, utf8);
+    part.name = std::string_view(utf8);
+    partitions.push_back(part);
+  }
+}
+
+bool Image::open(const std::string &path, std::error_code &err) {
+  mapping_.map(path, 0, mio::map_entire_file, err);
+  if (!err && mapping_.size() < sizeof(mbr_t)) {
+    mapping_.unmap();
+    err = error::truncated;
+  }
+  return !err;
+}
+
+FatWindows::~FatWindows() { close(); }
+
+void FatWindows::close() {
+  if (base_ != nullptr) {
+    ::munmap(base_, slot_size_ * slots_.size());
+    base_ = nullptr;
+  }
+  slots_.clear();
+  slot_of_.clear();
+  head_ = tail_ = -1;
+  current_size_ = 0;
+  if (fd_ >= 0) {
+    ::close(fd_);
+    fd_ = -1;
+  }
+}
+
+bool FatWindows::open(const std::string &path, const Volume &volume,
+                      unsigned copy, size_t window, size_t budget,
+                      std::error_code &err) {
+  err.clear();
+  close();
+  fd_ = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd_ < 0) {
+    err = std::error_code(errno, std::system_category());
+    return false;
+  }
+
+  auto page = (size_t)::sysconf(_SC_PAGESIZE);
+  window_ = std::max((window + page - 1) / page * page, page);
+  table_offset_ = volume.fat_offset(copy);
+  count_ = volume.cluster_count();
+  type_ = volume.fat_type();
+  table_size_ = bytes();
+  counters_ = Counters();
+
+  // a window starts anywhere in its first page and has the 4 bytes of its
+  // last entry past the end
+  auto slots = std::max<size_t>(budget / window_, 1);
+  slot_size_ = window_ + 2 * page;
+  auto base = ::mmap(nullptr, slot_size_ * slots, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (base == MAP_FAILED) {
+    err = std::error_code(errno, std::system_category());
+    close();
+    return false;
+  }
+  base_ = static_cast<uint8_t *>(base);
+  slots_.assign(slots, Slot());
+  for (size_t i = 0; i < slots; ++i) {
+    slots_[i].prev = (int32_t)i - 1;
+    slots_[i].next = i + 1 < slots ? (int32_t)i + 1 : -1;
+  }
+  head_ = 0;
+  tail_ = (int32_t)slots - 1;
+  slot_of_.assign((table_size_ + window_ - 1) / window_, -1);
+  return true;
+}
+
+// moves a slot to the front of the list
+void FatWindows::touch(int32_t slot) const {
+  if (slot == head_) {
+    return;
+  }
+  auto &s = slots_[slot];
+  slots_[s.prev].next = s.next;
+  if (s.next >= 0) {
+    slots_[s.next].prev = s.prev;
+  } else {
+    tail_ = s.prev;
+  }
+  s.prev = -1;
+  s.next = head_;
+  slots_[head_].prev = slot;
+  head_ = slot;
+}
+
+const uint8_t *FatWindows::load(uint64_t offset) const {
+  // what a window that could not be mapped reads as, a free entry
+  static const uint8_t free_entry[4] = {};
+
+  auto index = offset / window_;
+  auto slot = slot_of_[index];
+  if (slot >= 0) {
+    ++counters_.hits;
+  } else {
+    // the least recently used slot, which is an empty one while there are
+    slot = tail_;
+    auto &s = slots_[slot];
+    if (s.data != nullptr) {
+      slot_of_[s.window] = -1;
+      s.data = nullptr;
+      ++counters_.evictions;
+    }
+
+    // entries that start in the window end in its mapping, those of FAT12
+    // reach up to two bytes into the next one
+    auto page = (uint64_t)::sysconf(_SC_PAGESIZE);
+    auto begin = index * window_;
+    auto pos = table_offset_ + begin;
+    auto aligned = pos / page * page;
+    auto size = (size_t)(pos - aligned +
+                         std::min<uint64_t>(window_ + 4, table_size_ - begin));
+    auto map = base_ + slot * slot_size_;
+    if (::mmap(map, size, PROT_READ, MAP_SHARED | MAP_FIXED, fd_, aligned) ==
+        MAP_FAILED) {
+      ++counters_.failures;
+      current_size_ = 0;
+      return free_entry;
+    }
+    ++counters_.misses;
+    s.data = map + (pos - aligned);
+    s.window = index;
+    slot_of_[index] = slot;
+  }
+
+  touch(slot);
+  auto &s = slots_[slot];
+  current_begin_ = s.window * window_;
+  current_size_ = std::min<uint64_t>(window_, table_size_ - current_begin_);
+  current_ = s.data;
+  return current_ + (offset - current_begin_);
+}
+
+FatSummary FatWindows::summary() const {
+  return visit([](const auto &fat) { return fat.summary(); });
+}
+
+} // namespace fat32
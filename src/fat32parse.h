@@ -0,0 +1,862 @@
+#pragma once
+
+// Read-only, zero-copy access to FAT12, FAT16 and FAT32 disk images.
+//
+// Image maps the file once, everything else is a view into that mapping:
+// Volume over a partition's boot sector, FatView over one FAT copy, chain,
+// extent and directory iterators over clusters. Nothing allocates and
+// nothing is read before it is dereferenced. Views are valid while the Image
+// they came from is alive. FatWindows is the exception: it maps a FAT copy
+// in windows of its own, for tables too large to map as a whole.
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <type_traits>
+#include <vector>
+
+#include "mio/mmap.hpp"
+
+#include "emfat1.h"
+
+namespace fat32 {
+
+// FAT32 entries are 28 bit, the upper 4 bits are reserved
+static constexpr uint32_t FAT32_MASK = 0x0fffffff;
+
+// Width of the FAT entries. A boot sector without the FAT12/16 fields is
+// FAT32, otherwise up to MAX_FAT12_CLUSTERS data clusters is FAT12 and up to
+// MAX_FAT16_CLUSTERS FAT16.
+enum class FatType : uint8_t { Fat12, Fat16, Fat32 };
+
+static constexpr uint32_t MAX_FAT12_CLUSTERS = 4084;
+static constexpr uint32_t MAX_FAT16_CLUSTERS = 65524;
+
+// guards recursion on corrupted images with directory loops
+static constexpr int MAX_TREE_DEPTH = 1024;
+
+enum class error {
+  truncated = 1,       // a structure reaches past the end of the image
+  bad_boot_sector,     // geometry that can not be a FAT file system
+  bad_fat_type,        // FAT12/16 fields that are incomplete or too small
+  bad_partition_table, // an EBR chain or GPT that can not be followed
+};
+
+const std::error_category &error_category();
+std::error_code make_error_code(error e);
+
+template <typename It> class Range {
+public:
+  Range(It begin, It end) : begin_(begin), end_(end) {}
+  It begin() const { return begin_; }
+  It end() const { return end_; }
+
+private:
+  It begin_;
+  It end_;
+};
+
+// Entry decoders, one per width. Reserved values come out widened to their
+// FAT32 counterparts, 0xff7 and 0xfff7 as CLUST_BAD, 0xff8 and up as end
+// marks, so nothing past the decoder deals with more than one set of them.
+// Loops over many entries take the decoder as a template parameter and are
+// compiled once per width. offset() is where an entry starts in the table,
+// decode() reads it from there, at most 4 bytes.
+struct Fat12Entries {
+  static constexpr FatType type = FatType::Fat12;
+  static uint64_t bytes(uint32_t count) {
+    return ((uint64_t)count * 3 + 1) / 2;
+  }
+  static uint64_t offset(uint32_t cluster) {
+    return (uint64_t)cluster + cluster / 2;
+  }
+  // two entries share three bytes, the odd one in the upper 12 bits
+  static uint32_t decode(const uint8_t *p, uint32_t cluster) {
+    uint16_t v;
+    std::memcpy(&v, p, sizeof(v));
+    v = cluster & 1 ? v >> 4 : v & 0xfff;
+    return v >= 0xff7 ? v | 0x0ffff000u : v;
+  }
+  uint32_t operator()(const uint8_t *fat, uint32_t cluster) const {
+    return decode(fat + offset(cluster), cluster);
+  }
+};
+
+struct Fat16Entries {
+  static constexpr FatType type = FatType::Fat16;
+  static uint64_t bytes(uint32_t count) { return (uint64_t)count * 2; }
+  static uint64_t offset(uint32_t cluster) { return (uint64_t)cluster * 2; }
+  static uint32_t decode(const uint8_t *p, uint32_t) {
+    uint16_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v >= 0xfff7 ? v | 0x0fff0000u : v;
+  }
+  uint32_t operator()(const uint8_t *fat, uint32_t cluster) const {
+    return decode(fat + offset(cluster), cluster);
+  }
+};
+
+struct Fat32Entries {
+  static constexpr FatType type = FatType::Fat32;
+  static uint64_t bytes(uint32_t count) { return (uint64_t)count * 4; }
+  static uint64_t offset(uint32_t cluster) { return (uint64_t)cluster * 4; }
+  static uint32_t decode(const uint8_t *p, uint32_t) {
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v & FAT32_MASK;
+  }
+  uint32_t operator()(const uint8_t *fat, uint32_t cluster) const {
+    return decode(fat + offset(cluster), cluster);
+  }
+};
+
+// The width known at run time only. For iterators that step once per
+// cluster of a directory, where a switch costs nothing next to the slots.
+struct AnyEntries {
+  FatType type = FatType::Fat32;
+
+  uint64_t bytes(uint32_t count) const {
+    switch (type) {
+    case FatType::Fat12:
+      return Fat12Entries::bytes(count);
+    case FatType::Fat16:
+      return Fat16Entries::bytes(count);
+    default:
+      return Fat32Entries::bytes(count);
+    }
+  }
+  uint32_t operator()(const uint8_t *fat, uint32_t cluster) const {
+    switch (type) {
+    case FatType::Fat12:
+      return Fat12Entries()(fat, cluster);
+    case FatType::Fat16:
+      return Fat16Entries()(fat, cluster);
+    default:
+      return Fat32Entries()(fat, cluster);
+    }
+  }
+};
+
+enum class ChainEnd { End, Bad, Invalid, Loop };
+
+// Clusters of a chain. Stops at the end mark, at a bad or out of range link,
+// or after as many steps as there are clusters, which only a loop can take.
+// end_reason() of the iterator that compared equal to end() tells which.
+template <typename Entries> class BasicChainIterator {
+public:
+  using iterator_category = std::input_iterator_tag;
+  using value_type = uint32_t;
+  using difference_type = std::ptrdiff_t;
+  using pointer = const uint32_t *;
+  using reference = uint32_t;
+
+  BasicChainIterator() = default;
+  BasicChainIterator(const uint8_t *fat, uint32_t count, uint32_t first,
+                     Entries entries = Entries())
+      : fat_(fat), count_(count), cluster_(first), entries_(entries) {
+    if (first < 2 || first >= count) {
+      cluster_ = 0;
+      end_ = ChainEnd::Invalid;
+    }
+  }
+
+  uint32_t operator*() const { return cluster_; }
+
+  BasicChainIterator &operator++() {
+    auto next = entries_(fat_, cluster_);
+    if (++steps_ >= count_) {
+      end_ = ChainEnd::Loop;
+    } else if (next >= CLUST_ROOT_END) {
+      end_ = ChainEnd::End;
+    } else if (next == CLUST_BAD) {
+      end_ = ChainEnd::Bad;
+    } else if (next < 2 || next >= count_) {
+      end_ = ChainEnd::Invalid;
+    } else {
+      cluster_ = next;
+      return *this;
+    }
+    cluster_ = 0;
+    return *this;
+  }
+
+  BasicChainIterator operator++(int) {
+    auto it = *this;
+    ++*this;
+    return it;
+  }
+
+  bool operator==(const BasicChainIterator &o) const {
+    return cluster_ == o.cluster_;
+  }
+  bool operator!=(const BasicChainIterator &o) const { return !(*this == o); }
+
+  ChainEnd end_reason() const { return end_; }
+
+private:
+  const uint8_t *fat_ = nullptr;
+  uint32_t count_ = 0;
+  uint32_t cluster_ = 0; // 0 - past the end
+  uint32_t steps_ = 0;
+  ChainEnd end_ = ChainEnd::End;
+  Entries entries_;
+};
+
+using ChainIterator = BasicChainIterator<AnyEntries>;
+
+// run of consecutive clusters
+struct Extent {
+  uint32_t first;
+  uint32_t count;
+};
+
+// A chain as runs of consecutive clusters, one per fragment
+template <typename Entries> class BasicExtentIterator {
+public:
+  using iterator_category = std::input_iterator_tag;
+  using value_type = Extent;
+  using difference_type = std::ptrdiff_t;
+  using pointer = const Extent *;
+  using reference = const Extent &;
+
+  BasicExtentIterator() = default;
+  explicit BasicExtentIterator(BasicChainIterator<Entries> chain)
+      : next_(chain) {
+    load();
+  }
+
+  const Extent &operator*() const { return extent_; }
+  const Extent *operator->() const { return &extent_; }
+
+  BasicExtentIterator &operator++() {
+    load();
+    return *this;
+  }
+
+  bool operator==(const BasicExtentIterator &o) const {
+    return extent_.count == o.extent_.count &&
+           (extent_.count == 0 || extent_.first == o.extent_.first);
+  }
+  bool operator!=(const BasicExtentIterator &o) const {
+    return !(*this == o);
+  }
+
+  ChainEnd end_reason() const { return next_.end_reason(); }
+
+private:
+  void load() {
+    extent_ = {*next_, 0};
+    for (; next_ != BasicChainIterator<Entries>() &&
+           *next_ == extent_.first + extent_.count;
+         ++next_) {
+      ++extent_.count;
+    }
+  }
+
+  BasicChainIterator<Entries> next_;
+  Extent extent_{0, 0};
+};
+
+using ExtentIterator = BasicExtentIterator<AnyEntries>;
+
+struct FatSummary {
+  uint32_t free;
+  uint32_t used;
+  uint32_t bad;
+  uint32_t chains; // number of end of chain marks
+};
+
+// One copy of the allocation table, count entries including the two
+// reserved ones. FatView decodes by the width of the volume at run time,
+// visit() hands the same table over with the decoder fixed at compile time.
+template <typename Entries> class BasicFatView {
+public:
+  using Chain = BasicChainIterator<Entries>;
+  using Extents = BasicExtentIterator<Entries>;
+
+  BasicFatView() = default;
+  BasicFatView(const uint8_t *data, uint32_t count,
+               Entries entries = Entries())
+      : data_(data), count_(count), entries_(entries) {}
+
+  const uint8_t *data() const { return data_; }
+  uint32_t count() const { return count_; }
+  FatType type() const { return entries_.type; }
+  // size of the entries in bytes
+  uint64_t bytes() const { return entries_.bytes(count_); }
+  uint32_t operator[](uint32_t cluster) const {
+    return entries_(data_, cluster);
+  }
+
+  Range<Chain> chain(uint32_t first) const {
+    return {Chain(data_, count_, first, entries_), Chain()};
+  }
+  Range<Extents> extents(uint32_t first) const {
+    return {Extents(Chain(data_, count_, first, entries_)), Extents()};
+  }
+
+  FatSummary summary() const;
+
+  // f(view) with a view of the same table that has the decoder of its width
+  // as a type, Fat12Entries, Fat16Entries or Fat32Entries
+  template <typename F> decltype(auto) visit(F &&f) const {
+    if constexpr (std::is_same_v<Entries, AnyEntries>) {
+      switch (entries_.type) {
+      case FatType::Fat12:
+        return f(BasicFatView<Fat12Entries>(data_, count_));
+      case FatType::Fat16:
+        return f(BasicFatView<Fat16Entries>(data_, count_));
+      default:
+        return f(BasicFatView<Fat32Entries>(data_, count_));
+      }
+    } else {
+      return f(*this);
+    }
+  }
+
+private:
+  const uint8_t *data_ = nullptr;
+  uint32_t count_ = 0;
+  Entries entries_;
+};
+
+using FatView = BasicFatView<AnyEntries>;
+
+// Calls visit(cluster) for every cluster of a chain, returns how it ended.
+// fat is a FatView or FatWindows.
+template <typename View, typename F>
+ChainEnd walk_chain(const View &fat, uint32_t first, F &&visit) {
+  return fat.visit([&](const auto &typed) {
+    auto chain = typed.chain(first);
+    auto it = chain.begin();
+    for (; it != chain.end(); ++it) {
+      visit(*it);
+    }
+    return it.end_reason();
+  });
+}
+
+// "NAME.EXT" without the padding, kept inline so decoding does not allocate
+struct ShortName {
+  char text[FULL_SHRT_NAME_LEN];
+  uint8_t size;
+
+  operator std::string_view() const { return {text, size}; }
+};
+
+// a VFAT name takes up to 20 slots of 13 UCS-2 characters
+static constexpr unsigned MAX_LFN_SLOTS =
+    (LONG_FILE_NAME_LEN + LFN_LEN_PER_ENTRY - 1) / LFN_LEN_PER_ENTRY;
+
+// The long name slots in front of a short entry, in the order they are
+// stored: the last part of the name first
+struct LongNameSlots {
+  const lfn_entry *slot[MAX_LFN_SLOTS];
+  uint8_t count = 0;
+};
+
+// UTF-8 name, long or short, kept inline so decoding does not allocate. A
+// UCS-2 character takes up to 3 bytes.
+struct Name {
+  char text[LONG_FILE_NAME_LEN * 3];
+  uint16_t size;
+
+  operator std::string_view() const { return {text, size}; }
+};
+
+// the checksum of the short name every slot of its long name carries
+uint8_t lfn_checksum(const dir_entry &e);
+// UCS-2 text up to a 0 terminator or count characters to UTF-8, at most
+// LONG_FILE_NAME_LEN characters. Unpaired surrogates become U+FFFD.
+void decode_ucs2(const uint16_t *ucs2, size_t count, Name &name);
+
+// FAT date and time fields as text, out of range values printed as they
+// are stored. "YYYY-MM-DD" and "HH:MM:SS", the time with ".ss" hundredths
+// when tenth, the 10 ms units of the creation time, is not negative.
+// Return the length written, there is no terminator.
+size_t format_date(uint16_t date, char *out);
+size_t format_time(uint16_t time, int tenth, char *out);
+
+// Tells one version of a sector from another, not meant to resist anyone.
+// Runs at memory speed.
+uint64_t hash_bytes(const uint8_t *data, uint64_t size);
+
+// "0x1f"
+std::string hex(uint64_t v);
+
+// A decoded view of a 32 byte directory slot
+class Entry {
+public:
+  // lfn is only read while the iterator that produced it stays in place
+  explicit Entry(const dir_entry *raw, const LongNameSlots *lfn = nullptr)
+      : raw_(raw), lfn_(lfn) {}
+
+  const dir_entry &raw() const { return *raw_; }
+
+  uint8_t attr() const { return raw_->attr; }
+  bool is_lfn() const { return raw_->attr == ATTR_LONG_FNAME; }
+  bool is_deleted() const { return raw_->name[0] == DEL_DIR_ENTRY; }
+  bool is_dot() const { return raw_->name[0] == DOT_DIR_ENTRY; }
+  bool is_volume_label() const {
+    return !is_lfn() && (raw_->attr & ATTR_VOL_LABEL);
+  }
+  bool is_dir() const {
+    return (raw_->attr & (ATTR_DIR | ATTR_VOL_LABEL)) == ATTR_DIR;
+  }
+
+  uint32_t first_cluster() const {
+    return (uint32_t)raw_->strt_clus_hword << 16 | raw_->strt_clus_lword;
+  }
+  uint32_t size() const { return raw_->size; }
+
+  ShortName short_name() const;
+  // there were long name slots before this entry with its checksum
+  bool has_long_name() const { return lfn_ != nullptr && lfn_->count != 0; }
+  // the long name if there is one, the short name otherwise
+  Name name() const;
+
+private:
+  const dir_entry *raw_;
+  const LongNameSlots *lfn_;
+};
+
+class Volume;
+class TreeIterator;
+
+// Slots of a directory in chain order, or of the fixed root region of
+// FAT12/16 when first is 0, up to the end mark. Unless all is set, long
+// name, deleted, "." and ".." slots are skipped. Long name slots are
+// collected on the way, so a short entry comes with its long name when the
+// run of slots in front of it is complete and its checksum matches.
+class DirectoryIterator {
+public:
+  using iterator_category = std::input_iterator_tag;
+  using value_type = Entry;
+  using difference_type = std::ptrdiff_t;
+  using pointer = void;
+  using reference = Entry;
+
+  DirectoryIterator() = default;
+  DirectoryIterator(const Volume &volume, uint32_t first, unsigned fat_copy,
+                    bool all);
+
+  Entry operator*() const { return Entry(slot_, &lfn_); }
+  // the long name slots of the current entry
+  const LongNameSlots &long_name_slots() const { return lfn_; }
+
+  DirectoryIterator &operator++() {
+    ++slot_;
+    settle();
+    return *this;
+  }
+
+  bool operator==(const DirectoryIterator &o) const {
+    return slot_ == o.slot_;
+  }
+  bool operator!=(const DirectoryIterator &o) const { return !(*this == o); }
+
+  // offset of the current slot in the image
+  uint64_t offset() const;
+  // how the directory's cluster chain ended, once at the end
+  ChainEnd end_reason() const { return chain_.end_reason(); }
+
+private:
+  void enter(uint32_t cluster);
+  void settle();
+  void collect();
+
+  const Volume *volume_ = nullptr;
+  ChainIterator chain_;
+  const dir_entry *slot_ = nullptr; // nullptr - past the end
+  const dir_entry *cluster_end_ = nullptr;
+  bool all_ = false;
+
+  // slots of the run being collected, count is set for the current entry
+  LongNameSlots lfn_;
+  uint8_t collected_ = 0;
+  uint8_t expected_ = 0; // ord of the next slot of the run
+};
+
+// A FAT file system somewhere in the image
+class Volume {
+public:
+  // Checks the boot sector at offset and the layout it describes
+  bool open(const uint8_t *image, uint64_t image_size, uint64_t offset,
+            std::error_code &err);
+
+  FatType fat_type() const { return type_; }
+  const boot_sector &boot() const { return *boot_; }
+  // the same sector with the extended fields of FAT12/16, whose offsets
+  // boot() gets wrong on those
+  const boot_sector16 &boot16() const {
+    return *(const boot_sector16 *)boot_;
+  }
+  // nullptr on FAT12/16 or if the boot sector points outside the image
+  const fsinfo_t *fsinfo() const;
+
+  const uint8_t *image() const { return image_; }
+  uint64_t offset() const { return offset_; }
+  uint32_t sector_size() const { return boot_->bytes_per_sec; }
+  uint32_t cluster_size() const { return cluster_size_; }
+  // 0 on FAT12/16, where the root directory is not a chain
+  uint32_t root_cluster() const {
+    return type_ == FatType::Fat32 ? boot_->root_dir_strt_cluster : 0;
+  }
+  // slots of the fixed root region, 0 on FAT32
+  uint32_t root_entries() const { return boot_->root_dir_max_cnt; }
+
+  uint64_t fsinfo_offset() const {
+    return offset_ + (uint64_t)boot_->fs_info_sector * sector_size();
+  }
+  unsigned fat_copies() const { return boot_->fat_cnt; }
+  uint32_t fat_sectors() const { return fat_sectors_; }
+  // first sector of a FAT copy, of the fixed root and of the data region,
+  // relative to offset()
+  uint64_t fat_sector(unsigned copy) const {
+    return boot_->reserved_sec_cnt + (uint64_t)fat_sectors_ * copy;
+  }
+  uint64_t root_sector() const { return fat_sector(fat_copies()); }
+  uint64_t data_sector() const {
+    return root_sector() +
+           ((uint64_t)root_entries() * sizeof(dir_entry) + sector_size() - 1) /
+               sector_size();
+  }
+  uint64_t fat_offset(unsigned copy) const {
+    return offset_ + fat_sector(copy) * sector_size();
+  }
+  uint64_t data_offset() const {
+    return offset_ + data_sector() * sector_size();
+  }
+  // where the root directory starts, wherever that is
+  uint64_t root_offset() const {
+    return type_ == FatType::Fat32 ? cluster_offset(root_cluster())
+                                   : offset_ + root_sector() * sector_size();
+  }
+
+  // entries in each FAT, data clusters + 2
+  uint32_t cluster_count() const { return cluster_count_; }
+  FatView fat(unsigned copy = 0) const {
+    return FatView(image_ + fat_offset(copy), cluster_count_,
+                   AnyEntries{type_});
+  }
+
+  uint64_t cluster_offset(uint32_t cluster) const {
+    return data_offset() + (uint64_t)(cluster - 2) * cluster_size_;
+  }
+  // nullptr for clusters out of range or past the end of the image
+  const uint8_t *cluster(uint32_t cluster) const {
+    if (cluster < 2 || cluster >= cluster_count_ ||
+        cluster_offset(cluster) + cluster_size_ > image_size_) {
+      return nullptr;
+    }
+    return image_ + cluster_offset(cluster);
+  }
+
+  Range<DirectoryIterator> directory(uint32_t first, unsigned fat_copy = 0,
+                                     bool all = false) const {
+    return {DirectoryIterator(*this, first, fat_copy, all),
+            DirectoryIterator()};
+  }
+  Range<DirectoryIterator> root(unsigned fat_copy = 0,
+                                bool all = false) const {
+    return directory(root_cluster(), fat_copy, all);
+  }
+
+  // every entry under first, depth-first, produced as it is reached
+  Range<TreeIterator> tree(uint32_t first, unsigned fat_copy = 0) const;
+  Range<TreeIterator> tree() const;
+
+private:
+  const uint8_t *image_ = nullptr;
+  uint64_t image_size_ = 0;
+  uint64_t offset_ = 0;
+  const boot_sector *boot_ = nullptr;
+  FatType type_ = FatType::Fat32;
+  uint32_t fat_sectors_ = 0;
+  uint32_t cluster_size_ = 0;
+  uint32_t cluster_count_ = 0;
+};
+
+// Depth-first, pre-order walk over a directory tree that is suspended
+// between increments: a consumer can stop at any entry and nothing past it
+// is read. State is one DirectoryIterator per open directory, so memory
+// grows with the depth of the tree and not with its size. Directories that
+// link back to one of their ancestors and levels past MAX_TREE_DEPTH are
+// not entered.
+class TreeIterator {
+public:
+  using iterator_category = std::input_iterator_tag;
+  using value_type = Entry;
+  using difference_type = std::ptrdiff_t;
+  using pointer = void;
+  using reference = Entry;
+
+  TreeIterator() = default;
+  TreeIterator(const Volume &volume, uint32_t first, unsigned fat_copy);
+
+  Entry operator*() const { return *stack_.back().it; }
+  TreeIterator &operator++();
+
+  bool operator==(const TreeIterator &o) const {
+    return stack_.empty() ? o.stack_.empty()
+                          : !o.stack_.empty() &&
+                                stack_.back().it == o.stack_.back().it;
+  }
+  bool operator!=(const TreeIterator &o) const { return !(*this == o); }
+
+  // 0 for entries of the starting directory
+  int depth() const { return (int)stack_.size() - 1; }
+  // offset of the current slot in the image
+  uint64_t offset() const { return stack_.back().it.offset(); }
+  // "DIR/SUB/NAME" from the starting directory, with long names
+  std::string path() const;
+
+  // the next increment does not enter the current entry if it is a
+  // directory
+  void skip_children() { skip_ = true; }
+
+private:
+  struct Level {
+    DirectoryIterator it;
+    uint32_t first;         // cluster of this directory
+    const dir_entry *entry; // its slot in the parent, nullptr at the top
+    LongNameSlots lfn;      // and the long name slots of that
+  };
+
+  void pop_finished();
+
+  const Volume *volume_ = nullptr;
+  unsigned fat_copy_ = 0;
+  std::vector<Level> stack_;
+  bool skip_ = false;
+};
+
+inline Range<TreeIterator> Volume::tree(uint32_t first,
+                                        unsigned fat_copy) const {
+  return {TreeIterator(*this, first, fat_copy), TreeIterator()};
+}
+
+inline Range<TreeIterator> Volume::tree() const {
+  return tree(root_cluster());
+}
+
+// "/DIR/NAME" of every entry of a TreeIterator walk in turn, without
+// decoding the names of its directories again: "/DIR/" of the last
+// directory seen at every depth is kept, entries come right after the
+// directory they are in.
+class TreePaths {
+public:
+  // Appends the path of the entry at depth to out, returns its length
+  size_t append(std::string &out, int depth, std::string_view name,
+                bool is_dir);
+
+private:
+  std::vector<std::string> dirs_{"/"};
+};
+
+// visit(entry, depth) for every file, directory and volume label under
+// first
+template <typename F>
+void walk_tree(const Volume &volume, uint32_t first, F &&visit,
+               unsigned fat_copy = 0) {
+  auto tree = volume.tree(first, fat_copy);
+  for (auto it = tree.begin(); it != tree.end(); ++it) {
+    visit(*it, it.depth());
+  }
+}
+
+// How a partition was found
+enum class Scheme {
+  Mbr, // a primary slot of the MBR
+  Ebr, // a logical partition in the EBR chain of an extended partition
+  Gpt, // an entry of the GUID partition table
+};
+
+// A data partition of the image, wherever its table entry was
+struct Partition {
+  unsigned index = 0; // discovery order, the number the dump shows
+  Scheme scheme = Scheme::Mbr;
+  uint8_t type = 0;        // MBR partition type, 0 for GPT
+  uint8_t type_guid[16]{}; // GPT partition type, zeroes for MBR
+  uint64_t start_lba = 0;  // in sectors of sector_size
+  uint64_t size_lba = 0;
+  uint32_t sector_size = SECT;
+  std::string name; // GPT partition name as UTF-8
+
+  uint64_t offset() const { return start_lba * sector_size; }
+};
+
+// A partition and the FAT volume in it, or why there is none
+struct PartitionVolume {
+  Partition partition;
+  Volume volume;
+  std::error_code err; // the partition holds no FAT volume, volume is unset
+};
+
+// A disk image file mapped read-only as a whole
+class Image {
+public:
+  bool open(const std::string &path, std::error_code &err);
+
+  const uint8_t *data() const { return (const uint8_t *)mapping_.data(); }
+  uint64_t size() const { return mapping_.size(); }
+
+  const mbr_t &mbr() const { return *(const mbr_t *)data(); }
+
+  // The GPT if the MBR is protective, otherwise the primary MBR slots in
+  // use followed by the logical partitions of every extended one. A damaged
+  // GPT header or entry array is replaced by the backup copy. If a table
+  // can not be followed to its end, err is set and what was found up to
+  // there is returned.
+  std::vector<Partition> partitions(std::error_code &err) const;
+
+  bool volume(const Partition &partition, Volume &volume,
+              std::error_code &err) const {
+    return volume.open(data(), size(), partition.offset(), err);
+  }
+
+  // The partitions, or only the one numbered partition unless that is
+  // negative, each with its volume opened or the error that kept it shut.
+  // table_err is set as by partitions().
+  std::vector<PartitionVolume> volumes(int partition,
+                                       std::error_code &table_err) const;
+
+private:
+  void read_ebr_chain(const mbr_part_t &extended,
+                      std::vector<Partition> &partitions,
+                      std::error_code &err) const;
+  void read_gpt(std::vector<Partition> &partitions,
+                std::error_code &err) const;
+
+  mio::mmap_source mapping_;
+};
+
+// One FAT copy mapped in windows instead of as a whole, for tables of
+// multi-terabyte volumes that would otherwise take gigabytes of address
+// space and, once walked at random, as much memory. A window is mapped from
+// the image file when an entry in it is first read, and the least recently
+// used one is unmapped when budget is taken, so reads through it never hold
+// more than budget bytes of the table. Reads go through the decoders of
+// visit() and walk_chain() as they would on a FatView. Not thread safe,
+// every thread opens its own.
+class FatWindows {
+public:
+  static constexpr size_t DEFAULT_WINDOW = 64 * 1024;
+
+  struct Counters {
+    uint64_t hits = 0;      // entries read from a window that was mapped
+    uint64_t misses = 0;    // reads that mapped one
+    uint64_t evictions = 0; // windows unmapped to make room
+    uint64_t failures = 0;  // windows that could not be mapped, their
+                            // entries read as free
+  };
+
+  FatWindows() = default;
+  FatWindows(const FatWindows &) = delete;
+  FatWindows &operator=(const FatWindows &) = delete;
+  ~FatWindows();
+
+  // Maps nothing yet. window is rounded up to whole pages, budget down to
+  // whole windows, one at least.
+  bool open(const std::string &path, const Volume &volume, unsigned copy,
+            size_t window, size_t budget, std::error_code &err);
+
+  uint32_t count() const { return count_; }
+  FatType type() const { return type_; }
+  uint64_t bytes() const { return AnyEntries{type_}.bytes(count_); }
+  size_t window() const { return window_; }
+  // windows mapped at a time at most
+  size_t capacity() const { return slots_.size(); }
+  const Counters &counters() const { return counters_; }
+
+  // The table from offset on, at least as far as the entry starting there.
+  // Valid until the next call.
+  const uint8_t *at(uint64_t offset) const {
+    if (offset - current_begin_ < current_size_) {
+      ++counters_.hits;
+      return current_ + (offset - current_begin_);
+    }
+    return load(offset);
+  }
+
+  // f(view), with a view of the table that reads through the windows and
+  // has the decoder of its width as a type
+  template <typename F> decltype(auto) visit(F &&f) const;
+
+  FatSummary summary() const;
+  uint32_t operator[](uint32_t cluster) const;
+
+private:
+  // Every slot has its own place in one reserved range, a window is
+  // mapped over whatever the slot held before
+  struct Slot {
+    const uint8_t *data = nullptr; // first byte of the window, nullptr if
+                                   // nothing is mapped
+    uint64_t window = 0;
+    int32_t prev = -1; // towards the most recently used
+    int32_t next = -1;
+  };
+
+  const uint8_t *load(uint64_t offset) const;
+  void touch(int32_t slot) const;
+  void close();
+
+  int fd_ = -1;
+  uint64_t table_offset_ = 0; // in the image
+  uint64_t table_size_ = 0;
+  uint32_t count_ = 0;
+  FatType type_ = FatType::Fat32;
+  size_t window_ = 0;
+
+  uint8_t *base_ = nullptr; // of the reserved range
+  size_t slot_size_ = 0;
+  mutable std::vector<Slot> slots_;
+  mutable std::vector<int32_t> slot_of_; // per window, -1 if not mapped
+  mutable int32_t head_ = -1; // most recently used
+  mutable int32_t tail_ = -1;
+  mutable Counters counters_;
+  // the window reads are served from without a lookup
+  mutable uint64_t current_begin_ = 0;
+  mutable uint64_t current_size_ = 0;
+  mutable const uint8_t *current_ = nullptr;
+};
+
+// A decoder that reads through FatWindows, the table pointer it is handed
+// is not used
+template <typename Entries> struct WindowedEntries {
+  static constexpr FatType type = Entries::type;
+  static uint64_t bytes(uint32_t count) { return Entries::bytes(count); }
+  uint32_t operator()(const uint8_t *, uint32_t cluster) const {
+    return Entries::decode(windows->at(Entries::offset(cluster)), cluster);
+  }
+
+  const FatWindows *windows = nullptr;
+};
+
+template <typename F> decltype(auto) FatWindows::visit(F &&f) const {
+  switch (type_) {
+  case FatType::Fat12:
+    return f(BasicFatView<WindowedEntries<Fat12Entries>>(nullptr, count_,
+                                                          {this}));
+  case FatType::Fat16:
+    return f(BasicFatView<WindowedEntries<Fat16Entries>>(nullptr, count_,
+                                                          {this}));
+  default:
+    return f(BasicFatView<WindowedEntries<Fat32Entries>>(nullptr, count_,
+                                                          {this}));
+  }
+}
+
+inline uint32_t FatWindows::operator[](uint32_t cluster) const {
+  return visit([cluster](const auto &fat) { return fat[cluster]; });
+}
+
+} // namespace fat32
+
+namespace std {
+template <> struct is_error_code_enum<fat32::error> : true_type {};
+} // namespace std
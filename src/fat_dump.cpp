@@ -0,0 +1,532 @@
+#include <algorithm>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include "fat_dump.h"
+#include "work_pool.h"
+
+void separator(std::ostream &os) { os << std::endl; }
+
+template <typename T = uint8_t>
+static auto dump_bytes(const T *p, size_t count) {
+  std::stringstream ss;
+
+  ss << '[';
+  for (size_t i = 0; i < count; ++i) {
+    ss << "0x" << std::hex << (uint64_t)p[i];
+    if (i < count - 1) {
+      ss << ' ';
+    }
+  }
+  ss << ']';
+
+  return ss.str();
+}
+
+void dump_mbr(const mbr_t &mbr, std::ostream &os) {
+  using std::endl;
+
+  os << "MBR:" << endl
+     << ".DiskSig=" << mbr.DiskSig
+     << " .BootSignature=" << dump_bytes(mbr.BootSignature, 2) << endl
+     << "MBR partitions:" << endl;
+  auto p = std::cbegin(mbr.PartTable);
+  for (int i = 0; i < 4; ++i, ++p) {
+    os << "#:" << i << ":"
+       << " .status=" << (int)p->status << " .start(HSC)=("
+       << (int)p->start_head << ", " << (int)p->start_sector << ", "
+       << (int)p->start_cylinder << ") "
+       << " .PartType=0x" << std::hex << (int)p->PartType << std::dec
+       << " .end(HSC)=(" << (int)p->end_head << ", " << (int)p->end_sector
+       << ", " << (int)p->end_cylinder << ") "
+       << " .StartLBA=" << p->StartLBA << " .SizeLBA=" << p->SizeLBA << endl;
+  }
+}
+
+// drive_number .. file_system_type, at their FAT32 or FAT12/16 offsets
+template <typename BootSector>
+static void dump_ext_bpb(const BootSector &boot, std::ostream &os) {
+  using std::endl;
+
+  os << "\t.drive_number = 0x" << std::hex << (int)boot.drive_number
+     << std::dec
+     << endl
+
+     //<< "\t.reserved1 = " << dump_bytes(&boot.reserved1, 1) << endl
+     << "\t.boot_sig = 0x" << std::hex << (int)boot.boot_sig << std::dec
+     << endl
+     << "\t.volume_id[VOL_ID_LEN] = " << dump_bytes(boot.volume_id, VOL_ID_LEN)
+     << endl
+     << "\t.volume_label[VOL_LABEL_LEN] = \""
+     << std::string((const char *)boot.volume_label, VOL_LABEL_LEN) << "\""
+     << endl
+     << "\t.file_system_type[FILE_SYS_TYPE_LENGTH] = \""
+     << std::string((const char *)boot.file_system_type, FILE_SYS_TYPE_LENGTH)
+     << "\"" << endl;
+}
+
+void dump_boot_sect(const fat32::Volume &volume, std::ostream &os) {
+  using std::endl;
+
+  auto boot_sect = &volume.boot();
+  auto file_offset = volume.offset();
+
+  os << "boot_sector at offset 0x" << std::hex << file_offset << " :"
+     << std::dec << endl
+     << "\t.jump[JUMP_INS_LEN] = " << dump_bytes(boot_sect->jump, JUMP_INS_LEN)
+     << endl
+     << "\t.OEM_name[OEM_NAME_LEN] = \""
+     << std::string((const char *)boot_sect->OEM_name, OEM_NAME_LEN) << "\""
+     << endl
+     << "\t.bytes_per_sec = " << boot_sect->bytes_per_sec
+     << " # Размер сектора в байтах" << endl
+     << "\t.sec_per_clus = " << (int)boot_sect->sec_per_clus << endl
+     << "\t.reserved_sec_cnt = " << boot_sect->reserved_sec_cnt
+     << " # зарезервированых секторов между началом раздела и первой копией FAT"
+     << endl
+     << "\t.fat_cnt = " << (int)boot_sect->fat_cnt << endl
+     << "\t.root_dir_max_cnt = " << boot_sect->root_dir_max_cnt
+     << " # Для FAT32 0, иначе - количество записей в корневом каталоге" << endl
+     << "\t.tot_sectors = " << boot_sect->tot_sectors << endl
+     << "\t.media_desc = 0x" << std::hex << (int)boot_sect->media_desc
+     << std::dec << " # 0xF8 - HDD, 0xF0 - Floppy" << endl
+     << "\t.sec_per_fat_fat16 = " << boot_sect->sec_per_fat_fat16 << endl
+     << "\t.sec_per_track = " << boot_sect->sec_per_track << endl
+     << "\t.number_of_heads = " << boot_sect->number_of_heads << endl
+     << "\t.hidden_sec_cnt = " << boot_sect->hidden_sec_cnt
+     << " # Число скрытых секторов перед разделом" << endl
+     << "\t.tol_sector_cnt = " << boot_sect->tol_sector_cnt
+     << " # Всего секторов в разделе" << endl;
+
+  if (volume.fat_type() == fat32::FatType::Fat32) {
+    os << "\t.sectors_per_fat = " << boot_sect->sectors_per_fat
+       << " # Cколько секторов занимает 1 копия FAT" << endl
+       << "\t.ext_flags = " << boot_sect->ext_flags << endl
+       << "\t.fs_version[FS_VER_LEN] = "
+       << dump_bytes(boot_sect->fs_version, FS_VER_LEN) << endl
+
+       << "\t.root_dir_strt_cluster = " << boot_sect->root_dir_strt_cluster
+       << " # Первый КЛАСТЕР корневого каталога ("
+       << boot_sect->root_dir_strt_cluster << "cls *"
+       << (int)boot_sect->sec_per_clus << "sec/cls = "
+       << boot_sect->root_dir_strt_cluster * (int)boot_sect->sec_per_clus
+       << "sec)" << endl
+
+       << "\t.fs_info_sector = " << boot_sect->fs_info_sector
+       << " # Сектор, в котором лежит fsinfo (0x" << std::hex << file_offset
+       << " + 0x" << boot_sect->bytes_per_sec << " * "
+       << boot_sect->fs_info_sector << " = 0x"
+       << (file_offset + boot_sect->bytes_per_sec * boot_sect->fs_info_sector)
+       << std::dec << endl
+
+       << "\t.backup_boot_sector = " << boot_sect->backup_boot_sector
+       << " # Сектор в котором лежит бакап MBR (0 - откл.)" << endl;
+
+    //<< "\t.reserved[RESERV_LEN] = "
+    //<< dump_bytes(boot_sect->reserved, RESERV_LEN) << endl
+    dump_ext_bpb(*boot_sect, os);
+  } else {
+    // FAT12/16 have the extended fields right after the common ones
+    dump_ext_bpb(volume.boot16(), os);
+  }
+
+  os << "File system: FAT"
+     << (volume.fat_type() == fat32::FatType::Fat12   ? 12
+         : volume.fat_type() == fat32::FatType::Fat16 ? 16
+                                                      : 32)
+     << ", " << volume.cluster_count() - 2 << " clusters" << endl
+     << endl;
+
+  for (unsigned i = 0; i < volume.fat_copies(); ++i) {
+    os << "FAT" << i + 1 << " sector: " << volume.fat_sector(i) << std::hex
+       << " (offset: 0x" << volume.fat_offset(i) << ")" << std::dec << endl;
+  }
+
+  os << "Root dir sector:"
+     << (volume.root_offset() - file_offset) / volume.sector_size()
+     << std::hex << " (offset: 0x" << volume.root_offset() << ")" << std::dec
+     << endl;
+}
+
+void dump_fsinfo(const fat32::Volume &volume, std::ostream &os) {
+  using std::endl;
+
+  auto fsinfo = volume.fsinfo();
+  if (fsinfo == nullptr) {
+    os << "fsinfo at offset 0x" << std::hex << volume.fsinfo_offset()
+       << std::dec << " is past the end of the image" << endl
+       << endl;
+    return;
+  }
+
+  os << "fsinfo at offset 0x" << std::hex << volume.fsinfo_offset() << " :"
+     << endl
+     << "\t.signature1 = 0x" << fsinfo->signature1 << endl
+     << "\t.signature2 = 0x" << fsinfo->signature2 << endl
+     << "\t.free_clusters = " << std::dec << fsinfo->free_clusters << endl
+     << "\t.next_cluster = " << fsinfo->next_cluster
+     << endl
+     //<< "\t.reserved2[3] = " << dump_bytes(fsinfo->reserved2, 3) << endl
+     << "\t.signature3 = 0x" << std::hex << fsinfo->signature3 << endl
+     << std::dec << endl;
+}
+
+void dump_fat(const fat32::Volume &volume, unsigned copy, std::ostream &os,
+              DumpStats *stats, const fat32::FatWindows *windows) {
+  using fat32::ChainEnd;
+  using std::endl;
+
+  const auto fat = volume.fat(copy);
+  // the reserved entries, at most 8 bytes at the start of the table
+  uint8_t raw[8] = {};
+  std::memcpy(raw, windows != nullptr ? windows->at(0) : fat.data(),
+              (size_t)fat32::AnyEntries{volume.fat_type()}.bytes(2));
+  // the table through the image mapping or the windows
+  auto walk_chain = [&](uint32_t first, auto &&visit) {
+    return windows != nullptr ? fat32::walk_chain(*windows, first, visit)
+                              : fat32::walk_chain(fat, first, visit);
+  };
+
+  uint64_t clusters = 0;
+  auto print_claster_chain = [&walk_chain, &clusters](
+                                 uint32_t first_claster) -> std::string {
+    std::stringstream ss;
+    bool first = true;
+    auto end = walk_chain(first_claster,
+                          [&ss, &first, &clusters](uint32_t claster) {
+                            if (!first) {
+                              ss << " -> ";
+                            }
+                            ss << claster;
+                            first = false;
+                            ++clusters;
+                          });
+    switch (end) {
+    case ChainEnd::End:
+      ss << " <END>" << endl;
+      break;
+    case ChainEnd::Bad:
+      ss << "<brocken>" << endl;
+      break;
+    case ChainEnd::Invalid:
+      ss << " <invalid>" << endl;
+      break;
+    case ChainEnd::Loop:
+      ss << " <loop>" << endl;
+      break;
+    }
+    return ss.str();
+  };
+
+  {
+    DumpStats::Scope scope(stats, DumpStats::Fat);
+
+    os << "FAT at offset 0x" << std::hex << volume.fat_offset(copy) << " :"
+       << endl;
+    // FAT12 packs both reserved entries into three bytes
+    switch (volume.fat_type()) {
+    case fat32::FatType::Fat12:
+      os << "Reserved: " << dump_bytes(raw, 3) << endl;
+      break;
+    case fat32::FatType::Fat16:
+      os << "Reserved: " << dump_bytes(raw, 2) << ", " << dump_bytes(raw + 2, 2)
+         << endl;
+      break;
+    case fat32::FatType::Fat32:
+      os << "Reserved: " << dump_bytes(raw, 4) << ", " << dump_bytes(raw + 4, 4)
+         << endl;
+      break;
+    }
+
+    auto summary = windows != nullptr ? windows->summary() : fat.summary();
+    os << std::dec << "Clusters: used=" << summary.used
+       << " bad=" << summary.bad << " chains=" << summary.chains << endl;
+
+    if (volume.fat_type() == fat32::FatType::Fat32) {
+      os << "Root dir in clasters: "
+         << print_claster_chain(volume.root_cluster()) << endl;
+    } else {
+      os << "Root dir: " << volume.root_entries() << " fixed slots" << endl
+         << endl;
+    }
+
+    if (stats != nullptr) {
+      (*stats)[DumpStats::Fat].bytes += fat.bytes();
+      (*stats)[DumpStats::Fat].clusters += clusters;
+    }
+    clusters = 0;
+  }
+
+  auto decode_attr = [](uint8_t attr) -> std::string {
+    std::stringstream ss;
+    if (attr & (1 << 5)) {
+      ss << "Archive";
+    }
+    if (attr & (1 << 4)) {
+      ss << " | Dir";
+    }
+    if (attr & (1 << 3)) {
+      ss << " | VolID";
+    }
+    if (attr & (1 << 2)) {
+      ss << " | Sys";
+    }
+    if (attr & (1 << 1)) {
+      ss << " | Hidden";
+    }
+    if (attr & (1 << 0)) {
+      ss << " | RO";
+    }
+    return ss.str();
+  };
+
+  // the stamps next to their raw value, a date of 0 is unset
+  auto decode_date = [](uint16_t date) -> std::string {
+    char text[16] = " (";
+    if (date == 0) {
+      return {};
+    }
+    auto n = 2 + fat32::format_date(date, text + 2);
+    text[n++] = ')';
+    return {text, n};
+  };
+  auto decode_time = [](uint16_t time, int tenth) -> std::string {
+    char text[16] = " (";
+    auto n = 2 + fat32::format_time(time, tenth, text + 2);
+    text[n++] = ')';
+    return {text, n};
+  };
+
+  auto print_file_info = [&os, decode_attr, decode_date, decode_time,
+                          &print_claster_chain](
+                             auto f, uint64_t offset, std::string name) {
+    if (f->attr == 0x0f) {
+      auto l = (const lfn_entry *)f;
+      os << "> Long name slot " << (l->ord_field & (LAST_ORD_FIELD_SEQ - 1))
+         << " at 0x" << std::hex << offset << std::dec << endl;
+    } else {
+      auto claster = ((uint32_t)f->strt_clus_hword) << 16 | f->strt_clus_lword;
+      if (f->name[0] == 0x05) {
+        os << "Deleted file ?" << name.erase(0) << " at 0x" << std::hex
+           << offset << std::dec << ": " << endl;
+      } else {
+        os << "File " << name << " at 0x" << std::hex << offset << std::dec
+           << ": " << endl;
+      }
+
+      os << "\t.attr = " << decode_attr(f->attr) << endl
+         << "\t.crt_time_tenth = " << (int)f->crt_time_tenth << endl
+         << "\t.crt_time = " << f->crt_time
+         << decode_time(f->crt_time, f->crt_time_tenth) << endl
+         << "\t.crt_date = " << f->crt_date << decode_date(f->crt_date) << endl
+         << "\t.lst_access_date = " << f->lst_access_date
+         << decode_date(f->lst_access_date) << endl
+         << "\t.strt_clus_hword = " << f->strt_clus_hword << endl
+         << "\t.lst_mod_time = " << f->lst_mod_time
+         << decode_time(f->lst_mod_time, -1) << endl
+         << "\t.lst_mod_date = " << f->lst_mod_date
+         << decode_date(f->lst_mod_date) << endl
+         << "\t.strt_clus_lword = " << f->strt_clus_lword << endl
+         << "\t.size = " << f->size << endl
+
+         << "\t ->strt_clus = " << claster << endl;
+
+      if (f->attr & (1 << 3)) {
+        separator(os);
+        return;
+      }
+
+      os << "\t> Claster chain: " << print_claster_chain(claster);
+    }
+
+    separator(os);
+  };
+
+  // files, every slot of the root directory up to the end mark
+  DumpStats::Scope scope(stats, DumpStats::Directories);
+  uint64_t entries = 0;
+  auto root = volume.root(copy, true);
+  for (auto it = root.begin(); it != root.end(); ++it) {
+    auto e = *it;
+    std::string name(static_cast<std::string_view>(e.short_name()));
+    if (e.has_long_name()) {
+      name = std::string(std::string_view(e.name())) + " (" + name + ")";
+    }
+    print_file_info(&e.raw(), it.offset(), name);
+    ++entries;
+  }
+
+  if (stats != nullptr) {
+    auto &c = (*stats)[DumpStats::Directories];
+    c.bytes += (entries + 1) * sizeof(dir_entry);
+    c.entries += entries;
+    c.clusters += clusters;
+  }
+
+  if (windows != nullptr) {
+    auto &w = windows->counters();
+    auto reads = w.hits + w.misses + w.failures;
+    os << "FAT windows: " << windows->capacity() << " of "
+       << windows->window() / 1024 << " KiB, " << reads << " reads, "
+       << std::fixed << std::setprecision(2)
+       << (reads ? 100.0 * w.hits / reads : 100.0) << std::defaultfloat
+       << "% hits, " << w.misses << " mapped, " << w.evictions
+       << " unmapped";
+    if (w.failures) {
+      os << ", " << w.failures << " failed to map and read as free";
+    }
+    os << endl << endl;
+    if (stats != nullptr) {
+      (*stats)[DumpStats::Fat].mappings += w.misses;
+    }
+  }
+}
+
+// counts bytes of the image read by a stage
+static void touched(DumpStats *stats, DumpStats::Stage stage, uint64_t size) {
+  if (stats != nullptr) {
+    (*stats)[stage].bytes += size;
+  }
+}
+
+static std::string describe(const fat32::Partition &p) {
+  std::stringstream ss;
+  switch (p.scheme) {
+  case fat32::Scheme::Mbr:
+    ss << "MBR";
+    break;
+  case fat32::Scheme::Ebr:
+    ss << "EBR";
+    break;
+  case fat32::Scheme::Gpt:
+    ss << "GPT";
+    break;
+  }
+  if (p.scheme != fat32::Scheme::Gpt) {
+    ss << " type 0x" << std::hex << (int)p.type << std::dec;
+  } else if (!p.name.empty()) {
+    ss << " \"" << p.name << "\"";
+  }
+  ss << ", LBA " << p.start_lba << " + " << p.size_lba;
+  if (p.sector_size != SECT) {
+    ss << " of " << p.sector_size << " bytes";
+  }
+  return ss.str();
+}
+
+// one partition into its own stream, so partitions can run in parallel
+static bool dump_partition(const std::string &file, const fat32::Image &image,
+                           const fat32::Partition &partition,
+                           std::ostream &os, std::string &error,
+                           DumpStats *stats, uint64_t fat_budget,
+                           size_t fat_window) {
+  os << "Partition #" << partition.index << " (" << describe(partition) << ")"
+     << std::endl;
+
+  std::error_code err;
+  fat32::Volume volume;
+  {
+    DumpStats::Scope scope(stats, DumpStats::BootSector);
+    touched(stats, DumpStats::BootSector, sizeof(boot_sector));
+    if (!image.volume(partition, volume, err)) {
+      error = err.message();
+      separator(os);
+      return false;
+    }
+    dump_boot_sect(volume, os);
+  }
+
+  // FAT12/16 have no fsinfo sector
+  if (volume.fat_type() == fat32::FatType::Fat32) {
+    separator(os);
+    DumpStats::Scope scope(stats, DumpStats::FsInfo);
+    touched(stats, DumpStats::FsInfo, sizeof(fsinfo_t));
+    dump_fsinfo(volume, os);
+  }
+
+  for (unsigned copy = 0; copy < volume.fat_copies(); ++copy) {
+    separator(os);
+    // one copy mapped at a time, the budget is not split between them
+    fat32::FatWindows windows;
+    if (fat_budget != 0 && !windows.open(file, volume, copy, fat_window,
+                                         fat_budget, err)) {
+      error = err.message();
+      return false;
+    }
+    dump_fat(volume, copy, os, stats, fat_budget != 0 ? &windows : nullptr);
+  }
+
+  separator(os);
+  return true;
+}
+
+int dump_image(const std::string &file, std::ostream &os, DumpStats *stats,
+               unsigned threads, uint64_t fat_budget, size_t fat_window) {
+  fat32::Image image;
+  std::vector<fat32::Partition> partitions;
+  std::error_code table_err;
+  {
+    DumpStats::Scope scope(stats, DumpStats::Mbr);
+    std::error_code err;
+    if (!image.open(file, err)) {
+      std::cerr << "Failed to map file: " << err.message() << std::endl;
+      return -1;
+    }
+    // the whole image is mapped once, stages read from that mapping
+    if (stats != nullptr) {
+      ++(*stats)[DumpStats::Mbr].mappings;
+    }
+    touched(stats, DumpStats::Mbr, sizeof(mbr_t));
+    dump_mbr(image.mbr(), os);
+    partitions = image.partitions(table_err);
+  }
+  separator(os);
+
+  int ret = 0;
+  if (table_err) {
+    std::cerr << "Partition table: " << table_err.message() << std::endl;
+    ret = -1;
+  }
+
+  struct Output {
+    std::stringstream os;
+    std::string error;
+    DumpStats stats;
+  };
+  std::vector<Output> outputs(partitions.size());
+  {
+    auto workers = std::min<unsigned>(
+        threads ? threads : std::thread::hardware_concurrency(),
+        (unsigned)std::max<size_t>(partitions.size(), 1));
+    // every worker maps its share of the budget
+    auto budget = fat_budget ? std::max<uint64_t>(fat_budget / workers, 1) : 0;
+    WorkPool pool(workers);
+    for (size_t i = 0; i < partitions.size(); ++i) {
+      pool.submit([&, i] {
+        auto &out = outputs[i];
+        dump_partition(file, image, partitions[i], out.os, out.error,
+                       stats != nullptr ? &out.stats : nullptr, budget,
+                       fat_window);
+      });
+    }
+    pool.wait();
+  }
+
+  // merged in partition order, as if they ran one after another
+  for (size_t i = 0; i < outputs.size(); ++i) {
+    auto &out = outputs[i];
+    os << out.os.str();
+    if (!out.error.empty()) {
+      std::cerr << "Partition #" << i << ": " << out.error << std::endl;
+      ret = -1;
+    }
+    if (stats != nullptr) {
+      *stats += out.stats;
+    }
+  }
+  return ret;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+#include "dump_stats.h"
+#include "fat32parse.h"
+
+// Text output of the default mode, built on fat32parse
+
+void separator(std::ostream &os);
+
+// Stages of the default mode, each prints what it parsed
+void dump_mbr(const mbr_t &mbr, std::ostream &os);
+void dump_boot_sect(const fat32::Volume &volume, std::ostream &os);
+void dump_fsinfo(const fat32::Volume &volume, std::ostream &os);
+// one FAT copy and the root directory as that copy links it, the table read
+// through windows if they are given, opened on the same copy
+void dump_fat(const fat32::Volume &volume, unsigned copy, std::ostream &os,
+              DumpStats *stats = nullptr,
+              const fat32::FatWindows *windows = nullptr);
+
+// The whole default mode: every partition of the image file, found in the
+// MBR, EBR chains or GPT. Partitions are dumped on up to threads threads (0 -
+// one per core) and their output is merged in partition order. Stage
+// counters are collected into stats if it is not null. With a fat_budget,
+// every FAT is read through fat_window sized windows, no more than
+// fat_budget bytes of them mapped at a time over all threads.
+int dump_image(const std::string &file, std::ostream &os,
+               DumpStats *stats = nullptr, unsigned threads = 0,
+               uint64_t fat_budget = 0,
+               size_t fat_window = fat32::FatWindows::DEFAULT_WINDOW);
@@ -0,0 +1,386 @@
+#include <algorithm>
+#include <cctype>
+#include <optional>
+#include <cstdio>
+
+#include "fat_find.h"
+
+// ASCII only, UTF-8 bytes of other letters are left as they are
+static char fold(char c) { return c >= 'a' && c <= 'z' ? c - 'a' + 'A' : c; }
+
+// shell style glob without '/', case-insensitive for ASCII
+static bool glob_match(std::string_view p, std::string_view s) {
+  size_t pi = 0, si = 0;
+  size_t star = std::string_view::npos, resume = 0;
+  while (si < s.size()) {
+    if (pi < p.size() && p[pi] == '*') {
+      star = pi++;
+      resume = si;
+      continue;
+    }
+    if (pi < p.size() && p[pi] == '[') {
+      size_t i = pi + 1;
+      bool negate = i < p.size() && (p[i] == '!' || p[i] == '^');
+      i += negate;
+      bool hit = false;
+      auto c = fold(s[si]);
+      for (bool first = true; i < p.size() && (first || p[i] != ']');
+           first = false) {
+        auto lo = fold(p[i]), hi = lo;
+        if (i + 2 < p.size() && p[i + 1] == '-' && p[i + 2] != ']') {
+          hi = fold(p[i + 2]);
+          i += 2;
+        }
+        hit = hit || (lo <= c && c <= hi);
+        ++i;
+      }
+      if (i < p.size() && hit != negate) {
+        pi = i + 1;
+        ++si;
+        continue;
+      }
+    } else if (pi < p.size() && (p[pi] == '?' || fold(p[pi]) == fold(s[si]))) {
+      ++pi;
+      ++si;
+      continue;
+    }
+    if (star == std::string_view::npos) {
+      return false;
+    }
+    pi = star + 1;
+    si = ++resume;
+  }
+  while (pi < p.size() && p[pi] == '*') {
+    ++pi;
+  }
+  return pi == p.size();
+}
+
+bool parse_fat_time(const std::string &s, uint32_t &packed) {
+  unsigned y, mo, d, h = 0, mi = 0, sec = 0;
+  char sep, tail;
+  int n = std::sscanf(s.c_str(), "%4u-%2u-%2u%c%2u:%2u:%2u%c", &y, &mo, &d,
+                      &sep, &h, &mi, &sec, &tail);
+  if (n != 3 && n != 6 && n != 7) {
+    return false;
+  }
+  if (n > 3 && sep != ' ' && sep != 'T') {
+    return false;
+  }
+  if (y < 1980 || y > 2107 || mo < 1 || mo > 12 || d < 1 || d > 31 ||
+      h > 23 || mi > 59 || sec > 59) {
+    return false;
+  }
+  uint32_t date = (y - 1980) << 9 | mo << 5 | d;
+  uint32_t time = h << 11 | mi << 5 | sec / 2;
+  packed = date << 16 | time;
+  return true;
+}
+
+static bool parse_attr(const std::string &s, uint8_t &bits) {
+  bits = 0;
+  for (auto c : s) {
+    switch (std::tolower((unsigned char)c)) {
+    case 'r':
+      bits |= ATTR_READ;
+      break;
+    case 'h':
+      bits |= ATTR_HIDDEN;
+      break;
+    case 's':
+      bits |= ATTR_SYSTEM;
+      break;
+    case 'a':
+      bits |= ATTR_ARCHIVE;
+      break;
+    case 'd':
+      bits |= ATTR_DIR;
+      break;
+    default:
+      return false;
+    }
+  }
+  return true;
+}
+
+bool FindFilter::compile(const FindQuery &query, std::string &error) {
+  *this = FindFilter();
+
+  uint8_t set, clear;
+  if (!parse_attr(query.attr, set)) {
+    error = "bad attributes: " + query.attr;
+    return false;
+  }
+  if (!parse_attr(query.not_attr, clear)) {
+    error = "bad attributes: " + query.not_attr;
+    return false;
+  }
+  if (query.type == 'f') {
+    clear |= ATTR_DIR;
+  } else if (query.type == 'd') {
+    set |= ATTR_DIR;
+  } else if (query.type != 0) {
+    error = std::string("bad type: ") + query.type;
+    return false;
+  }
+  // labels and long name slots are never matched
+  clear |= ATTR_VOL_LABEL;
+  attr_mask_ = set | clear;
+  attr_value_ = set;
+
+  min_size_ = (uint32_t)std::min<uint64_t>(query.min_size, UINT32_MAX);
+  max_size_ = (uint32_t)std::min<uint64_t>(query.max_size, UINT32_MAX);
+  empty_size_ = query.min_size > query.max_size || query.min_size > UINT32_MAX;
+
+  if (!query.newer.empty()) {
+    if (!parse_fat_time(query.newer, min_time_)) {
+      error = "bad time: " + query.newer;
+      return false;
+    }
+    has_time_ = true;
+  }
+  if (!query.older.empty()) {
+    if (!parse_fat_time(query.older, max_time_)) {
+      error = "bad time: " + query.older;
+      return false;
+    }
+    has_time_ = true;
+  }
+
+  name_ = Glob(query.name);
+  size_t start = 0;
+  std::vector<std::string> path;
+  while (start <= query.path.size()) {
+    auto end = query.path.find('/', start);
+    if (end == std::string::npos) {
+      end = query.path.size();
+    }
+    if (end > start) {
+      path.emplace_back(query.path.substr(start, end - start));
+    }
+    start = end + 1;
+  }
+  if (path.size() >= 64) {
+    error = "too many path components: " + query.path;
+    return false;
+  }
+  for (auto &c : path) {
+    path_.emplace_back(c);
+  }
+  max_depth_ = query.max_depth;
+  return true;
+}
+
+FindFilter::Glob::Glob(const std::string &pattern)
+    : pattern(pattern), any(pattern == "**") {
+  // short names are upper case and padded, so the literal part of the
+  // base name can be checked in place
+  for (auto c : pattern) {
+    if (c == '*' || c == '?' || c == '[' || c == EXTN_DELIMITER ||
+        prefix.size() == FILE_NAME_SHRT_LEN) {
+      break;
+    }
+    prefix += fold(c);
+  }
+  // and the literal end after the last wildcard, which most names fail
+  auto wild = pattern.find_last_of("*?]");
+  if (wild != std::string::npos) {
+    for (size_t i = wild + 1; i < pattern.size(); ++i) {
+      suffix += fold(pattern[i]);
+    }
+  }
+}
+
+bool FindFilter::Glob::match(std::string_view name) const {
+  if (name.size() < suffix.size()) {
+    return false;
+  }
+  auto tail = name.data() + name.size() - suffix.size();
+  for (size_t i = 0; i < suffix.size(); ++i) {
+    if (fold(tail[i]) != suffix[i]) {
+      return false;
+    }
+  }
+  return glob_match(pattern, name);
+}
+
+bool FindFilter::Glob::may_match(const fat32::Entry &entry) const {
+  // 0x05 stands for 0xE5 in the first byte, leave those to the decoder, and
+  // a long name is what is matched if there is one
+  auto &e = entry.raw();
+  if (prefix.empty() || e.name[0] == 0x05 || entry.has_long_name()) {
+    return true;
+  }
+  for (size_t i = 0; i < prefix.size(); ++i) {
+    if (fold((char)e.name[i]) != prefix[i]) {
+      return false;
+    }
+  }
+  // a literal that ends the base name must be followed by padding
+  if (prefix.size() == FILE_NAME_SHRT_LEN) {
+    return true;
+  }
+  return (prefix.size() < pattern.size() &&
+          pattern[prefix.size()] != EXTN_DELIMITER) ||
+         e.name[prefix.size()] == ' ';
+}
+
+bool FindFilter::match_fixed(const dir_entry &e) const {
+  if ((e.attr & attr_mask_) != attr_value_) {
+    return false;
+  }
+  if (empty_size_ || e.size < min_size_ || e.size > max_size_) {
+    return false;
+  }
+  if (has_time_) {
+    uint32_t t = (uint32_t)e.lst_mod_date << 16 | e.lst_mod_time;
+    if (t < min_time_ || (max_time_ != UINT32_MAX && t >= max_time_)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Path matching is a walk of the pattern components as states: bit i of a
+// set means the directories so far match the first i components. Entering a
+// directory moves every state by one name, so each slot costs one glob per
+// live state and not a match of its whole path.
+uint64_t FindFilter::closure(uint64_t states) const {
+  for (size_t i = 0; i < path_.size(); ++i) {
+    if ((states >> i & 1) && path_[i].any) {
+      states |= 1ull << (i + 1);
+    }
+  }
+  return states;
+}
+
+template <typename Decode>
+uint64_t FindFilter::step(uint64_t states, const fat32::Entry &e,
+                          Decode &&name) const {
+  uint64_t next = 0;
+  for (size_t i = 0; i < path_.size(); ++i) {
+    if (!(states >> i & 1)) {
+      continue;
+    }
+    auto &glob = path_[i];
+    if (glob.any) {
+      next |= 1ull << i;
+    } else if (glob.may_match(e) && glob.match(name())) {
+      next |= 1ull << (i + 1);
+    }
+  }
+  return closure(next);
+}
+
+void FindFilter::run(const fat32::Volume &volume, uint32_t first,
+                     const Visit &visit, FindStats *stats) const {
+  FindStats local;
+  auto &st = stats != nullptr ? *stats : local;
+
+  // path states of the open directories, by depth
+  const uint64_t done = 1ull << path_.size();
+  const uint64_t live = done - 1;
+  std::vector<uint64_t> states{closure(1)};
+
+  ++st.dirs;
+  auto tree = volume.tree(first);
+  for (auto it = tree.begin(); it != tree.end(); ++it) {
+    auto e = *it;
+    ++st.entries;
+    if (e.is_volume_label()) {
+      continue;
+    }
+
+    int depth = it.depth();
+    bool fixed = match_fixed(e.raw());
+    bool dir = e.is_dir();
+    if (!fixed && !(dir && (!path_.empty() || max_depth_ >= 0))) {
+      // nothing to decide about this slot or its subtree
+      if (dir) {
+        ++st.dirs;
+      }
+      continue;
+    }
+
+    // decoded on first use, most slots are turned down on raw bytes
+    std::optional<fat32::Name> decoded;
+    auto name = [&]() -> std::string_view {
+      if (!decoded) {
+        ++st.decoded;
+        decoded.emplace(e.name());
+      }
+      return *decoded;
+    };
+
+    uint64_t next = path_.empty() ? done : step(states[depth], e, name);
+
+    if (fixed && (next & done) && name_.may_match(e) &&
+        (name_.pattern.empty() || name_.match(name()))) {
+      ++st.matches;
+      if (!visit(it, it.path())) {
+        return;
+      }
+    }
+
+    if (dir) {
+      if ((max_depth_ >= 0 && depth >= max_depth_) ||
+          (!path_.empty() && !(next & live))) {
+        ++st.pruned;
+        it.skip_children();
+      } else {
+        states.resize(depth + 1);
+        states.push_back(next);
+        ++st.dirs;
+      }
+    }
+  }
+}
+
+void FindFilter::run_parallel(const fat32::Volume &volume, uint32_t first,
+                              const WalkOptions &walk,
+                              const WalkVisit &visit,
+                              FindStats *stats) const {
+  const uint64_t done = 1ull << path_.size();
+  const uint64_t live = done - 1;
+
+  // the path states of a directory travel as the tag of its WalkDir
+  auto options = walk;
+  options.tag = closure(1);
+  auto filter = [&](WalkSlot &slot, WalkChoice &choice) {
+    auto &e = slot.entry();
+    choice.report = false;
+    if (e.is_volume_label()) {
+      return;
+    }
+    bool fixed = match_fixed(e.raw());
+    bool dir = e.is_dir();
+    if (!fixed && !(dir && (!path_.empty() || max_depth_ >= 0))) {
+      return;
+    }
+
+    auto name = [&] { return slot.name(); };
+    uint64_t next = path_.empty() ? done : step(slot.dir().tag, e, name);
+
+    choice.report = fixed && (next & done) && name_.may_match(e) &&
+                    (name_.pattern.empty() || name_.match(slot.name()));
+    if (dir) {
+      choice.tag = next;
+      choice.enter =
+          !(max_depth_ >= 0 && slot.dir().depth >= max_depth_) &&
+          !(!path_.empty() && !(next & live));
+    }
+  };
+
+  WalkStats ws;
+  parallel_walk(
+      volume, first, options, filter,
+      [&](const WalkEntry &entry) { return visit(entry, entry.path()); },
+      &ws);
+  if (stats != nullptr) {
+    stats->dirs += ws.dirs;
+    stats->pruned += ws.pruned;
+    stats->entries += ws.entries;
+    stats->decoded += ws.decoded;
+    stats->matches += ws.reported;
+  }
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "fat32parse.h"
+#include "tree_walk.h"
+
+// Search conditions as they are given on the command line, all of them must
+// hold for an entry to match
+struct FindQuery {
+  std::string name; // glob on the long or else short name: * ? [a-z] [!a-z]
+  std::string path; // glob on "DIR/SUB/NAME", ** spans any directories
+  uint64_t min_size = 0;
+  uint64_t max_size = UINT64_MAX;
+  std::string newer; // modified at or after "YYYY-MM-DD[ HH:MM[:SS]]"
+  std::string older; // modified before
+  std::string attr;     // letters of r h s a d that must be set
+  std::string not_attr; // and that must be clear
+  char type = 0;        // 'f' files, 'd' directories, 0 both
+  int max_depth = -1;   // directory levels below the start, -1 unlimited
+};
+
+struct FindStats {
+  uint64_t dirs = 0;    // directories read
+  uint64_t pruned = 0;  // directories not entered
+  uint64_t entries = 0; // slots looked at
+  uint64_t decoded = 0; // names decoded
+  uint64_t matches = 0;
+};
+
+// A FindQuery compiled for evaluation on raw directory slots. Conditions on
+// fixed fields (attributes, size, time) are byte comparisons done first,
+// names are decoded only for slots that pass them, and the path glob is
+// also checked against every directory so subtrees it can not match are
+// never read.
+class FindFilter {
+public:
+  // false with a message naming the bad condition
+  bool compile(const FindQuery &query, std::string &error);
+
+  // visit(it, path) for every match under first in traversal order, until
+  // visit returns false
+  using Visit =
+      std::function<bool(const fat32::TreeIterator &, const std::string &)>;
+  void run(const fat32::Volume &volume, uint32_t first, const Visit &visit,
+           FindStats *stats = nullptr) const;
+  void run(const fat32::Volume &volume, const Visit &visit,
+           FindStats *stats = nullptr) const {
+    run(volume, volume.root_cluster(), visit, stats);
+  }
+
+  // The same search with directories read in parallel, see parallel_walk.
+  // Conditions are checked on the workers, visit(entry, path) is called on
+  // this thread, in traversal order unless walk.ordered is false.
+  using WalkVisit =
+      std::function<bool(const WalkEntry &, const std::string &)>;
+  void run_parallel(const fat32::Volume &volume, uint32_t first,
+                    const WalkOptions &walk, const WalkVisit &visit,
+                    FindStats *stats = nullptr) const;
+
+private:
+  struct Glob {
+    std::string pattern;
+    std::string prefix; // literal start, compared to the raw short name
+    std::string suffix; // literal end, checked before the whole pattern
+    bool any = false;   // **, any number of directories
+
+    explicit Glob(const std::string &pattern = std::string());
+    // false if the slot can not match, without decoding its name
+    bool may_match(const fat32::Entry &e) const;
+    bool match(std::string_view name) const;
+  };
+
+  bool match_fixed(const dir_entry &e) const;
+  uint64_t closure(uint64_t states) const;
+  template <typename Decode>
+  uint64_t step(uint64_t states, const fat32::Entry &e, Decode &&name) const;
+
+  uint8_t attr_mask_ = 0;
+  uint8_t attr_value_ = 0;
+  uint32_t min_size_ = 0;
+  uint32_t max_size_ = UINT32_MAX;
+  bool empty_size_ = false; // min > max or min past 4 GiB, nothing matches
+  uint32_t min_time_ = 0;   // date << 16 | time, as stored
+  uint32_t max_time_ = UINT32_MAX;
+  bool has_time_ = false;
+  Glob name_;
+  std::vector<Glob> path_;
+  int max_depth_ = -1;
+};
+
+// "YYYY-MM-DD[ HH:MM[:SS]]" to the packed FAT date << 16 | time
+bool parse_fat_time(const std::string &s, uint32_t &packed);
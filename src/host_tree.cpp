@@ -0,0 +1,347 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <unordered_set>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "host_tree.h"
+
+// FAT dates start at 1980-01-01
+static constexpr time_t FAT_EPOCH = 315532800;
+
+static uint32_t cma_time(time_t t) {
+  return emfat_cma_time_from_unix((uint32_t)std::max(t, FAT_EPOCH));
+}
+
+// Descriptors cached in file records, of all trees
+static std::atomic<long> cached_fds{0};
+
+// Half of RLIMIT_NOFILE, the other half is left for sockets and the rest
+static long fd_budget() {
+  static const long budget = [] {
+    rlimit limit;
+    if (::getrlimit(RLIMIT_NOFILE, &limit) != 0 ||
+        limit.rlim_cur == RLIM_INFINITY) {
+      return 1024L;
+    }
+    return std::max(16L, (long)(limit.rlim_cur / 2));
+  }();
+  return budget;
+}
+
+// Returns a descriptor cached in the file record. Once the cache holds
+// fd_budget() of them, a temporary one is opened that must be closed by the
+// caller. -1 if the file does not open, which is reported once per file as
+// its reads then give zeros and its writes are dropped.
+static int open_file(const HostTree::File *f, bool &temporary) {
+  temporary = false;
+  auto fd = f->fd.load(std::memory_order_acquire);
+  if (fd >= 0) {
+    return fd;
+  }
+
+  auto flags = (f->writable ? O_RDWR : O_RDONLY) | O_CLOEXEC;
+  if (cached_fds.fetch_add(1) >= fd_budget()) {
+    --cached_fds;
+    temporary = true;
+  }
+  fd = ::open(f->path.c_str(), flags);
+  if (fd < 0) {
+    if (!temporary) {
+      --cached_fds;
+    }
+    temporary = false;
+    if (!f->open_failed.exchange(true)) {
+      std::cerr << "Can't open " << f->path << ": " << std::strerror(errno)
+                << std::endl;
+    }
+    return fd;
+  }
+  if (temporary) {
+    return fd;
+  }
+
+  int expected = -1;
+  if (!f->fd.compare_exchange_strong(expected, fd, std::memory_order_acq_rel)) {
+    ::close(fd);
+    --cached_fds;
+    return expected;
+  }
+  return fd;
+}
+
+// characters a short name may hold besides letters and digits
+static bool short_name_char(char c) {
+  return (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+         (c != 0 && std::strchr("!#$%&'()-@^_`{}~", c) != nullptr);
+}
+
+static char upper(char c) { return c >= 'a' && c <= 'z' ? c - 'a' + 'A' : c; }
+
+// "NAME.EXT" as it can be stored in a short entry
+static bool is_short_name(const std::string &name) {
+  auto dot = name.find('.');
+  auto base = name.substr(0, dot);
+  auto ext = dot == std::string::npos ? std::string() : name.substr(dot + 1);
+  if (base.empty() || base.size() > 8 || ext.size() > 3 ||
+      (dot != std::string::npos && ext.empty())) {
+    return false;
+  }
+  return std::all_of(base.begin(), base.end(), short_name_char) &&
+         std::all_of(ext.begin(), ext.end(), short_name_char);
+}
+
+// The base and extension a short name is made of, upper case, with what a
+// short name can not hold as '_', one for each character of UTF-8
+static void short_basis(const std::string &name, std::string &base,
+                        std::string &ext) {
+  auto start = name.find_first_not_of('.');
+  auto dot = name.rfind('.');
+  if (dot == std::string::npos || dot < start) {
+    dot = name.size();
+  }
+  auto convert = [](const std::string &from, std::string &to, size_t max) {
+    to.clear();
+    for (auto c : from) {
+      if (to.size() == max) {
+        break;
+      }
+      if (c == ' ' || c == '.' || (c & 0xC0) == 0x80) {
+        continue;
+      }
+      to += short_name_char(upper(c)) ? upper(c) : '_';
+    }
+  };
+  convert(name.substr(start, dot - start), base, 8);
+  convert(dot < name.size() ? name.substr(dot + 1) : std::string(), ext, 3);
+  if (base.empty()) {
+    base = "_";
+  }
+}
+
+static void read_file(uint8_t *dest, int size, uint32_t offset,
+                      size_t userdata) {
+  auto f = reinterpret_cast<const HostTree::File *>(userdata);
+  bool temporary;
+  auto fd = open_file(f, temporary);
+
+  size_t done = 0;
+  while (fd >= 0 && done < (size_t)size) {
+    auto r = ::pread(fd, dest + done, size - done, (off_t)offset + done);
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r <= 0) {
+      break;
+    }
+    done += r;
+  }
+  // past the end of file or on error
+  std::memset(dest + done, 0, size - done);
+
+  if (temporary) {
+    ::close(fd);
+  }
+}
+
+static void write_file(const uint8_t *data, int size, uint32_t offset,
+                       size_t userdata) {
+  auto f = reinterpret_cast<const HostTree::File *>(userdata);
+  bool temporary;
+  auto fd = open_file(f, temporary);
+
+  size_t done = 0;
+  while (fd >= 0 && done < (size_t)size) {
+    auto r = ::pwrite(fd, data + done, size - done, (off_t)offset + done);
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r <= 0) {
+      break;
+    }
+    done += r;
+  }
+
+  if (temporary) {
+    ::close(fd);
+  }
+}
+
+// Maps the whole file once and keeps the mapping until the tree goes. A
+// file shorter than at the scan is not mapped, read_file zero-fills its
+// tail where a mapping would fault; one truncated later faults all the same.
+static const uint8_t *map_file(uint32_t offset, uint32_t *size,
+                               size_t userdata) {
+  auto f = reinterpret_cast<const HostTree::File *>(userdata);
+  auto failed = static_cast<const uint8_t *>(MAP_FAILED);
+  auto p = f->map.load(std::memory_order_acquire);
+  if (p == nullptr) {
+    p = failed;
+    bool temporary;
+    auto fd = open_file(f, temporary);
+    struct stat st;
+    if (fd >= 0 && f->size && ::fstat(fd, &st) == 0 &&
+        (uint64_t)st.st_size >= f->size) {
+      p = static_cast<const uint8_t *>(
+          ::mmap(nullptr, f->size, PROT_READ, MAP_SHARED, fd, 0));
+    }
+    if (temporary) {
+      ::close(fd);
+    }
+    const uint8_t *expected = nullptr;
+    if (!f->map.compare_exchange_strong(expected, p,
+                                        std::memory_order_acq_rel)) {
+      if (p != failed) {
+        ::munmap(const_cast<uint8_t *>(p), f->size);
+      }
+      p = expected;
+    }
+  }
+  if (p == failed || offset >= f->size) {
+    return nullptr;
+  }
+  *size = std::min(*size, f->size - offset);
+  return p + offset;
+}
+
+HostTree::~HostTree() {
+  for (auto &f : files_) {
+    auto map = f.map.load();
+    if (map != nullptr && map != MAP_FAILED) {
+      ::munmap(const_cast<uint8_t *>(map), f.size);
+    }
+    auto fd = f.fd.load();
+    if (fd >= 0) {
+      ::close(fd);
+      --cached_fds;
+    }
+  }
+}
+
+bool HostTree::scan(const std::string &root, bool writable,
+                    std::error_code &err) {
+  err.clear();
+  writable_ = writable;
+
+  emfat_entry_t e{};
+  e.name = "";
+  e.dir = true;
+  e.level = 0;
+  entries_.emplace_back(e);
+
+  if (!scan_dir(root, 1, err)) {
+    return false;
+  }
+
+  entries_.emplace_back(emfat_entry_t{});
+  return true;
+}
+
+bool HostTree::scan_dir(const std::string &path, int level,
+                        std::error_code &err) {
+  auto dir = ::opendir(path.c_str());
+  if (dir == nullptr) {
+    err = std::error_code(errno, std::system_category());
+    return false;
+  }
+
+  std::vector<std::string> names;
+  while (auto de = ::readdir(dir)) {
+    if (std::strcmp(de->d_name, ".") && std::strcmp(de->d_name, "..")) {
+      names.emplace_back(de->d_name);
+    }
+  }
+  ::closedir(dir);
+  std::sort(names.begin(), names.end());
+
+  // FAT compares names without case, of names that differ only in case the
+  // first is kept. Names that are short names already are taken as they
+  // are, the others get the first free "BASE~N.EXT" and a long name.
+  std::unordered_set<std::string> long_names, short_names;
+  std::vector<bool> keep(names.size());
+  for (size_t i = 0; i < names.size(); ++i) {
+    auto folded = names[i];
+    std::transform(folded.begin(), folded.end(), folded.begin(), upper);
+    keep[i] = long_names.insert(folded).second;
+    if (!keep[i]) {
+      skipped_.emplace_back(path + '/' + names[i]);
+    } else if (is_short_name(names[i])) {
+      short_names.insert(names[i]);
+    }
+  }
+  auto alias = [&](const std::string &name) -> const char * {
+    if (is_short_name(name)) {
+      return nullptr;
+    }
+    auto folded = name;
+    std::transform(folded.begin(), folded.end(), folded.begin(), upper);
+    std::string base, ext, candidate;
+    // only the case lost: the upper case name, if it is free
+    if (is_short_name(folded) && short_names.insert(folded).second) {
+      candidate = folded;
+    } else {
+      short_basis(name, base, ext);
+      for (unsigned n = 1;; ++n) {
+        auto tail = "~" + std::to_string(n);
+        candidate = base.substr(0, 8 - tail.size()) + tail +
+                    (ext.empty() ? "" : "." + ext);
+        if (short_names.insert(candidate).second) {
+          break;
+        }
+      }
+    }
+    return names_.emplace_back(candidate).c_str();
+  };
+
+  for (size_t i = 0; i < names.size(); ++i) {
+    if (!keep[i]) {
+      continue;
+    }
+    auto &name = names[i];
+    auto full = path + '/' + name;
+
+    struct stat st;
+    if (::lstat(full.c_str(), &st) != 0) {
+      skipped_.emplace_back(full);
+      continue;
+    }
+
+    emfat_entry_t e{};
+    e.level = level;
+    e.cma_time[0] = cma_time(st.st_mtime);
+    e.cma_time[1] = cma_time(st.st_mtime);
+    e.cma_time[2] = cma_time(st.st_atime);
+
+    if (S_ISDIR(st.st_mode)) {
+      e.name = names_.emplace_back(name).c_str();
+      e.short_name = alias(name);
+      e.dir = true;
+      entries_.emplace_back(e);
+      if (!scan_dir(full, level + 1, err)) {
+        return false;
+      }
+    } else if (S_ISREG(st.st_mode) && (uint64_t)st.st_size <= UINT32_MAX) {
+      auto &f = files_.emplace_back(full, (uint32_t)st.st_size, writable_);
+      e.name = names_.emplace_back(name).c_str();
+      e.short_name = alias(name);
+      e.curr_size = f.size;
+      e.max_size = f.size;
+      e.user_data = reinterpret_cast<size_t>(&f);
+      e.readcb = read_file;
+      e.mapcb = map_file;
+      e.writecb = writable_ ? write_file : nullptr;
+      entries_.emplace_back(e);
+      total_size_ += f.size;
+    } else {
+      skipped_.emplace_back(full);
+    }
+  }
+  return true;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "emfat.h"
+
+// Host directory tree presented as an emfat entry table. File contents are
+// read (and, if allowed, written) on demand through the emfat callbacks.
+class HostTree {
+public:
+  struct File {
+    std::string path;
+    uint32_t size;
+    bool writable;
+    mutable std::atomic<int> fd{-1};
+    // the whole file, mapped on first use of mapcb, MAP_FAILED if it can not
+    mutable std::atomic<const uint8_t *> map{nullptr};
+    mutable std::atomic<bool> open_failed{false}; // and reported
+
+    File(std::string path, uint32_t size, bool writable)
+        : path(std::move(path)), size(size), writable(writable) {}
+  };
+
+  HostTree() = default;
+  HostTree(const HostTree &) = delete;
+  HostTree &operator=(const HostTree &) = delete;
+  ~HostTree();
+
+  // Builds the entry table for everything below root. Names that are not
+  // upper case 8.3 names get a unique short alias and a long name. Files
+  // that do not fit FAT32 (>= 4 GiB), special files and names that differ
+  // from another in the same directory only in case are left out and listed
+  // in skipped().
+  bool scan(const std::string &root, bool writable, std::error_code &err);
+
+  emfat_entry_t *entries() { return entries_.data(); }
+  const std::vector<emfat_entry_t> &entry_table() const { return entries_; }
+  const std::vector<std::string> &skipped() const { return skipped_; }
+
+  size_t file_count() const { return files_.size(); }
+  uint64_t total_size() const { return total_size_; }
+
+  static const File *file_of(const emfat_entry_t &e) {
+    return reinterpret_cast<const File *>(e.user_data);
+  }
+
+private:
+  bool scan_dir(const std::string &path, int level, std::error_code &err);
+
+  std::deque<std::string> names_;
+  std::deque<File> files_;
+  std::vector<emfat_entry_t> entries_;
+  std::vector<std::string> skipped_;
+  uint64_t total_size_ = 0;
+  bool writable_ = false;
+};
@@ -0,0 +1,29 @@
+#include <algorithm>
+
+#include "json.h"
+
+void append_json_string(std::string &out, std::string_view s) {
+  static const char hex[] = "0123456789abcdef";
+  out += '"';
+  // runs that need no escape in one append
+  for (auto p = s.begin(), end = s.end(); p != end;) {
+    auto plain = std::find_if(p, end, [](char c) {
+      return c == '"' || c == '\\' || (unsigned char)c < 0x20;
+    });
+    out.append(p, plain);
+    if (plain == end) {
+      break;
+    }
+    auto c = (unsigned char)*plain;
+    if (c < 0x20) {
+      out.append("\\u00");
+      out += hex[c >> 4];
+      out += hex[c & 0xf];
+    } else {
+      out += '\\';
+      out += (char)c;
+    }
+    p = plain + 1;
+  }
+  out += '"';
+}
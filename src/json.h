@@ -0,0 +1,15 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+// s as a JSON string, quotes included, appended to out. '"', '\' and
+// control characters are escaped, every other byte, UTF-8 or not, is
+// copied as it is.
+void append_json_string(std::string &out, std::string_view s);
+
+inline std::string json_string(std::string_view s) {
+  std::string out;
+  append_json_string(out, s);
+  return out;
+}
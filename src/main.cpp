@@ -7,368 +7,661 @@
 #endif
 
 #include <algorithm>
-#include <cstring>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
-#include <sstream>
-#include <vector>
+#include <memory>
 
 #include "argparser.h"
 
-#include "mio/mmap.hpp"
-
-#include "str_trim.h"
-
 #include "emfat.h"
 #include "emfat1.h"
 
-static void separator(std::ostream &os) { os << std::endl; }
+#include "batch.h"
+#include "compact.h"
+#include "fat_dump.h"
+#include "fat_find.h"
+#include "host_tree.h"
+#include "merkle.h"
+#include "mkimage.h"
+#include "nbd_server.h"
+#include "query_server.h"
+#include "quick_check.h"
+#include "synth_image.h"
+#include "timeline.h"
+#include "trim_copy.h"
+#include "watch.h"
+#include "whois.h"
+
+static NbdServer *nbd_server = nullptr;
+
+static void stop_nbd_server(int) {
+  if (nbd_server != nullptr) {
+    nbd_server->stop();
+  }
+}
 
-template <typename T = uint8_t>
-static auto dump_bytes(const T *p, size_t count) {
-  std::stringstream ss;
+static int serve_nbd(const Options::Nbd &options) {
+  HostTree tree;
+  std::error_code err;
+  if (!tree.scan(options.dir, options.writable, err)) {
+    std::cerr << "Failed to scan " << options.dir << ": " << err.message()
+              << std::endl;
+    return -1;
+  }
+  for (auto &path : tree.skipped()) {
+    std::cerr << "Skipped " << path << std::endl;
+  }
 
-  ss << '[';
-  for (size_t i = 0; i < count; ++i) {
-    ss << "0x" << std::hex << (uint64_t)p[i];
-    if (i < count - 1) {
-      ss << ' ';
-    }
+  auto emfat = std::make_unique<emfat_t>();
+  if (!emfat_init(emfat.get(), options.label.c_str(), tree.entries())) {
+    std::cerr << "Failed to build FAT32 layout" << std::endl;
+    return -1;
   }
-  ss << ']';
 
-  return ss.str();
+  NbdServer server(*emfat, !options.writable, options.threads);
+  nbd_server = &server;
+  std::signal(SIGINT, stop_nbd_server);
+  std::signal(SIGTERM, stop_nbd_server);
+
+  std::cerr << "Serving " << tree.file_count() << " files ("
+            << emfat->vol_size << " bytes volume) on " << options.socket
+            << std::endl;
+  server.serve(options.socket, err);
+  nbd_server = nullptr;
+  if (err) {
+    std::cerr << "Failed to serve on " << options.socket << ": "
+              << err.message() << std::endl;
+    return -1;
+  }
+  return 0;
 }
 
-static auto dump_mbr(const mio::mmap_source &mapping, std::ostream &os) {
-  using std::endl;
-
-  auto mbr = reinterpret_cast<const mbr_t *>(&mapping[0]);
-
-  std::vector<uint32_t> res;
-
-  os << "MBR:" << endl
-     << ".DiskSig=" << mbr->DiskSig
-     << " .BootSignature=" << dump_bytes(mbr->BootSignature, 2) << endl
-     << "MBR partitions:" << endl;
-  auto p = std::cbegin(mbr->PartTable);
-  for (int i = 0; i < 4; ++i, ++p) {
-    os << "#:" << i << ":"
-       << " .status=" << (int)p->status << " .start(HSC)=("
-       << (int)p->start_head << ", " << (int)p->start_sector << ", "
-       << (int)p->start_cylinder << ") "
-       << " .PartType=0x" << std::hex << (int)p->PartType << std::dec
-       << " .end(HSC)=(" << (int)p->end_head << ", " << (int)p->end_sector
-       << ", " << (int)p->end_cylinder << ") "
-       << " .StartLBA=" << p->StartLBA << " .SizeLBA=" << p->SizeLBA << endl;
-
-    if (p->StartLBA != 0) {
-      res.emplace_back(p->StartLBA);
-    }
+static QueryServer *query_server = nullptr;
+
+static void stop_query_server(int) {
+  if (query_server != nullptr) {
+    query_server->stop();
   }
-  return res;
 }
 
-static auto dump_boot_sect(int id, const mio::mmap_source &mapping,
-                           uint32_t file_offset, std::ostream &os) {
-  using std::endl;
-
-  auto boot_sect = reinterpret_cast<const boot_sector *>(&mapping[0]);
-
-  os << "boot_sector at offset 0x" << std::hex << file_offset << " :"
-     << std::dec << endl
-     << "\t.jump[JUMP_INS_LEN] = " << dump_bytes(boot_sect->jump, JUMP_INS_LEN)
-     << endl
-     << "\t.OEM_name[OEM_NAME_LEN] = \""
-     << std::string((const char *)boot_sect->OEM_name, OEM_NAME_LEN) << "\""
-     << endl
-     << "\t.bytes_per_sec = " << boot_sect->bytes_per_sec
-     << " # Размер сектора в байтах" << endl
-     << "\t.sec_per_clus = " << (int)boot_sect->sec_per_clus << endl
-     << "\t.reserved_sec_cnt = " << boot_sect->reserved_sec_cnt
-     << " # зарезервированых секторов между началом раздела и первой копией FAT"
-     << endl
-     << "\t.fat_cnt = " << (int)boot_sect->fat_cnt << endl
-     << "\t.root_dir_max_cnt = " << boot_sect->root_dir_max_cnt
-     << " # Для FAT32 0, иначе - количество записей в корневом каталоге" << endl
-     << "\t.tot_sectors = " << boot_sect->tot_sectors << endl
-     << "\t.media_desc = 0x" << std::hex << (int)boot_sect->media_desc
-     << std::dec << " # 0xF8 - HDD, 0xF0 - Floppy" << endl
-     << "\t.sec_per_fat_fat16 = " << boot_sect->sec_per_fat_fat16 << endl
-     << "\t.sec_per_track = " << boot_sect->sec_per_track << endl
-     << "\t.number_of_heads = " << boot_sect->number_of_heads << endl
-     << "\t.hidden_sec_cnt = " << boot_sect->hidden_sec_cnt
-     << " # Число скрытых секторов перед разделом" << endl
-     << "\t.tol_sector_cnt = " << boot_sect->tol_sector_cnt
-     << " # Всего секторов в разделе" << endl
-     << "\t.sectors_per_fat = " << boot_sect->sectors_per_fat
-     << " # Cколько секторов занимает 1 копия FAT" << endl
-     << "\t.ext_flags = " << boot_sect->ext_flags << endl
-     << "\t.fs_version[FS_VER_LEN] = "
-     << dump_bytes(boot_sect->fs_version, FS_VER_LEN) << endl
-
-     << "\t.root_dir_strt_cluster = " << boot_sect->root_dir_strt_cluster
-     << " # Первый КЛАСТЕР корневого каталога ("
-     << boot_sect->root_dir_strt_cluster << "cls *"
-     << (int)boot_sect->sec_per_clus << "sec/cls = "
-     << boot_sect->root_dir_strt_cluster * (int)boot_sect->sec_per_clus
-     << "sec)" << endl
-
-     << "\t.fs_info_sector = " << boot_sect->fs_info_sector
-     << " # Сектор, в котором лежит fsinfo (0x" << std::hex << file_offset
-     << " + 0x" << boot_sect->bytes_per_sec << " * "
-     << boot_sect->fs_info_sector << " = 0x"
-     << (file_offset + boot_sect->bytes_per_sec * boot_sect->fs_info_sector)
-     << std::dec << endl
-
-     << "\t.backup_boot_sector = " << boot_sect->backup_boot_sector
-     << " # Сектор в котором лежит бакап MBR (0 - откл.)"
-     << endl
-
-     //<< "\t.reserved[RESERV_LEN] = "
-     //<< dump_bytes(boot_sect->reserved, RESERV_LEN) << endl
-
-     << "\t.drive_number = 0x" << std::hex << (int)boot_sect->drive_number
-     << std::dec
-     << endl
-
-     //<< "\t.reserved1 = " << dump_bytes(&boot_sect->reserved1, 1) << endl
-     << "\t.boot_sig = 0x" << std::hex << (int)boot_sect->boot_sig << std::dec
-     << endl
-     << "\t.volume_id[VOL_ID_LEN] = "
-     << dump_bytes(boot_sect->volume_id, VOL_ID_LEN) << endl
-     << "\t.volume_label[VOL_LABEL_LEN] = \""
-     << std::string((const char *)boot_sect->volume_label, VOL_LABEL_LEN)
-     << "\"" << endl
-     << "\t.file_system_type[FILE_SYS_TYPE_LENGTH] = \""
-     << std::string((const char *)boot_sect->file_system_type,
-                    FILE_SYS_TYPE_LENGTH)
-     << "\"" << endl
-     << endl;
-
-  size_t first_fat_sector = boot_sect->reserved_sec_cnt;
-
-  std::vector<uint32_t> fat_sectors_offsets;
-  for (auto i = (uint8_t)0; i < boot_sect->fat_cnt; ++i) {
-    auto s = first_fat_sector + boot_sect->sectors_per_fat * i;
-    os << "FAT" << i + 1 << " sector: " << s << std::hex << " (offset: 0x"
-       << file_offset + s * boot_sect->bytes_per_sec << ")" << std::dec << endl;
-    fat_sectors_offsets.emplace_back(s);
-  }
-
-  auto root_dir = *fat_sectors_offsets.crbegin() + boot_sect->sectors_per_fat;
-
-  os << "Root dir sector:" << root_dir << std::hex << " (offset: 0x"
-     << file_offset + root_dir * boot_sect->bytes_per_sec << ")" << std::dec
-     << endl;
-
-  return std::make_tuple(boot_sect->fs_info_sector, fat_sectors_offsets,
-                         boot_sect->sectors_per_fat, root_dir);
+static int run_daemon(const Options::Daemon &options, bool print_stats) {
+  auto start = std::chrono::steady_clock::now();
+  QueryServer server(options.threads);
+  std::error_code err;
+  for (auto &file : options.files) {
+    if (!server.add_image(file, err)) {
+      std::cerr << "Failed to map " << file << ": " << err.message()
+                << std::endl;
+      return -1;
+    }
+    if (err) {
+      std::cerr << file << ": partition table: " << err.message()
+                << std::endl;
+    }
+  }
+  if (server.volume_count() == 0) {
+    std::cerr << "No FAT partition to serve" << std::endl;
+    return -1;
+  }
+  if (print_stats) {
+    std::cerr << "Indexed in "
+              << std::chrono::duration<double>(
+                     std::chrono::steady_clock::now() - start)
+                     .count()
+              << " s" << std::endl;
+  }
+
+  query_server = &server;
+  std::signal(SIGINT, stop_query_server);
+  std::signal(SIGTERM, stop_query_server);
+
+  std::cerr << "Serving " << server.volume_count() << " volumes, "
+            << server.entry_count() << " entries, on " << options.socket
+            << std::endl;
+  server.serve(options.socket, err);
+  query_server = nullptr;
+  if (err) {
+    std::cerr << "Failed to serve on " << options.socket << ": "
+              << err.message() << std::endl;
+    return -1;
+  }
+  return 0;
 }
 
-static void dump_fsinfo(const mio::mmap_source &mapping, uint32_t offset,
-                        std::ostream &os) {
-  using std::endl;
-
-  auto fsinfo = reinterpret_cast<const fsinfo_t *>(&mapping[0]);
-
-  os << "fsinfo at offset 0x" << std::hex << offset << " :" << endl
-     << "\t.signature1 = 0x" << fsinfo->signature1 << endl
-     << "\t.signature2 = 0x" << fsinfo->signature2 << endl
-     << "\t.free_clusters = " << std::dec << fsinfo->free_clusters << endl
-     << "\t.next_cluster = " << fsinfo->next_cluster
-     << endl
-     //<< "\t.reserved2[3] = " << dump_bytes(fsinfo->reserved2, 3) << endl
-     << "\t.signature3 = 0x" << std::hex << fsinfo->signature3 << endl
-     << std::dec << endl;
+static int make_image(const Options::MkImage &options) {
+  HostTree tree;
+  std::error_code err;
+  if (!tree.scan(options.dir, false, err)) {
+    std::cerr << "Failed to scan " << options.dir << ": " << err.message()
+              << std::endl;
+    return -1;
+  }
+  for (auto &path : tree.skipped()) {
+    std::cerr << "Skipped " << path << std::endl;
+  }
+
+  auto emfat = std::make_unique<emfat_t>();
+  if (!emfat_init(emfat.get(), options.label.c_str(), tree.entries())) {
+    std::cerr << "Failed to build FAT32 layout" << std::endl;
+    return -1;
+  }
+
+  MkImageStats stats;
+  if (!mkimage(tree, *emfat, options.out, options.threads, stats, err)) {
+    std::cerr << "Failed to write " << options.out << ": " << err.message()
+              << std::endl;
+    return -1;
+  }
+
+  std::cout << options.out << ": " << emfat->vol_size << " bytes, "
+            << stats.files << " files, " << stats.data_bytes
+            << " bytes of data, " << stats.metadata_bytes
+            << " bytes of metadata" << std::endl;
+  return 0;
 }
 
-static void dump_fat(const mio::mmap_source &cluster_chains, uint32_t offset,
-                     const mio::mmap_source &data, uint32_t data_offset,
-                     std::ostream &os) {
-  using std::endl;
+static int make_synth(const Options::Synth &options) {
+  SynthSpec spec;
+  spec.seed = options.seed;
+  spec.sectors_per_cluster = (uint8_t)options.sectors_per_cluster;
+  spec.fat_bits = options.fat;
+  spec.root_entries = options.root_entries;
+  spec.clusters = options.clusters;
+  if (options.size_mb) {
+    spec.clusters = (uint32_t)std::min<uint64_t>(
+        options.size_mb * 1024 * 1024 / (options.sectors_per_cluster * SECT),
+        UINT32_MAX);
+  }
+  spec.files_per_dir = options.files;
+  spec.dirs_per_dir = options.dirs;
+  spec.depth = options.depth;
+  spec.mean_file_clusters = options.mean_size;
+  spec.fragmentation = options.fragmentation;
+  spec.bad_clusters = options.bad;
+  spec.cross_links = options.cross_links;
+  spec.loops = options.loops;
+  spec.lost_chains = options.lost;
+  spec.long_names = options.long_names;
+  spec.label = options.label;
+
+  SynthStats stats;
+  std::error_code err;
+  if (options.sectors_per_cluster > 128 ||
+      !synth_image(spec, options.out, stats, err)) {
+    std::cerr << "Failed to generate " << options.out << ": "
+              << (err ? err.message() : "bad cluster size") << std::endl;
+    return -1;
+  }
 
-  static constexpr uint32_t END = 0x0fffffff;
-  static constexpr uint32_t BROCKEN = 0x0ffffff7;
+  std::cout << options.out << ": " << stats.volume_size << " bytes, "
+            << stats.files << " files, " << stats.dirs << " directories, "
+            << stats.used_clusters << " clusters in " << stats.fragments
+            << " fragments, " << stats.bytes_written << " bytes written"
+            << std::endl;
+  return 0;
+}
 
-  const auto cluster_chain_base = (uint32_t *)&cluster_chains[0];
+static int run_compact(const Options::Compact &options, bool print_stats) {
+  auto start = std::chrono::steady_clock::now();
+  CompactStats stats;
+  std::error_code err;
+  if (!compact_image(options.in, options.out, options.partition, stats,
+                     err)) {
+    std::cerr << "Failed to compact " << options.in << " into "
+              << options.out << ": " << err.message() << std::endl;
+    return -1;
+  }
+  if (stats.volumes == 0) {
+    std::cerr << "No FAT partition to compact, copied as it is"
+              << std::endl;
+  }
 
-  auto print_claster_chain =
-      [cluster_chain_base](uint32_t current_claster) -> std::string {
-    std::stringstream ss;
-    uint32_t next_claster = cluster_chain_base[current_claster];
-    while (true) {
-      if (next_claster == END) {
-        ss << current_claster << " <END>" << endl;
-        break;
-      }
-      if (next_claster == BROCKEN) {
-        ss << current_claster << "<brocken>" << endl;
-        break;
-      }
+  std::cout << options.out << ": " << stats.volumes << " volumes, "
+            << stats.files << " files, " << stats.dirs << " directories, "
+            << stats.clusters << " clusters in " << stats.fragments
+            << " fragments moved into " << stats.extents << ", "
+            << stats.bytes_written << " bytes written" << std::endl;
+  if (stats.truncated) {
+    std::cerr << stats.truncated
+              << " files had a chain shorter than their size and were cut "
+                 "to it"
+              << std::endl;
+  }
+  if (print_stats) {
+    auto seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+    std::cerr << "Written in " << seconds << " s, "
+              << stats.bytes_written / seconds / (1024 * 1024) << " MiB/s"
+              << std::endl;
+  }
+  return 0;
+}
+
+static int run_trim_copy(const Options::TrimCopy &options, bool print_stats) {
+  auto start = std::chrono::steady_clock::now();
+  TrimStats stats;
+  std::error_code err;
+  bool ok = options.punch
+                ? trim_in_place(options.in, options.partition, stats, err)
+                : trim_copy(options.in, options.out, options.partition,
+                            stats, err);
+  if (!ok) {
+    std::cerr << "Failed to trim " << options.in
+              << (options.punch ? "" : " into " + options.out) << ": "
+              << err.message() << std::endl;
+    return -1;
+  }
+  if (stats.volumes == 0) {
+    std::cerr << "No FAT partition to trim" << std::endl;
+  }
 
-      ss << current_claster << " -> ";
+  std::cout << (options.punch ? options.in : options.out) << ": "
+            << stats.volumes << " volumes, " << stats.free << " of "
+            << stats.clusters << " clusters free, " << stats.bytes_free
+            << " bytes " << (options.punch ? "punched" : "left out");
+  if (!options.punch) {
+    std::cout << ", " << stats.bytes_copied << " bytes copied in "
+              << stats.extents << " runs";
+  }
+  std::cout << std::endl;
+  if (print_stats) {
+    std::cerr << "Done in "
+              << std::chrono::duration<double>(
+                     std::chrono::steady_clock::now() - start)
+                     .count()
+              << " s" << std::endl;
+  }
+  return 0;
+}
 
-      current_claster = next_claster;
-      next_claster = cluster_chain_base[next_claster];
-    }
-    return ss.str();
-  };
+static int run_index(const Options::Index &options, bool print_stats) {
+  auto start = std::chrono::steady_clock::now();
+  auto out = options.out.empty() ? options.file + ".merkle" : options.out;
+  MerkleStats stats;
+  std::error_code err;
+  if (!merkle_index(options.file, out, options.threads, stats, err)) {
+    std::cerr << "Failed to index " << options.file << " into " << out
+              << ": " << err.message() << std::endl;
+    return -1;
+  }
 
-  os << "FAT at offset 0x" << std::hex << offset << " :" << endl;
-  os << "Reserved: " << dump_bytes((uint8_t *)&cluster_chains[0], 4) << ", "
-     << dump_bytes((uint8_t *)&cluster_chains[4], 4) << endl;
+  std::cout << out << ": " << stats.volumes << " volumes, " << stats.regions
+            << " regions, " << stats.leaves << " leaves, "
+            << stats.zero_leaves << " of them zeroes, " << stats.index_size
+            << " bytes, root " << stats.root << std::endl;
+  if (print_stats) {
+    auto seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+    std::cerr << "Hashed in " << seconds << " s, " << stats.bytes_read
+              << " bytes read, "
+              << stats.bytes_read / seconds / (1024 * 1024) << " MiB/s"
+              << std::endl;
+  }
+  return 0;
+}
 
-  os << "Root dir in clasters: " << print_claster_chain(3) << endl;
+// 0 - the image is as indexed, 1 - it is not
+static int run_verify(const Options::Verify &options, bool print_stats) {
+  auto start = std::chrono::steady_clock::now();
+  auto index =
+      options.index.empty() ? options.file + ".merkle" : options.index;
+  MerkleReport report;
+  std::error_code err;
+  if (!merkle_verify(options.file, index, options.threads, report, err)) {
+    std::cerr << "Failed to verify " << options.file << " against " << index
+              << ": " << err.message() << std::endl;
+    return -1;
+  }
 
-  auto decode_attr = [](uint8_t attr) -> std::string {
-    std::stringstream ss;
-    if (attr & (1 << 5)) {
-      ss << "Archive";
+  if (report.match()) {
+    std::cout << options.file << ": matches " << index << ", root "
+              << report.stats.root << std::endl;
+  } else {
+    std::cout << options.file << ": differs from " << index << ", root "
+              << report.stats.root << ", indexed " << report.indexed_root
+              << std::endl;
+    if (report.image_size != report.indexed_size) {
+      std::cout << "  size " << report.image_size << ", indexed "
+                << report.indexed_size << std::endl;
     }
-    if (attr & (1 << 4)) {
-      ss << " | Dir";
+    for (auto &diff : report.diffs) {
+      std::cout << "  " << diff.region << " at 0x" << std::hex << diff.offset
+                << std::dec << ", " << diff.size << " bytes";
+      if (!diff.what.empty()) {
+        std::cout << ": " << diff.what;
+      }
+      std::cout << std::endl;
     }
-    if (attr & (1 << 3)) {
-      ss << " | VolID";
+    std::cout << "  " << report.leaves_differ << " of "
+              << report.stats.leaves << " leaves differ, found in "
+              << report.comparisons << " comparisons" << std::endl;
+  }
+  if (print_stats) {
+    auto seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+    std::cerr << "Verified in " << seconds << " s, "
+              << report.stats.bytes_read << " bytes read, "
+              << report.stats.zero_leaves << " zero leaves" << std::endl;
+  }
+  return report.match() ? 0 : 1;
+}
+
+static bool read_manifest(std::istream &is, std::vector<std::string> &files) {
+  std::string line;
+  while (std::getline(is, line)) {
+    if (!line.empty() && line.back() == '\r') {
+      line.pop_back();
     }
-    if (attr & (1 << 2)) {
-      ss << " | Sys";
+    if (!line.empty() && line[0] != '#') {
+      files.emplace_back(line);
     }
-    if (attr & (1 << 1)) {
-      ss << " | Hidden";
+  }
+  return !is.bad();
+}
+
+static int run_batch(const Options::Batch &options) {
+  auto files = options.files;
+  if (!options.manifest.empty()) {
+    std::ifstream manifest;
+    if (options.manifest != "-") {
+      manifest.open(options.manifest);
     }
-    if (attr & (1 << 0)) {
-      ss << " | RO";
+    auto &is = options.manifest == "-" ? std::cin : manifest;
+    if (!is || !read_manifest(is, files)) {
+      std::cerr << "Failed to read " << options.manifest << std::endl;
+      return -1;
     }
-    return ss.str();
-  };
-
-  auto print_file_info = [&os, decode_attr, &print_claster_chain](
-                             auto f, uint32_t offset, std::string name) {
-    if (f->attr == 0x0f) {
-      os << "> Long file record at 0x" << std::hex << offset << std::dec
-         << ", skip" << endl;
-    } else {
-      auto claster = ((uint32_t)f->strt_clus_hword) << 16 | f->strt_clus_lword;
-      if (f->name[0] == 0x05) {
-        os << "Deleted file ?" << name.erase(0) << " at 0x" << std::hex
-           << offset << std::dec << ": " << endl;
-      } else {
-        os << "File " << name << " at 0x" << std::hex << offset << std::dec
-           << ": " << endl;
-      }
+  }
 
-      os << "\t.attr = " << decode_attr(f->attr) << endl
-         << "\t.crt_time_tenth = " << (int)f->crt_time_tenth << endl
-         << "\t.crt_time = " << f->crt_time << endl
-         << "\t.crt_date = " << f->crt_date << endl
-         << "\t.lst_access_date = " << f->lst_access_date << endl
-         << "\t.strt_clus_hword = " << f->strt_clus_hword << endl
-         << "\t.lst_mod_time = " << f->lst_mod_time << endl
-         << "\t.lst_mod_date = " << f->lst_mod_date << endl
-         << "\t.strt_clus_lword = " << f->strt_clus_lword << endl
-         << "\t.size = " << f->size << endl
-
-         << "\t ->strt_clus = " << claster << endl;
-
-      if (f->attr & (1 << 3)) {
-        separator(os);
-        return;
+  auto start = std::chrono::steady_clock::now();
+  if (options.quick) {
+    auto reports = quick_check_images(files, options.threads);
+    auto seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+    Verdict worst;
+    if (options.out.empty()) {
+      worst = write_quick_reports(reports, seconds, std::cout);
+    } else {
+      std::ofstream os(options.out);
+      worst = write_quick_reports(reports, seconds, os);
+      if (!os) {
+        std::cerr << "Failed to write " << options.out << std::endl;
+        return -1;
       }
+    }
+    return verdict_exit_code(worst);
+  }
 
-      os << "\t> Claster chain: " << print_claster_chain(claster);
+  auto reports = inspect_images(files, options.threads);
+  auto seconds = std::chrono::duration<double>(
+                     std::chrono::steady_clock::now() - start)
+                     .count();
+
+  size_t failed;
+  if (options.out.empty()) {
+    failed = write_report(reports, seconds, std::cout);
+  } else {
+    std::ofstream os(options.out);
+    failed = write_report(reports, seconds, os);
+    if (!os) {
+      std::cerr << "Failed to write " << options.out << std::endl;
+      return -1;
     }
+  }
 
-    separator(os);
-  };
+  std::cerr << reports.size() << " images, " << failed << " with errors, "
+            << seconds << " s" << std::endl;
+  return failed ? -1 : 0;
+}
 
-  // files
-  auto f = (const dir_entry *)&data[0];
+static void print_long(const fat32::Entry &e, std::ostream &os) {
+  auto &raw = e.raw();
+  const char letters[] = "rhsvda";
+  for (int bit = 0; bit < 6; ++bit) {
+    os << (raw.attr & (1 << bit) ? letters[bit] : '-');
+  }
+  unsigned date = raw.lst_mod_date, time = raw.lst_mod_time;
+  os << std::setw(11) << e.size() << ' ' << std::setfill('0')
+     << (date >> 9) + 1980 << '-' << std::setw(2) << (date >> 5 & 0xf) << '-'
+     << std::setw(2) << (date & 0x1f) << ' ' << std::setw(2) << (time >> 11)
+     << ':' << std::setw(2) << (time >> 5 & 0x3f) << ':' << std::setw(2)
+     << (time & 0x1f) * 2 << std::setfill(' ') << ' ';
+}
 
-  while (true) {
-    if (*f->name == '\0' && *f->extn == '\0') {
-      break;
-    }
+static int run_find(const Options::Find &options, bool print_stats) {
+  FindQuery query;
+  query.name = options.name;
+  query.path = options.path;
+  query.min_size = options.min_size;
+  query.max_size = options.max_size;
+  query.newer = options.newer;
+  query.older = options.older;
+  query.attr = options.attr;
+  query.not_attr = options.not_attr;
+  query.type = options.type.empty() ? 0 : options.type[0];
+  query.max_depth = options.max_depth;
+
+  FindFilter filter;
+  std::string error;
+  if (options.type.size() > 1 || !filter.compile(query, error)) {
+    std::cerr << "Invalid condition: "
+              << (error.empty() ? "bad type: " + options.type : error)
+              << std::endl;
+    return -1;
+  }
 
-    auto name = trim_copy(std::string((char *)f->name, FILE_NAME_SHRT_LEN));
-    auto ext = trim_copy(std::string((char *)f->extn, FILE_NAME_EXTN_LEN));
-    if (!ext.empty()) {
-      name += "." + ext;
-    }
+  fat32::Image image;
+  std::error_code err;
+  if (!image.open(options.file, err)) {
+    std::cerr << "Failed to map file: " << err.message() << std::endl;
+    return -1;
+  }
 
-    print_file_info(f, data_offset, name);
-    ++f;
-    data_offset += sizeof(dir_entry);
+  auto opened = image.volumes(options.partition, err);
+  if (err) {
+    std::cerr << "Partition table: " << err.message() << std::endl;
   }
-}
 
-int main(int argc, char *argv[]) {
-  Options options;
-  {
-    auto ret = parseArguments(argc, argv, options);
-    if (ret || options.file.empty()) {
-      return ret;
+  std::vector<std::pair<int, fat32::Volume>> volumes;
+  for (auto &v : opened) {
+    int i = (int)v.partition.index;
+    if (v.err) {
+      std::cerr << "Partition #" << i << ": " << v.err.message() << std::endl;
+      continue;
     }
+    volumes.emplace_back(i, v.volume);
+  }
+  if (volumes.empty()) {
+    std::cerr << "No FAT32 partition to search" << std::endl;
+    return -1;
   }
 
-  std::vector<uint32_t> parts;
-  {
-    std::error_code err;
-    mio::mmap_source mapping;
-    mapping.map(options.file, 0, sizeof(mbr_t), err);
-    if (err.value()) {
-      std::cerr << "Failed to map file: " << err.message() << std::endl;
-      return -1;
+  FindStats stats;
+  uint64_t found = 0;
+  for (auto &v : volumes) {
+    // partition prefix only when the output could mix several
+    std::string prefix =
+        volumes.size() > 1 ? std::to_string(v.first) + ":/" : "/";
+    auto print = [&](const fat32::Entry &e, const std::string &path) {
+      if (options.long_format) {
+        print_long(e, std::cout);
+      }
+      std::cout << prefix << path << '\n';
+      return options.limit == 0 || ++found < options.limit;
+    };
+    if (options.threads == 1 && !options.unordered) {
+      filter.run(
+          v.second,
+          [&](const fat32::TreeIterator &it, const std::string &path) {
+            return print(*it, path);
+          },
+          &stats);
+    } else {
+      WalkOptions walk;
+      walk.threads = options.threads;
+      walk.ordered = !options.unordered;
+      filter.run_parallel(
+          v.second, v.second.root_cluster(), walk,
+          [&](const WalkEntry &entry, const std::string &path) {
+            return print(entry.entry(), path);
+          },
+          &stats);
+    }
+    if (options.limit != 0 && found >= options.limit) {
+      break;
     }
-    parts = dump_mbr(mapping, std::cout);
   }
-  separator(std::cout);
+  std::cout.flush();
 
-  int i = 0;
-  for (auto &startlba : parts) {
-    std::cout << "Partition #" << i << std::endl;
+  if (print_stats) {
+    std::cerr << stats.matches << " matches, " << stats.entries
+              << " entries in " << stats.dirs << " directories read, "
+              << stats.pruned << " directories pruned, " << stats.decoded
+              << " names decoded" << std::endl;
+  }
+  return 0;
+}
 
-    std::error_code err;
-    mio::mmap_source mapping;
-    mapping.map(options.file, startlba * SECT, sizeof(boot_sector), err);
-    if (err.value()) {
-      std::cerr << "Failed to map boot_sector: " << err.message() << std::endl;
-      return -1;
-    }
+static int run_timeline(const Options::Timeline &options, bool print_stats) {
+  auto start = std::chrono::steady_clock::now();
+  fat32::Image image;
+  std::error_code err;
+  if (!image.open(options.file, err)) {
+    std::cerr << "Failed to map file: " << err.message() << std::endl;
+    return -1;
+  }
 
-    auto [fsinfo_sec, fat_offsets, fat_size, root_dir] =
-        dump_boot_sect(i, mapping, startlba * SECT, std::cout);
+  auto opened = image.volumes(options.partition, err);
+  if (err) {
+    std::cerr << "Partition table: " << err.message() << std::endl;
+  }
 
-    separator(std::cout);
-    mapping.map(options.file, (startlba + fsinfo_sec) * SECT, sizeof(fsinfo_t),
-                err);
-    if (err.value()) {
-      std::cerr << "Failed to map fsinfo_t: " << err.message() << std::endl;
-      return -1;
+  Timeline timeline;
+  size_t volumes = 0;
+  for (auto &v : opened) {
+    int i = (int)v.partition.index;
+    if (v.err) {
+      std::cerr << "Partition #" << i << ": " << v.err.message() << std::endl;
+      continue;
     }
-    dump_fsinfo(mapping, (startlba + 1) * SECT, std::cout);
+    timeline.add(v.volume, i);
+    ++volumes;
+  }
+  if (volumes == 0) {
+    std::cerr << "No FAT partition to read" << std::endl;
+    return -1;
+  }
 
-    mio::mmap_source data_mapping;
-    data_mapping.map(options.file, (startlba + root_dir) * SECT, SECT * 4, err);
-    if (err.value()) {
-      std::cerr << "Failed to map data region: " << err.message() << std::endl;
+  auto collected = std::chrono::steady_clock::now();
+  timeline.sort(options.threads);
+  auto sorted = std::chrono::steady_clock::now();
+
+  auto format = options.format == "ndjson" ? TimelineFormat::Ndjson
+                                           : TimelineFormat::Csv;
+  if (options.out.empty()) {
+    timeline.write(std::cout, format);
+    std::cout.flush();
+  } else {
+    std::ofstream os(options.out, std::ios::binary);
+    timeline.write(os, format);
+    if (!os) {
+      std::cerr << "Failed to write " << options.out << std::endl;
       return -1;
     }
+  }
 
-    for (auto offset : fat_offsets) {
-      separator(std::cout);
-      mapping.map(options.file, (startlba + offset) * SECT, fat_size * SECT,
-                  err);
-      if (err.value()) {
-        std::cerr << "Failed to map FAT at 0x" << std::hex << offset << ":"
-                  << err.message() << std::dec << std::endl;
-        return -1;
-      }
-      dump_fat(mapping, (startlba + offset) * SECT, data_mapping,
-               (startlba + root_dir) * SECT, std::cout);
+  if (print_stats) {
+    using seconds = std::chrono::duration<double>;
+    std::cerr << timeline.events() << " events of " << timeline.entries()
+              << " entries, read in " << seconds(collected - start).count()
+              << " s, sorted in " << seconds(sorted - collected).count()
+              << " s, written in "
+              << seconds(std::chrono::steady_clock::now() - sorted).count()
+              << " s" << std::endl;
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  Options options;
+  {
+    auto ret = parseArguments(argc, argv, options);
+    if (ret) {
+      return ret;
     }
+  }
 
-    separator(std::cout);
-    ++i;
+  switch (options.mode) {
+  case Options::Mode::Nbd:
+    return serve_nbd(options.nbd);
+  case Options::Mode::MkImage:
+    return make_image(options.mkimage);
+  case Options::Mode::Synth:
+    return make_synth(options.synth);
+  case Options::Mode::Batch:
+    return run_batch(options.batch);
+  case Options::Mode::Find:
+    return run_find(options.find, options.stats || options.stats_json);
+  case Options::Mode::Timeline:
+    return run_timeline(options.timeline, options.stats || options.stats_json);
+  case Options::Mode::Whois: {
+    WhoisOptions whois;
+    whois.file = options.whois.file;
+    whois.targets = options.whois.targets;
+    whois.partition = options.whois.partition;
+    whois.unit = options.whois.unit;
+    whois.map = options.whois.map;
+    whois.stats = options.stats || options.stats_json;
+    return whois_image(whois, std::cin, std::cout);
+  }
+  case Options::Mode::Watch: {
+    WatchOptions watch;
+    watch.file = options.watch.file;
+    watch.partition = options.watch.partition;
+    watch.interval_ms = options.watch.interval_ms;
+    watch.settle_ms = options.watch.settle_ms;
+    watch.passes = options.watch.passes;
+    watch.stats = options.stats || options.stats_json;
+    return watch_image(watch, std::cout);
+  }
+  case Options::Mode::Compact:
+    return run_compact(options.compact, options.stats || options.stats_json);
+  case Options::Mode::TrimCopy:
+    return run_trim_copy(options.trim_copy,
+                         options.stats || options.stats_json);
+  case Options::Mode::Index:
+    return run_index(options.index, options.stats || options.stats_json);
+  case Options::Mode::Verify:
+    return run_verify(options.verify, options.stats || options.stats_json);
+  case Options::Mode::Daemon:
+    return run_daemon(options.daemon, options.stats || options.stats_json);
+  case Options::Mode::Dump:
+    break;
+  }
+
+  if (options.quick) {
+    auto report = quick_check(options.file);
+    write_quick_report(report, std::cout);
+    std::cout << std::endl;
+    return verdict_exit_code(report.verdict);
+  }
+
+  DumpStats stats;
+  auto collect = options.stats || options.stats_json;
+  auto ret = dump_image(options.file, std::cout, collect ? &stats : nullptr,
+                        options.threads, options.fat_budget_mb << 20,
+                        (size_t)options.fat_window_kb << 10);
+  if (options.stats) {
+    stats.print(std::cerr);
+  }
+  if (options.stats_json) {
+    stats.print_json(std::cerr);
   }
+  return ret;
 }
@@ -0,0 +1,934 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fat32parse.h"
+#include "merkle.h"
+#include "owner_map.h"
+#include "sha256.h"
+#include "work_pool.h"
+
+namespace {
+
+using Digest = Sha256::Digest;
+// levels[0] are the leaves, the last level is the root
+using Tree = std::vector<std::vector<Digest>>;
+
+enum class Kind : uint8_t { Other, Reserved, Fat, Root, Data };
+
+constexpr uint32_t OTHER_LEAF = 64 * 1024;
+constexpr uint64_t CHUNK_BYTES = 4 * 1024 * 1024;
+constexpr uint32_t NO_PARTITION = 0xffffffff;
+
+constexpr char MAGIC[8] = {'F', 'A', 'T', 'M', 'R', 'K', 'L', 'E'};
+constexpr uint32_t VERSION = 1;
+
+// The sidecar: the header, the records of the chunks in the order they
+// were hashed, then the regions and the chunks pointing at their records
+struct Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t region_count;
+  uint64_t image_size;
+  uint64_t table_offset;
+  uint64_t chunk_count;
+  uint8_t root[32];
+};
+
+struct Region {
+  uint64_t offset; // in the image
+  uint64_t size;
+  uint64_t leaves;
+  uint64_t first_chunk;
+  uint64_t volume;   // offset of the boot sector, 0 for Other
+  uint64_t fat_size; // bytes per FAT copy, for Fat
+  uint32_t leaf_size;
+  uint32_t chunk_leaves; // a power of two
+  uint32_t partition;    // NO_PARTITION for Other
+  Kind kind;
+  uint8_t fat_type; // fat32::FatType
+  uint8_t pad[2];
+  uint8_t root[32];
+
+  uint64_t chunks() const {
+    return (leaves + chunk_leaves - 1) / chunk_leaves;
+  }
+};
+
+// A chunk record is a bit per leaf, set if the leaf is not all zeroes,
+// followed by the hashes of those leaves
+struct Chunk {
+  uint64_t offset; // of the record
+  uint8_t root[32];
+};
+
+static_assert(sizeof(Header) == 72 && sizeof(Region) == 96 &&
+                  sizeof(Chunk) == 40,
+              "sidecar records must have no padding");
+
+// The leaves of one chunk
+struct Leaves {
+  std::vector<Digest> hashes; // zero leaves included
+  std::vector<uint8_t> present;
+};
+
+std::error_code last_error() {
+  return std::error_code(errno, std::system_category());
+}
+
+bool is_zero(const uint8_t *p, size_t size) {
+  return p[0] == 0 && std::equal(p, p + size - 1, p + 1);
+}
+
+bool pwrite_all(int fd, const uint8_t *data, size_t size, uint64_t offset) {
+  while (size) {
+    auto r = ::pwrite(fd, data, size, (off_t)offset);
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r <= 0) {
+      return false;
+    }
+    data += r;
+    size -= r;
+    offset += r;
+  }
+  return true;
+}
+
+// Past the end of the file reads as zeroes
+bool pread_all(int fd, uint8_t *data, size_t size, uint64_t offset) {
+  while (size) {
+    auto r = ::pread(fd, data, size, (off_t)offset);
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r < 0) {
+      return false;
+    }
+    if (r == 0) {
+      std::memset(data, 0, size);
+      return true;
+    }
+    data += r;
+    size -= r;
+    offset += r;
+  }
+  return true;
+}
+
+Digest leaf_hash(const uint8_t *data, size_t size) {
+  const uint8_t tag = 0;
+  Sha256 h;
+  h.update(&tag, 1);
+  h.update(data, size);
+  return h.finish();
+}
+
+Digest node_hash(const Digest &left, const Digest &right) {
+  uint8_t node[1 + 2 * Sha256::SIZE] = {1};
+  std::memcpy(node + 1, left.data(), Sha256::SIZE);
+  std::memcpy(node + 1 + Sha256::SIZE, right.data(), Sha256::SIZE);
+  return Sha256::hash(node, sizeof(node));
+}
+
+Digest zero_leaf(uint32_t size) {
+  // a leaf size per region and the shorter last leaves
+  thread_local std::unordered_map<uint32_t, Digest> known;
+  auto it = known.find(size);
+  if (it == known.end()) {
+    std::vector<uint8_t> zeroes(size);
+    it = known.emplace(size, leaf_hash(zeroes.data(), size)).first;
+  }
+  return it->second;
+}
+
+std::vector<Digest> next_level(const std::vector<Digest> &level) {
+  std::vector<Digest> up((level.size() + 1) / 2);
+  for (size_t i = 0; i + 1 < level.size(); i += 2) {
+    // runs of zero leaves make runs of equal pairs all the way up
+    if (i >= 2 && level[i] == level[i - 2] && level[i + 1] == level[i - 1]) {
+      up[i / 2] = up[i / 2 - 1];
+    } else {
+      up[i / 2] = node_hash(level[i], level[i + 1]);
+    }
+  }
+  if (level.size() % 2) {
+    up.back() = level.back();
+  }
+  return up;
+}
+
+Digest tree_root(std::vector<Digest> level) {
+  if (level.empty()) {
+    return leaf_hash(nullptr, 0);
+  }
+  while (level.size() > 1) {
+    level = next_level(level);
+  }
+  return level[0];
+}
+
+Tree build_tree(std::vector<Digest> leaves) {
+  Tree tree;
+  tree.push_back(std::move(leaves));
+  while (tree.back().size() > 1) {
+    tree.push_back(next_level(tree.back()));
+  }
+  return tree;
+}
+
+// Leaves below node i of level where a and b differ, in order. Both trees
+// have the same shape, so every comparison that finds them equal prunes a
+// subtree.
+void descend(const Tree &a, const Tree &b, size_t level, size_t i,
+             uint64_t &comparisons, std::vector<uint64_t> &out) {
+  ++comparisons;
+  if (a[level][i] == b[level][i]) {
+    return;
+  }
+  if (level == 0) {
+    out.push_back(i);
+    return;
+  }
+  descend(a, b, level - 1, 2 * i, comparisons, out);
+  if (2 * i + 1 < a[level - 1].size()) {
+    descend(a, b, level - 1, 2 * i + 1, comparisons, out);
+  }
+}
+
+void put64(Sha256 &h, uint64_t v) {
+  uint8_t bytes[8];
+  for (int i = 0; i < 8; ++i) {
+    bytes[i] = (uint8_t)(v >> (i * 8));
+  }
+  h.update(bytes, sizeof(bytes));
+}
+
+// The root of the image binds its size and where the regions are
+Digest image_root(uint64_t image_size, const std::vector<Region> &regions) {
+  const uint8_t tag = 2;
+  Sha256 h;
+  h.update(&tag, 1);
+  put64(h, image_size);
+  for (auto &r : regions) {
+    put64(h, r.offset);
+    put64(h, r.size);
+    put64(h, r.leaf_size);
+    put64(h, (uint64_t)r.kind);
+    h.update(r.root, sizeof(r.root));
+  }
+  return h.finish();
+}
+
+std::string hex(const uint8_t *p, size_t size) {
+  static const char digits[] = "0123456789abcdef";
+  std::string s;
+  for (size_t i = 0; i < size; ++i) {
+    s += digits[p[i] >> 4];
+    s += digits[p[i] & 15];
+  }
+  return s;
+}
+
+Region make_region(Kind kind, uint64_t begin, uint64_t end,
+                   uint32_t leaf_size) {
+  Region r{};
+  r.offset = begin;
+  r.size = end - begin;
+  r.leaf_size = leaf_size;
+  r.leaves = (r.size + leaf_size - 1) / leaf_size;
+  r.chunk_leaves = 1;
+  while ((uint64_t)r.chunk_leaves * 2 * leaf_size <= CHUNK_BYTES) {
+    r.chunk_leaves *= 2;
+  }
+  r.kind = kind;
+  r.partition = NO_PARTITION;
+  return r;
+}
+
+// Regions of the FAT volumes of the image, by offset, with what lies
+// between and around them as Other. A volume that overlaps one in front of
+// it is left to the first.
+std::vector<Region> layout(const std::string &path, uint64_t &image_size,
+                           unsigned &volumes, std::error_code &err) {
+  fat32::Image image;
+  if (!image.open(path, err)) {
+    return {};
+  }
+  image_size = image.size();
+  struct Found {
+    uint64_t begin;
+    uint64_t end;
+    std::vector<Region> regions;
+  };
+  std::vector<Found> found;
+  // a table that can not be followed is covered as far as it goes
+  std::error_code table_err;
+  for (auto &opened : image.volumes(-1, table_err)) {
+    if (opened.err) {
+      continue;
+    }
+    auto &v = opened.volume;
+    Found f;
+    f.begin = v.offset();
+    f.end = std::min(v.cluster_offset(v.cluster_count()), image_size);
+    auto add = [&](Kind kind, uint64_t begin, uint64_t end) {
+      end = std::min(end, f.end);
+      if (begin >= end) {
+        return;
+      }
+      auto r = make_region(kind, begin, end, v.cluster_size());
+      r.volume = v.offset();
+      r.partition = opened.partition.index;
+      r.fat_type = (uint8_t)v.fat_type();
+      r.fat_size = (uint64_t)v.fat_sectors() * v.sector_size();
+      f.regions.push_back(r);
+    };
+    add(Kind::Reserved, v.offset(), v.fat_offset(0));
+    add(Kind::Fat, v.fat_offset(0), v.fat_offset(v.fat_copies()));
+    add(Kind::Root, v.fat_offset(v.fat_copies()), v.data_offset());
+    add(Kind::Data, v.data_offset(), f.end);
+    if (!f.regions.empty()) {
+      found.push_back(std::move(f));
+    }
+  }
+  std::sort(found.begin(), found.end(), [](const Found &a, const Found &b) {
+    return a.begin < b.begin;
+  });
+
+  std::vector<Region> regions;
+  uint64_t pos = 0;
+  auto other = [&](uint64_t end) {
+    if (pos < end) {
+      regions.push_back(make_region(Kind::Other, pos, end, OTHER_LEAF));
+    }
+  };
+  for (auto &f : found) {
+    if (f.begin < pos) {
+      continue;
+    }
+    other(f.begin);
+    regions.insert(regions.end(), f.regions.begin(), f.regions.end());
+    pos = f.end;
+    ++volumes;
+  }
+  other(image_size);
+  return regions;
+}
+
+// Hashes the leaves of chunks of the image, from any number of threads
+class Hasher {
+public:
+  explicit Hasher(int fd) : fd_(fd) {}
+
+  bool hash(const Region &r, uint64_t chunk, Leaves &out,
+            std::error_code &err) {
+    auto first = chunk * r.chunk_leaves;
+    auto n = std::min<uint64_t>(r.chunk_leaves, r.leaves - first);
+    auto begin = r.offset + first * r.leaf_size;
+    auto end = std::min(r.offset + r.size, begin + n * r.leaf_size);
+    out.hashes.resize(n);
+    out.present.assign((n + 7) / 8, 0);
+
+    // a hole is zeroes without reading it
+    auto data = ::lseek(fd_, (off_t)begin, SEEK_DATA);
+    bool hole = (data < 0 && errno == ENXIO) ||
+                (data >= 0 && (uint64_t)data >= end);
+    thread_local std::vector<uint8_t> buf;
+    if (!hole) {
+      buf.resize(end - begin);
+      if (!pread_all(fd_, buf.data(), buf.size(), begin)) {
+        err = last_error();
+        return false;
+      }
+      bytes_read += end - begin;
+    }
+
+    uint64_t zero = 0;
+    auto full = zero_leaf(r.leaf_size);
+    for (uint64_t i = 0; i < n; ++i) {
+      auto size = (uint32_t)std::min<uint64_t>(r.leaf_size,
+                                               end - begin - i * r.leaf_size);
+      auto p = buf.data() + i * r.leaf_size;
+      if (hole || is_zero(p, size)) {
+        out.hashes[i] = size == r.leaf_size ? full : zero_leaf(size);
+        ++zero;
+      } else {
+        out.hashes[i] = leaf_hash(p, size);
+        out.present[i / 8] |= (uint8_t)(1 << (i % 8));
+      }
+    }
+    zero_leaves += zero;
+    return true;
+  }
+
+  std::atomic<uint64_t> bytes_read{0};
+  std::atomic<uint64_t> zero_leaves{0};
+
+private:
+  int fd_;
+};
+
+// The first error of any worker, the others stop at their next chunk
+class Failure {
+public:
+  void set(const std::error_code &err) {
+    std::lock_guard<std::mutex> guard(lock_);
+    if (!err_) {
+      err_ = err;
+    }
+    failed_ = true;
+  }
+  bool failed() const { return failed_; }
+  std::error_code error() const { return err_; }
+
+private:
+  std::mutex lock_;
+  std::error_code err_;
+  std::atomic<bool> failed_{false};
+};
+
+struct Sidecar {
+  Header header;
+  std::vector<Region> regions;
+  std::vector<Chunk> chunks;
+};
+
+bool read_sidecar(int fd, Sidecar &s, std::error_code &err) {
+  struct stat st;
+  if (::fstat(fd, &st) != 0) {
+    err = last_error();
+    return false;
+  }
+  auto size = (uint64_t)st.st_size;
+  auto bad = [&]() {
+    err = std::make_error_code(std::errc::bad_message);
+    return false;
+  };
+  if (size < sizeof(Header)) {
+    return bad();
+  }
+  if (!pread_all(fd, (uint8_t *)&s.header, sizeof(Header), 0)) {
+    err = last_error();
+    return false;
+  }
+  auto &h = s.header;
+  if (std::memcmp(h.magic, MAGIC, sizeof(MAGIC)) != 0 ||
+      h.version != VERSION || h.table_offset > size ||
+      h.region_count > (size - h.table_offset) / sizeof(Region) ||
+      h.chunk_count >
+          (size - h.table_offset - h.region_count * sizeof(Region)) /
+              sizeof(Chunk)) {
+    return bad();
+  }
+  s.regions.resize(h.region_count);
+  s.chunks.resize(h.chunk_count);
+  if (!pread_all(fd, (uint8_t *)s.regions.data(),
+                 s.regions.size() * sizeof(Region), h.table_offset) ||
+      !pread_all(fd, (uint8_t *)s.chunks.data(),
+                 s.chunks.size() * sizeof(Chunk),
+                 h.table_offset + s.regions.size() * sizeof(Region))) {
+    err = last_error();
+    return false;
+  }
+  for (auto &r : s.regions) {
+    if (r.leaf_size == 0 || r.chunk_leaves == 0 ||
+        r.leaves != (r.size + r.leaf_size - 1) / r.leaf_size ||
+        r.first_chunk > h.chunk_count ||
+        r.chunks() > h.chunk_count - r.first_chunk ||
+        r.kind > Kind::Data) {
+      return bad();
+    }
+  }
+  return true;
+}
+
+// The stored leaves of a chunk, zero ones filled in
+bool read_chunk(int fd, const Region &r, uint64_t chunk, const Chunk &record,
+                Leaves &out, std::error_code &err) {
+  auto first = chunk * r.chunk_leaves;
+  auto n = std::min<uint64_t>(r.chunk_leaves, r.leaves - first);
+  out.present.resize((n + 7) / 8);
+  if (!pread_all(fd, out.present.data(), out.present.size(), record.offset)) {
+    err = last_error();
+    return false;
+  }
+  std::vector<Digest> stored;
+  for (uint64_t i = 0; i < n; ++i) {
+    if (out.present[i / 8] & (1 << (i % 8))) {
+      stored.emplace_back();
+    }
+  }
+  if (!pread_all(fd, (uint8_t *)stored.data(), stored.size() * Sha256::SIZE,
+                 record.offset + out.present.size())) {
+    err = last_error();
+    return false;
+  }
+  out.hashes.resize(n);
+  size_t next = 0;
+  for (uint64_t i = 0; i < n; ++i) {
+    if (out.present[i / 8] & (1 << (i % 8))) {
+      out.hashes[i] = stored[next++];
+    } else {
+      // only the last leaf of the region can be short
+      auto at = (first + i) * r.leaf_size;
+      out.hashes[i] =
+          zero_leaf((uint32_t)std::min<uint64_t>(r.leaf_size, r.size - at));
+    }
+  }
+  return true;
+}
+
+} // namespace
+
+namespace {
+
+// Says what differing leaves hold now, by the FAT of their volume as it is
+// in the image now; the owner map of a volume is built the first time one
+// of its clusters is asked about
+class Describer {
+public:
+  explicit Describer(const std::string &path) {
+    std::error_code err;
+    if (image_.open(path, err)) {
+      opened_ = image_.volumes(-1, err);
+    }
+  }
+
+  void describe(const Region &r, const std::vector<uint64_t> &leaves,
+                std::vector<MerkleDiff> &diffs) {
+    auto name = r.kind == Kind::Other
+                    ? std::string("other")
+                    : "partition " + std::to_string(r.partition) + " " +
+                          KIND_NAMES[(int)r.kind];
+    // runs of neighbouring leaves, as byte ranges of the region
+    for (size_t i = 0; i < leaves.size();) {
+      auto j = i + 1;
+      while (j < leaves.size() && leaves[j] == leaves[j - 1] + 1) {
+        ++j;
+      }
+      auto begin = leaves[i] * r.leaf_size;
+      auto end = std::min(r.size, (leaves[j - 1] + 1) * r.leaf_size);
+      switch (r.kind) {
+      case Kind::Fat:
+        fat(r, name, begin, end, diffs);
+        break;
+      case Kind::Data:
+        data(r, name, begin, end, diffs);
+        break;
+      case Kind::Root:
+        add(diffs, name, r, begin, end,
+            "root directory slots " + range(begin / sizeof(dir_entry),
+                                            (end - 1) / sizeof(dir_entry)));
+        break;
+      case Kind::Reserved:
+        add(diffs, name, r, begin, end, "boot sector and reserved sectors");
+        break;
+      case Kind::Other:
+        add(diffs, name, r, begin, end, "");
+        break;
+      }
+      i = j;
+    }
+  }
+
+private:
+  static constexpr const char *KIND_NAMES[] = {"other", "reserved", "FAT",
+                                               "root", "data"};
+
+  struct Owners {
+    fat32::Volume volume;
+    OwnerMap map;
+    bool ok = false;
+  };
+
+  static std::string range(uint64_t first, uint64_t last) {
+    return first == last ? std::to_string(first)
+                         : std::to_string(first) + "-" + std::to_string(last);
+  }
+
+  static void add(std::vector<MerkleDiff> &diffs, const std::string &name,
+                  const Region &r, uint64_t begin, uint64_t end,
+                  std::string what) {
+    diffs.push_back({name, r.offset + begin, end - begin, std::move(what)});
+  }
+
+  // nullptr if the volume no longer opens where it was indexed
+  Owners *owners(const Region &r) {
+    auto &o = volumes_[r.volume];
+    if (!o) {
+      o.reset(new Owners);
+      for (auto &v : opened_) {
+        if (!v.err && v.volume.offset() == r.volume) {
+          o->volume = v.volume;
+          o->map.build(o->volume);
+          o->ok = true;
+          break;
+        }
+      }
+    }
+    return o->ok ? o.get() : nullptr;
+  }
+
+  // up to three of the paths of the clusters, and how many more there are
+  static std::string paths(Owners &o, uint32_t first, uint32_t last) {
+    std::vector<uint32_t> entries;
+    for (uint64_t c = first; c <= last; ++c) {
+      auto owner = o.map.owner((uint32_t)c);
+      if (owner == OwnerMap::SHARED) {
+        for (auto e : o.map.owners((uint32_t)c)) {
+          entries.push_back(e);
+        }
+      } else if (owner != OwnerMap::NONE) {
+        entries.push_back(owner);
+      }
+    }
+    std::sort(entries.begin(), entries.end());
+    entries.erase(std::unique(entries.begin(), entries.end()), entries.end());
+    std::string s;
+    for (size_t i = 0; i < entries.size() && i < 3; ++i) {
+      s += (i ? ", " : "") + std::string(o.map.path(entries[i]));
+    }
+    if (entries.size() > 3) {
+      s += " and " + std::to_string(entries.size() - 3) + " more";
+    }
+    return s;
+  }
+
+  void fat(const Region &r, const std::string &name, uint64_t begin,
+           uint64_t end, std::vector<MerkleDiff> &diffs) {
+    auto bits = r.fat_type == (uint8_t)fat32::FatType::Fat12   ? 12
+                : r.fat_type == (uint8_t)fat32::FatType::Fat16 ? 16
+                                                               : 32;
+    auto o = owners(r);
+    // a run can reach from one copy into the next
+    while (begin < end) {
+      auto copy = begin / r.fat_size;
+      auto copy_end = std::min(end, (copy + 1) * r.fat_size);
+      auto first = (begin - copy * r.fat_size) * 8 / bits;
+      auto last = ((copy_end - copy * r.fat_size) * 8 + bits - 1) / bits - 1;
+      // the tail of the last sector holds no entries
+      if (o && first < o->volume.cluster_count()) {
+        last = std::min<uint64_t>(last, o->volume.cluster_count() - 1);
+      }
+      std::string what = "FAT copy " + std::to_string(copy) + " entries " +
+                         range(first, last);
+      auto p = o && last < o->volume.cluster_count()
+                   ? paths(*o, (uint32_t)first, (uint32_t)last)
+                   : std::string();
+      if (!p.empty()) {
+        what += ", chains of " + p;
+      }
+      add(diffs, name, r, begin, copy_end, std::move(what));
+      begin = copy_end;
+    }
+  }
+
+  void data(const Region &r, const std::string &name, uint64_t begin,
+            uint64_t end, std::vector<MerkleDiff> &diffs) {
+    auto first = (uint32_t)(2 + begin / r.leaf_size);
+    auto last = (uint32_t)(2 + (end - 1) / r.leaf_size);
+    auto o = owners(r);
+    if (!o || o->volume.cluster_size() != r.leaf_size ||
+        o->volume.data_offset() != r.offset) {
+      add(diffs, name, r, begin, end,
+          "clusters " + range(first, last) +
+              (o ? ", the volume has another layout now"
+                 : ", the volume does not open"));
+      return;
+    }
+    // split where the owner changes
+    for (auto c = first; c <= last;) {
+      auto owner = o->map.owner(c);
+      auto next = c + 1;
+      while (next <= last && o->map.owner(next) == owner) {
+        ++next;
+      }
+      std::string what = "clusters " + range(c, next - 1);
+      if (owner == OwnerMap::NONE) {
+        what += ", free or lost";
+      } else if (owner == OwnerMap::SHARED) {
+        what += ", cross-linked into " + paths(*o, c, next - 1);
+      } else {
+        what += " of " + std::string(o->map.path(owner));
+      }
+      auto b = (uint64_t)(c - 2) * r.leaf_size;
+      add(diffs, name, r, b,
+          std::min(end, (uint64_t)(next - 2) * r.leaf_size), std::move(what));
+      c = next;
+    }
+  }
+
+  fat32::Image image_;
+  std::vector<fat32::PartitionVolume> opened_;
+  std::map<uint64_t, std::unique_ptr<Owners>> volumes_;
+};
+
+} // namespace
+
+bool merkle_index(const std::string &image, const std::string &index,
+                  unsigned threads, MerkleStats &stats,
+                  std::error_code &err) {
+  err.clear();
+  stats = MerkleStats();
+
+  // truncating the sidecar would empty the image
+  struct stat a, b;
+  if (::stat(image.c_str(), &a) == 0 && ::stat(index.c_str(), &b) == 0 &&
+      a.st_dev == b.st_dev && a.st_ino == b.st_ino) {
+    err = std::make_error_code(std::errc::invalid_argument);
+    return false;
+  }
+
+  uint64_t size = 0;
+  auto regions = layout(image, size, stats.volumes, err);
+  if (err) {
+    return false;
+  }
+  uint64_t chunk_count = 0;
+  for (auto &r : regions) {
+    r.first_chunk = chunk_count;
+    chunk_count += r.chunks();
+    stats.leaves += r.leaves;
+  }
+
+  auto fd = ::open(image.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    err = last_error();
+    return false;
+  }
+  auto out =
+      ::open(index.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (out < 0) {
+    err = last_error();
+    ::close(fd);
+    return false;
+  }
+
+  // records go wherever the next free byte is when their chunk is done
+  std::vector<Chunk> chunks(chunk_count);
+  std::atomic<uint64_t> end{sizeof(Header)};
+  Hasher hasher(fd);
+  Failure failure;
+  {
+    WorkPool pool(threads);
+    for (auto &region : regions) {
+      for (uint64_t c = 0; c < region.chunks(); ++c) {
+        pool.submit([&, r = &region, c]() {
+          if (failure.failed()) {
+            return;
+          }
+          thread_local Leaves leaves;
+          thread_local std::vector<uint8_t> record;
+          std::error_code e;
+          if (!hasher.hash(*r, c, leaves, e)) {
+            failure.set(e);
+            return;
+          }
+          record = leaves.present;
+          for (size_t i = 0; i < leaves.hashes.size(); ++i) {
+            if (leaves.present[i / 8] & (1 << (i % 8))) {
+              record.insert(record.end(), leaves.hashes[i].begin(),
+                            leaves.hashes[i].end());
+            }
+          }
+          auto &chunk = chunks[r->first_chunk + c];
+          chunk.offset = end.fetch_add(record.size());
+          auto root = tree_root(leaves.hashes);
+          std::copy(root.begin(), root.end(), chunk.root);
+          if (!pwrite_all(out, record.data(), record.size(), chunk.offset)) {
+            failure.set(last_error());
+          }
+        });
+      }
+    }
+    pool.wait();
+  }
+
+  bool ok = !failure.failed();
+  err = failure.error();
+  if (ok) {
+    for (auto &r : regions) {
+      std::vector<Digest> roots(r.chunks());
+      for (uint64_t c = 0; c < roots.size(); ++c) {
+        std::copy(chunks[r.first_chunk + c].root,
+                  chunks[r.first_chunk + c].root + Sha256::SIZE,
+                  roots[c].begin());
+      }
+      auto root = tree_root(std::move(roots));
+      std::copy(root.begin(), root.end(), r.root);
+    }
+
+    Header header{};
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.region_count = (uint32_t)regions.size();
+    header.image_size = size;
+    header.table_offset = end;
+    header.chunk_count = chunk_count;
+    auto root = image_root(size, regions);
+    std::copy(root.begin(), root.end(), header.root);
+
+    ok = pwrite_all(out, (const uint8_t *)regions.data(),
+                    regions.size() * sizeof(Region), end) &&
+         pwrite_all(out, (const uint8_t *)chunks.data(),
+                    chunks.size() * sizeof(Chunk),
+                    end + regions.size() * sizeof(Region)) &&
+         pwrite_all(out, (const uint8_t *)&header, sizeof(header), 0);
+    if (!ok) {
+      err = last_error();
+    }
+    stats.root = hex(header.root, sizeof(header.root));
+    stats.index_size = end + regions.size() * sizeof(Region) +
+                       chunks.size() * sizeof(Chunk);
+  }
+  stats.regions = (unsigned)regions.size();
+  stats.zero_leaves = hasher.zero_leaves;
+  stats.bytes_read = hasher.bytes_read;
+
+  ::close(fd);
+  if (::close(out) != 0 && ok) {
+    err = last_error();
+    ok = false;
+  }
+  return ok;
+}
+
+bool merkle_verify(const std::string &image, const std::string &index,
+                   unsigned threads, MerkleReport &report,
+                   std::error_code &err) {
+  err.clear();
+  report = MerkleReport();
+
+  Sidecar sidecar;
+  auto side = ::open(index.c_str(), O_RDONLY | O_CLOEXEC);
+  if (side < 0) {
+    err = last_error();
+    return false;
+  }
+  if (!read_sidecar(side, sidecar, err)) {
+    ::close(side);
+    return false;
+  }
+  auto &regions = sidecar.regions;
+  report.indexed_size = sidecar.header.image_size;
+  report.indexed_root = hex(sidecar.header.root, sizeof(sidecar.header.root));
+
+  auto fd = ::open(image.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0 || ::fstat(fd, &st) != 0) {
+    err = last_error();
+    if (fd >= 0) {
+      ::close(fd);
+    }
+    ::close(side);
+    return false;
+  }
+  report.image_size = (uint64_t)st.st_size;
+
+  // the same chunks again; only the leaves of the ones whose root is not
+  // the stored one are kept for the way down
+  std::vector<Digest> current(sidecar.chunks.size());
+  std::map<uint64_t, Leaves> changed;
+  std::mutex changed_lock;
+  Hasher hasher(fd);
+  Failure failure;
+  {
+    WorkPool pool(threads);
+    for (auto &region : regions) {
+      for (uint64_t c = 0; c < region.chunks(); ++c) {
+        pool.submit([&, r = &region, c]() {
+          if (failure.failed()) {
+            return;
+          }
+          Leaves leaves;
+          std::error_code e;
+          if (!hasher.hash(*r, c, leaves, e)) {
+            failure.set(e);
+            return;
+          }
+          auto g = r->first_chunk + c;
+          current[g] = tree_root(leaves.hashes);
+          if (!std::equal(current[g].begin(), current[g].end(),
+                          sidecar.chunks[g].root)) {
+            std::lock_guard<std::mutex> guard(changed_lock);
+            changed.emplace(g, std::move(leaves));
+          }
+        });
+      }
+    }
+    pool.wait();
+  }
+  bool ok = !failure.failed();
+  err = failure.error();
+
+  // down from each region root to the chunks that differ, and in those
+  // down to the leaves
+  Describer describer(image);
+  auto now = regions;
+  for (size_t ri = 0; ok && ri < regions.size(); ++ri) {
+    auto &r = regions[ri];
+    std::vector<Digest> stored_roots(r.chunks());
+    std::vector<Digest> current_roots(r.chunks());
+    for (uint64_t c = 0; c < r.chunks(); ++c) {
+      auto &chunk = sidecar.chunks[r.first_chunk + c];
+      std::copy(chunk.root, chunk.root + Sha256::SIZE,
+                stored_roots[c].begin());
+      current_roots[c] = current[r.first_chunk + c];
+    }
+    auto stored_tree = build_tree(std::move(stored_roots));
+    auto current_tree = build_tree(std::move(current_roots));
+    auto &root = current_tree.back()[0];
+    std::copy(root.begin(), root.end(), now[ri].root);
+
+    std::vector<uint64_t> chunks;
+    descend(stored_tree, current_tree, stored_tree.size() - 1, 0,
+            report.comparisons, chunks);
+    std::vector<uint64_t> leaves;
+    for (auto c : chunks) {
+      Leaves stored;
+      if (!read_chunk(side, r, c, sidecar.chunks[r.first_chunk + c], stored,
+                      err)) {
+        ok = false;
+        break;
+      }
+      auto a = build_tree(std::move(stored.hashes));
+      auto b = build_tree(std::move(changed[r.first_chunk + c].hashes));
+      std::vector<uint64_t> found;
+      descend(a, b, a.size() - 1, 0, report.comparisons, found);
+      for (auto i : found) {
+        leaves.push_back(c * r.chunk_leaves + i);
+      }
+    }
+    report.leaves_differ += leaves.size();
+    describer.describe(r, leaves, report.diffs);
+  }
+
+  if (ok) {
+    auto root = image_root(report.image_size, now);
+    report.stats.root = hex(root.data(), root.size());
+  }
+  report.stats.regions = (unsigned)regions.size();
+  for (auto &r : regions) {
+    report.stats.leaves += r.leaves;
+    if (r.kind == Kind::Reserved) {
+      ++report.stats.volumes;
+    }
+  }
+  report.stats.zero_leaves = hasher.zero_leaves;
+  report.stats.bytes_read = hasher.bytes_read;
+
+  ::close(fd);
+  ::close(side);
+  return ok;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <system_error>
+#include <vector>
+
+// A Merkle tree of SHA-256 hashes over the whole image, kept in a sidecar
+// file, so a later verify finds what changed without a second copy of the
+// image. The image is cut into regions: per FAT volume its reserved
+// sectors, the FAT copies and the fixed root directory in leaves of a
+// cluster, and its data region in one leaf per cluster; whatever lies
+// outside the volumes, partition tables and gaps, in 64 KiB leaves. Each
+// region has a tree of its own, the root of the image hashes the layout and
+// the region roots.
+//
+// Leaves are hashed as 0x00 | bytes, inner nodes as 0x01 | left | right,
+// with an odd node at the end of a level lifted as it is. Leaves of all
+// zeroes are the common case of free space and sparse images: holes are
+// not read, and the sidecar keeps a bit for them instead of a hash. The
+// other leaves are stored in chunks of about 4 MiB of image, each with the
+// root of its subtree, in the native byte order of the machine that made
+// it.
+
+struct MerkleStats {
+  unsigned volumes = 0;
+  unsigned regions = 0;
+  uint64_t leaves = 0;
+  uint64_t zero_leaves = 0; // hashed without a read when in a hole
+  uint64_t bytes_read = 0;
+  uint64_t index_size = 0; // of the sidecar
+  std::string root;        // hex
+};
+
+// A run of neighbouring leaves of one region that differ
+struct MerkleDiff {
+  std::string region; // "partition 0 data", "other", ...
+  uint64_t offset;    // in the image
+  uint64_t size;
+  // what is in there now, by the FAT: "clusters 10-12 of /DIR/NAME", ...
+  std::string what;
+};
+
+struct MerkleReport {
+  MerkleStats stats; // of the image as it is now
+  std::string indexed_root;
+  uint64_t image_size = 0;
+  uint64_t indexed_size = 0;
+  uint64_t leaves_differ = 0;
+  uint64_t comparisons = 0; // of tree nodes, on the way down to those
+  std::vector<MerkleDiff> diffs;
+
+  bool match() const { return stats.root == indexed_root; }
+};
+
+// Hashes the image with threads workers, 0 - one per core, into a new
+// sidecar at index
+bool merkle_index(const std::string &image, const std::string &index,
+                  unsigned threads, MerkleStats &stats, std::error_code &err);
+
+// Hashes the image again along the regions the sidecar was made with and
+// walks down both trees only where the hashes differ. Differing data
+// clusters and FAT entries are looked up in the FAT as it is now. err is
+// set if the sidecar can not be read or is not one, a mismatch is not an
+// error.
+bool merkle_verify(const std::string &image, const std::string &index,
+                   unsigned threads, MerkleReport &report,
+                   std::error_code &err);
@@ -0,0 +1,231 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "emfat1.h"
+
+#include "host_tree.h"
+#include "mkimage.h"
+
+// sectors generated by emfat per pwrite
+static constexpr uint32_t CHUNK_SECTORS = 2048;
+
+static std::error_code last_error() {
+  return std::error_code(errno, std::system_category());
+}
+
+static uint64_t cluster_offset(const emfat_t &emfat, uint32_t cluster) {
+  return ((uint64_t)emfat.priv.root_lba +
+          (uint64_t)(cluster - 2) * SECT_PER_CLUST) *
+         SECT;
+}
+
+static bool is_zero(const uint8_t *p, size_t size) {
+  return p[0] == 0 && std::equal(p, p + size - 1, p + 1);
+}
+
+static bool pwrite_all(int fd, const uint8_t *data, size_t size,
+                       uint64_t offset) {
+  while (size) {
+    auto r = ::pwrite(fd, data, size, (off_t)offset);
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r <= 0) {
+      return false;
+    }
+    data += r;
+    size -= r;
+    offset += r;
+  }
+  return true;
+}
+
+// Generates sectors [first, first + count) and writes the non-zero ones
+static bool write_generated(const emfat_t &emfat, emfat_cursor_t &cursor,
+                            int fd, uint32_t first, uint32_t count,
+                            uint64_t &written) {
+  std::vector<uint8_t> buf((size_t)std::min(count, CHUNK_SECTORS) * SECT);
+
+  while (count) {
+    auto n = std::min(count, CHUNK_SECTORS);
+    emfat_read_r(&emfat, &cursor, buf.data(), first, (int)n);
+
+    // coalesce non-zero sectors into runs
+    uint32_t run = 0;
+    for (uint32_t i = 0; i <= n; ++i) {
+      if (i < n && !is_zero(&buf[(size_t)i * SECT], SECT)) {
+        continue;
+      }
+      if (i > run) {
+        auto size = (size_t)(i - run) * SECT;
+        if (!pwrite_all(fd, &buf[(size_t)run * SECT], size,
+                        (uint64_t)(first + run) * SECT)) {
+          return false;
+        }
+        written += size;
+      }
+      run = i + 1;
+    }
+
+    first += n;
+    count -= n;
+  }
+  return true;
+}
+
+static std::error_code copy_file(const HostTree::File &f, int out,
+                                 uint64_t offset) {
+  auto in = ::open(f.path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (in < 0) {
+    return last_error();
+  }
+
+  std::error_code err;
+  loff_t in_off = 0;
+  loff_t out_off = (loff_t)offset;
+  size_t left = f.size;
+  bool fallback = false;
+  while (left && !fallback) {
+    auto r = ::copy_file_range(in, &in_off, out, &out_off, left, 0);
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL ||
+                  errno == EOPNOTSUPP)) {
+      fallback = true; // not supported between these files
+    } else if (r < 0) {
+      err = last_error();
+      left = 0;
+    } else if (r == 0) {
+      left = 0; // the file shrank since the scan, the tail stays a hole
+    } else {
+      left -= r;
+    }
+  }
+
+  std::vector<uint8_t> buf(left ? 1024 * 1024 : 0);
+  while (left) {
+    auto r = ::pread(in, buf.data(), std::min(left, buf.size()), in_off);
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r < 0 || (r > 0 && !pwrite_all(out, buf.data(), r, out_off))) {
+      err = last_error();
+      break;
+    }
+    if (r == 0) {
+      break;
+    }
+    in_off += r;
+    out_off += r;
+    left -= r;
+  }
+
+  ::close(in);
+  return err;
+}
+
+bool mkimage(const HostTree &tree, const emfat_t &emfat,
+             const std::string &out, unsigned threads, MkImageStats &stats,
+             std::error_code &err) {
+  err.clear();
+  stats = MkImageStats();
+
+  auto fd = ::open(out.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    err = last_error();
+    return false;
+  }
+  // everything that is not written below reads back as zeroes
+  if (::ftruncate(fd, (off_t)emfat.vol_size) != 0) {
+    err = last_error();
+    ::close(fd);
+    return false;
+  }
+
+  emfat_cursor_t cursor;
+  emfat_cursor_init(&emfat, &cursor);
+
+  // MBR, boot sector, FSInfo and both FATs
+  if (!write_generated(emfat, cursor, fd, 0, emfat.priv.root_lba,
+                       stats.metadata_bytes)) {
+    err = last_error();
+    ::close(fd);
+    return false;
+  }
+
+  std::vector<const emfat_entry_t *> files;
+  for (auto &e : tree.entry_table()) {
+    if (e.name == nullptr) {
+      break;
+    }
+    if (e.dir) {
+      auto first = emfat.priv.root_lba +
+                   (e.priv.first_clust - 2) * SECT_PER_CLUST;
+      auto count =
+          (e.priv.last_clust - e.priv.first_clust + 1) * SECT_PER_CLUST;
+      if (!write_generated(emfat, cursor, fd, first, count,
+                           stats.metadata_bytes)) {
+        err = last_error();
+        ::close(fd);
+        return false;
+      }
+    } else if (e.curr_size) {
+      files.emplace_back(&e);
+    }
+  }
+
+  // largest files first to balance the workers
+  std::sort(files.begin(), files.end(),
+            [](auto a, auto b) { return a->curr_size > b->curr_size; });
+
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  threads = std::min<size_t>(threads, std::max<size_t>(1, files.size()));
+
+  std::atomic<size_t> next{0};
+  std::atomic<uint64_t> copied{0};
+  std::mutex error_lock;
+
+  auto worker = [&]() {
+    for (auto i = next++; i < files.size(); i = next++) {
+      auto &e = *files[i];
+      auto &f = *HostTree::file_of(e);
+      auto copy_err =
+          copy_file(f, fd, cluster_offset(emfat, e.priv.first_clust));
+      if (copy_err) {
+        std::lock_guard<std::mutex> lock(error_lock);
+        if (!err) {
+          err = copy_err;
+        }
+        continue;
+      }
+      copied += f.size;
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (unsigned i = 1; i < threads; ++i) {
+    workers.emplace_back(worker);
+  }
+  worker();
+  for (auto &w : workers) {
+    w.join();
+  }
+
+  stats.data_bytes = copied;
+  stats.files = files.size();
+
+  if (::close(fd) != 0 && !err) {
+    err = last_error();
+  }
+  return !err;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <system_error>
+
+#include "emfat.h"
+
+class HostTree;
+
+struct MkImageStats {
+  uint64_t metadata_bytes = 0;
+  uint64_t data_bytes = 0;
+  size_t files = 0;
+};
+
+// Writes the volume emfat was initialised with from tree into a sparse disk
+// image. Boot sectors, FATs and directories are generated by emfat, file
+// contents are copied from the host files to their clusters with
+// copy_file_range, several files at once. Nothing is written for unused
+// sectors and clusters, they stay holes.
+bool mkimage(const HostTree &tree, const emfat_t &emfat,
+             const std::string &out, unsigned threads, MkImageStats &stats,
+             std::error_code &err);
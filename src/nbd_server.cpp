@@ -0,0 +1,429 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "emfat1.h"
+
+#include "nbd_server.h"
+
+// Protocol constants, see
+// https://github.com/NetworkBlockDevice/nbd/blob/master/doc/proto.md
+static constexpr uint64_t NBD_MAGIC = 0x4e42444d41474943;
+static constexpr uint64_t NBD_IHAVEOPT = 0x49484156454f5054;
+static constexpr uint64_t NBD_OPT_REPLY_MAGIC = 0x3e889045565a9;
+static constexpr uint32_t NBD_REQUEST_MAGIC = 0x25609513;
+static constexpr uint32_t NBD_SIMPLE_REPLY_MAGIC = 0x67446698;
+
+enum : uint16_t {
+  NBD_FLAG_FIXED_NEWSTYLE = 1 << 0,
+  NBD_FLAG_NO_ZEROES = 1 << 1,
+};
+
+enum : uint32_t {
+  NBD_FLAG_C_NO_ZEROES = 1 << 1,
+};
+
+enum : uint16_t {
+  NBD_FLAG_HAS_FLAGS = 1 << 0,
+  NBD_FLAG_READ_ONLY = 1 << 1,
+  NBD_FLAG_SEND_FLUSH = 1 << 2,
+  NBD_FLAG_SEND_FUA = 1 << 3,
+  NBD_FLAG_CAN_MULTI_CONN = 1 << 8,
+};
+
+enum : uint32_t {
+  NBD_OPT_EXPORT_NAME = 1,
+  NBD_OPT_ABORT = 2,
+  NBD_OPT_LIST = 3,
+  NBD_OPT_INFO = 6,
+  NBD_OPT_GO = 7,
+};
+
+enum : uint32_t {
+  NBD_REP_ACK = 1,
+  NBD_REP_SERVER = 2,
+  NBD_REP_INFO = 3,
+  NBD_REP_ERR_UNSUP = 0x80000001,
+  NBD_REP_ERR_INVALID = 0x80000003,
+};
+
+enum : uint16_t {
+  NBD_CMD_READ = 0,
+  NBD_CMD_WRITE = 1,
+  NBD_CMD_DISC = 2,
+  NBD_CMD_FLUSH = 3,
+};
+
+enum : uint16_t {
+  NBD_CMD_FLAG_FUA = 1 << 0,
+};
+
+enum : uint32_t {
+  NBD_EPERM = 1,
+  NBD_EINVAL = 22,
+  NBD_ENOSPC = 28,
+};
+
+static constexpr uint16_t NBD_INFO_EXPORT = 0;
+static constexpr size_t MAX_OPTION_LEN = 4096;
+
+static void put_be16(uint8_t *p, uint16_t v) {
+  p[0] = v >> 8;
+  p[1] = v;
+}
+
+static void put_be32(uint8_t *p, uint32_t v) {
+  put_be16(p, v >> 16);
+  put_be16(p + 2, v);
+}
+
+static void put_be64(uint8_t *p, uint64_t v) {
+  put_be32(p, v >> 32);
+  put_be32(p + 4, v);
+}
+
+static uint16_t get_be16(const uint8_t *p) { return (uint16_t)(p[0] << 8 | p[1]); }
+
+static uint32_t get_be32(const uint8_t *p) {
+  return (uint32_t)get_be16(p) << 16 | get_be16(p + 2);
+}
+
+static uint64_t get_be64(const uint8_t *p) {
+  return (uint64_t)get_be32(p) << 32 | get_be32(p + 4);
+}
+
+static bool recv_all(int fd, void *buf, size_t size) {
+  auto p = static_cast<uint8_t *>(buf);
+  while (size) {
+    auto r = ::recv(fd, p, size, MSG_WAITALL);
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r <= 0) {
+      return false;
+    }
+    p += r;
+    size -= r;
+  }
+  return true;
+}
+
+static bool send_all(int fd, const void *buf, size_t size) {
+  iovec iov{const_cast<void *>(buf), size};
+  return send_all(fd, &iov, 1);
+}
+
+NbdServer::NbdServer(emfat_t &emfat, bool read_only, unsigned workers)
+    : emfat_(emfat), read_only_(read_only) {
+  if (workers == 0) {
+    workers = std::max(1u, std::thread::hardware_concurrency());
+  }
+  for (unsigned i = 0; i < workers; ++i) {
+    workers_.emplace_back(&NbdServer::worker, this);
+  }
+}
+
+NbdServer::~NbdServer() {
+  {
+    std::lock_guard<std::mutex> lock(queue_lock_);
+    exit_ = true;
+  }
+  queue_cv_.notify_all();
+  for (auto &w : workers_) {
+    w.join();
+  }
+}
+
+void NbdServer::serve(const std::string &socket_path, std::error_code &err) {
+  acceptor_.serve(
+      socket_path,
+      [this](std::shared_ptr<SocketConnection> conn) {
+        handle_connection(std::move(conn));
+      },
+      err);
+  if (err) {
+    return;
+  }
+
+  std::unique_lock<std::shared_mutex> lock(volume_lock_);
+  emfat_flush(&emfat_);
+}
+
+bool NbdServer::handshake(SocketConnection &conn) {
+  uint8_t hello[18];
+  put_be64(hello, NBD_MAGIC);
+  put_be64(hello + 8, NBD_IHAVEOPT);
+  put_be16(hello + 16, NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+  if (!send_all(conn.fd, hello, sizeof(hello))) {
+    return false;
+  }
+
+  uint8_t client_flags[4];
+  if (!recv_all(conn.fd, client_flags, sizeof(client_flags))) {
+    return false;
+  }
+  auto no_zeroes = (get_be32(client_flags) & NBD_FLAG_C_NO_ZEROES) != 0;
+
+  uint16_t tflags = NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_FLUSH |
+                    NBD_FLAG_SEND_FUA | NBD_FLAG_CAN_MULTI_CONN;
+  if (read_only_) {
+    tflags |= NBD_FLAG_READ_ONLY;
+  }
+
+  auto option_reply = [&conn](uint32_t option, uint32_t type,
+                              const uint8_t *data = nullptr, uint32_t len = 0) {
+    uint8_t hdr[20];
+    put_be64(hdr, NBD_OPT_REPLY_MAGIC);
+    put_be32(hdr + 8, option);
+    put_be32(hdr + 12, type);
+    put_be32(hdr + 16, len);
+    iovec iov[2] = {{hdr, sizeof(hdr)}, {const_cast<uint8_t *>(data), len}};
+    return send_all(conn.fd, iov, len ? 2 : 1);
+  };
+
+  while (true) {
+    uint8_t hdr[16];
+    if (!recv_all(conn.fd, hdr, sizeof(hdr)) ||
+        get_be64(hdr) != NBD_IHAVEOPT) {
+      return false;
+    }
+    auto option = get_be32(hdr + 8);
+    auto len = get_be32(hdr + 12);
+    if (len > MAX_OPTION_LEN) {
+      return false;
+    }
+    std::vector<uint8_t> data(len);
+    if (len && !recv_all(conn.fd, data.data(), len)) {
+      return false;
+    }
+
+    // there is a single export, any name selects it
+    switch (option) {
+    case NBD_OPT_EXPORT_NAME: {
+      uint8_t info[10 + 124] = {};
+      put_be64(info, emfat_.vol_size);
+      put_be16(info + 8, tflags);
+      return send_all(conn.fd, info, no_zeroes ? 10 : sizeof(info));
+    }
+    case NBD_OPT_ABORT:
+      option_reply(option, NBD_REP_ACK);
+      return false;
+    case NBD_OPT_LIST: {
+      uint8_t name_len[4] = {};
+      if (!option_reply(option, NBD_REP_SERVER, name_len, sizeof(name_len)) ||
+          !option_reply(option, NBD_REP_ACK)) {
+        return false;
+      }
+      break;
+    }
+    case NBD_OPT_INFO:
+    case NBD_OPT_GO: {
+      if (len < 6 || get_be32(data.data()) > len - 6) {
+        if (!option_reply(option, NBD_REP_ERR_INVALID)) {
+          return false;
+        }
+        break;
+      }
+      uint8_t info[12];
+      put_be16(info, NBD_INFO_EXPORT);
+      put_be64(info + 2, emfat_.vol_size);
+      put_be16(info + 10, tflags);
+      if (!option_reply(option, NBD_REP_INFO, info, sizeof(info)) ||
+          !option_reply(option, NBD_REP_ACK)) {
+        return false;
+      }
+      if (option == NBD_OPT_GO) {
+        return true;
+      }
+      break;
+    }
+    default:
+      if (!option_reply(option, NBD_REP_ERR_UNSUP)) {
+        return false;
+      }
+    }
+  }
+}
+
+void NbdServer::handle_connection(std::shared_ptr<SocketConnection> conn) {
+  if (handshake(*conn)) {
+    uint8_t hdr[28];
+    while (!acceptor_.stopped() && recv_all(conn->fd, hdr, sizeof(hdr))) {
+      if (get_be32(hdr) != NBD_REQUEST_MAGIC) {
+        break;
+      }
+
+      Request req;
+      req.conn = conn;
+      req.flags = get_be16(hdr + 4);
+      req.type = get_be16(hdr + 6);
+      std::memcpy(&req.handle, hdr + 8, sizeof(req.handle));
+      req.offset = get_be64(hdr + 16);
+      req.length = get_be32(hdr + 24);
+
+      if (req.type == NBD_CMD_DISC) {
+        break;
+      }
+      if (req.type == NBD_CMD_WRITE) {
+        // the payload has to be consumed even if the write is refused
+        if (req.length > MAX_REQUEST) {
+          break;
+        }
+        req.payload.resize(req.length);
+        if (!recv_all(conn->fd, req.payload.data(), req.length)) {
+          break;
+        }
+      } else if (req.type != NBD_CMD_READ && req.type != NBD_CMD_FLUSH) {
+        reply(*conn, req.handle, NBD_EINVAL);
+        continue;
+      }
+
+      conn->begin_request();
+      {
+        std::lock_guard<std::mutex> lock(queue_lock_);
+        queue_.emplace_back(std::move(req));
+      }
+      queue_cv_.notify_one();
+    }
+  }
+}
+
+void NbdServer::worker() {
+  emfat_cursor_t cursor;
+  emfat_cursor_init(&emfat_, &cursor);
+  std::vector<uint8_t> buffer;
+  std::vector<emfat_seg_t> segs;
+
+  while (true) {
+    Request req;
+    {
+      std::unique_lock<std::mutex> lock(queue_lock_);
+      queue_cv_.wait(lock, [this] { return exit_ || !queue_.empty(); });
+      if (queue_.empty()) {
+        return;
+      }
+      req = std::move(queue_.front());
+      queue_.pop_front();
+    }
+
+    execute(req, cursor, buffer, segs);
+    req.conn->end_request();
+  }
+}
+
+void NbdServer::execute(Request &req, emfat_cursor_t &cursor,
+                        std::vector<uint8_t> &buffer,
+                        std::vector<emfat_seg_t> &segs) {
+  auto &conn = *req.conn;
+
+  if (req.type == NBD_CMD_FLUSH) {
+    std::unique_lock<std::shared_mutex> lock(volume_lock_);
+    emfat_flush(&emfat_);
+    reply(conn, req.handle, 0);
+    return;
+  }
+
+  if (req.length > MAX_REQUEST || req.offset > emfat_.vol_size ||
+      req.length > emfat_.vol_size - req.offset) {
+    reply(conn, req.handle,
+          req.type == NBD_CMD_WRITE ? NBD_ENOSPC : NBD_EINVAL);
+    return;
+  }
+
+  auto first = (uint32_t)(req.offset / SECT);
+  auto skip = (uint32_t)(req.offset % SECT);
+  auto count = (skip + req.length + SECT - 1) / SECT;
+
+  if (req.type == NBD_CMD_READ) {
+    // every segment covers a sector at least, so count of them and count
+    // sectors of scratch describe any request in one go
+    if (buffer.size() < (size_t)count * SECT) {
+      buffer.resize((size_t)count * SECT);
+    }
+    if (segs.size() < count + 1) {
+      segs.resize(count + 1);
+    }
+    int num_segs = 0;
+    {
+      std::shared_lock<std::shared_mutex> lock(volume_lock_);
+      emfat_readv_r(&emfat_, &cursor, segs.data() + 1, (int)count, &num_segs,
+                    buffer.data(), (int)count, first, (int)count);
+    }
+    // file data goes from the host mappings to the socket, only what emfat
+    // generates or reads through readcb passes the buffer
+    reply(conn, req.handle, segs.data(), num_segs, skip, req.length);
+    return;
+  }
+
+  if (read_only_) {
+    reply(conn, req.handle, NBD_EPERM);
+    return;
+  }
+
+  {
+    std::unique_lock<std::shared_mutex> lock(volume_lock_);
+    if (skip == 0 && req.length % SECT == 0) {
+      emfat_write(&emfat_, req.payload.data(), first, count);
+    } else {
+      // partial sectors: read-modify-write
+      if (buffer.size() < (size_t)count * SECT) {
+        buffer.resize((size_t)count * SECT);
+      }
+      emfat_read(&emfat_, buffer.data(), first, count);
+      std::memcpy(buffer.data() + skip, req.payload.data(), req.length);
+      emfat_write(&emfat_, buffer.data(), first, count);
+    }
+    if (req.flags & NBD_CMD_FLAG_FUA) {
+      emfat_flush(&emfat_);
+    }
+  }
+  reply(conn, req.handle, 0);
+}
+
+void NbdServer::reply(SocketConnection &conn, uint64_t handle,
+                      uint32_t error, const uint8_t *data, uint32_t length) {
+  uint8_t hdr[16];
+  put_be32(hdr, NBD_SIMPLE_REPLY_MAGIC);
+  put_be32(hdr + 4, error);
+  std::memcpy(hdr + 8, &handle, sizeof(handle));
+
+  iovec iov[2] = {{hdr, sizeof(hdr)}, {const_cast<uint8_t *>(data), length}};
+
+  std::lock_guard<std::mutex> lock(conn.send_lock);
+  // a failed send means the client is gone, the reader will notice
+  send_all(conn.fd, iov, error == 0 && length ? 2 : 1);
+}
+
+void NbdServer::reply(SocketConnection &conn, uint64_t handle,
+                      emfat_seg_t *segs, int count, uint32_t skip,
+                      uint32_t length) {
+  static_assert(sizeof(emfat_seg_t) == sizeof(iovec) &&
+                    offsetof(emfat_seg_t, base) == offsetof(iovec, iov_base) &&
+                    offsetof(emfat_seg_t, len) == offsetof(iovec, iov_len),
+                "emfat_seg_t is sent as iovec");
+  uint8_t hdr[16];
+  put_be32(hdr, NBD_SIMPLE_REPLY_MAGIC);
+  put_be32(hdr + 4, 0);
+  std::memcpy(hdr + 8, &handle, sizeof(handle));
+
+  auto iov = reinterpret_cast<iovec *>(segs);
+  iov[0] = {hdr, sizeof(hdr)};
+  // whole sectors were described, the request may start and end within one
+  size_t total = 0;
+  for (int i = 1; i <= count; ++i) {
+    total += iov[i].iov_len;
+  }
+  if (count) {
+    iov[1].iov_base = static_cast<uint8_t *>(iov[1].iov_base) + skip;
+    iov[1].iov_len -= skip;
+    iov[count].iov_len -= total - skip - length;
+  }
+
+  std::lock_guard<std::mutex> lock(conn.send_lock);
+  send_all(conn.fd, iov, count + 1);
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include "emfat.h"
+#include "socket_server.h"
+
+// Exports an emfat volume as an NBD (network block device) on a Unix domain
+// socket. Requests of all connections are served by a pool of workers, each
+// reading the volume through its own emfat cursor, so many requests can be in
+// flight at once and replies go out in completion order.
+class NbdServer {
+public:
+  // NBD recommends clients not to send requests larger than 32 MiB
+  static constexpr uint32_t MAX_REQUEST = 32 * 1024 * 1024;
+
+  NbdServer(emfat_t &emfat, bool read_only, unsigned workers = 0);
+  NbdServer(const NbdServer &) = delete;
+  NbdServer &operator=(const NbdServer &) = delete;
+  ~NbdServer();
+
+  // Binds socket_path and serves clients until stop() is called.
+  void serve(const std::string &socket_path, std::error_code &err);
+  // Async-signal-safe: only raises a flag that serve() polls for.
+  void stop() { acceptor_.stop(); }
+
+  bool listening() const { return acceptor_.listening(); }
+
+private:
+  struct Request {
+    std::shared_ptr<SocketConnection> conn;
+    uint16_t type;
+    uint16_t flags;
+    uint64_t handle; // opaque, sent back as received
+    uint64_t offset;
+    uint32_t length;
+    std::vector<uint8_t> payload;
+  };
+
+  void worker();
+  void handle_connection(std::shared_ptr<SocketConnection> conn);
+  bool handshake(SocketConnection &conn);
+  void execute(Request &req, emfat_cursor_t &cursor,
+               std::vector<uint8_t> &buffer, std::vector<emfat_seg_t> &segs);
+  void reply(SocketConnection &conn, uint64_t handle, uint32_t error,
+             const uint8_t *data = nullptr, uint32_t length = 0);
+  // segs[0] is left for the header, the data follows in segs[1..count]
+  void reply(SocketConnection &conn, uint64_t handle, emfat_seg_t *segs,
+             int count, uint32_t skip, uint32_t length);
+
+  emfat_t &emfat_;
+  bool read_only_;
+
+  // readers share the volume, writes and flushes need it exclusively
+  std::shared_mutex volume_lock_;
+
+  std::mutex queue_lock_;
+  std::condition_variable queue_cv_;
+  std::deque<Request> queue_;
+  bool exit_ = false;
+  std::vector<std::thread> workers_;
+
+  SocketServer acceptor_;
+};
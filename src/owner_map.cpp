@@ -0,0 +1,287 @@
+#include <algorithm>
+#include <fstream>
+#include <unordered_set>
+
+#include "owner_map.h"
+
+namespace {
+
+// the file: this header, then the owner array, the entries, the cross
+// links and the path text, each at a multiple of 8 bytes
+struct MapHeader {
+  char magic[8];
+  uint64_t volume_offset;
+  uint64_t fat_hash;
+  uint32_t cluster_count;
+  uint32_t cluster_size;
+  uint64_t entries;
+  uint64_t links;
+  uint64_t path_bytes;
+};
+
+// chains of up to that many fragments and clusters are walked on every
+// lookup, an extent costs a FAT read per cluster
+constexpr unsigned INDEXED_RUNS = 16;
+constexpr uint64_t INDEXED_CLUSTERS = 4096;
+
+const char MAGIC[8] = {'F', 'A', 'T', 'O', 'W', 'N', 'R', '1'};
+
+uint64_t align8(uint64_t v) { return (v + 7) & ~(uint64_t)7; }
+
+} // namespace
+
+void OwnerMap::build(const fat32::Volume &volume) {
+  auto fat = volume.fat();
+  volume_offset_ = volume.offset();
+  fat_hash_ = fat32::hash_bytes(fat.data(), fat.bytes());
+  cluster_size_ = volume.cluster_size();
+
+  mapping_.unmap();
+  runs_.clear();
+  owner_store_.assign(fat.count(), NONE);
+  entry_store_.clear();
+  link_store_.clear();
+  path_store_.clear();
+
+  if (volume.root_cluster() != 0) {
+    entry_store_.push_back({0, 1, 0, volume.root_cluster(), ATTR_DIR});
+    path_store_ = "/";
+    claim(0, fat, volume.root_cluster());
+  }
+
+  fat32::TreePaths paths;
+  auto tree = volume.tree();
+  for (auto it = tree.begin(); it != tree.end(); ++it) {
+    auto e = *it;
+    if (e.is_volume_label()) {
+      continue;
+    }
+
+    Owner owner{};
+    owner.path = path_store_.size();
+    owner.path_size =
+        (uint32_t)paths.append(path_store_, it.depth(), e.name(), e.is_dir());
+    owner.size = e.size();
+    owner.first_cluster = e.first_cluster();
+    owner.attr = e.attr();
+
+    auto index = (uint32_t)entry_store_.size();
+    entry_store_.push_back(owner);
+    claim(index, fat, owner.first_cluster);
+  }
+
+  std::sort(link_store_.begin(), link_store_.end());
+  link_store_.erase(std::unique(link_store_.begin(), link_store_.end()),
+                    link_store_.end());
+  point_at_storage();
+}
+
+void OwnerMap::claim(uint32_t entry, const fat32::FatView &fat,
+                     uint32_t first) {
+  // clusters of this chain that are cross-linked, a loop through them is
+  // not seen in the owner array
+  std::unordered_set<uint32_t> shared;
+  fat.visit([&](const auto &typed) {
+    for (auto cluster : typed.chain(first)) {
+      auto &owner = owner_store_[cluster];
+      if (owner == entry) {
+        break; // looped back into itself
+      }
+      if (owner == NONE) {
+        owner = entry;
+        continue;
+      }
+      if (owner != SHARED) {
+        link_store_.push_back({cluster, owner});
+        owner = SHARED;
+      } else if (!shared.insert(cluster).second) {
+        break;
+      }
+      link_store_.push_back({cluster, entry});
+    }
+  });
+}
+
+void OwnerMap::point_at_storage() {
+  owners_ = owner_store_.data();
+  count_ = (uint32_t)owner_store_.size();
+  entries_ = entry_store_.data();
+  entry_count_ = entry_store_.size();
+  links_ = link_store_.data();
+  link_count_ = link_store_.size();
+  paths_ = path_store_.data();
+}
+
+std::vector<uint32_t> OwnerMap::owners(uint32_t cluster) const {
+  auto o = owner(cluster);
+  if (o == NONE) {
+    return {};
+  }
+  if (o != SHARED) {
+    return {o};
+  }
+  std::vector<uint32_t> res;
+  auto it = std::lower_bound(links_, links_ + link_count_, Link{cluster, 0});
+  for (; it != links_ + link_count_ && it->cluster == cluster; ++it) {
+    res.push_back(it->entry);
+  }
+  return res;
+}
+
+bool OwnerMap::position(const fat32::FatView &fat, uint32_t entry,
+                        uint32_t cluster, uint64_t &before) {
+  auto first = entries_[entry].first_cluster;
+  auto cached = runs_.find(entry);
+  if (cached == runs_.end() || cached->second.empty()) {
+    uint64_t n = 0;
+    unsigned runs = 0;
+    bool found = false;
+    bool longer = false;
+    for (auto &extent : fat.extents(first)) {
+      if (cluster >= extent.first && cluster - extent.first < extent.count) {
+        before = n + (cluster - extent.first);
+        found = true;
+      }
+      n += extent.count;
+      if (++runs >= INDEXED_RUNS || n > INDEXED_CLUSTERS) {
+        longer = true;
+        break;
+      }
+      if (found) {
+        return true;
+      }
+    }
+    if (!longer) {
+      return found;
+    }
+    // a long chain is indexed when it is looked into a second time, or
+    // right away if the walk stopped short of the cluster
+    if (cached == runs_.end() && found) {
+      runs_.emplace(entry, std::vector<Run>());
+      return true;
+    }
+
+    std::vector<Run> index;
+    n = 0;
+    for (auto &extent : fat.extents(first)) {
+      index.push_back({extent.first, extent.count, n});
+      n += extent.count;
+    }
+    // stable, a loop back into a fragment finds its first pass
+    std::stable_sort(
+        index.begin(), index.end(),
+        [](const Run &a, const Run &b) { return a.first < b.first; });
+    cached = runs_.insert_or_assign(entry, std::move(index)).first;
+  }
+
+  auto &index = cached->second;
+  auto it = std::upper_bound(
+      index.begin(), index.end(), cluster,
+      [](uint32_t c, const Run &run) { return c < run.first; });
+  if (it == index.begin()) {
+    return false;
+  }
+  --it;
+  if (cluster - it->first >= it->count) {
+    return false;
+  }
+  before = it->before + (cluster - it->first);
+  return true;
+}
+
+bool OwnerMap::save(const std::string &path, std::error_code &err) const {
+  MapHeader header;
+  std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.volume_offset = volume_offset_;
+  header.fat_hash = fat_hash_;
+  header.cluster_count = count_;
+  header.cluster_size = cluster_size_;
+  header.entries = entry_count_;
+  header.links = link_count_;
+  header.path_bytes = entry_count_ == 0
+                          ? 0
+                          : entries_[entry_count_ - 1].path +
+                                entries_[entry_count_ - 1].path_size;
+
+  std::ofstream os(path, std::ios::binary | std::ios::trunc);
+  const char zeroes[8] = {};
+  auto put = [&os, &zeroes](const void *data, uint64_t size) {
+    os.write((const char *)data, (std::streamsize)size);
+    os.write(zeroes, (std::streamsize)(align8(size) - size));
+  };
+  put(&header, sizeof(header));
+  put(owners_, (uint64_t)count_ * sizeof(*owners_));
+  put(entries_, entry_count_ * sizeof(*entries_));
+  put(links_, link_count_ * sizeof(*links_));
+  put(paths_, header.path_bytes);
+  os.close();
+  if (!os) {
+    err = std::make_error_code(std::errc::io_error);
+    return false;
+  }
+  return true;
+}
+
+bool OwnerMap::load(const std::string &path, const fat32::Volume &volume,
+                    std::error_code &err) {
+  mio::mmap_source mapping;
+  mapping.map(path, err);
+  if (err) {
+    if (err == std::errc::no_such_file_or_directory) {
+      err.clear();
+    }
+    return false;
+  }
+
+  MapHeader header;
+  if (mapping.size() < sizeof(header)) {
+    return false;
+  }
+  std::memcpy(&header, mapping.data(), sizeof(header));
+  auto fat = volume.fat();
+  if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 ||
+      header.volume_offset != volume.offset() ||
+      header.cluster_count != fat.count() ||
+      header.cluster_size != volume.cluster_size()) {
+    return false;
+  }
+
+  // sections, checked to fit before anything points into them
+  uint64_t owners = align8(sizeof(header));
+  uint64_t entries = owners + align8((uint64_t)header.cluster_count * 4);
+  uint64_t links = entries + align8(header.entries * sizeof(Owner));
+  uint64_t paths = links + align8(header.links * sizeof(Link));
+  if (header.entries > mapping.size() || header.links > mapping.size() ||
+      paths + header.path_bytes > mapping.size()) {
+    return false;
+  }
+  auto base = (const uint8_t *)mapping.data();
+  auto first = (const Owner *)(base + entries);
+  if (std::any_of(first, first + header.entries, [&header](const Owner &o) {
+        return o.path + o.path_size > header.path_bytes;
+      })) {
+    return false;
+  }
+  // the hash last, it reads the whole FAT
+  if (header.fat_hash != fat32::hash_bytes(fat.data(), fat.bytes())) {
+    return false;
+  }
+
+  runs_.clear();
+  owner_store_ = {};
+  entry_store_ = {};
+  link_store_ = {};
+  path_store_ = {};
+  volume_offset_ = header.volume_offset;
+  fat_hash_ = header.fat_hash;
+  cluster_size_ = header.cluster_size;
+  owners_ = (const uint32_t *)(base + owners);
+  count_ = header.cluster_count;
+  entries_ = (const Owner *)(base + entries);
+  entry_count_ = header.entries;
+  links_ = (const Link *)(base + links);
+  link_count_ = header.links;
+  paths_ = (const char *)(base + paths);
+  mapping_ = std::move(mapping);
+  return true;
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <unordered_map>
+#include <vector>
+
+#include "mio/mmap.hpp"
+
+#include "fat32parse.h"
+
+// Which directory entry owns each cluster of a volume: a dense array with
+// one uint32_t entry index per cluster, filled in a single pass over the
+// chain of every file and directory, so a cluster resolves to its file in
+// O(1). That is 4 bytes per cluster, 2 GiB for a 2 TiB volume of 4 KiB
+// clusters. A map saved to disk is mapped back instead of rebuilt, and only
+// the pages of the clusters looked up are read.
+class OwnerMap {
+public:
+  // free, lost, bad or out of range: nothing in the tree links to it
+  static constexpr uint32_t NONE = 0xffffffff;
+  // cross-linked into more than one chain, owners() has them all
+  static constexpr uint32_t SHARED = 0xfffffffe;
+
+  struct Owner {
+    uint64_t path; // offset in the path text
+    uint32_t path_size;
+    uint32_t size;
+    uint32_t first_cluster;
+    uint8_t attr;
+  };
+
+  void build(const fat32::Volume &volume);
+
+  // Maps a map saved for the same volume. False if there is none or it was
+  // made for another geometry or FAT, err is set only for I/O errors. A
+  // rename that allocates nothing goes unnoticed.
+  bool load(const std::string &path, const fat32::Volume &volume,
+            std::error_code &err);
+  // native byte order, for the machine that made it
+  bool save(const std::string &path, std::error_code &err) const;
+
+  uint32_t clusters() const { return count_; }
+  uint32_t owner(uint32_t cluster) const {
+    auto o = cluster < count_ ? owners_[cluster] : NONE;
+    return o < entry_count_ || o == SHARED ? o : NONE;
+  }
+  // every entry linking to the cluster, in traversal order
+  std::vector<uint32_t> owners(uint32_t cluster) const;
+
+  // Clusters in front of cluster in the chain of entry, false if it is not
+  // in there. Long chains are indexed the first time, later lookups in
+  // them take log(fragments).
+  bool position(const fat32::FatView &fat, uint32_t entry, uint32_t cluster,
+                uint64_t &before);
+
+  size_t entries() const { return entry_count_; }
+  const Owner &entry(uint32_t index) const { return entries_[index]; }
+  // "/DIR/NAME", "/" for the FAT32 root directory
+  std::string_view path(uint32_t index) const {
+    return {paths_ + entries_[index].path, entries_[index].path_size};
+  }
+
+private:
+  // a cluster and one of the entries it is cross-linked into
+  struct Link {
+    uint32_t cluster;
+    uint32_t entry;
+    bool operator<(const Link &o) const {
+      return cluster != o.cluster ? cluster < o.cluster : entry < o.entry;
+    }
+    bool operator==(const Link &o) const {
+      return cluster == o.cluster && entry == o.entry;
+    }
+  };
+
+  // a fragment of an indexed chain and the clusters in front of it
+  struct Run {
+    uint32_t first;
+    uint32_t count;
+    uint64_t before;
+  };
+
+  void claim(uint32_t entry, const fat32::FatView &fat, uint32_t first);
+  void point_at_storage();
+
+  // what the map was built from, compared on load
+  uint64_t volume_offset_ = 0;
+  uint64_t fat_hash_ = 0;
+  uint32_t cluster_size_ = 0;
+
+  // built in memory
+  std::vector<uint32_t> owner_store_;
+  std::vector<Owner> entry_store_;
+  std::vector<Link> link_store_;
+  std::string path_store_;
+  // or loaded from a file
+  mio::mmap_source mapping_;
+
+  // whichever of the two holds the map
+  const uint32_t *owners_ = nullptr;
+  uint32_t count_ = 0;
+  const Owner *entries_ = nullptr;
+  size_t entry_count_ = 0;
+  const Link *links_ = nullptr;
+  size_t link_count_ = 0;
+  const char *paths_ = nullptr;
+
+  // by entry, the fragments of long chains sorted by first cluster
+  std::unordered_map<uint32_t, std::vector<Run>> runs_;
+};
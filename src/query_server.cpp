@@ -0,0 +1,581 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string_view>
+#include <thread>
+#include <unordered_set>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "fat_find.h"
+#include "json.h"
+#include "query_server.h"
+
+namespace {
+
+constexpr uint32_t NO_NODE = 0xffffffff;
+
+// "YYYY-MM-DD HH:MM:SS" as print_long shows it, null if never set
+void json_time(uint16_t date, uint16_t time, bool with_time,
+               std::string &out) {
+  if (date == 0) {
+    out += "null";
+    return;
+  }
+  char text[32];
+  if (with_time) {
+    std::snprintf(text, sizeof(text), "\"%04u-%02u-%02u %02u:%02u:%02u\"",
+                  (date >> 9) + 1980, date >> 5 & 0xf, date & 0x1f,
+                  time >> 11, time >> 5 & 0x3f, (time & 0x1f) * 2);
+  } else {
+    std::snprintf(text, sizeof(text), "\"%04u-%02u-%02u\"",
+                  (date >> 9) + 1980, date >> 5 & 0xf, date & 0x1f);
+  }
+  out += text;
+}
+
+char fold(char c) { return c >= 'a' && c <= 'z' ? (char)(c - 'a' + 'A') : c; }
+
+// FAT names compare without case, as far as ASCII goes
+int compare_names(std::string_view a, std::string_view b) {
+  auto n = std::min(a.size(), b.size());
+  for (size_t i = 0; i < n; ++i) {
+    auto x = fold(a[i]), y = fold(b[i]);
+    if (x != y) {
+      return (unsigned char)x < (unsigned char)y ? -1 : 1;
+    }
+  }
+  return a.size() < b.size() ? -1 : a.size() > b.size() ? 1 : 0;
+}
+
+bool parse_number(const std::string &s, uint64_t &value) {
+  if (s.empty()) {
+    return false;
+  }
+  char *end = nullptr;
+  errno = 0;
+  value = std::strtoull(s.c_str(), &end, 0);
+  return errno == 0 && *end == 0;
+}
+
+std::vector<std::string> split(const std::string &line) {
+  std::vector<std::string> fields;
+  size_t start = 0;
+  while (true) {
+    auto tab = line.find('\t', start);
+    fields.emplace_back(line, start,
+                        tab == std::string::npos ? std::string::npos
+                                                 : tab - start);
+    if (tab == std::string::npos) {
+      return fields;
+    }
+    start = tab + 1;
+  }
+}
+
+} // namespace
+
+// A volume as it was indexed: nodes in breadth-first order, so the children
+// of every directory are one run, sorted by name for lookups
+struct QueryServer::Volume {
+  struct Node {
+    uint32_t parent;
+    uint32_t first_child;
+    uint32_t children;
+    uint32_t name_size;
+    uint64_t name; // offset in names
+    uint64_t extent; // first of the chain in extents
+    uint32_t extents;
+    uint32_t first_cluster;
+    uint32_t size;
+    uint8_t attr;
+    uint16_t crt_date, crt_time;
+    uint16_t mod_date, mod_time;
+    uint16_t acc_date;
+  };
+
+  struct Health {
+    fat32::FatSummary summary{};
+    int64_t fsinfo_free = -1; // -1 on FAT12/16 or if there is none
+    bool copies_match = true;
+    uint64_t reachable = 0; // clusters in the chains of the tree
+    uint64_t cross_linked = 0; // of those, in more than one chain
+  };
+
+  std::string image;
+  unsigned partition = 0;
+  fat32::Volume volume;
+  uint64_t image_size = 0;
+
+  std::vector<Node> nodes;
+  std::string names;
+  std::vector<fat32::Extent> extents;
+  std::vector<uint64_t> before; // clusters of the chain in front of each
+  Health health;
+
+  std::string_view name(const Node &n) const {
+    return {names.data() + n.name, n.name_size};
+  }
+
+  void build();
+  void index_chains();
+  // the node at "/DIR/NAME", NO_NODE if there is none
+  uint32_t lookup(std::string_view path) const;
+  void node_json(const Node &n, std::string &out) const;
+  bool read(const Node &n, uint64_t offset, uint64_t length,
+            std::vector<iovec> &data, std::string &error) const;
+};
+
+void QueryServer::Volume::build() {
+  Node root{};
+  root.first_cluster = volume.root_cluster();
+  root.attr = ATTR_DIR;
+  nodes.push_back(root);
+
+  // a directory linked in twice, or into itself, is entered once
+  std::unordered_set<uint32_t> entered;
+  std::vector<uint32_t> dirs{0};
+  for (size_t q = 0; q < dirs.size(); ++q) {
+    auto d = dirs[q];
+    auto first = nodes[d].first_cluster;
+    if ((d != 0 && first < 2) ||
+        (first >= 2 && !entered.insert(first).second)) {
+      continue;
+    }
+    auto begin = (uint32_t)nodes.size();
+    for (auto e : volume.directory(first)) {
+      if (e.is_volume_label()) {
+        continue;
+      }
+      auto &raw = e.raw();
+      Node n{};
+      n.parent = d;
+      auto name = e.name();
+      n.name = names.size();
+      n.name_size = name.size;
+      names.append(name.text, name.size);
+      n.first_cluster = e.first_cluster();
+      n.size = e.size();
+      n.attr = raw.attr;
+      n.crt_date = raw.crt_date;
+      n.crt_time = raw.crt_time;
+      n.mod_date = raw.lst_mod_date;
+      n.mod_time = raw.lst_mod_time;
+      n.acc_date = raw.lst_access_date;
+      nodes.push_back(n);
+    }
+    nodes[d].first_child = begin;
+    nodes[d].children = (uint32_t)nodes.size() - begin;
+    std::stable_sort(nodes.begin() + begin, nodes.end(),
+                     [this](const Node &a, const Node &b) {
+                       return compare_names(name(a), name(b)) < 0;
+                     });
+    for (auto i = begin; i < nodes.size(); ++i) {
+      if ((nodes[i].attr & (ATTR_DIR | ATTR_VOL_LABEL)) == ATTR_DIR) {
+        dirs.push_back(i);
+      }
+    }
+  }
+  index_chains();
+}
+
+void QueryServer::Volume::index_chains() {
+  auto fat = volume.fat();
+  health.summary = fat.summary();
+  if (auto info = volume.fsinfo()) {
+    health.fsinfo_free = info->free_clusters == 0xffffffff
+                             ? -1
+                             : (int64_t)info->free_clusters;
+  }
+  for (unsigned c = 1; c < volume.fat_copies(); ++c) {
+    if (volume.fat_offset(c) + fat.bytes() > image_size ||
+        std::memcmp(volume.image() + volume.fat_offset(0),
+                    volume.image() + volume.fat_offset(c),
+                    fat.bytes()) != 0) {
+      health.copies_match = false;
+    }
+  }
+
+  std::vector<uint8_t> seen(volume.cluster_count());
+  for (auto &n : nodes) {
+    n.extent = extents.size();
+    if (n.first_cluster < 2) {
+      continue;
+    }
+    uint64_t clusters = 0;
+    for (auto &x : fat.extents(n.first_cluster)) {
+      extents.push_back(x);
+      before.push_back(clusters);
+      clusters += x.count;
+      for (auto c = x.first; c < x.first + x.count && c < seen.size(); ++c) {
+        if (seen[c] == 1) {
+          ++health.cross_linked;
+        }
+        if (seen[c] < 2) {
+          ++seen[c];
+        }
+      }
+    }
+    n.extents = (uint32_t)(extents.size() - n.extent);
+  }
+  for (auto s : seen) {
+    health.reachable += s != 0;
+  }
+}
+
+uint32_t QueryServer::Volume::lookup(std::string_view path) const {
+  uint32_t node = 0;
+  while (!path.empty()) {
+    auto slash = path.find('/');
+    auto part = path.substr(0, slash);
+    path = slash == std::string_view::npos ? std::string_view()
+                                           : path.substr(slash + 1);
+    if (part.empty() || part == ".") {
+      continue;
+    }
+    auto &n = nodes[node];
+    if (part == "..") {
+      node = n.parent;
+      continue;
+    }
+    auto begin = nodes.begin() + n.first_child;
+    auto end = begin + n.children;
+    auto it = std::lower_bound(begin, end, part,
+                               [this](const Node &a, std::string_view b) {
+                                 return compare_names(name(a), b) < 0;
+                               });
+    if (it == end || compare_names(name(*it), part) != 0) {
+      return NO_NODE;
+    }
+    node = (uint32_t)(it - nodes.begin());
+  }
+  return node;
+}
+
+void QueryServer::Volume::node_json(const Node &n, std::string &out) const {
+  const char letters[] = "rhsvda";
+  char attr[7] = {};
+  for (int bit = 0; bit < 6; ++bit) {
+    attr[bit] = n.attr & (1 << bit) ? letters[bit] : '-';
+  }
+  uint64_t clusters = 0;
+  for (uint32_t i = 0; i < n.extents; ++i) {
+    clusters += extents[n.extent + i].count;
+  }
+  out += "{\"name\": ";
+  append_json_string(out, &n == &nodes[0] ? "/" : name(n));
+  out += ", \"type\": ";
+  out += (n.attr & ATTR_DIR) ? "\"dir\"" : "\"file\"";
+  out += ", \"attr\": \"";
+  out += attr;
+  out += "\", \"size\": " + std::to_string(n.size) +
+         ", \"cluster\": " + std::to_string(n.first_cluster) +
+         ", \"clusters\": " + std::to_string(clusters) +
+         ", \"fragments\": " + std::to_string(n.extents) + ", \"created\": ";
+  json_time(n.crt_date, n.crt_time, true, out);
+  out += ", \"modified\": ";
+  json_time(n.mod_date, n.mod_time, true, out);
+  out += ", \"accessed\": ";
+  json_time(n.acc_date, 0, false, out);
+  out += '}';
+}
+
+// The byte range of the file as pieces of the mapped image, one per
+// fragment it touches
+bool QueryServer::Volume::read(const Node &n, uint64_t offset,
+                               uint64_t length, std::vector<iovec> &data,
+                               std::string &error) const {
+  if (n.attr & ATTR_DIR) {
+    error = "is a directory";
+    return false;
+  }
+  if (offset >= n.size) {
+    return true;
+  }
+  length = std::min<uint64_t>(length, n.size - offset);
+  auto cluster_size = volume.cluster_size();
+  auto first = before.begin() + n.extent;
+  auto last = first + n.extents;
+  while (length) {
+    auto index = offset / cluster_size;
+    auto it = std::upper_bound(first, last, index) - 1;
+    if (it < first || index >= *it + extents[it - before.begin()].count) {
+      error = "the chain ends before the size";
+      return false;
+    }
+    auto &x = extents[it - before.begin()];
+    auto within = offset - *it * cluster_size;
+    auto piece =
+        std::min(length, (uint64_t)x.count * cluster_size - within);
+    auto at = volume.cluster_offset(x.first) + within;
+    if (at + piece > image_size) {
+      error = "the file reaches past the end of the image";
+      return false;
+    }
+    data.push_back({const_cast<uint8_t *>(volume.image() + at), piece});
+    offset += piece;
+    length -= piece;
+  }
+  return true;
+}
+
+struct QueryServer::Reply {
+  bool ok = true;
+  std::string text;        // JSON or the error
+  std::vector<iovec> data; // or bytes of the image
+
+  void fail(std::string message) {
+    ok = false;
+    text = std::move(message);
+    data.clear();
+  }
+};
+
+// A worker waits out the page faults of the reads it answers, more of them
+// than cores keep the other requests going meanwhile
+QueryServer::QueryServer(unsigned workers)
+    : pool_(workers ? workers
+                    : 4 * std::max(1u, std::thread::hardware_concurrency())) {}
+
+QueryServer::~QueryServer() { pool_.wait(); }
+
+bool QueryServer::add_image(const std::string &path, std::error_code &err) {
+  err.clear();
+  auto image = std::make_unique<fat32::Image>();
+  if (!image->open(path, err)) {
+    return false;
+  }
+  std::error_code table_err;
+  auto first = volumes_.size();
+  for (auto &opened : image->volumes(-1, table_err)) {
+    if (opened.err) {
+      continue;
+    }
+    auto v = std::make_unique<Volume>();
+    v->volume = opened.volume;
+    v->image = path;
+    v->partition = opened.partition.index;
+    v->image_size = image->size();
+    volumes_.push_back(std::move(v));
+  }
+  for (auto i = first; i < volumes_.size(); ++i) {
+    pool_.submit([v = volumes_[i].get()] { v->build(); });
+  }
+  pool_.wait();
+  images_.push_back(std::move(image));
+  err = table_err;
+  return true;
+}
+
+uint64_t QueryServer::entry_count() const {
+  uint64_t n = 0;
+  for (auto &v : volumes_) {
+    n += v->nodes.size() - 1;
+  }
+  return n;
+}
+
+void QueryServer::execute(const std::string &line, Reply &reply) const {
+  auto fields = split(line);
+  if (fields.size() < 2) {
+    reply.fail("no verb");
+    return;
+  }
+  auto &verb = fields[1];
+
+  if (verb == "volumes") {
+    reply.text = "[";
+    for (size_t i = 0; i < volumes_.size(); ++i) {
+      auto &v = *volumes_[i];
+      auto type = v.volume.fat_type();
+      reply.text += (i ? ", " : "") + std::string("{\"volume\": ") +
+                    std::to_string(i) + ", \"image\": ";
+      append_json_string(reply.text, v.image);
+      reply.text +=
+          ", \"partition\": " + std::to_string(v.partition) +
+          ", \"fat\": \"" +
+          (type == fat32::FatType::Fat12   ? "FAT12"
+           : type == fat32::FatType::Fat16 ? "FAT16"
+                                           : "FAT32") +
+          "\", \"clusters\": " + std::to_string(v.volume.cluster_count() - 2) +
+          ", \"entries\": " + std::to_string(v.nodes.size() - 1) + "}";
+    }
+    reply.text += "]";
+    return;
+  }
+
+  uint64_t index = 0;
+  if (fields.size() < 3 || !parse_number(fields[2], index) ||
+      index >= volumes_.size()) {
+    reply.fail("no such volume");
+    return;
+  }
+  auto &v = *volumes_[index];
+
+  if (verb == "health") {
+    auto &h = v.health;
+    reply.text =
+        "{\"clusters\": " + std::to_string(v.volume.cluster_count() - 2) +
+        ", \"free\": " + std::to_string(h.summary.free) +
+        ", \"used\": " + std::to_string(h.summary.used) +
+        ", \"bad\": " + std::to_string(h.summary.bad) +
+        ", \"chains\": " + std::to_string(h.summary.chains) +
+        ", \"fsinfo_free\": " +
+        (h.fsinfo_free < 0 ? "null" : std::to_string(h.fsinfo_free)) +
+        ", \"copies\": " + std::to_string(v.volume.fat_copies()) +
+        ", \"copies_match\": " + (h.copies_match ? "true" : "false") +
+        ", \"reachable\": " + std::to_string(h.reachable) +
+        ", \"unreachable\": " +
+        std::to_string(h.summary.used > h.reachable
+                           ? h.summary.used - h.reachable
+                           : 0) +
+        ", \"cross_linked\": " + std::to_string(h.cross_linked) + "}";
+    return;
+  }
+
+  if (verb == "find") {
+    FindQuery query;
+    query.path = fields.size() > 3 ? fields[3] : "**";
+    uint64_t limit = 0;
+    if (fields.size() > 4 && !parse_number(fields[4], limit)) {
+      reply.fail("bad limit");
+      return;
+    }
+    if (fields.size() > 5) {
+      if (fields[5] != "f" && fields[5] != "d") {
+        reply.fail("bad type: " + fields[5]);
+        return;
+      }
+      query.type = fields[5][0];
+    }
+    FindFilter filter;
+    std::string error;
+    if (!filter.compile(query, error)) {
+      reply.fail(error);
+      return;
+    }
+    uint64_t found = 0;
+    reply.text = "[";
+    filter.run(v.volume,
+               [&](const fat32::TreeIterator &, const std::string &path) {
+                 reply.text += found++ ? ", " : "";
+                 append_json_string(reply.text, "/" + path);
+                 return limit == 0 || found < limit;
+               });
+    reply.text += "]";
+    return;
+  }
+
+  if (fields.size() < 4) {
+    reply.fail("no path");
+    return;
+  }
+  auto node = v.lookup(fields[3]);
+  if (node == NO_NODE) {
+    reply.fail("no such file or directory");
+    return;
+  }
+  auto &n = v.nodes[node];
+
+  if (verb == "stat") {
+    v.node_json(n, reply.text);
+  } else if (verb == "list") {
+    if (!(n.attr & ATTR_DIR)) {
+      reply.fail("not a directory");
+      return;
+    }
+    reply.text = "[";
+    for (uint32_t i = 0; i < n.children; ++i) {
+      reply.text += i ? ",\n " : "";
+      v.node_json(v.nodes[n.first_child + i], reply.text);
+    }
+    reply.text += "]";
+  } else if (verb == "read") {
+    uint64_t offset = 0, length = 0;
+    if (fields.size() < 6 || !parse_number(fields[4], offset) ||
+        !parse_number(fields[5], length) || length > MAX_READ) {
+      reply.fail("bad range");
+      return;
+    }
+    std::string error;
+    if (!v.read(n, offset, length, reply.data, error)) {
+      reply.fail(error);
+    }
+  } else {
+    reply.fail("unknown verb");
+  }
+}
+
+void QueryServer::send(SocketConnection &conn, const std::string &id,
+                       Reply &reply) {
+  uint64_t size = reply.text.size();
+  for (auto &d : reply.data) {
+    size += d.iov_len;
+  }
+  auto header =
+      id + (reply.ok ? "\tok\t" : "\terror\t") + std::to_string(size) + "\n";
+
+  std::vector<iovec> iov;
+  iov.reserve(2 + reply.data.size());
+  iov.push_back({&header[0], header.size()});
+  if (!reply.text.empty()) {
+    iov.push_back({&reply.text[0], reply.text.size()});
+  }
+  iov.insert(iov.end(), reply.data.begin(), reply.data.end());
+
+  std::lock_guard<std::mutex> lock(conn.send_lock);
+  send_all(conn.fd, iov.data(), (int)iov.size());
+}
+
+void QueryServer::serve(const std::string &socket_path,
+                        std::error_code &err) {
+  acceptor_.serve(
+      socket_path,
+      [this](std::shared_ptr<SocketConnection> conn) {
+        handle_connection(std::move(conn));
+      },
+      err);
+  pool_.wait();
+}
+
+void QueryServer::handle_connection(std::shared_ptr<SocketConnection> conn) {
+  std::string pending;
+  char buf[16 * 1024];
+  while (!acceptor_.stopped()) {
+    auto r = ::recv(conn->fd, buf, sizeof(buf), 0);
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r <= 0) {
+      break;
+    }
+    pending.append(buf, r);
+
+    size_t start = 0;
+    for (auto nl = pending.find('\n'); nl != std::string::npos;
+         nl = pending.find('\n', start)) {
+      auto line = pending.substr(start, nl - start);
+      start = nl + 1;
+      if (!line.empty() && line.back() == '\r') {
+        line.pop_back();
+      }
+      if (line.empty()) {
+        continue;
+      }
+      conn->begin_request();
+      pool_.submit([this, conn, line = std::move(line)] {
+        Reply reply;
+        execute(line, reply);
+        send(*conn, line.substr(0, line.find('\t')), reply);
+        conn->end_request();
+      });
+    }
+    pending.erase(0, start);
+    if (pending.size() > MAX_LINE) {
+      break;
+    }
+  }
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "fat32parse.h"
+#include "socket_server.h"
+#include "work_pool.h"
+
+// Answers queries about the FAT volumes of disk images on a Unix domain
+// socket, with the images kept mapped and every volume indexed once when it
+// is added: the directory tree with children sorted by name, the extents of
+// every chain and the health of the FAT. A query is then a lookup, not a
+// parse. The index is not rebuilt if the image changes underneath.
+//
+// A request is one line of tab separated fields, an id the reply echoes
+// and a verb with its arguments; volumes are numbered as "volumes" lists
+// them:
+//
+//   id  volumes
+//   id  stat    volume  /DIR/NAME
+//   id  list    volume  /DIR
+//   id  find    volume  path glob  [limit]  [f or d]
+//   id  read    volume  /DIR/NAME  offset  length
+//   id  health  volume
+//
+// and its reply the line "id\tok\tlength" or "id\terror\tlength" followed
+// by that many bytes: JSON, the bytes read, or the error message. Requests
+// of all connections are run by a pool of workers, replies of one
+// connection go out in completion order.
+class QueryServer {
+public:
+  static constexpr uint32_t MAX_READ = 32 * 1024 * 1024;
+  static constexpr size_t MAX_LINE = 64 * 1024;
+
+  // 0 workers - four per core
+  explicit QueryServer(unsigned workers = 0);
+  QueryServer(const QueryServer &) = delete;
+  QueryServer &operator=(const QueryServer &) = delete;
+  ~QueryServer();
+
+  // Maps the image and indexes its FAT volumes, on the workers. False if
+  // it does not map, err is set to the first error.
+  bool add_image(const std::string &path, std::error_code &err);
+  size_t volume_count() const { return volumes_.size(); }
+  uint64_t entry_count() const;
+
+  // Binds socket_path and serves clients until stop() is called.
+  void serve(const std::string &socket_path, std::error_code &err);
+  // Async-signal-safe: only raises a flag that serve() polls for.
+  void stop() { acceptor_.stop(); }
+
+  bool listening() const { return acceptor_.listening(); }
+
+  struct Volume;
+
+private:
+  struct Reply;
+
+  void handle_connection(std::shared_ptr<SocketConnection> conn);
+  void execute(const std::string &line, Reply &reply) const;
+  void send(SocketConnection &conn, const std::string &id, Reply &reply);
+
+  WorkPool pool_;
+  std::vector<std::unique_ptr<fat32::Image>> images_;
+  std::vector<std::unique_ptr<Volume>> volumes_;
+
+  SocketServer acceptor_;
+};
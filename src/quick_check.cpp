@@ -0,0 +1,323 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+#include "fat32parse.h"
+#include "json.h"
+
+#include "quick_check.h"
+
+// FAT[1] flags, set when all is well, per entry width
+static constexpr uint32_t FAT16_CLEAN = 0x8000;
+static constexpr uint32_t FAT16_NO_IO_ERROR = 0x4000;
+static constexpr uint32_t FAT32_CLEAN = 0x08000000;
+static constexpr uint32_t FAT32_NO_IO_ERROR = 0x04000000;
+
+// the state byte Linux keeps in the boot sector, reserved1 on FAT32 and in
+// the same place of the FAT12/16 extended fields
+static constexpr uint8_t BOOT_STATE_DIRTY = 0x01;
+
+static constexpr uint32_t FSINFO_SIGNATURE1 = 0x41615252;
+static constexpr uint32_t FSINFO_SIGNATURE2 = 0x61417272;
+static constexpr uint32_t FSINFO_SIGNATURE3 = 0xAA550000;
+static constexpr uint32_t FSINFO_UNKNOWN = 0xffffffff;
+
+static bool has_signature(const uint8_t *sector) {
+  return sector[510] == 0x55 && sector[511] == 0xAA;
+}
+
+namespace {
+
+class Checker {
+public:
+  Checker(const fat32::Image &image, QuickReport &report)
+      : image_(image), report_(report) {}
+
+  void add(int partition, Verdict severity, const char *check,
+           std::string message) {
+    report_.verdict = std::max(report_.verdict, severity);
+    report_.findings.push_back(
+        {partition, severity, check, std::move(message)});
+  }
+
+  void disk(const std::vector<fat32::Partition> &partitions) {
+    // sorted by start, each must end before the next begins
+    std::vector<const fat32::Partition *> sorted;
+    for (auto &p : partitions) {
+      int i = (int)p.index;
+      if (p.size_lba == 0) {
+        add(i, Verdict::Error, "partition_size", "partition is empty");
+        continue;
+      }
+      if (p.offset() + p.size_lba * p.sector_size > image_.size()) {
+        add(i, Verdict::Error, "partition_size",
+            "partition ends past the end of the image");
+      }
+      sorted.push_back(&p);
+    }
+    std::sort(sorted.begin(), sorted.end(), [](auto a, auto b) {
+      return a->offset() < b->offset();
+    });
+    for (size_t n = 1; n < sorted.size(); ++n) {
+      auto prev = sorted[n - 1];
+      auto end = prev->offset() + prev->size_lba * prev->sector_size;
+      if (sorted[n]->offset() < end) {
+        add((int)sorted[n]->index, Verdict::Error, "partition_overlap",
+            "partition overlaps #" + std::to_string(prev->index));
+      }
+    }
+  }
+
+  void partition(const fat32::Partition &p) {
+    int i = (int)p.index;
+    if (p.offset() + SECT > image_.size()) {
+      return; // reported as partition_size
+    }
+
+    auto sector = image_.data() + p.offset();
+    auto &boot = *(const boot_sector *)sector;
+    if (!has_signature(sector)) {
+      add(i, Verdict::Error, "boot_signature",
+          "boot sector does not end with 0x55 0xAA");
+    }
+    // the checks Volume::open makes, one by one for a message that says
+    // which
+    auto bps = boot.bytes_per_sec;
+    auto spc = boot.sec_per_clus;
+    if (bps < SECT || bps > 4096 || (bps & (bps - 1)) != 0) {
+      add(i, Verdict::Error, "geometry",
+          "bytes per sector " + std::to_string(bps));
+      return;
+    }
+    if (spc == 0 || (spc & (spc - 1)) != 0) {
+      add(i, Verdict::Error, "geometry",
+          "sectors per cluster " + std::to_string(spc) +
+              " is not a power of two");
+      return;
+    }
+
+    std::error_code err;
+    fat32::Volume volume;
+    if (!image_.volume(p, volume, err)) {
+      add(i, Verdict::Error, "boot_sector", err.message());
+      return;
+    }
+    geometry(i, p, volume);
+    if (volume.fat_type() == fat32::FatType::Fat32) {
+      backup_boot(i, volume);
+      fsinfo(i, volume);
+    }
+    fat_head(i, volume);
+  }
+
+private:
+  void geometry(int i, const fat32::Partition &p, const fat32::Volume &v) {
+    auto &boot = v.boot();
+    uint64_t sectors =
+        boot.tot_sectors != 0 ? boot.tot_sectors : boot.tol_sector_cnt;
+    if (sectors * v.sector_size() > p.size_lba * p.sector_size) {
+      add(i, Verdict::Error, "volume_size",
+          std::to_string(sectors) + " sectors do not fit the partition");
+    }
+    // the open volume is cut down to what the FAT holds
+    uint64_t clusters = (sectors - v.data_sector()) / boot.sec_per_clus;
+    if (v.cluster_count() - 2 < clusters) {
+      add(i, Verdict::Error, "fat_size",
+          "FAT of " + std::to_string(v.fat_sectors()) + " sectors holds " +
+              std::to_string(v.cluster_count() - 2) + " of " +
+              std::to_string(clusters) + " clusters");
+    }
+    auto state = v.fat_type() == fat32::FatType::Fat32
+                     ? boot.reserved1
+                     : v.boot16().reserved1;
+    if (state & BOOT_STATE_DIRTY) {
+      add(i, Verdict::Warning, "dirty", "boot sector marks the volume dirty");
+    }
+  }
+
+  void backup_boot(int i, const fat32::Volume &v) {
+    auto backup = v.boot().backup_boot_sector;
+    if (backup == 0 || backup == 0xffff) {
+      add(i, Verdict::Warning, "backup_boot", "no backup boot sector");
+      return;
+    }
+    auto offset = v.offset() + (uint64_t)backup * v.sector_size();
+    if (backup >= v.boot().reserved_sec_cnt ||
+        offset + SECT > image_.size()) {
+      add(i, Verdict::Warning, "backup_boot",
+          "backup boot sector " + std::to_string(backup) +
+              " is outside the reserved sectors");
+      return;
+    }
+    if (std::memcmp(image_.data() + v.offset(), image_.data() + offset,
+                    SECT) != 0) {
+      add(i, Verdict::Warning, "backup_boot",
+          "backup boot sector " + std::to_string(backup) + " differs");
+    }
+  }
+
+  void fsinfo(int i, const fat32::Volume &v) {
+    auto info = v.fsinfo();
+    if (info == nullptr) {
+      add(i, Verdict::Error, "fsinfo", "fsinfo sector is past the end");
+      return;
+    }
+    if (info->signature1 != FSINFO_SIGNATURE1 ||
+        info->signature2 != FSINFO_SIGNATURE2 ||
+        info->signature3 != FSINFO_SIGNATURE3) {
+      add(i, Verdict::Warning, "fsinfo_signature",
+          "fsinfo signatures " + fat32::hex(info->signature1) + " " +
+              fat32::hex(info->signature2) + " " +
+              fat32::hex(info->signature3));
+      return;
+    }
+    // hints only, but a driver that trusts them allocates wrongly
+    if (info->free_clusters != FSINFO_UNKNOWN &&
+        info->free_clusters > v.cluster_count() - 2) {
+      add(i, Verdict::Warning, "fsinfo_free",
+          "fsinfo counts " + std::to_string(info->free_clusters) +
+              " free clusters of " + std::to_string(v.cluster_count() - 2));
+    }
+    // a full volume may point just past its last cluster
+    if (info->next_cluster != FSINFO_UNKNOWN &&
+        (info->next_cluster < 2 || info->next_cluster > v.cluster_count())) {
+      add(i, Verdict::Warning, "fsinfo_next",
+          "fsinfo next free cluster " + std::to_string(info->next_cluster) +
+              " is out of range");
+    }
+  }
+
+  // FAT[0] repeats the media byte, FAT[1] carries the shutdown state
+  void fat_head(int i, const fat32::Volume &v) {
+    auto media = v.boot().media_desc;
+    if (media != 0xF0 && media < 0xF8) {
+      add(i, Verdict::Warning, "media", "media byte " + fat32::hex(media));
+    }
+
+    auto fat = v.fat();
+    uint32_t fat0 = 0, fat1 = 0, expected = 0;
+    switch (v.fat_type()) {
+    case fat32::FatType::Fat12:
+      fat0 = (fat.data()[0] | fat.data()[1] << 8) & 0xfff;
+      expected = 0xf00 | media;
+      break;
+    case fat32::FatType::Fat16:
+      fat0 = fat.data()[0] | fat.data()[1] << 8;
+      fat1 = fat.data()[2] | fat.data()[3] << 8;
+      expected = 0xff00 | media;
+      break;
+    case fat32::FatType::Fat32:
+      std::memcpy(&fat0, fat.data(), sizeof(fat0));
+      std::memcpy(&fat1, fat.data() + 4, sizeof(fat1));
+      fat0 &= fat32::FAT32_MASK;
+      expected = 0x0fffff00 | media;
+      break;
+    }
+    if (fat0 != expected) {
+      add(i, Verdict::Error, "fat_media",
+          "FAT[0] is " + fat32::hex(fat0) + ", expected " +
+              fat32::hex(expected));
+    }
+
+    // FAT12 has no room for the flags
+    uint32_t clean = 0, no_io_error = 0;
+    if (v.fat_type() == fat32::FatType::Fat16) {
+      clean = FAT16_CLEAN;
+      no_io_error = FAT16_NO_IO_ERROR;
+    } else if (v.fat_type() == fat32::FatType::Fat32) {
+      clean = FAT32_CLEAN;
+      no_io_error = FAT32_NO_IO_ERROR;
+    }
+    if (clean && !(fat1 & clean)) {
+      add(i, Verdict::Warning, "dirty", "FAT[1] clean shutdown bit is clear");
+    }
+    if (no_io_error && !(fat1 & no_io_error)) {
+      add(i, Verdict::Warning, "io_error",
+          "FAT[1] records a disk I/O error");
+    }
+
+    // the other copies should start the same
+    auto first = v.fat_offset(0);
+    for (unsigned copy = 1; copy < v.fat_copies(); ++copy) {
+      auto bytes = std::min<uint64_t>(v.sector_size(), fat.bytes());
+      if (std::memcmp(image_.data() + first,
+                      image_.data() + v.fat_offset(copy), bytes) != 0) {
+        add(i, Verdict::Warning, "fat_copies",
+            "FAT copy " + std::to_string(copy + 1) +
+                " differs from the first in its first sector");
+      }
+    }
+  }
+
+  const fat32::Image &image_;
+  QuickReport &report_;
+};
+
+} // namespace
+
+QuickReport quick_check(const std::string &path) {
+  auto start = std::chrono::steady_clock::now();
+  QuickReport report;
+  report.path = path;
+  auto done = [&] {
+    report.seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+    return report;
+  };
+
+  fat32::Image image;
+  Checker check(image, report);
+  std::error_code err;
+  if (!image.open(path, err)) {
+    check.add(-1, Verdict::Error, "open", err.message());
+    return done();
+  }
+  if (!has_signature(image.data())) {
+    // anything in the table is as good as random then
+    check.add(-1, Verdict::Error, "mbr_signature",
+              "MBR does not end with 0x55 0xAA");
+    return done();
+  }
+
+  auto partitions = image.partitions(err);
+  if (err) {
+    check.add(-1, Verdict::Error, "partition_table", err.message());
+  }
+  if (partitions.empty()) {
+    check.add(-1, Verdict::Error, "partition_table", "no partitions");
+  }
+  check.disk(partitions);
+  for (auto &p : partitions) {
+    check.partition(p);
+  }
+  return done();
+}
+
+static const char *verdict_name(Verdict v) {
+  switch (v) {
+  case Verdict::Ok:
+    return "ok";
+  case Verdict::Warning:
+    return "warning";
+  case Verdict::Error:
+    return "error";
+  }
+  return "error";
+}
+
+int verdict_exit_code(Verdict verdict) { return (int)verdict; }
+
+void write_quick_report(const QuickReport &report, std::ostream &os) {
+  os << "{\"path\": " << json_string(report.path) << ", \"verdict\": \""
+     << verdict_name(report.verdict) << "\", \"seconds\": " << report.seconds
+     << ", \"findings\": [";
+  for (size_t i = 0; i < report.findings.size(); ++i) {
+    auto &f = report.findings[i];
+    os << (i ? ", " : "") << "{\"partition\": " << f.partition
+       << ", \"severity\": \"" << verdict_name(f.severity)
+       << "\", \"check\": \"" << f.check
+       << "\", \"message\": " << json_string(f.message) << "}";
+  }
+  os << "]}";
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+// ordered, the verdict of an image is its worst finding
+enum class Verdict { Ok, Warning, Error };
+
+struct Finding {
+  int partition; // as the dump numbers them, -1 for the disk itself
+  Verdict severity;
+  const char *check; // short stable name, e.g. "fsinfo_signature"
+  std::string message;
+};
+
+struct QuickReport {
+  std::string path;
+  Verdict verdict = Verdict::Ok;
+  std::vector<Finding> findings;
+  double seconds = 0;
+};
+
+// Health check for triage that reads a few sectors per partition: the MBR
+// signature and partition table, boot sector geometry and signature, the
+// FAT size against the volume size, the backup boot sector and fsinfo of
+// FAT32, and the media byte and clean shutdown bits of FAT[0] and FAT[1].
+// Nothing past the first sector of each FAT copy is read.
+QuickReport quick_check(const std::string &path);
+
+// the report as one line of JSON
+void write_quick_report(const QuickReport &report, std::ostream &os);
+
+// exit code for a verdict: 0 ok, 1 warnings, 2 errors
+int verdict_exit_code(Verdict verdict);
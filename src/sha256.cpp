@@ -0,0 +1,185 @@
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define SHA256_X86 1
+#endif
+
+#include "sha256.h"
+
+namespace {
+
+alignas(16) const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+uint32_t rotr(uint32_t x, int n) { return x >> n | x << (32 - n); }
+
+uint32_t load_be32(const uint8_t *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+         p[3];
+}
+
+void compress_generic(uint32_t state[8], const uint8_t *data, size_t blocks) {
+  for (; blocks; --blocks, data += 64) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; ++i) {
+      w[i] = load_be32(data + i * 4);
+    }
+    for (int i = 16; i < 64; ++i) {
+      auto s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+      auto s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    auto a = state[0], b = state[1], c = state[2], d = state[3];
+    auto e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; ++i) {
+      auto t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) +
+                ((e & f) ^ (~e & g)) + K[i] + w[i];
+      auto t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) +
+                ((a & b) ^ (a & c) ^ (b & c));
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+  }
+}
+
+#ifdef SHA256_X86
+// Four rounds per step, the state kept as ABEF and CDGH as the
+// instructions want it. Message words W[4g..4g+3] of step g >= 4 follow
+// from the four vectors before them.
+__attribute__((target("sha,ssse3,sse4.1"))) void
+compress_sha_ni(uint32_t state[8], const uint8_t *data, size_t blocks) {
+  const __m128i mask =
+      _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+  auto tmp = _mm_loadu_si128((const __m128i *)&state[0]);
+  auto state1 = _mm_loadu_si128((const __m128i *)&state[4]);
+  tmp = _mm_shuffle_epi32(tmp, 0xb1);            // CDAB
+  state1 = _mm_shuffle_epi32(state1, 0x1b);      // EFGH
+  auto state0 = _mm_alignr_epi8(tmp, state1, 8); // ABEF
+  state1 = _mm_blend_epi16(state1, tmp, 0xf0);   // CDGH
+
+  for (; blocks; --blocks, data += 64) {
+    auto abef = state0;
+    auto cdgh = state1;
+    __m128i w[4];
+#pragma GCC unroll 16
+    for (int g = 0; g < 16; ++g) {
+      __m128i m;
+      if (g < 4) {
+        m = _mm_shuffle_epi8(
+            _mm_loadu_si128((const __m128i *)(data + g * 16)), mask);
+      } else {
+        m = _mm_sha256msg1_epu32(w[g & 3], w[(g - 3) & 3]);
+        m = _mm_add_epi32(
+            m, _mm_alignr_epi8(w[(g - 1) & 3], w[(g - 2) & 3], 4));
+        m = _mm_sha256msg2_epu32(m, w[(g - 1) & 3]);
+      }
+      w[g & 3] = m;
+      auto t = _mm_add_epi32(m, _mm_load_si128((const __m128i *)&K[g * 4]));
+      state1 = _mm_sha256rnds2_epu32(state1, state0, t);
+      t = _mm_shuffle_epi32(t, 0x0e);
+      state0 = _mm_sha256rnds2_epu32(state0, state1, t);
+    }
+    state0 = _mm_add_epi32(state0, abef);
+    state1 = _mm_add_epi32(state1, cdgh);
+  }
+
+  tmp = _mm_shuffle_epi32(state0, 0x1b);       // FEBA
+  state1 = _mm_shuffle_epi32(state1, 0xb1);    // DCHG
+  state0 = _mm_blend_epi16(tmp, state1, 0xf0); // DCBA
+  state1 = _mm_alignr_epi8(state1, tmp, 8);    // ABEF
+  _mm_storeu_si128((__m128i *)&state[0], state0);
+  _mm_storeu_si128((__m128i *)&state[4], state1);
+}
+
+bool has_sha_ni() {
+  unsigned a, b, c, d;
+  if (!__get_cpuid(1, &a, &b, &c, &d) || !(c & bit_SSE4_1) ||
+      !(c & bit_SSSE3)) {
+    return false;
+  }
+  return __get_cpuid_count(7, 0, &a, &b, &c, &d) && (b & (1u << 29));
+}
+#endif
+
+using Compress = void (*)(uint32_t *, const uint8_t *, size_t);
+
+const Compress compress =
+#ifdef SHA256_X86
+    has_sha_ni() ? compress_sha_ni :
+#endif
+                 compress_generic;
+
+} // namespace
+
+Sha256::Sha256()
+    : state_{0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f,
+             0x9b05688c, 0x1f83d9ab, 0x5be0cd19} {}
+
+void Sha256::update(const uint8_t *data, size_t size) {
+  total_ += size;
+  if (buffered_) {
+    auto n = std::min(size, sizeof(buffer_) - buffered_);
+    std::memcpy(buffer_ + buffered_, data, n);
+    buffered_ += n;
+    data += n;
+    size -= n;
+    if (buffered_ < sizeof(buffer_)) {
+      return;
+    }
+    compress(state_, buffer_, 1);
+    buffered_ = 0;
+  }
+  compress(state_, data, size / 64);
+  data += size / 64 * 64;
+  size %= 64;
+  std::memcpy(buffer_, data, size);
+  buffered_ = size;
+}
+
+Sha256::Digest Sha256::finish() {
+  // 0x80, zeroes up to 8 bytes short of a block, the length in bits
+  uint8_t tail[128] = {0x80};
+  auto pad = (buffered_ < 56 ? 56 : 120) - buffered_;
+  auto bits = total_ * 8;
+  for (int i = 0; i < 8; ++i) {
+    tail[pad + i] = (uint8_t)(bits >> (56 - i * 8));
+  }
+  update(tail, pad + 8);
+
+  Digest digest;
+  for (int i = 0; i < 8; ++i) {
+    digest[i * 4] = (uint8_t)(state_[i] >> 24);
+    digest[i * 4 + 1] = (uint8_t)(state_[i] >> 16);
+    digest[i * 4 + 2] = (uint8_t)(state_[i] >> 8);
+    digest[i * 4 + 3] = (uint8_t)state_[i];
+  }
+  return digest;
+}
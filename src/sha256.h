@@ -0,0 +1,30 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+// SHA-256 (FIPS 180-4), with the SHA extensions of x86 CPUs that have them,
+// picked at run time
+class Sha256 {
+public:
+  static constexpr size_t SIZE = 32;
+  using Digest = std::array<uint8_t, SIZE>;
+
+  Sha256();
+
+  void update(const uint8_t *data, size_t size);
+  Digest finish();
+
+  static Digest hash(const uint8_t *data, size_t size) {
+    Sha256 h;
+    h.update(data, size);
+    return h.finish();
+  }
+
+private:
+  uint32_t state_[8];
+  uint8_t buffer_[64];
+  size_t buffered_ = 0;
+  uint64_t total_ = 0;
+};
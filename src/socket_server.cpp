@@ -0,0 +1,150 @@
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "socket_server.h"
+
+bool send_all(int fd, iovec *iov, int iovcnt) {
+  while (iovcnt) {
+    msghdr msg{};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = std::min(iovcnt, IOV_MAX);
+    auto r = ::sendmsg(fd, &msg, MSG_NOSIGNAL);
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r < 0) {
+      return false;
+    }
+    // skip what has been sent
+    while (iovcnt && (size_t)r >= iov->iov_len) {
+      r -= iov->iov_len;
+      ++iov;
+      --iovcnt;
+    }
+    if (iovcnt) {
+      iov->iov_base = static_cast<uint8_t *>(iov->iov_base) + r;
+      iov->iov_len -= r;
+    }
+  }
+  return true;
+}
+
+SocketConnection::~SocketConnection() { ::close(fd); }
+
+void SocketConnection::begin_request() {
+  std::lock_guard<std::mutex> lock(inflight_lock_);
+  ++inflight_;
+}
+
+void SocketConnection::end_request() {
+  std::lock_guard<std::mutex> lock(inflight_lock_);
+  if (--inflight_ == 0) {
+    inflight_cv_.notify_all();
+  }
+}
+
+void SocketConnection::wait_requests() {
+  std::unique_lock<std::mutex> lock(inflight_lock_);
+  inflight_cv_.wait(lock, [this] { return inflight_ == 0; });
+}
+
+void SocketServer::serve(const std::string &socket_path,
+                         const Handler &handler, std::error_code &err) {
+  err.clear();
+
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if (socket_path.size() >= sizeof(addr.sun_path)) {
+    err = std::make_error_code(std::errc::filename_too_long);
+    return;
+  }
+  std::strcpy(addr.sun_path, socket_path.c_str());
+
+  auto listen_fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listen_fd < 0) {
+    err = std::error_code(errno, std::system_category());
+    return;
+  }
+
+  ::unlink(socket_path.c_str());
+  if (::bind(listen_fd, (const sockaddr *)&addr, sizeof(addr)) != 0 ||
+      ::listen(listen_fd, SOMAXCONN) != 0) {
+    err = std::error_code(errno, std::system_category());
+    ::close(listen_fd);
+    return;
+  }
+  listening_ = true;
+
+  struct Reader {
+    std::thread thread;
+    std::shared_ptr<SocketConnection> conn;
+  };
+  std::vector<Reader> readers;
+  while (!stop_) {
+    for (size_t i = 0; i < readers.size();) {
+      if (readers[i].conn->done_) {
+        readers[i].thread.join();
+        readers[i] = std::move(readers.back());
+        readers.pop_back();
+      } else {
+        ++i;
+      }
+    }
+
+    pollfd p{listen_fd, POLLIN, 0};
+    if (::poll(&p, 1, 100) <= 0) {
+      continue;
+    }
+    auto fd = ::accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd < 0) {
+      continue;
+    }
+
+    auto conn = std::make_shared<SocketConnection>(fd);
+    {
+      std::lock_guard<std::mutex> lock(conn_lock_);
+      connections_.insert(conn);
+    }
+    readers.push_back({std::thread(&SocketServer::run, this, conn,
+                                   std::cref(handler)),
+                       conn});
+  }
+
+  ::close(listen_fd);
+  ::unlink(socket_path.c_str());
+
+  // wake up readers blocked on their sockets
+  {
+    std::lock_guard<std::mutex> lock(conn_lock_);
+    for (auto &c : connections_) {
+      ::shutdown(c->fd, SHUT_RDWR);
+    }
+  }
+  for (auto &r : readers) {
+    r.thread.join();
+  }
+  listening_ = false;
+}
+
+void SocketServer::run(std::shared_ptr<SocketConnection> conn,
+                       const Handler &handler) {
+  handler(conn);
+
+  conn->wait_requests();
+  ::shutdown(conn->fd, SHUT_RDWR);
+  {
+    std::lock_guard<std::mutex> lock(conn_lock_);
+    connections_.erase(conn);
+  }
+  conn->done_ = true;
+}
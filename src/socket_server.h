@@ -0,0 +1,71 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <system_error>
+
+#include <sys/uio.h>
+
+// Sends all of iov, IOV_MAX at a time, retrying on EINTR. Consumes iov.
+// False if the peer is gone.
+bool send_all(int fd, iovec *iov, int iovcnt);
+
+// A client of a SocketServer. Its reader hands requests to workers, which
+// answer them in any order, so replies are sent under send_lock and the
+// connection is not shut down while one is still in flight.
+struct SocketConnection {
+  int fd;
+  std::mutex send_lock;
+
+  explicit SocketConnection(int fd) : fd(fd) {}
+  SocketConnection(const SocketConnection &) = delete;
+  SocketConnection &operator=(const SocketConnection &) = delete;
+  ~SocketConnection();
+
+  // around every request handed to a worker
+  void begin_request();
+  void end_request();
+  void wait_requests();
+
+private:
+  friend class SocketServer;
+
+  std::mutex inflight_lock_;
+  std::condition_variable inflight_cv_;
+  unsigned inflight_ = 0;
+  std::atomic<bool> done_{false}; // its reader returned, to be joined
+};
+
+// Accepts clients on a Unix domain socket, with a reader thread per
+// connection that runs the handler of the server. Readers of closed
+// connections are joined as it goes.
+class SocketServer {
+public:
+  // Reads requests off the connection until the client or the server is
+  // done. Its requests in flight are waited for after it returns.
+  using Handler = std::function<void(std::shared_ptr<SocketConnection>)>;
+
+  // Binds socket_path and serves clients until stop() is called, then
+  // shuts the open connections down and joins their readers.
+  void serve(const std::string &socket_path, const Handler &handler,
+             std::error_code &err);
+  // Async-signal-safe: only raises a flag that serve() polls for.
+  void stop() { stop_ = true; }
+  bool stopped() const { return stop_; }
+
+  bool listening() const { return listening_; }
+
+private:
+  void run(std::shared_ptr<SocketConnection> conn, const Handler &handler);
+
+  std::mutex conn_lock_;
+  std::set<std::shared_ptr<SocketConnection>> connections_;
+
+  std::atomic<bool> stop_{false};
+  std::atomic<bool> listening_{false};
+};
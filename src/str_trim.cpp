@@ -1,43 +0,0 @@
-#include <algorithm>
-#include <cctype>
-#include <functional>
-#include <locale>
-
-// trim from start (in place)
-void ltrim(std::string &s) {
-  s.erase(s.begin(),
-          std::find_if(s.begin(), s.end(),
-                       std::not1(std::ptr_fun<int, int>(std::isspace))));
-}
-
-// trim from end (in place)
-void rtrim(std::string &s) {
-  s.erase(std::find_if(s.rbegin(), s.rend(),
-                       std::not1(std::ptr_fun<int, int>(std::isspace)))
-              .base(),
-          s.end());
-}
-
-// trim from both ends (in place)
-void trim(std::string &s) {
-  ltrim(s);
-  rtrim(s);
-}
-
-// trim from start (copying)
-std::string ltrim_copy(std::string s) {
-  ltrim(s);
-  return s;
-}
-
-// trim from end (copying)
-std::string rtrim_copy(std::string s) {
-  rtrim(s);
-  return s;
-}
-
-std::string trim_copy(std::string s) {
-  rtrim(s);
-  ltrim(s);
-  return s;
-}
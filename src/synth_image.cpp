@@ -0,0 +1,655 @@
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "emfat1.h"
+
+#include "synth_image.h"
+
+// partition alignment and layout of the reserved area, FAT12/16 only
+// reserve the boot sector
+static constexpr uint32_t PART_START = 2048;
+static constexpr uint16_t RESERVED_SECTORS = 32;
+static constexpr uint16_t BACKUP_BOOT_SECTOR = 6;
+
+// cluster counts define the FAT type, past the last the links run into the
+// marks
+static constexpr uint32_t MAX_FAT12_CLUSTERS = 4084;
+static constexpr uint32_t MAX_FAT16_CLUSTERS = 65524;
+static constexpr uint32_t MAX_CLUSTERS = CLUST_BAD - 2;
+
+// FAT blocks that are all zero stay holes
+static constexpr size_t FAT_BLOCK = 64 * 1024;
+
+// long names of generated entries all take 3 slots
+static constexpr uint32_t LONG_NAME_SLOTS = 3;
+
+static std::error_code last_error() {
+  return std::error_code(errno, std::system_category());
+}
+
+static bool pwrite_all(int fd, const uint8_t *data, size_t size,
+                       uint64_t offset) {
+  while (size) {
+    auto r = ::pwrite(fd, data, size, (off_t)offset);
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r <= 0) {
+      return false;
+    }
+    data += r;
+    size -= r;
+    offset += r;
+  }
+  return true;
+}
+
+// splitmix64: std:: distributions differ between standard libraries and the
+// images must not
+class Rng {
+public:
+  explicit Rng(uint64_t seed) : state_(seed) {}
+
+  uint64_t next() {
+    uint64_t z = (state_ += 0x9e3779b97f4a7c15);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    return z ^ (z >> 31);
+  }
+
+  // uniform in [0, n)
+  uint64_t below(uint64_t n) {
+    return (uint64_t)(((unsigned __int128)next() * n) >> 64);
+  }
+
+  // uniform in [0, 1)
+  double real() { return (next() >> 11) * 0x1.0p-53; }
+
+private:
+  uint64_t state_;
+};
+
+class Generator {
+public:
+  Generator(const SynthSpec &spec, int fd, SynthStats &stats)
+      : spec_(spec), fd_(fd), stats_(stats), rng_(spec.seed),
+        cluster_size_((uint32_t)spec.sectors_per_cluster * SECT),
+        fat_(spec.clusters + 2), used_((fat_.size() + 63) / 64),
+        free_(spec.clusters) {
+    fat_[0] = 0x0FFFFFF8;
+    fat_[1] = CLUST_EOF;
+    used_[0] = 3;
+    // bits past the last cluster are never free
+    if (fat_.size() % 64) {
+      used_.back() |= ~0ull << (fat_.size() % 64);
+    }
+
+    uint64_t fat_bytes = spec.fat_bits == 12 ? (fat_.size() * 3 + 1) / 2
+                                             : fat_.size() * spec.fat_bits / 8;
+    sectors_per_fat = (uint32_t)((fat_bytes + SECT - 1) / SECT);
+    reserved_sectors = spec.fat_bits == 32 ? RESERVED_SECTORS : 1;
+    root_sectors = spec.fat_bits == 32
+                       ? 0
+                       : (spec.root_entries * sizeof(dir_entry) + SECT - 1) /
+                             SECT;
+    root_lba = PART_START + reserved_sectors + 2 * sectors_per_fat;
+    data_lba = root_lba + root_sectors;
+  }
+
+  uint32_t sectors_per_fat;
+  uint32_t reserved_sectors;
+  uint32_t root_sectors; // the fixed root of FAT12/16
+  uint32_t root_lba;
+  uint32_t data_lba;
+
+  bool build_tree(std::error_code &err) {
+    struct Pending {
+      uint32_t first;
+      uint32_t parent;
+      uint32_t level;
+    };
+
+    // FAT12/16 keep the root outside the clusters, it is cluster 0
+    uint32_t root = 0;
+    if (fixed_root()) {
+      if (dir_entries(0) > spec_.root_entries) {
+        err = std::make_error_code(std::errc::no_space_on_device);
+        return false;
+      }
+    } else if ((root = alloc_chain(dir_clusters(0))) != 2) {
+      err = std::make_error_code(std::errc::no_space_on_device);
+      return false;
+    }
+
+    std::vector<Pending> pending{{root, 0, 0}};
+    std::vector<uint8_t> buf;
+    while (!pending.empty()) {
+      auto dir = pending.back();
+      pending.pop_back();
+
+      buf.assign(dir.first == 0
+                     ? (size_t)root_sectors * SECT
+                     : (size_t)dir_clusters(dir.level) * cluster_size_,
+                 0);
+      auto e = reinterpret_cast<dir_entry *>(buf.data());
+      if (dir.level == 0) {
+        set_label(*e++);
+      } else {
+        set_entry(*e++, ".          ", ATTR_DIR, dir.first, 0);
+        set_entry(*e++, "..         ", ATTR_DIR, dir.parent, 0);
+      }
+
+      char name[SHRT_FILE_NAME_LEN + 1];
+      for (uint32_t i = 0; i < spec_.files_per_dir; ++i) {
+        auto size = file_size();
+        auto first = size ? alloc_chain(
+                                (uint32_t)((size + cluster_size_ - 1) /
+                                           cluster_size_))
+                          : 0;
+        if (size && first == 0) {
+          err = std::make_error_code(std::errc::no_space_on_device);
+          return false;
+        }
+        if (first) {
+          file_starts_.push_back(first);
+        }
+        std::snprintf(name, sizeof(name), "F%07uDAT", i % 10000000);
+        if (spec_.long_names) {
+          auto prefix = i % 8 == 7 ? u"Синтетический файл " : u"Synthetic file ";
+          e = set_long_name(e, name, prefix, i, u".data");
+        }
+        set_entry(*e++, name, ATTR_ARCHIVE, first, size);
+        ++stats_.files;
+      }
+
+      for (uint32_t i = 0; dir.level < spec_.depth && i < spec_.dirs_per_dir;
+           ++i) {
+        auto first = alloc_chain(dir_clusters(dir.level + 1));
+        if (first == 0) {
+          err = std::make_error_code(std::errc::no_space_on_device);
+          return false;
+        }
+        std::snprintf(name, sizeof(name), "D%07u   ", i % 10000000);
+        if (spec_.long_names) {
+          e = set_long_name(e, name, u"Synthetic directory ", i, u"");
+        }
+        set_entry(*e++, name, ATTR_DIR, first, 0);
+        // ".." of a directory in the root points to cluster 0
+        pending.push_back({first, dir.level ? dir.first : 0, dir.level + 1});
+        ++stats_.dirs;
+      }
+
+      if (dir.first == 0
+              ? !pwrite_all(fd_, buf.data(), buf.size(),
+                            (uint64_t)root_lba * SECT)
+              : !write_chain(dir.first, buf)) {
+        err = last_error();
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool corrupt(std::error_code &err) {
+    for (uint32_t i = 0; i < spec_.lost_chains; ++i) {
+      auto size = std::max<uint64_t>(1, file_size());
+      if (alloc_chain((uint32_t)((size + cluster_size_ - 1) / cluster_size_)) ==
+          0) {
+        err = std::make_error_code(std::errc::no_space_on_device);
+        return false;
+      }
+    }
+
+    // each file gets at most one corrupted tail
+    for (uint32_t i = 0; i < spec_.cross_links && file_starts_.size() > 1;
+         ++i) {
+      auto from = take_file();
+      auto to = file_starts_[rng_.below(file_starts_.size())];
+      auto len = chain_length(to);
+      for (auto steps = rng_.below(len); steps; --steps) {
+        to = fat_[to];
+      }
+      fat_[chain_tail(from)] = to;
+    }
+    for (uint32_t i = 0; i < spec_.loops && !file_starts_.empty(); ++i) {
+      auto first = take_file();
+      fat_[chain_tail(first)] = first;
+    }
+
+    for (uint32_t i = 0; i < spec_.bad_clusters && free_; ++i) {
+      auto c = find_free(2 + (uint32_t)rng_.below(spec_.clusters));
+      mark_used(c);
+      fat_[c] = CLUST_BAD;
+    }
+    return true;
+  }
+
+  bool write_metadata(std::error_code &err) {
+    const uint32_t total = reserved_sectors + 2 * sectors_per_fat +
+                           root_sectors +
+                           spec_.clusters * spec_.sectors_per_cluster;
+
+    std::vector<uint8_t> sector(SECT);
+    auto mbr = reinterpret_cast<mbr_t *>(sector.data());
+    mbr->DiskSig = (uint32_t)spec_.seed;
+    auto &part = mbr->PartTable[0];
+    // CHS fields saturated, addressing is by LBA
+    part.start_head = part.end_head = 0xFE;
+    part.start_sector = part.end_sector = 0xFF;
+    part.start_cylinder = part.end_cylinder = 0xFF;
+    part.PartType = spec_.fat_bits == 12   ? 0x01
+                    : spec_.fat_bits == 16 ? 0x06
+                                           : 0x0C;
+    part.StartLBA = PART_START;
+    part.SizeLBA = total;
+    mbr->BootSignature[0] = 0x55;
+    mbr->BootSignature[1] = 0xAA;
+    if (!pwrite_all(fd_, sector.data(), SECT, 0)) {
+      err = last_error();
+      return false;
+    }
+
+    std::fill(sector.begin(), sector.end(), 0);
+    auto boot = reinterpret_cast<boot_sector *>(sector.data());
+    boot->jump[0] = 0xEB;
+    boot->jump[1] = fixed_root() ? 0x3C : 0x58;
+    boot->jump[2] = 0x90;
+    std::memcpy(boot->OEM_name, "MSWIN4.1", OEM_NAME_LEN);
+    boot->bytes_per_sec = SECT;
+    boot->sec_per_clus = spec_.sectors_per_cluster;
+    boot->reserved_sec_cnt = (uint16_t)reserved_sectors;
+    boot->fat_cnt = 2;
+    boot->media_desc = 0xF8;
+    boot->sec_per_track = 63;
+    boot->number_of_heads = 255;
+    boot->hidden_sec_cnt = PART_START;
+    auto id = (uint32_t)(spec_.seed >> 32 ^ spec_.seed);
+    if (fixed_root()) {
+      auto boot16 = reinterpret_cast<boot_sector16 *>(sector.data());
+      boot16->root_dir_max_cnt = spec_.root_entries;
+      if (total < 0x10000) {
+        boot16->tot_sectors = (uint16_t)total;
+      } else {
+        boot16->tol_sector_cnt = total;
+      }
+      boot16->sec_per_fat_fat16 = (uint16_t)sectors_per_fat;
+      boot16->drive_number = 0x80;
+      boot16->boot_sig = 0x29;
+      std::memcpy(boot16->volume_id, &id, VOL_ID_LEN);
+      pad_name(boot16->volume_label, VOL_LABEL_LEN, spec_.label);
+      std::memcpy(boot16->file_system_type,
+                  spec_.fat_bits == 12 ? "FAT12   " : "FAT16   ",
+                  FILE_SYS_TYPE_LENGTH);
+    } else {
+      boot->tol_sector_cnt = total;
+      boot->sectors_per_fat = sectors_per_fat;
+      boot->root_dir_strt_cluster = 2;
+      boot->fs_info_sector = 1;
+      boot->backup_boot_sector = BACKUP_BOOT_SECTOR;
+      boot->drive_number = 0x80;
+      boot->boot_sig = 0x29;
+      std::memcpy(boot->volume_id, &id, VOL_ID_LEN);
+      pad_name(boot->volume_label, VOL_LABEL_LEN, spec_.label);
+      std::memcpy(boot->file_system_type, "FAT32   ", FILE_SYS_TYPE_LENGTH);
+    }
+    sector[510] = 0x55;
+    sector[511] = 0xAA;
+    if (!pwrite_all(fd_, sector.data(), SECT, (uint64_t)PART_START * SECT) ||
+        (!fixed_root() &&
+         !pwrite_all(fd_, sector.data(), SECT,
+                     (uint64_t)(PART_START + BACKUP_BOOT_SECTOR) * SECT))) {
+      err = last_error();
+      return false;
+    }
+
+    // and only FAT32 has fsinfo
+    std::fill(sector.begin(), sector.end(), 0);
+    auto fsinfo = reinterpret_cast<fsinfo_t *>(sector.data());
+    fsinfo->signature1 = 0x41615252;
+    fsinfo->signature2 = 0x61417272;
+    fsinfo->free_clusters = free_;
+    fsinfo->next_cluster = cursor_;
+    fsinfo->signature3 = 0xAA550000;
+    if (!fixed_root() &&
+        (!pwrite_all(fd_, sector.data(), SECT,
+                     (uint64_t)(PART_START + 1) * SECT) ||
+         !pwrite_all(fd_, sector.data(), SECT,
+                     (uint64_t)(PART_START + BACKUP_BOOT_SECTOR + 1) * SECT))) {
+      err = last_error();
+      return false;
+    }
+
+    auto fat = reinterpret_cast<const uint8_t *>(fat_.data());
+    size_t fat_bytes = fat_.size() * 4;
+    std::vector<uint8_t> packed;
+    if (spec_.fat_bits != 32) {
+      packed = pack_fat();
+      fat = packed.data();
+      fat_bytes = packed.size();
+    }
+    for (int copy = 0; copy < 2; ++copy) {
+      auto offset = (uint64_t)(PART_START + reserved_sectors +
+                               copy * sectors_per_fat) *
+                    SECT;
+      for (size_t pos = 0; pos < fat_bytes; pos += FAT_BLOCK) {
+        auto n = std::min(FAT_BLOCK, fat_bytes - pos);
+        if (std::all_of(fat + pos, fat + pos + n,
+                        [](uint8_t b) { return b == 0; })) {
+          continue;
+        }
+        if (!pwrite_all(fd_, fat + pos, n, offset + pos)) {
+          err = last_error();
+          return false;
+        }
+        stats_.bytes_written += n;
+      }
+    }
+
+    stats_.used_clusters = spec_.clusters - free_;
+    stats_.volume_size = (uint64_t)(PART_START + total) * SECT;
+    return true;
+  }
+
+private:
+  bool fixed_root() const { return spec_.fat_bits != 32; }
+
+  // slots of a directory at level, with the label or "." and ".."
+  uint64_t dir_entries(uint32_t level) const {
+    uint64_t entries = (uint64_t)spec_.files_per_dir +
+                       (level < spec_.depth ? spec_.dirs_per_dir : 0);
+    return entries * (spec_.long_names ? 1 + LONG_NAME_SLOTS : 1) +
+           (level ? 2 : 1);
+  }
+
+  uint32_t dir_clusters(uint32_t level) const {
+    return (uint32_t)std::max<uint64_t>(
+        1, (dir_entries(level) * sizeof(dir_entry) + cluster_size_ - 1) /
+               cluster_size_);
+  }
+
+  // the FAT in 12 or 16 bit entries, marks cut down to their width
+  std::vector<uint8_t> pack_fat() const {
+    std::vector<uint8_t> res;
+    if (spec_.fat_bits == 16) {
+      res.resize(fat_.size() * 2);
+      for (size_t i = 0; i < fat_.size(); ++i) {
+        res[i * 2] = (uint8_t)fat_[i];
+        res[i * 2 + 1] = (uint8_t)(fat_[i] >> 8);
+      }
+      return res;
+    }
+    // two entries in three bytes, the odd one in the upper 12 bits
+    res.resize((fat_.size() * 3 + 1) / 2 + 1);
+    for (size_t i = 0; i < fat_.size(); ++i) {
+      auto v = fat_[i] & 0xfff;
+      auto p = &res[i + i / 2];
+      if (i & 1) {
+        p[0] = (uint8_t)((p[0] & 0x0f) | v << 4);
+        p[1] = (uint8_t)(v >> 4);
+      } else {
+        p[0] = (uint8_t)v;
+        p[1] = (uint8_t)((p[1] & 0xf0) | v >> 8);
+      }
+    }
+    res.resize((fat_.size() * 3 + 1) / 2);
+    return res;
+  }
+
+  // exponential with the requested mean, capped to what a FAT file can hold
+  uint32_t file_size() {
+    auto clusters = -std::log(1.0 - rng_.real()) * spec_.mean_file_clusters;
+    return (uint32_t)std::min(clusters * cluster_size_, 4294967295.0);
+  }
+
+  bool is_used(uint32_t c) const { return used_[c / 64] >> (c % 64) & 1; }
+
+  void mark_used(uint32_t c) {
+    used_[c / 64] |= 1ull << (c % 64);
+    --free_;
+  }
+
+  // first free cluster at or after from, wrapping around
+  uint32_t find_free(uint32_t from) const {
+    auto w = from / 64;
+    auto bits = ~used_[w] & (~0ull << (from % 64));
+    for (size_t n = 0; n <= used_.size(); ++n) {
+      if (bits) {
+        return (uint32_t)(w * 64 + __builtin_ctzll(bits));
+      }
+      w = (w + 1) % used_.size();
+      bits = ~used_[w];
+    }
+    return 0;
+  }
+
+  uint32_t random_cluster() {
+    return 2 + (uint32_t)rng_.below(spec_.clusters);
+  }
+
+  // Links count free clusters into a chain. Clusters follow each other
+  // unless fragmentation sends the next one to a random place, like a real
+  // allocator that keeps a next free hint. Returns 0 when out of space.
+  uint32_t alloc_chain(uint32_t count) {
+    if (count > free_) {
+      return 0;
+    }
+
+    uint32_t first = 0;
+    uint32_t prev = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+      auto from = cursor_;
+      if (prev && spec_.fragmentation > 0 &&
+          rng_.real() < spec_.fragmentation) {
+        from = random_cluster();
+      }
+      auto c = find_free(from);
+      mark_used(c);
+      if (c != prev + 1) {
+        ++stats_.fragments;
+      }
+      if (prev) {
+        fat_[prev] = c;
+      } else {
+        first = c;
+      }
+      prev = c;
+      cursor_ = c + 1 < fat_.size() ? c + 1 : 2;
+    }
+    fat_[prev] = CLUST_EOF;
+    return first;
+  }
+
+  uint32_t chain_length(uint32_t c) const {
+    uint32_t n = 1;
+    for (; fat_[c] < CLUST_BAD && n < fat_.size(); ++n) {
+      c = fat_[c];
+    }
+    return n;
+  }
+
+  uint32_t chain_tail(uint32_t c) const {
+    for (size_t n = 0; fat_[c] < CLUST_BAD && n < fat_.size(); ++n) {
+      c = fat_[c];
+    }
+    return c;
+  }
+
+  // removes a random file from the candidates for corruption
+  uint32_t take_file() {
+    auto i = rng_.below(file_starts_.size());
+    auto first = file_starts_[i];
+    file_starts_[i] = file_starts_.back();
+    file_starts_.pop_back();
+    return first;
+  }
+
+  // writes buf over the clusters of the chain, one pwrite per contiguous run
+  bool write_chain(uint32_t first, const std::vector<uint8_t> &buf) {
+    size_t pos = 0;
+    auto c = first;
+    while (pos < buf.size()) {
+      auto run = c;
+      size_t n = cluster_size_;
+      while (pos + n < buf.size() && fat_[c] == c + 1) {
+        c = fat_[c];
+        n += cluster_size_;
+      }
+      auto offset = ((uint64_t)data_lba +
+                     (uint64_t)(run - 2) * spec_.sectors_per_cluster) *
+                    SECT;
+      if (!pwrite_all(fd_, &buf[pos], n, offset)) {
+        return false;
+      }
+      stats_.bytes_written += n;
+      pos += n;
+      c = fat_[c];
+    }
+    return true;
+  }
+
+  static void pad_name(uint8_t *dest, size_t size, const std::string &name) {
+    std::memset(dest, ' ', size);
+    for (size_t i = 0; i < size && i < name.size(); ++i) {
+      dest[i] = (uint8_t)std::toupper((unsigned char)name[i]);
+    }
+  }
+
+  void stamp(dir_entry &e) {
+    // somewhere in 2000-2023, the dates are only there to be parsed
+    e.crt_date = e.lst_mod_date = e.lst_access_date =
+        (uint16_t)((20 + rng_.below(24)) << 9 | (1 + rng_.below(12)) << 5 |
+                   (1 + rng_.below(28)));
+    e.crt_time = e.lst_mod_time =
+        (uint16_t)(rng_.below(24) << 11 | rng_.below(60) << 5 |
+                   rng_.below(30));
+  }
+
+  void set_entry(dir_entry &e, const char *name, uint8_t attr,
+                 uint32_t cluster, uint32_t size) {
+    std::memcpy(e.name, name, FILE_NAME_SHRT_LEN);
+    std::memcpy(e.extn, name + FILE_NAME_SHRT_LEN, FILE_NAME_EXTN_LEN);
+    e.attr = attr;
+    e.strt_clus_hword = (uint16_t)(cluster >> 16);
+    e.strt_clus_lword = (uint16_t)cluster;
+    e.size = size;
+    stamp(e);
+  }
+
+  // "<prefix><7 digits><suffix>" as long name slots in front of the short
+  // name, returns the slot for the short entry
+  static dir_entry *set_long_name(dir_entry *e, const char *short_name,
+                                  const char16_t *prefix, uint32_t n,
+                                  const char16_t *suffix) {
+    std::u16string name = prefix;
+    char digits[8];
+    std::snprintf(digits, sizeof(digits), "%07u", n % 10000000);
+    name.append(digits, digits + 7);
+    name += suffix;
+
+    uint8_t sum = 0;
+    for (int i = 0; i < SHRT_FILE_NAME_LEN; ++i) {
+      sum = (uint8_t)(((sum & 1) << 7) + (sum >> 1) + (uint8_t)short_name[i]);
+    }
+
+    // the slot with the highest ord and the end of the name comes first
+    for (uint32_t ord = LONG_NAME_SLOTS; ord >= 1; --ord) {
+      uint16_t chars[LFN_LEN_PER_ENTRY];
+      for (uint32_t i = 0; i < LFN_LEN_PER_ENTRY; ++i) {
+        auto at = (ord - 1) * LFN_LEN_PER_ENTRY + i;
+        chars[i] = at < name.size()    ? (uint16_t)name[at]
+                   : at == name.size() ? LFN_TERM_MARK
+                                       : LFN_END_MARK;
+      }
+      auto l = reinterpret_cast<lfn_entry *>(e++);
+      l->ord_field =
+          (uint8_t)(ord | (ord == LONG_NAME_SLOTS ? LAST_ORD_FIELD_SEQ : 0));
+      l->flag = ATTR_LONG_FNAME;
+      l->chksum = sum;
+      std::memcpy(l->fname0_4, chars, LFN_FIRST_SET_LEN);
+      std::memcpy(l->fname6_11, chars + LFN_FIRST_SET_CNT, LFN_SEC_SET_LEN);
+      std::memcpy(l->fname12_13, chars + LFN_FIRST_SET_CNT + LFN_SEC_SET_CNT,
+                  LFN_THIRD_SET_LEN);
+    }
+    return e;
+  }
+
+  void set_label(dir_entry &e) {
+    pad_name(e.name, SHRT_FILE_NAME_LEN, spec_.label);
+    e.attr = ATTR_VOL_LABEL;
+    stamp(e);
+  }
+
+  const SynthSpec &spec_;
+  int fd_;
+  SynthStats &stats_;
+  Rng rng_;
+  uint32_t cluster_size_;
+
+  std::vector<uint32_t> fat_;
+  std::vector<uint64_t> used_; // allocation bitmap, 1 - taken
+  uint32_t free_;
+  uint32_t cursor_ = 2;
+
+  std::vector<uint32_t> file_starts_;
+};
+
+bool synth_image(const SynthSpec &spec, const std::string &out,
+                 SynthStats &stats, std::error_code &err) {
+  err.clear();
+  stats = SynthStats();
+
+  auto spc = spec.sectors_per_cluster;
+  uint32_t min_clusters = spec.fat_bits == 12   ? 1
+                          : spec.fat_bits == 16 ? MAX_FAT12_CLUSTERS + 1
+                                                : MAX_FAT16_CLUSTERS + 1;
+  uint32_t max_clusters = spec.fat_bits == 12   ? MAX_FAT12_CLUSTERS
+                          : spec.fat_bits == 16 ? MAX_FAT16_CLUSTERS
+                                                : MAX_CLUSTERS;
+  if ((spec.fat_bits != 12 && spec.fat_bits != 16 && spec.fat_bits != 32) ||
+      spec.clusters < min_clusters || spec.clusters > max_clusters ||
+      (spec.fat_bits != 32 &&
+       (spec.root_entries == 0 ||
+        spec.root_entries % (SECT / sizeof(dir_entry)) != 0)) ||
+      spc == 0 || (spc & (spc - 1)) != 0 || spec.fragmentation < 0 ||
+      spec.fragmentation > 1 || !(spec.mean_file_clusters >= 0)) {
+    err = std::make_error_code(std::errc::invalid_argument);
+    return false;
+  }
+  // the MBR addresses sectors with 32 bits
+  if ((uint64_t)spec.clusters * spc + RESERVED_SECTORS +
+          2 * (((uint64_t)spec.clusters + 2) * 4 / SECT + 1) +
+          spec.root_entries * sizeof(dir_entry) / SECT + PART_START >
+      UINT32_MAX) {
+    err = std::make_error_code(std::errc::file_too_large);
+    return false;
+  }
+
+  auto fd = ::open(out.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    err = last_error();
+    return false;
+  }
+
+  Generator gen(spec, fd, stats);
+  auto size = ((uint64_t)gen.data_lba + (uint64_t)spec.clusters * spc) * SECT;
+  if (::ftruncate(fd, (off_t)size) != 0) {
+    err = last_error();
+  }
+
+  bool ok = !err && gen.build_tree(err) && gen.corrupt(err) &&
+            gen.write_metadata(err);
+  if (::close(fd) != 0 && ok) {
+    err = last_error();
+    ok = false;
+  }
+  return ok;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <system_error>
+
+// Shape of a generated FAT volume. The same spec and seed always produce
+// the same image, byte for byte.
+struct SynthSpec {
+  uint64_t seed = 1;
+  uint32_t clusters = 1 << 20; // data clusters, sets the volume size
+  uint8_t sectors_per_cluster = 8;
+
+  // 12 or 16 need a cluster count in their range and put the root
+  // directory in a fixed region of root_entries slots
+  unsigned fat_bits = 32;
+  uint16_t root_entries = 512;
+
+  // every directory down to depth holds files_per_dir files and, except the
+  // deepest, dirs_per_dir subdirectories
+  uint32_t files_per_dir = 64;
+  uint32_t dirs_per_dir = 4;
+  uint32_t depth = 2;
+
+  // file sizes are exponentially distributed with this mean, in clusters
+  double mean_file_clusters = 4;
+  // chance that the next cluster of a file or directory goes to a random
+  // place instead of the following free one, 0 - no fragmentation
+  double fragmentation = 0;
+
+  // injected corruption
+  uint32_t bad_clusters = 0; // free clusters marked bad
+  uint32_t cross_links = 0;  // file tails linked into another file's chain
+  uint32_t loops = 0;        // file tails linked back to their first cluster
+  uint32_t lost_chains = 0;  // allocated chains no directory refers to
+
+  // VFAT long names in front of every file and directory, one in eight of
+  // them not ASCII
+  bool long_names = false;
+
+  std::string label = "SYNTH";
+};
+
+struct SynthStats {
+  uint64_t files = 0;
+  uint64_t dirs = 0;
+  uint64_t used_clusters = 0;
+  uint64_t fragments = 0;
+  uint64_t volume_size = 0;
+  uint64_t bytes_written = 0;
+};
+
+// Writes a sparse MBR disk image with a single FAT partition laid out by
+// spec. Only the boot sectors, FATs and directories are written, file
+// contents are holes. Fails with ENOSPC if the tree does not fit.
+bool synth_image(const SynthSpec &spec, const std::string &out,
+                 SynthStats &stats, std::error_code &err);
@@ -0,0 +1,202 @@
+#include <algorithm>
+#include <array>
+#include <charconv>
+
+#include "json.h"
+#include "timeline.h"
+#include "work_pool.h"
+
+static constexpr int KEY_BITS = 42;
+static constexpr int DIGIT_BITS = 8;
+static constexpr size_t BUCKETS = 1 << DIGIT_BITS;
+// fewer events per worker cost more in task hand-off than they save
+static constexpr size_t MIN_PART = 1 << 16;
+
+void Timeline::add(const fat32::Volume &volume, int partition) {
+  fat32::TreePaths paths;
+  auto tree = volume.tree();
+  for (auto it = tree.begin(); it != tree.end(); ++it) {
+    auto e = *it;
+    if (e.is_volume_label()) {
+      continue;
+    }
+
+    Item item;
+    item.path = paths_.size();
+    item.path_size =
+        (uint32_t)paths.append(paths_, it.depth(), e.name(), e.is_dir());
+    item.size = e.size();
+    item.cluster = e.first_cluster();
+    item.partition = (uint16_t)partition;
+    item.attr = e.attr();
+
+    auto index = (uint32_t)entries_.size();
+    entries_.push_back(item);
+    auto &raw = e.raw();
+    auto stamp = [&](uint16_t date, uint16_t time, uint8_t tenth, Kind kind) {
+      if (date != 0) {
+        uint64_t key = (uint64_t)date << 26 | (uint64_t)time << 10 |
+                       (uint64_t)tenth << 2 | kind;
+        events_.push_back({key, index});
+      }
+    };
+    stamp(raw.crt_date, raw.crt_time, raw.crt_time_tenth, Created);
+    stamp(raw.lst_mod_date, raw.lst_mod_time, 0, Modified);
+    stamp(raw.lst_access_date, 0, 0, Accessed);
+  }
+}
+
+void Timeline::sort(unsigned threads) {
+  const size_t n = events_.size();
+  if (n < 2) {
+    return;
+  }
+
+  WorkPool pool(threads);
+  const size_t parts =
+      std::max<size_t>(1, std::min<size_t>(pool.size(), n / MIN_PART));
+  std::vector<std::array<size_t, BUCKETS>> counts(parts);
+  std::vector<Event> scratch(n);
+  auto src = events_.data();
+  auto dst = scratch.data();
+
+  for (int shift = 0; shift < KEY_BITS; shift += DIGIT_BITS) {
+    auto digit = [shift](const Event &e) {
+      return (size_t)(e.key >> shift) & (BUCKETS - 1);
+    };
+
+    // every part counts its digits, then moves its events to where the
+    // parts before it end, which keeps the sort stable
+    for (size_t p = 0; p < parts; ++p) {
+      pool.submit([&, p] {
+        auto &count = counts[p];
+        count.fill(0);
+        for (size_t i = n * p / parts, end = n * (p + 1) / parts; i < end;
+             ++i) {
+          ++count[digit(src[i])];
+        }
+      });
+    }
+    pool.wait();
+
+    size_t offset = 0;
+    bool same = false; // one digit for all, nothing moves
+    for (size_t b = 0; b < BUCKETS; ++b) {
+      size_t total = 0;
+      for (auto &count : counts) {
+        auto c = count[b];
+        count[b] = offset + total;
+        total += c;
+      }
+      same = same || total == n;
+      offset += total;
+    }
+    if (same) {
+      continue;
+    }
+
+    for (size_t p = 0; p < parts; ++p) {
+      pool.submit([&, p] {
+        auto &next = counts[p];
+        for (size_t i = n * p / parts, end = n * (p + 1) / parts; i < end;
+             ++i) {
+          dst[next[digit(src[i])]++] = src[i];
+        }
+      });
+    }
+    pool.wait();
+    std::swap(src, dst);
+  }
+
+  if (src != events_.data()) {
+    events_.swap(scratch);
+  }
+}
+
+static void append_number(std::string &out, uint32_t v) {
+  char text[10];
+  auto end = std::to_chars(text, text + sizeof(text), v).ptr;
+  out.append(text, end - text);
+}
+
+static void append_csv(std::string &out, const char *s, size_t size) {
+  if (std::none_of(s, s + size, [](char c) {
+        return c == ',' || c == '"' || c == '\n' || c == '\r';
+      })) {
+    out.append(s, size);
+    return;
+  }
+  out += '"';
+  for (size_t i = 0; i < size; ++i) {
+    if (s[i] == '"') {
+      out += '"';
+    }
+    out += s[i];
+  }
+  out += '"';
+}
+
+void Timeline::write(std::ostream &os, TimelineFormat format) const {
+  static const char *const kinds[] = {"created", "modified", "accessed"};
+  const char letters[] = "rhsvda";
+  const bool csv = format == TimelineFormat::Csv;
+
+  std::string out;
+  if (csv) {
+    out = "time,event,partition,path,size,attr,cluster\n";
+  }
+  for (auto &ev : events_) {
+    auto &item = entries_[ev.entry];
+    auto kind = (Kind)(ev.key & 3);
+    auto date = (uint16_t)(ev.key >> 26);
+    auto time = (uint16_t)(ev.key >> 10);
+    auto tenth = (int)(ev.key >> 2 & 0xff);
+
+    // to the precision the stamp has
+    char stamp[24];
+    auto n = fat32::format_date(date, stamp);
+    if (kind != Accessed) {
+      stamp[n++] = 'T';
+      n += fat32::format_time(time, kind == Created ? tenth : -1, stamp + n);
+    }
+    char attr[6];
+    for (int bit = 0; bit < 6; ++bit) {
+      attr[bit] = item.attr & (1 << bit) ? letters[bit] : '-';
+    }
+    auto path = paths_.data() + item.path;
+
+    if (csv) {
+      out.append(stamp, n) += ',';
+      out.append(kinds[kind]) += ',';
+      append_number(out, item.partition);
+      out += ',';
+      append_csv(out, path, item.path_size);
+      out += ',';
+      append_number(out, item.size);
+      out += ',';
+      out.append(attr, sizeof(attr)) += ',';
+      append_number(out, item.cluster);
+      out += '\n';
+    } else {
+      out.append("{\"time\": \"").append(stamp, n);
+      out.append("\", \"event\": \"").append(kinds[kind]);
+      out.append("\", \"partition\": ");
+      append_number(out, item.partition);
+      out.append(", \"path\": ");
+      append_json_string(out, std::string_view(path, item.path_size));
+      out.append(", \"size\": ");
+      append_number(out, item.size);
+      out.append(", \"attr\": \"").append(attr, sizeof(attr));
+      out.append("\", \"cluster\": ");
+      append_number(out, item.cluster);
+      out.append("}\n");
+    }
+
+    // written in blocks, a stream call per field costs more than the rest
+    if (out.size() >= 1 << 16) {
+      os.write(out.data(), (std::streamsize)out.size());
+      out.clear();
+    }
+  }
+  os.write(out.data(), (std::streamsize)out.size());
+}
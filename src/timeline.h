@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "fat32parse.h"
+
+enum class TimelineFormat { Csv, Ndjson };
+
+// Creation, modification and access stamps of every file and directory of
+// one or more volumes as events in time order. FAT keeps local time without
+// a zone: creation to 10 ms, modification to 2 s and access as a date only,
+// and every event is printed to the precision it has. Stamps with a date of
+// 0 are unset and make no event.
+class Timeline {
+public:
+  enum Kind : uint8_t { Created, Modified, Accessed };
+
+  // events of everything under the root of the volume, partition is the
+  // number the dump shows
+  void add(const fat32::Volume &volume, int partition);
+
+  // Stable parallel LSD radix sort on the packed stamps, threads - 0 for
+  // one per core. Equal stamps keep their kind and traversal order, so the
+  // output does not depend on the number of threads.
+  void sort(unsigned threads);
+
+  // a header line first for CSV
+  void write(std::ostream &os, TimelineFormat format) const;
+
+  size_t events() const { return events_.size(); }
+  size_t entries() const { return entries_.size(); }
+
+private:
+  // date << 26 | time << 10 | tenth << 2 | kind, 42 bits in stamp order,
+  // and a creation before a modification with the same stamp
+  struct Event {
+    uint64_t key;
+    uint32_t entry;
+  };
+
+  struct Item {
+    uint64_t path; // offset in paths_
+    uint32_t path_size;
+    uint32_t size;
+    uint32_t cluster;
+    uint16_t partition;
+    uint8_t attr;
+  };
+
+  std::vector<Event> events_;
+  std::vector<Item> entries_;
+  std::string paths_; // "/DIR/NAME" of every entry, back to back
+};
@@ -0,0 +1,290 @@
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#include "tree_walk.h"
+#include "work_pool.h"
+
+static size_t path_size(const WalkDir *dir) {
+  size_t size = 0;
+  for (auto d = dir; d->parent; d = d->parent.get()) {
+    size += d->name.size() + 1;
+  }
+  return size ? size - 1 : 0;
+}
+
+// The names from the bottom up, ending at end of out, which has its
+// separators already
+static void fill_path(const WalkDir *dir, size_t end, std::string &out) {
+  for (auto d = dir; d->parent; d = d->parent.get()) {
+    end -= d->name.size();
+    out.replace(end, d->name.size(), d->name);
+    end -= end ? 1 : 0;
+  }
+}
+
+std::string WalkDir::path() const {
+  auto size = path_size(this);
+  std::string res(size, '/');
+  fill_path(this, size, res);
+  return res;
+}
+
+std::string WalkEntry::path() const {
+  auto size = path_size(dir);
+  std::string res(size + (size ? 1 : 0) + name.size(), '/');
+  res.replace(res.size() - name.size(), name.size(), name);
+  fill_path(dir, size, res);
+  return res;
+}
+
+std::string_view WalkSlot::name() {
+  if (!has_name_) {
+    name_ = entry_.name();
+    has_name_ = true;
+    ++decoded_;
+  }
+  return name_;
+}
+
+namespace {
+
+struct Result;
+
+struct Item {
+  const dir_entry *raw;
+  uint64_t offset;
+  uint32_t name; // in Result::names
+  uint16_t name_size;
+  bool report;
+  std::shared_ptr<Result> child; // the subdirectory, when entered
+};
+
+// The slots of one directory that matter to the output stage, as its task
+// read them. Names are decoded by the task, the slot may have long name
+// slots in front of it that are gone once the task moves on.
+struct Result {
+  std::shared_ptr<const WalkDir> dir;
+  std::vector<Item> items;
+  std::string names;
+  bool done = false; // guarded by Walk::lock_
+};
+
+class Walk {
+public:
+  Walk(const fat32::Volume &volume, const WalkOptions &options,
+       const WalkFilter &filter, const WalkVisit &visit)
+      : volume_(volume), options_(options), filter_(filter), visit_(visit),
+        pool_(options.threads) {}
+
+  void run(uint32_t first, WalkStats *stats);
+
+private:
+  void read(const std::shared_ptr<Result> &result);
+  void wait_done(const Result &result);
+  bool emit(const Result &result, const Item &item);
+  void output_ordered(std::shared_ptr<Result> top);
+  void output_unordered();
+
+  const fat32::Volume &volume_;
+  const WalkOptions &options_;
+  const WalkFilter &filter_;
+  const WalkVisit &visit_;
+  WorkPool pool_;
+
+  std::mutex lock_;
+  std::condition_variable done_cv_;
+  // unordered: directories read and not yet emitted, guarded by lock_
+  std::deque<std::shared_ptr<Result>> ready_;
+  // unordered: directories queued and not yet emitted
+  std::atomic<uint64_t> outstanding_{0};
+  std::atomic<bool> stop_{false};
+  WalkStats stats_; // of the tasks, guarded by lock_
+  uint64_t reported_ = 0;
+};
+
+void Walk::run(uint32_t first, WalkStats *stats) {
+  auto dir = std::make_shared<WalkDir>();
+  dir->first = first;
+  dir->tag = options_.tag;
+  auto top = std::make_shared<Result>();
+  top->dir = dir;
+  outstanding_ = 1;
+  pool_.submit([this, top] { read(top); });
+
+  if (options_.ordered) {
+    output_ordered(top);
+  } else {
+    output_unordered();
+  }
+  // the tasks still running after visit stopped the walk return early
+  pool_.wait();
+
+  if (stats != nullptr) {
+    stats->dirs += stats_.dirs;
+    stats->pruned += stats_.pruned;
+    stats->entries += stats_.entries;
+    stats->decoded += stats_.decoded;
+    stats->reported += reported_;
+  }
+}
+
+void Walk::read(const std::shared_ptr<Result> &result) {
+  WalkStats local;
+  auto &dir = *result->dir;
+  if (!stop_) {
+    ++local.dirs;
+    auto slots = volume_.directory(dir.first);
+    for (auto it = slots.begin(); it != slots.end() && !stop_; ++it) {
+      auto e = *it;
+      ++local.entries;
+      WalkSlot slot(e, dir, local.decoded);
+      WalkChoice choice;
+      choice.tag = dir.tag;
+      if (filter_) {
+        filter_(slot, choice);
+      }
+
+      auto sub = e.first_cluster();
+      bool enter = e.is_dir() && sub >= 2 && dir.depth < fat32::MAX_TREE_DEPTH;
+      for (auto d = &dir; enter && d != nullptr; d = d->parent.get()) {
+        enter = d->first != sub;
+      }
+      if (enter && !choice.enter) {
+        ++local.pruned;
+        enter = false;
+      }
+      if (!choice.report && !enter) {
+        continue;
+      }
+
+      std::string_view name;
+      if (enter || options_.names || slot.has_name()) {
+        name = slot.name();
+      }
+      Item item{&e.raw(), it.offset(), (uint32_t)result->names.size(),
+                (uint16_t)name.size(), choice.report, nullptr};
+      result->names += name;
+
+      if (enter) {
+        auto sub_dir = std::make_shared<WalkDir>();
+        sub_dir->parent = result->dir;
+        sub_dir->name = name;
+        sub_dir->first = sub;
+        sub_dir->depth = dir.depth + 1;
+        sub_dir->tag = choice.tag;
+        auto child = std::make_shared<Result>();
+        child->dir = std::move(sub_dir);
+        if (options_.ordered) {
+          item.child = child;
+        } else {
+          ++outstanding_;
+        }
+        pool_.submit([this, child] { read(child); });
+      }
+      // a subdirectory that is not reported only keeps its place in the
+      // order, which unordered output does not need
+      if (choice.report || item.child) {
+        result->items.push_back(std::move(item));
+      }
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    result->done = true;
+    stats_.dirs += local.dirs;
+    stats_.pruned += local.pruned;
+    stats_.entries += local.entries;
+    stats_.decoded += local.decoded;
+    if (!options_.ordered) {
+      ready_.push_back(result);
+    }
+  }
+  done_cv_.notify_one();
+}
+
+void Walk::wait_done(const Result &result) {
+  std::unique_lock<std::mutex> lock(lock_);
+  done_cv_.wait(lock, [&] { return result.done; });
+}
+
+bool Walk::emit(const Result &result, const Item &item) {
+  if (!item.report) {
+    return true;
+  }
+  ++reported_;
+  WalkEntry entry{item.raw,
+                  std::string_view(result.names.data() + item.name,
+                                   item.name_size),
+                  item.offset, result.dir.get()};
+  if (!visit_(entry)) {
+    stop_ = true;
+    return false;
+  }
+  return true;
+}
+
+// Depth-first over the results as a TreeIterator goes over the directories,
+// waiting for each to be read. A subtree is let go once it is emitted, what
+// is held is what was read ahead of the output.
+void Walk::output_ordered(std::shared_ptr<Result> top) {
+  struct Open {
+    std::shared_ptr<Result> result;
+    size_t next;
+  };
+  wait_done(*top);
+  std::vector<Open> stack{{std::move(top), 0}};
+  while (!stack.empty()) {
+    auto &open = stack.back();
+    auto &result = *open.result;
+    if (open.next == result.items.size()) {
+      stack.pop_back();
+      continue;
+    }
+    auto &item = result.items[open.next++];
+    if (!emit(result, item)) {
+      return;
+    }
+    if (item.child) {
+      auto child = std::move(item.child);
+      wait_done(*child);
+      stack.push_back({std::move(child), 0});
+    }
+  }
+}
+
+void Walk::output_unordered() {
+  while (true) {
+    std::shared_ptr<Result> result;
+    {
+      std::unique_lock<std::mutex> lock(lock_);
+      // outstanding_ only drops here, and a task counts its subdirectories
+      // before it is ready itself
+      done_cv_.wait(lock,
+                    [&] { return !ready_.empty() || outstanding_ == 0; });
+      if (ready_.empty()) {
+        return;
+      }
+      result = std::move(ready_.front());
+      ready_.pop_front();
+    }
+    for (auto &item : result->items) {
+      if (!emit(*result, item)) {
+        return;
+      }
+    }
+    --outstanding_;
+  }
+}
+
+} // namespace
+
+void parallel_walk(const fat32::Volume &volume, uint32_t first,
+                   const WalkOptions &options, const WalkFilter &filter,
+                   const WalkVisit &visit, WalkStats *stats) {
+  Walk walk(volume, options, filter, visit);
+  walk.run(first, stats);
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "fat32parse.h"
+
+// A directory of a parallel walk. Its subdirectories point to it, so a
+// path is a chain of these shared by everything under it and not a string
+// copied into every task.
+struct WalkDir {
+  std::shared_ptr<const WalkDir> parent; // nullptr at the start
+  std::string name;                      // "" at the start
+  uint32_t first = 0;                    // cluster
+  int depth = 0;                         // of its entries, 0 at the start
+  uint64_t tag = 0;                      // see WalkChoice
+
+  // "DIR/SUB" from the starting directory, "" for that one
+  std::string path() const;
+};
+
+// One slot as the filter sees it, on a worker, while the directory is read
+class WalkSlot {
+public:
+  WalkSlot(const fat32::Entry &entry, const WalkDir &dir, uint64_t &decoded)
+      : entry_(entry), dir_(dir), decoded_(decoded) {}
+
+  const fat32::Entry &entry() const { return entry_; }
+  const WalkDir &dir() const { return dir_; }
+  // the long or short name, decoded on first use
+  std::string_view name();
+  bool has_name() const { return has_name_; }
+
+private:
+  const fat32::Entry &entry_;
+  const WalkDir &dir_;
+  uint64_t &decoded_;
+  bool has_name_ = false;
+  fat32::Name name_;
+};
+
+// What to do with a slot and, for a directory, its subtree
+struct WalkChoice {
+  bool report = true; // hand it to the output stage
+  bool enter = true;  // read the directory, if it is one
+  uint64_t tag = 0;   // WalkDir::tag of the directory when entered
+};
+
+// A reported slot, handed to visit on the calling thread
+struct WalkEntry {
+  const dir_entry *raw;
+  std::string_view name; // empty if not decoded, see WalkOptions::names
+  uint64_t offset; // of the slot in the image
+  const WalkDir *dir;
+
+  // without the long name slots, name already has the long name
+  fat32::Entry entry() const { return fat32::Entry(raw); }
+  int depth() const { return dir->depth; }
+  // "DIR/SUB/NAME" from the starting directory
+  std::string path() const;
+};
+
+struct WalkOptions {
+  unsigned threads = 0; // 0 - one per core
+  // false - directories are reported in the order they are read, not in
+  // the depth-first order of a TreeIterator
+  bool ordered = true;
+  // false - reported slots carry only the names the filter decoded, for
+  // visitors that look at raw fields; directories always have theirs
+  bool names = true;
+  uint64_t tag = 0; // of the starting directory
+};
+
+struct WalkStats {
+  uint64_t dirs = 0;    // directories read
+  uint64_t pruned = 0;  // directories the filter did not enter
+  uint64_t entries = 0; // slots looked at
+  uint64_t decoded = 0; // names decoded
+  uint64_t reported = 0;
+};
+
+// Decides about a slot on a worker, called for many directories at once
+using WalkFilter = std::function<void(WalkSlot &, WalkChoice &)>;
+// Takes a reported slot on the calling thread, false stops the walk
+using WalkVisit = std::function<bool(const WalkEntry &)>;
+
+// Walks the tree under first with every directory read as a task of a
+// WorkPool, so the directory clusters of different subtrees are read, and
+// wait for their page faults, at the same time. A directory task queues a
+// task per subdirectory it finds on its worker's deque, idle workers steal
+// the oldest of those, the biggest subtrees left.
+//
+// The calling thread is the output stage: it takes the slots of each
+// directory once it has been read and calls visit for them one at a time,
+// in the order a TreeIterator would produce them or, unordered, a
+// directory at a time as they finish. Directories that link back to one of
+// their ancestors and levels past MAX_TREE_DEPTH are not entered, as with
+// TreeIterator. filter may be empty to report and enter everything.
+void parallel_walk(const fat32::Volume &volume, uint32_t first,
+                   const WalkOptions &options, const WalkFilter &filter,
+                   const WalkVisit &visit, WalkStats *stats = nullptr);
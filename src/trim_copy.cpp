@@ -0,0 +1,270 @@
+#include <algorithm>
+#include <cerrno>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fat32parse.h"
+#include "trim_copy.h"
+
+namespace {
+
+// [offset, offset + size) of the image
+struct Run {
+  uint64_t offset;
+  uint64_t size;
+};
+
+std::error_code last_error() {
+  return std::error_code(errno, std::system_category());
+}
+
+// Runs of free clusters of every FAT volume of the image, by offset
+std::vector<Run> free_runs(const std::string &path, int partition,
+                           TrimStats &stats, uint64_t &image_size,
+                           std::error_code &err) {
+  fat32::Image image;
+  if (!image.open(path, err)) {
+    return {};
+  }
+  image_size = image.size();
+  // a table that can not be followed is trimmed as far as it goes
+  std::error_code table_err;
+  std::vector<Run> runs;
+  for (auto &v : image.volumes(partition, table_err)) {
+    if (v.err) {
+      continue;
+    }
+    auto &volume = v.volume;
+    ++stats.volumes;
+    volume.fat().visit([&](const auto &typed) {
+      stats.clusters += typed.count() - 2;
+      uint32_t c = 2;
+      while (c < typed.count()) {
+        if (typed[c] != CLUST_FREE) {
+          ++c;
+          continue;
+        }
+        auto first = c;
+        while (c < typed.count() && typed[c] == CLUST_FREE) {
+          ++c;
+        }
+        // clusters past the end of the image are not there to copy
+        auto begin = volume.cluster_offset(first);
+        auto end = std::min(volume.cluster_offset(c), image_size);
+        if (begin < end) {
+          runs.push_back({begin, end - begin});
+        }
+        stats.free += c - first;
+      }
+    });
+  }
+  for (auto &run : runs) {
+    stats.bytes_free += run.size;
+  }
+  // partitions are found in table order, not by offset, and may overlap
+  std::sort(runs.begin(), runs.end(), [](const Run &a, const Run &b) {
+    return a.offset < b.offset;
+  });
+  return runs;
+}
+
+bool pwrite_all(int fd, const uint8_t *data, size_t size, uint64_t offset) {
+  while (size) {
+    auto r = ::pwrite(fd, data, size, (off_t)offset);
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r <= 0) {
+      return false;
+    }
+    data += r;
+    size -= r;
+    offset += r;
+  }
+  return true;
+}
+
+// Copies [offset, offset + size) from in to the same place in out, with
+// copy_file_range while the two file systems allow it
+class RangeCopier {
+public:
+  RangeCopier(int in, int out) : in_(in), out_(out) {}
+
+  bool copy(uint64_t offset, uint64_t size, std::error_code &err) {
+    auto end = offset + size;
+    while (offset < end) {
+      // only the data of a sparse source, holes stay holes
+      auto data = seek_ ? ::lseek(in_, (off_t)offset, SEEK_DATA)
+                        : (off_t)offset;
+      if (data < 0 && errno == ENXIO) {
+        return true; // a hole up to the end of the file
+      }
+      if (data < 0) {
+        seek_ = false; // not supported by the file system
+        continue;
+      }
+      if ((uint64_t)data >= end) {
+        return true;
+      }
+      auto hole = seek_ ? ::lseek(in_, data, SEEK_HOLE) : (off_t)end;
+      if (hole < 0) {
+        hole = (off_t)end;
+      }
+      auto n = std::min((uint64_t)hole, end) - data;
+      if (!copy_data(data, n, err)) {
+        return false;
+      }
+      copied_ += n;
+      offset = std::min((uint64_t)hole, end);
+    }
+    return true;
+  }
+
+  uint64_t copied() const { return copied_; }
+
+private:
+  bool copy_data(uint64_t offset, uint64_t size, std::error_code &err) {
+    loff_t in_off = (loff_t)offset;
+    loff_t out_off = (loff_t)offset;
+    while (size && fast_) {
+      auto r = ::copy_file_range(in_, &in_off, out_, &out_off, size, 0);
+      if (r < 0 && errno == EINTR) {
+        continue;
+      }
+      if (r < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL ||
+                    errno == EOPNOTSUPP)) {
+        fast_ = false; // not between these files, from here on by hand
+      } else if (r <= 0) {
+        err = r < 0 ? last_error()
+                    : std::make_error_code(std::errc::io_error);
+        return false;
+      } else {
+        size -= r;
+      }
+    }
+
+    buf_.resize(size ? 1024 * 1024 : 0);
+    while (size) {
+      auto n = std::min<uint64_t>(size, buf_.size());
+      auto r = ::pread(in_, buf_.data(), n, in_off);
+      if (r < 0 && errno == EINTR) {
+        continue;
+      }
+      if (r <= 0 || !pwrite_all(out_, buf_.data(), r, out_off)) {
+        err = r == 0 ? std::make_error_code(std::errc::io_error)
+                     : last_error();
+        return false;
+      }
+      in_off += r;
+      out_off += r;
+      size -= r;
+    }
+    return true;
+  }
+
+  int in_;
+  int out_;
+  bool seek_ = true;
+  bool fast_ = true;
+  uint64_t copied_ = 0;
+  std::vector<uint8_t> buf_;
+};
+
+} // namespace
+
+bool trim_copy(const std::string &in, const std::string &out, int partition,
+               TrimStats &stats, std::error_code &err) {
+  err.clear();
+  stats = TrimStats();
+
+  // truncating the destination would empty the source
+  struct stat a, b;
+  if (::stat(in.c_str(), &a) == 0 && ::stat(out.c_str(), &b) == 0 &&
+      a.st_dev == b.st_dev && a.st_ino == b.st_ino) {
+    err = std::make_error_code(std::errc::invalid_argument);
+    return false;
+  }
+
+  uint64_t size = 0;
+  auto runs = free_runs(in, partition, stats, size, err);
+  if (err) {
+    return false;
+  }
+
+  auto src = ::open(in.c_str(), O_RDONLY | O_CLOEXEC);
+  if (src < 0) {
+    err = last_error();
+    return false;
+  }
+  auto dst = ::open(out.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                    0644);
+  if (dst < 0) {
+    err = last_error();
+    ::close(src);
+    return false;
+  }
+
+  bool ok = ::ftruncate(dst, (off_t)size) == 0;
+  if (!ok) {
+    err = last_error();
+  }
+  // what lies between two runs of free clusters in one go
+  RangeCopier copier(src, dst);
+  uint64_t pos = 0;
+  for (size_t i = 0; ok && pos < size; ++i) {
+    auto end = i < runs.size() ? runs[i].offset : size;
+    if (end > pos) {
+      ok = copier.copy(pos, end - pos, err);
+      ++stats.extents;
+    }
+    if (i < runs.size()) {
+      pos = std::max(pos, runs[i].offset + runs[i].size);
+    } else {
+      pos = size;
+    }
+  }
+
+  stats.bytes_copied = copier.copied();
+  ::close(src);
+  if (::close(dst) != 0 && ok) {
+    err = last_error();
+    ok = false;
+  }
+  return ok;
+}
+
+bool trim_in_place(const std::string &path, int partition, TrimStats &stats,
+                   std::error_code &err) {
+  err.clear();
+  stats = TrimStats();
+
+  uint64_t size = 0;
+  auto runs = free_runs(path, partition, stats, size, err);
+  if (err) {
+    return false;
+  }
+
+  auto fd = ::open(path.c_str(), O_WRONLY | O_CLOEXEC);
+  if (fd < 0) {
+    err = last_error();
+    return false;
+  }
+  bool ok = true;
+  for (auto &run : runs) {
+    if (::fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                    (off_t)run.offset, (off_t)run.size) != 0) {
+      err = last_error();
+      ok = false;
+      break;
+    }
+    ++stats.extents;
+  }
+  if (::close(fd) != 0 && ok) {
+    err = last_error();
+    ok = false;
+  }
+  return ok;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <system_error>
+
+struct TrimStats {
+  unsigned volumes = 0;
+  uint64_t clusters = 0;  // of those volumes
+  uint64_t free = 0;      // left out or punched
+  uint64_t extents = 0;   // runs copied, after coalescing, or punched
+  uint64_t bytes_copied = 0; // data, holes of the source not counted
+  uint64_t bytes_free = 0; // in the free clusters
+};
+
+// Copies the image to out with the clusters the FATs of its volumes mark
+// free left as holes, volumes of other partitions than partition are copied
+// whole when it is not -1. Everything else, partition tables, reserved
+// sectors, FATs and allocated clusters, goes as runs of whatever lies
+// between two free ones, with copy_file_range. Holes of the source stay
+// holes, so the copy takes the space of what is allocated.
+bool trim_copy(const std::string &in, const std::string &out, int partition,
+               TrimStats &stats, std::error_code &err);
+
+// Punches the free clusters out of the image in place. What deleted files
+// left in them is gone after that.
+bool trim_in_place(const std::string &path, int partition, TrimStats &stats,
+                   std::error_code &err);
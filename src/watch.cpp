@@ -0,0 +1,545 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <thread>
+
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+#include "json.h"
+#include "watch.h"
+
+static const char *end_name(fat32::ChainEnd end) {
+  switch (end) {
+  case fat32::ChainEnd::End:
+    return "end";
+  case fat32::ChainEnd::Bad:
+    return "bad";
+  case fat32::ChainEnd::Invalid:
+    return "invalid";
+  default:
+    return "loop";
+  }
+}
+
+// "YYYY-MM-DDTHH:MM:SS" of date << 16 | time
+static std::string format_modified(uint32_t modified) {
+  char text[24];
+  auto n = fat32::format_date((uint16_t)(modified >> 16), text);
+  text[n++] = 'T';
+  n += fat32::format_time((uint16_t)modified, -1, text + n);
+  return {text, n};
+}
+
+static bool is_dir(uint8_t attr) {
+  return (attr & (ATTR_DIR | ATTR_VOL_LABEL)) == ATTR_DIR;
+}
+
+void VolumeWatch::scan(const fat32::Volume &volume) {
+  auto ss = volume.sector_size();
+  auto fat = volume.image() + volume.fat_offset(0);
+  boot_hash_ = fat32::hash_bytes(volume.image() + volume.offset(), ss);
+  fat_hashes_.resize(volume.fat_sectors());
+  for (uint32_t s = 0; s < volume.fat_sectors(); ++s) {
+    fat_hashes_[s] = fat32::hash_bytes(fat + (uint64_t)s * ss, ss);
+  }
+
+  nodes_.clear();
+  dirs_.clear();
+  live_ = 0;
+  owner_.assign(volume.cluster_count(), NONE);
+  root_ = volume.root_cluster();
+
+  Node root;
+  root.path = "/";
+  root.parent = NONE;
+  root.attr = ATTR_DIR;
+  root.size = 0;
+  root.first = root_;
+  root.modified = 0;
+  nodes_.push_back(root);
+  auto &dir = dirs_[root_];
+  dir.node = 0;
+  walk(volume, 0, 0);
+  dir.hashes = hash_blocks(volume, root_, dir);
+  dir.dirty = false;
+
+  WatchStats stats;
+  for (auto &item : read_dir(volume, root_)) {
+    add(volume, root_, item, 0, 0, nullptr, stats);
+  }
+}
+
+std::vector<uint64_t> VolumeWatch::hash_blocks(const fat32::Volume &volume,
+                                               uint32_t key,
+                                               const Dir &dir) const {
+  if (key == 0) {
+    return {fat32::hash_bytes(volume.image() + volume.root_offset(),
+                              (uint64_t)volume.root_entries() *
+                                  sizeof(dir_entry))};
+  }
+  std::vector<uint64_t> hashes;
+  hashes.reserve(dir.clusters.size());
+  for (auto c : dir.clusters) {
+    auto data = volume.cluster(c);
+    hashes.push_back(data ? fat32::hash_bytes(data, volume.cluster_size())
+                          : 0);
+  }
+  return hashes;
+}
+
+std::vector<VolumeWatch::Item>
+VolumeWatch::read_dir(const fat32::Volume &volume, uint32_t key) const {
+  std::vector<Item> items;
+  for (auto e : volume.directory(key)) {
+    if (e.is_volume_label()) {
+      continue;
+    }
+    auto &raw = e.raw();
+    auto name = e.name();
+    items.push_back({std::string(name.text, name.size), raw.attr, raw.size,
+                     e.first_cluster(),
+                     (uint32_t)raw.lst_mod_date << 16 | raw.lst_mod_time});
+  }
+  return items;
+}
+
+void VolumeWatch::walk(const fat32::Volume &volume, uint32_t id,
+                       uint64_t pass) {
+  auto &node = nodes_[id];
+  // the cluster list is kept for directories, their clusters are hashed
+  auto dir = dirs_.find(node.first);
+  bool own_dir = dir != dirs_.end() && dir->second.node == id;
+  std::vector<uint32_t> clusters;
+
+  uint32_t n = 0;
+  auto end = fat32::ChainEnd::End;
+  if (node.first != 0) {
+    end = fat32::walk_chain(volume.fat(), node.first, [&](uint32_t c) {
+      ++n;
+      owner_[c] = id;
+      if (own_dir) {
+        clusters.push_back(c);
+      }
+    });
+  }
+  node.clusters = n;
+  node.end = end;
+  node.walked = pass;
+  if (own_dir && clusters != dir->second.clusters) {
+    dir->second.clusters = std::move(clusters);
+    dir->second.dirty = true;
+  }
+}
+
+uint32_t VolumeWatch::add(const fat32::Volume &volume, uint32_t parent,
+                          const Item &item, int depth, uint64_t pass,
+                          std::ostream *os, WatchStats &stats) {
+  auto &parent_path = nodes_[dirs_[parent].node].path;
+  Node node;
+  node.path =
+      parent_path + (parent_path.size() > 1 ? "/" : "") + item.name;
+  node.parent = parent;
+  node.attr = item.attr;
+  node.size = item.size;
+  node.first = item.first;
+  node.modified = item.modified;
+
+  auto id = (uint32_t)nodes_.size();
+  nodes_.push_back(std::move(node));
+  ++live_;
+  dirs_[parent].children.push_back(id);
+
+  // a directory already watched under another name is a loop or a cross
+  // link, its chain is followed but not its entries
+  bool subtree = is_dir(item.attr) && item.first >= 2 &&
+                 depth < fat32::MAX_TREE_DEPTH && !dirs_.count(item.first);
+  if (subtree) {
+    dirs_[item.first].node = id;
+  }
+  walk(volume, id, pass);
+  if (os != nullptr) {
+    emit(*os, pass, "added", nodes_[id], std::string(), stats);
+  }
+  if (subtree) {
+    auto &dir = dirs_[item.first];
+    dir.hashes = hash_blocks(volume, item.first, dir);
+    dir.dirty = false;
+    for (auto &child : read_dir(volume, item.first)) {
+      add(volume, item.first, child, depth + 1, pass, os, stats);
+    }
+  }
+  return id;
+}
+
+void VolumeWatch::remove(uint32_t id, uint64_t pass, std::ostream &os,
+                         WatchStats &stats) {
+  auto &node = nodes_[id];
+  node.alive = false;
+  --live_;
+  emit(os, pass, "removed", node, std::string(), stats);
+
+  auto dir = dirs_.find(node.first);
+  if (dir != dirs_.end() && dir->second.node == id) {
+    auto children = std::move(dir->second.children);
+    dirs_.erase(dir);
+    for (auto child : children) {
+      remove(child, pass, os, stats);
+    }
+  }
+}
+
+void VolumeWatch::diff(const fat32::Volume &volume, uint32_t key,
+                       uint64_t pass, std::ostream &os, WatchStats &stats) {
+  auto items = read_dir(volume, key);
+  auto old = dirs_[key].children;
+  auto name_of = [this](uint32_t id) {
+    auto &path = nodes_[id].path;
+    return std::string_view(path).substr(path.rfind('/') + 1);
+  };
+  std::stable_sort(
+      items.begin(), items.end(),
+      [](const Item &a, const Item &b) { return a.name < b.name; });
+  std::stable_sort(old.begin(), old.end(), [&](uint32_t a, uint32_t b) {
+    return name_of(a) < name_of(b);
+  });
+
+  // loops are stopped by the dirs_ check in add(), new directories need no
+  // depth of their own
+  const int depth = 0;
+  dirs_[key].children.clear();
+  size_t i = 0, j = 0;
+  while (i < items.size() || j < old.size()) {
+    int order = i == items.size()   ? 1
+                : j == old.size() ? -1
+                                  : std::string_view(items[i].name)
+                                        .compare(name_of(old[j]));
+    if (order > 0) {
+      remove(old[j++], pass, os, stats);
+      continue;
+    }
+    if (order < 0) {
+      add(volume, key, items[i++], depth, pass, &os, stats);
+      continue;
+    }
+
+    auto &item = items[i++];
+    auto id = old[j++];
+    auto &node = nodes_[id];
+    // a directory that moved to other clusters is another directory
+    if (is_dir(node.attr) != is_dir(item.attr) ||
+        (is_dir(item.attr) && node.first != item.first)) {
+      remove(id, pass, os, stats);
+      add(volume, key, item, depth, pass, &os, stats);
+      continue;
+    }
+    dirs_[key].children.push_back(id);
+
+    std::string changed;
+    auto note = [&changed](const char *field) {
+      changed += (changed.empty() ? "\"" : ", \"") + std::string(field) + '"';
+    };
+    if (node.attr != item.attr) {
+      note("attr");
+    }
+    if (node.size != item.size) {
+      note("size");
+    }
+    if (node.first != item.first) {
+      note("cluster");
+    }
+    if (node.modified != item.modified) {
+      note("modified");
+    }
+    if (changed.empty()) {
+      continue;
+    }
+    bool moved = node.first != item.first;
+    node.attr = item.attr;
+    node.size = item.size;
+    node.first = item.first;
+    node.modified = item.modified;
+    emit(os, pass, "changed", node, ", \"changed\": [" + changed + "]",
+         stats);
+    if (moved) {
+      auto clusters = node.clusters;
+      auto end = node.end;
+      walk(volume, id, pass);
+      ++stats.chains;
+      auto &walked = nodes_[id];
+      if (walked.clusters != clusters || walked.end != end) {
+        emit(os, pass, "chain", walked,
+             ", \"was_clusters\": " + std::to_string(clusters) +
+                 ", \"was_end\": \"" + end_name(end) + '"',
+             stats);
+      }
+    }
+  }
+}
+
+void VolumeWatch::update(const fat32::Volume &volume, uint64_t pass,
+                         std::ostream &os, WatchStats &stats) {
+  auto ss = volume.sector_size();
+  if (fat32::hash_bytes(volume.image() + volume.offset(), ss) != boot_hash_ ||
+      volume.cluster_count() != owner_.size() ||
+      volume.fat_sectors() != fat_hashes_.size()) {
+    os << "{\"pass\": " << pass << ", \"partition\": " << partition_
+       << ", \"event\": \"rescan\"}\n";
+    ++stats.events;
+    scan(volume);
+    return;
+  }
+
+  // nodes whose chain runs through a FAT sector that changed
+  std::vector<uint32_t> affected;
+  auto fat = volume.image() + volume.fat_offset(0);
+  auto type = volume.fat_type();
+  for (uint32_t s = 0; s < fat_hashes_.size(); ++s) {
+    auto h = fat32::hash_bytes(fat + (uint64_t)s * ss, ss);
+    ++stats.fat_sectors;
+    if (h == fat_hashes_[s]) {
+      continue;
+    }
+    fat_hashes_[s] = h;
+    ++stats.fat_changed;
+
+    // entries with a byte in the sector, a FAT12 entry may straddle two
+    uint64_t from = (uint64_t)s * ss, to = from + ss;
+    uint64_t first = type == fat32::FatType::Fat12   ? from * 2 / 3
+                     : type == fat32::FatType::Fat16 ? from / 2
+                                                     : from / 4;
+    uint64_t last = type == fat32::FatType::Fat12   ? to * 2 / 3 + 1
+                    : type == fat32::FatType::Fat16 ? to / 2
+                                                    : to / 4;
+    last = std::min<uint64_t>(last, owner_.size());
+    for (auto c = first; c < last; ++c) {
+      if (owner_[c] != NONE) {
+        affected.push_back(owner_[c]);
+      }
+    }
+  }
+  std::sort(affected.begin(), affected.end());
+  affected.erase(std::unique(affected.begin(), affected.end()),
+                 affected.end());
+
+  auto rewalk = [&](uint32_t id) {
+    auto clusters = nodes_[id].clusters;
+    auto end = nodes_[id].end;
+    walk(volume, id, pass);
+    ++stats.chains;
+    auto &node = nodes_[id];
+    if (node.clusters != clusters || node.end != end) {
+      emit(os, pass, "chain", node,
+           ", \"was_clusters\": " + std::to_string(clusters) +
+               ", \"was_end\": \"" + end_name(end) + '"',
+           stats);
+    }
+  };
+
+  // directories first, a chain that grew has clusters to read
+  for (auto id : affected) {
+    auto &node = nodes_[id];
+    auto dir = dirs_.find(node.first);
+    if (node.alive && dir != dirs_.end() && dir->second.node == id) {
+      rewalk(id);
+    }
+  }
+
+  std::vector<uint32_t> keys;
+  keys.reserve(dirs_.size());
+  for (auto &d : dirs_) {
+    keys.push_back(d.first);
+  }
+  // the same order every pass, so the same change gives the same output
+  std::sort(keys.begin(), keys.end());
+  for (auto key : keys) {
+    auto dir = dirs_.find(key);
+    if (dir == dirs_.end()) {
+      continue; // under a directory removed this pass
+    }
+    auto hashes = hash_blocks(volume, key, dir->second);
+    stats.dir_blocks += hashes.size();
+    if (hashes == dir->second.hashes && !dir->second.dirty) {
+      continue;
+    }
+    dir->second.hashes = std::move(hashes);
+    dir->second.dirty = false;
+    ++stats.dir_changed;
+    diff(volume, key, pass, os, stats);
+  }
+
+  for (auto id : affected) {
+    if (nodes_[id].alive && nodes_[id].walked != pass) {
+      rewalk(id);
+    }
+  }
+}
+
+void VolumeWatch::emit(std::ostream &os, uint64_t pass, const char *event,
+                       const Node &node, const std::string &extra,
+                       WatchStats &stats) {
+  const char letters[] = "rhsvda";
+  std::string attr;
+  for (int bit = 0; bit < 6; ++bit) {
+    attr += node.attr & (1 << bit) ? letters[bit] : '-';
+  }
+  os << "{\"pass\": " << pass << ", \"partition\": " << partition_
+     << ", \"event\": \"" << event << "\", \"path\": " << json_string(node.path)
+     << ", \"attr\": \"" << attr << "\", \"size\": " << node.size
+     << ", \"cluster\": " << node.first << ", \"modified\": \""
+     << format_modified(node.modified) << "\", \"clusters\": " << node.clusters
+     << ", \"end\": \"" << end_name(node.end) << '"' << extra << "}\n";
+  ++stats.events;
+}
+
+namespace {
+
+struct Watched {
+  fat32::Partition partition;
+  VolumeWatch watch;
+};
+
+} // namespace
+
+int watch_image(const WatchOptions &options, std::ostream &os) {
+  fat32::Image image;
+  std::error_code err;
+  if (!image.open(options.file, err)) {
+    std::cerr << "Failed to map file: " << err.message() << std::endl;
+    return -1;
+  }
+  auto volumes = image.volumes(options.partition, err);
+  if (err) {
+    std::cerr << "Partition table: " << err.message() << std::endl;
+  }
+
+  std::vector<Watched> watched;
+  size_t entries = 0;
+  for (auto &v : volumes) {
+    int i = (int)v.partition.index;
+    if (v.err) {
+      std::cerr << "Partition #" << i << ": " << v.err.message() << std::endl;
+      continue;
+    }
+    watched.push_back({v.partition, VolumeWatch(i)});
+    watched.back().watch.scan(v.volume);
+    entries += watched.back().watch.entries();
+  }
+  if (watched.empty()) {
+    std::cerr << "No FAT partition to watch" << std::endl;
+    return -1;
+  }
+  std::cerr << "Watching " << watched.size() << " partitions, " << entries
+            << " entries" << std::endl;
+
+  uint64_t pass = 0;
+  auto run_pass = [&]() {
+    // a file that changed its size is mapped again, the views of the old
+    // mapping go with it
+    struct stat st;
+    if (::stat(options.file.c_str(), &st) != 0) {
+      std::cerr << "Image is gone: " << std::strerror(errno) << std::endl;
+      return false;
+    }
+    if ((uint64_t)st.st_size != image.size() &&
+        !image.open(options.file, err)) {
+      std::cerr << "Failed to map file: " << err.message() << std::endl;
+      return false;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    WatchStats stats;
+    ++pass;
+    for (auto &w : watched) {
+      fat32::Volume volume;
+      if (!image.volume(w.partition, volume, err)) {
+        // a boot sector halfway through a rewrite, the next pass sees it
+        std::cerr << "Partition #" << w.partition.index << ": "
+                  << err.message() << std::endl;
+        continue;
+      }
+      w.watch.update(volume, pass, os, stats);
+    }
+    os.flush();
+
+    if (options.stats) {
+      std::cerr << "Pass " << pass << ": " << stats.fat_changed << " of "
+                << stats.fat_sectors << " FAT sectors and "
+                << stats.dir_changed << " directories changed, "
+                << stats.dir_blocks << " directory clusters hashed, "
+                << stats.chains << " chains walked, " << stats.events
+                << " events, "
+                << std::chrono::duration<double, std::milli>(
+                       std::chrono::steady_clock::now() - start)
+                       .count()
+                << " ms" << std::endl;
+    }
+    return true;
+  };
+  auto more = [&] { return options.passes == 0 || pass < options.passes; };
+
+#ifdef __linux__
+  int fd = inotify_init1(IN_CLOEXEC);
+  if (fd < 0 || inotify_add_watch(fd, options.file.c_str(),
+                                  IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB |
+                                      IN_DELETE_SELF | IN_MOVE_SELF) < 0) {
+    std::cerr << "inotify: " << std::strerror(errno) << std::endl;
+    if (fd >= 0) {
+      ::close(fd);
+    }
+    return -1;
+  }
+
+  while (more()) {
+    pollfd p{fd, POLLIN, 0};
+    int ready = ::poll(&p, 1, options.interval_ms ? (int)options.interval_ms
+                                                  : -1);
+    if (ready < 0 && errno != EINTR) {
+      break;
+    }
+    if (ready > 0) {
+      // events until the writer pauses for settle_ms, one that never does
+      // still gets a pass every second
+      bool gone = false;
+      auto first = std::chrono::steady_clock::now();
+      do {
+        alignas(inotify_event) char buf[4096];
+        auto n = ::read(fd, buf, sizeof(buf));
+        for (ssize_t at = 0; at < n;) {
+          auto e = (const inotify_event *)(buf + at);
+          gone = gone || (e->mask & (IN_DELETE_SELF | IN_MOVE_SELF |
+                                     IN_IGNORED)) != 0;
+          at += sizeof(inotify_event) + e->len;
+        }
+      } while (!gone &&
+               std::chrono::steady_clock::now() - first <
+                   std::chrono::seconds(1) &&
+               ::poll(&p, 1, (int)options.settle_ms) > 0);
+      if (gone) {
+        std::cerr << "Image is gone" << std::endl;
+        break;
+      }
+    }
+    if (!run_pass()) {
+      break;
+    }
+  }
+  ::close(fd);
+#else
+  auto interval = options.interval_ms ? options.interval_ms : 1000;
+  while (more()) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(interval));
+    if (!run_pass()) {
+      break;
+    }
+  }
+#endif
+  return 0;
+}
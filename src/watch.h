@@ -0,0 +1,108 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "fat32parse.h"
+
+struct WatchStats {
+  uint64_t fat_sectors = 0;  // hashed
+  uint64_t fat_changed = 0;  // of them with a new hash
+  uint64_t dir_blocks = 0;   // directory clusters hashed
+  uint64_t dir_changed = 0;  // directories read again
+  uint64_t chains = 0;       // chains walked again
+  uint64_t events = 0;       // delta lines written
+};
+
+// One volume of an image that something is still writing to. scan() takes
+// a baseline: a hash of every FAT sector and directory cluster, every
+// directory entry and the length of every chain. update() hashes them
+// again, walks only the chains that run through a FAT sector that changed,
+// reads only the directories whose clusters changed, and writes what is
+// different as one JSON object per line. The Volume passed in may come
+// from a new mapping every time, as long as the geometry is the same.
+class VolumeWatch {
+public:
+  explicit VolumeWatch(int partition) : partition_(partition) {}
+
+  void scan(const fat32::Volume &volume);
+  void update(const fat32::Volume &volume, uint64_t pass, std::ostream &os,
+              WatchStats &stats);
+
+  size_t entries() const { return live_; }
+
+private:
+  static constexpr uint32_t NONE = 0xffffffff;
+
+  struct Node {
+    std::string path; // "/DIR/NAME", "/" for the root
+    uint32_t parent;  // key of the directory it is in
+    uint8_t attr;
+    uint32_t size;
+    uint32_t first;
+    uint32_t modified; // date << 16 | time, as stored
+    uint32_t clusters = 0;
+    fat32::ChainEnd end = fat32::ChainEnd::End;
+    uint64_t walked = 0; // pass that walked the chain last
+    bool alive = true;
+  };
+
+  // A directory by its first cluster, 0 for the fixed root of FAT12/16
+  struct Dir {
+    uint32_t node;
+    std::vector<uint32_t> clusters; // of the chain, none for the fixed root
+    std::vector<uint64_t> hashes;   // of every cluster, or of the region
+    std::vector<uint32_t> children;
+    bool dirty = false; // the chain changed, read it again
+  };
+
+  // a directory entry as read this pass
+  struct Item {
+    std::string name;
+    uint8_t attr;
+    uint32_t size;
+    uint32_t first;
+    uint32_t modified;
+  };
+
+  std::vector<uint64_t> hash_blocks(const fat32::Volume &volume,
+                                    uint32_t key, const Dir &dir) const;
+  std::vector<Item> read_dir(const fat32::Volume &volume, uint32_t key) const;
+  void walk(const fat32::Volume &volume, uint32_t id, uint64_t pass);
+  uint32_t add(const fat32::Volume &volume, uint32_t parent, const Item &item,
+               int depth, uint64_t pass, std::ostream *os, WatchStats &stats);
+  void remove(uint32_t id, uint64_t pass, std::ostream &os,
+              WatchStats &stats);
+  void diff(const fat32::Volume &volume, uint32_t key, uint64_t pass,
+            std::ostream &os, WatchStats &stats);
+  void emit(std::ostream &os, uint64_t pass, const char *event,
+            const Node &node, const std::string &extra, WatchStats &stats);
+
+  int partition_;
+  uint64_t boot_hash_ = 0;
+  uint32_t root_ = 0;
+  std::vector<uint64_t> fat_hashes_;
+  std::vector<Node> nodes_;
+  size_t live_ = 0;
+  std::unordered_map<uint32_t, Dir> dirs_;
+  // node whose chain ran through each cluster when it was walked last, may
+  // be stale, which costs a walk and nothing else
+  std::vector<uint32_t> owner_;
+};
+
+struct WatchOptions {
+  std::string file;
+  int partition = -1;
+  unsigned interval_ms = 0; // a pass at least this often, 0 - on change
+  unsigned settle_ms = 50;  // quiet time after a change before a pass
+  uint64_t passes = 0;      // follow-up passes before returning, 0 - no end
+  bool stats = false;       // a line per pass to stderr
+};
+
+// Baseline of the image, then a pass whenever inotify reports a write to
+// it, or every interval_ms where there is no inotify. Deltas go to os.
+// Returns when the image is deleted or moved away, or after passes.
+int watch_image(const WatchOptions &options, std::ostream &os);
@@ -0,0 +1,224 @@
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+
+#include "owner_map.h"
+#include "whois.h"
+
+namespace {
+
+// decimal, or hex with 0x
+bool parse_number(const std::string &s, uint64_t &value) {
+  bool hex = s.size() > 2 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X');
+  auto digits = s.c_str() + (hex ? 2 : 0);
+  if (*digits == '\0') {
+    return false;
+  }
+  char *end = nullptr;
+  errno = 0;
+  value = std::strtoull(digits, &end, hex ? 16 : 10);
+  return *end == '\0' && errno == 0 && std::isxdigit((unsigned char)*digits);
+}
+
+// A volume whois looks into and its owner map, made when the first target
+// lands in its data region
+struct WhoisVolume {
+  fat32::PartitionVolume opened;
+  std::unique_ptr<OwnerMap> owners;
+};
+
+OwnerMap &owner_map(WhoisVolume &v, const std::string &path,
+                    bool print_stats) {
+  if (v.owners) {
+    return *v.owners;
+  }
+  auto start = std::chrono::steady_clock::now();
+  v.owners = std::make_unique<OwnerMap>();
+  std::error_code err;
+  bool loaded = !path.empty() && v.owners->load(path, v.opened.volume, err);
+  if (err) {
+    std::cerr << "Owner map " << path << ": " << err.message() << std::endl;
+  }
+  if (!loaded) {
+    v.owners->build(v.opened.volume);
+    if (!path.empty() && !v.owners->save(path, err)) {
+      std::cerr << "Failed to write " << path << ": " << err.message()
+                << std::endl;
+    }
+  }
+  if (print_stats) {
+    std::cerr << "Owner map of partition #" << v.opened.partition.index << ": "
+              << (loaded ? "loaded" : "built") << " in "
+              << std::chrono::duration<double>(
+                     std::chrono::steady_clock::now() - start)
+                     .count()
+              << " s, " << v.owners->entries() << " entries, "
+              << v.owners->clusters() << " clusters" << std::endl;
+  }
+  return *v.owners;
+}
+
+// "cluster N, " and whoever owns it, with the offset inside the file
+std::string describe_cluster(const fat32::Volume &volume, OwnerMap &map,
+                             uint32_t cluster, uint32_t inner) {
+  std::string res = "cluster " + std::to_string(cluster) + ", ";
+  auto owners = map.owners(cluster);
+  if (owners.empty()) {
+    auto value = volume.fat()[cluster];
+    return res + (value == CLUST_FREE  ? "free"
+                  : value == CLUST_BAD ? "bad"
+                                       : "allocated, no owner (lost)");
+  }
+
+  for (size_t i = 0; i < owners.size(); ++i) {
+    auto &owner = map.entry(owners[i]);
+    res += (i ? " and " : "") + std::string(map.path(owners[i]));
+    uint64_t before;
+    if (!map.position(volume.fat(), owners[i], cluster, before)) {
+      continue;
+    }
+    auto offset = before * volume.cluster_size() + inner;
+    res += " at " + fat32::hex(offset);
+    if (!(owner.attr & ATTR_DIR) && offset >= owner.size) {
+      res += ", past its size " + fat32::hex(owner.size) + " (slack)";
+    }
+  }
+  if (owners.size() > 1) {
+    res += " (cross-linked)";
+  }
+  return res;
+}
+
+std::string describe_offset(const fat32::Image &image,
+                            std::vector<WhoisVolume> &volumes,
+                            uint64_t offset, const std::string &map,
+                            bool print_stats) {
+  if (offset >= image.size()) {
+    return "past the end of the image";
+  }
+  for (size_t n = 0; n < volumes.size(); ++n) {
+    auto &v = volumes[n];
+    auto &p = v.opened.partition;
+    if (offset < p.offset() ||
+        offset - p.offset() >= p.size_lba * p.sector_size) {
+      continue;
+    }
+    std::string res = "partition " + std::to_string(p.index) + ", ";
+    if (v.opened.err) {
+      return res + v.opened.err.message();
+    }
+
+    auto &volume = v.opened.volume;
+    uint64_t ss = volume.sector_size();
+    auto rel = offset - volume.offset();
+    if (rel < volume.fat_sector(0) * ss) {
+      return res + (rel < ss ? "boot sector" : "reserved sectors");
+    }
+    if (rel < volume.root_sector() * ss) {
+      auto within = rel - volume.fat_sector(0) * ss;
+      auto copy = within / ((uint64_t)volume.fat_sectors() * ss);
+      within -= copy * volume.fat_sectors() * ss;
+      auto type = volume.fat_type();
+      auto entry = type == fat32::FatType::Fat12   ? within * 2 / 3
+                   : type == fat32::FatType::Fat16 ? within / 2
+                                                   : within / 4;
+      return res + "FAT " + std::to_string(copy + 1) + ", entry " +
+             std::to_string(entry);
+    }
+    if (rel < volume.data_sector() * ss) {
+      return res + "root directory, slot " +
+             std::to_string((rel - volume.root_sector() * ss) /
+                            sizeof(dir_entry));
+    }
+    auto data = rel - volume.data_sector() * ss;
+    auto cluster = 2 + data / volume.cluster_size();
+    if (cluster >= volume.cluster_count()) {
+      return res + "past the last cluster";
+    }
+    auto path = volumes.size() > 1 && !map.empty()
+                    ? map + "." + std::to_string(p.index)
+                    : map;
+    return res + describe_cluster(volume, owner_map(v, path, print_stats),
+                                  (uint32_t)cluster,
+                                  (uint32_t)(data % volume.cluster_size()));
+  }
+  return offset < SECT ? "MBR" : "unpartitioned";
+}
+
+} // namespace
+
+int whois_image(const WhoisOptions &options, std::istream &in,
+                std::ostream &os) {
+  fat32::Image image;
+  std::error_code err;
+  if (!image.open(options.file, err)) {
+    std::cerr << "Failed to map file: " << err.message() << std::endl;
+    return -1;
+  }
+
+  std::vector<WhoisVolume> volumes;
+  for (auto &opened : image.volumes(options.partition, err)) {
+    volumes.push_back({std::move(opened), nullptr});
+  }
+  if (err) {
+    std::cerr << "Partition table: " << err.message() << std::endl;
+  }
+  bool clusters = options.unit == "cluster";
+  if (clusters && volumes.size() != 1) {
+    std::cerr << "Cluster numbers need a single partition, pick one with -p"
+              << std::endl;
+    return -1;
+  }
+  if (clusters && volumes[0].opened.err) {
+    std::cerr << "Partition #" << volumes[0].opened.partition.index << ": "
+              << volumes[0].opened.err.message() << std::endl;
+    return -1;
+  }
+
+  int ret = 0;
+  auto answer = [&](const std::string &target) {
+    uint64_t value;
+    if (!parse_number(target, value)) {
+      std::cerr << target << ": not a number" << std::endl;
+      ret = -1;
+      return;
+    }
+    std::string what;
+    if (!clusters) {
+      uint64_t unit = options.unit == "sector" ? SECT : 1;
+      what = value > image.size() / unit
+                 ? "past the end of the image"
+                 : describe_offset(image, volumes, value * unit, options.map,
+                                   options.stats);
+    } else {
+      auto &v = volumes[0];
+      what = "partition " + std::to_string(v.opened.partition.index) + ", ";
+      if (value < 2 || value >= v.opened.volume.cluster_count()) {
+        what += "no cluster " + std::to_string(value);
+      } else {
+        what += describe_cluster(v.opened.volume,
+                                 owner_map(v, options.map, options.stats),
+                                 (uint32_t)value, 0);
+      }
+    }
+    os << target << ": " << what << '\n';
+  };
+
+  for (auto &target : options.targets) {
+    if (target != "-") {
+      answer(target);
+      continue;
+    }
+    // answers are flushed at the end, not before every read
+    in.tie(nullptr);
+    std::string word;
+    while (in >> word) {
+      answer(word);
+    }
+  }
+  os.flush();
+  return ret;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <istream>
+#include <ostream>
+#include <string>
+#include <vector>
+
+struct WhoisOptions {
+  std::string file;
+  std::vector<std::string> targets; // "-" reads more of them from in
+  int partition = -1;
+  std::string unit = "byte"; // "sector" or "cluster" of the partition
+  std::string map;           // where the owner map is kept, "" - nowhere
+  bool stats = false;        // how the owner map was made, to stderr
+};
+
+// Tells what every target, an offset into the image in decimal or 0x hex,
+// belongs to: the MBR, a boot sector, a FAT entry, a root directory slot or
+// the file a cluster is in and where in it. Owners come from an OwnerMap,
+// made for a partition when the first target lands in its data region and
+// kept in options.map if given. Answers go to os, a line per target.
+int whois_image(const WhoisOptions &options, std::istream &in,
+                std::ostream &os);
@@ -0,0 +1,106 @@
+#include <algorithm>
+
+#include "work_pool.h"
+
+// the pool and queue of the worker running on this thread
+static thread_local WorkPool *current_pool = nullptr;
+static thread_local unsigned current_queue = 0;
+
+WorkPool::WorkPool(unsigned threads) {
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  for (unsigned i = 0; i < threads; ++i) {
+    queues_.emplace_back(std::make_unique<Queue>());
+  }
+  for (unsigned i = 0; i < threads; ++i) {
+    threads_.emplace_back([this, i] { run(i); });
+  }
+}
+
+WorkPool::~WorkPool() {
+  wait();
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    stop_ = true;
+  }
+  work_cv_.notify_all();
+  for (auto &t : threads_) {
+    t.join();
+  }
+}
+
+void WorkPool::submit(Task task) {
+  auto i = current_pool == this
+               ? current_queue
+               : next_queue_++ % (unsigned)queues_.size();
+  {
+    std::lock_guard<std::mutex> lock(queues_[i]->lock);
+    queues_[i]->tasks.emplace_back(std::move(task));
+  }
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    ++queued_;
+    ++pending_;
+  }
+  work_cv_.notify_one();
+}
+
+void WorkPool::wait() {
+  std::unique_lock<std::mutex> lock(lock_);
+  done_cv_.wait(lock, [this] { return pending_ == 0; });
+}
+
+bool WorkPool::take(unsigned self, Task &task) {
+  {
+    auto &q = *queues_[self];
+    std::lock_guard<std::mutex> lock(q.lock);
+    if (!q.tasks.empty()) {
+      task = std::move(q.tasks.back());
+      q.tasks.pop_back();
+      return true;
+    }
+  }
+  for (size_t n = 1; n < queues_.size(); ++n) {
+    auto &q = *queues_[(self + n) % queues_.size()];
+    std::lock_guard<std::mutex> lock(q.lock);
+    if (!q.tasks.empty()) {
+      task = std::move(q.tasks.front());
+      q.tasks.pop_front();
+      return true;
+    }
+  }
+  return false;
+}
+
+void WorkPool::run(unsigned self) {
+  current_pool = this;
+  current_queue = self;
+
+  Task task;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(lock_);
+      work_cv_.wait(lock, [this] { return stop_ || queued_ > 0; });
+      if (stop_ && queued_ == 0) {
+        return;
+      }
+    }
+    // another worker may get there first, then wait again
+    if (!take(self, task)) {
+      continue;
+    }
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      --queued_;
+    }
+
+    task();
+    task = nullptr;
+
+    std::lock_guard<std::mutex> lock(lock_);
+    if (--pending_ == 0) {
+      done_cv_.notify_all();
+    }
+  }
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Thread pool with a task queue per worker. A worker runs the newest task of
+// its own queue first and, when that is empty, steals the oldest task of
+// another worker. Tasks submitted from inside a task go to the submitting
+// worker's queue, so the work a task spawns stays close to it unless some
+// other worker is idle.
+class WorkPool {
+public:
+  using Task = std::function<void()>;
+
+  // 0 threads - one per core
+  explicit WorkPool(unsigned threads);
+  ~WorkPool();
+
+  WorkPool(const WorkPool &) = delete;
+  WorkPool &operator=(const WorkPool &) = delete;
+
+  // Tasks must not throw
+  void submit(Task task);
+  // Blocks until every submitted task, including the ones submitted by
+  // tasks, has finished
+  void wait();
+
+  unsigned size() const { return (unsigned)threads_.size(); }
+
+private:
+  struct Queue {
+    std::mutex lock;
+    std::deque<Task> tasks;
+  };
+
+  bool take(unsigned self, Task &task);
+  void run(unsigned self);
+
+  std::vector<std::unique_ptr<Queue>> queues_;
+  std::vector<std::thread> threads_;
+
+  std::mutex lock_;
+  std::condition_variable work_cv_;
+  std::condition_variable done_cv_;
+  size_t queued_ = 0;  // in some queue, guarded by lock_
+  size_t pending_ = 0; // submitted and not finished, guarded by lock_
+  bool stop_ = false;
+
+  std::atomic<unsigned> next_queue_{0};
+};
@@ -0,0 +1,789 @@
+#!/usr/bin/env python3
+"""Runs the imager on images it synthesizes and checks what it prints and
+writes. One test per run, in a work directory of its own. What the images
+hold is read with fatcheck.py, which does not share code with the imager.
+
+usage: cli_test.py <imager> <work dir> <test>
+exit code 0 - passed, 1 - failed, 2 - usage error
+"""
+
+import csv
+import fnmatch
+import hashlib
+import json
+import os
+import signal
+import socket
+import struct
+import subprocess
+import sys
+import time
+
+import fatcheck
+
+IMAGER = None
+WORK = None
+TESTS = {}
+
+
+class Failure(Exception):
+    pass
+
+
+def test(name):
+    def register(f):
+        TESTS[name] = f
+        return f
+    return register
+
+
+def expect(cond, what):
+    if not cond:
+        raise Failure(what)
+
+
+def expect_equal(got, want, what):
+    if got != want:
+        raise Failure('%s: got %r, want %r' % (what, got, want))
+
+
+def run(*args, code=0):
+    """Runs the imager, returns what it printed to stdout"""
+    p = subprocess.run([IMAGER] + [str(a) for a in args],
+                       stdout=subprocess.PIPE, stderr=subprocess.PIPE,
+                       universal_newlines=True)
+    if code is not None and p.returncode != code:
+        raise Failure('%s exited with %d, not %d:\n%s'
+                      % (' '.join(map(str, args)), p.returncode, code,
+                         p.stderr))
+    return p.stdout
+
+
+def work(name):
+    return os.path.join(WORK, name)
+
+
+# FAT12 holds a few thousand clusters, the rest is synth's defaults
+SIZES = {
+    12: ['--fat', 12, '-c', 3000, '-f', 8, '-d', 2, '--mean-size', 2],
+    16: ['--fat', 16, '-c', 20000],
+    32: [],
+}
+
+# what synth breaks on request
+CORRUPT = ['--bad', 4, '--cross-links', 3, '--loops', 2, '--lost', 2]
+
+
+def synth(name, fat, *options):
+    path = work(name + '.img')
+    run('synth', path, *SIZES[fat], *options)
+    return path
+
+
+class Reference:
+    """An image as fatcheck.py reads it"""
+
+    def __init__(self, path):
+        self.path = path
+        self.problems = []
+        self.tree = fatcheck.check(path, self.problems)
+        self.v = fatcheck.Volume(path)
+        fat = self.v.fat_bytes(0)
+        self.links = [self.v.fat_entry(fat, c) for c in range(self.v.count)]
+        self.owners = {}
+        for p, x in self.tree.items():
+            for c in x[4]:
+                self.owners.setdefault(c, []).append(p)
+        # the FAT32 root has no entry of its own
+        self.root = []
+        c = self.v.root
+        while self.v.bits == 32 and 2 <= c < self.v.count and \
+                c not in self.root:
+            self.root.append(c)
+            c = self.links[c]
+
+    def files(self):
+        return {p: x for p, x in self.tree.items() if x[0] == 'f'}
+
+    def content(self, path):
+        x = self.tree[path]
+        left = x[1]
+        data = b''
+        for c in x[4]:
+            n = min(left, self.v.cs)
+            data += self.v.cluster(c, n)
+            left -= n
+        return data
+
+    def cluster_offset(self, c):
+        return self.v.data + (c - 2) * self.v.cs
+
+    def count(self, value):
+        return sum(1 for c in range(2, self.v.count)
+                   if self.links[c] == value)
+
+
+def images(fats=(12, 16, 32)):
+    """Clean images of every FAT width and broken ones with long names"""
+    res = []
+    for bits in fats:
+        res.append(synth('fat%d' % bits, bits, '--fragmentation', 0.3))
+        res.append(synth('fat%d_broken' % bits, bits, '--long-names',
+                         '--fragmentation', 0.3, *CORRUPT))
+    return res
+
+
+def compact(fat, *options):
+    src = synth('src', fat, '--fragmentation', 0.5, *options)
+    out = work('out.img')
+    run('compact', src, out)
+    src_problems = []
+    src_tree = fatcheck.check(src, src_problems)
+    problems = []
+    tree = fatcheck.check(out, problems)
+    expect(not problems, 'the copy has problems: %s' % problems[:5])
+    differ = [k for k in set(src_tree) | set(tree)
+              if src_tree.get(k, ())[:3] != tree.get(k, ())[:3]]
+    expect(not differ, 'entries differ: %s' % sorted(differ)[:5])
+    split = [k for k, v in tree.items() if v[3] > 1]
+    expect(not split, 'fragmented in the copy: %s' % sorted(split)[:5])
+    return src_problems
+
+
+for bits in (12, 16, 32):
+    test('compact_fat%d' % bits)(lambda bits=bits: compact(bits))
+
+
+@test('compact_cross_links')
+def compact_cross_links():
+    problems = compact(32, '--cross-links', 5, '--loops', 3)
+    expect(any('cross-linked' in p for p in problems),
+           'the source has no cross-links')
+
+
+def expect_tree(ref, files, what):
+    expect(not ref.problems, '%s: problems %s' % (what, ref.problems[:5]))
+    got = {p: ref.content(p) for p in ref.files()}
+    expect_equal(sorted(got), sorted(files), what + ': files')
+    for p, data in files.items():
+        expect(got[p] == data, '%s: content of %s' % (what, p))
+
+
+@test('mkimage')
+def mkimage():
+    # directories of more than 127 entries, with short names, long ones and
+    # long ones that start alike, so that their aliases only differ in ~N
+    root = work('host')
+    files = {'/empty': b''}
+    for i in range(130):
+        files['/f%03d.txt' % i] = b'%d\n' % i * (i * 37 % 500)
+    for i in range(200):
+        files['/many/A long file name number %d.data' % i] = os.urandom(
+            i * 91 % 5000)
+        files['/many/short%d' % i] = b''
+    for i in range(140):
+        files['/many/deeper/Report of the year %d.txt' % i] = b'%d' % i
+    for p, data in files.items():
+        os.makedirs(os.path.dirname(root + p), exist_ok=True)
+        with open(root + p, 'wb') as f:
+            f.write(data)
+
+    path = work('out.img')
+    run('mkimage', root, path)
+    ref = Reference(path)
+    expect_tree(ref, files, 'mkimage')
+    want = set(files) | {'/many', '/many/deeper'}
+    expect_equal(sorted(run('find', path).splitlines()), sorted(want),
+                 'find in the image')
+
+
+@test('dump')
+def dump():
+    for path in images():
+        ref = Reference(path)
+        out = run(path)
+        used = sum(1 for c in range(2, ref.v.count)
+                   if ref.links[c] not in (0, fatcheck.BAD))
+        for line in ('File system: FAT%d, %d clusters'
+                     % (ref.v.bits, ref.v.count - 2),
+                     'Clusters: used=%d bad=%d'
+                     % (used, ref.count(fatcheck.BAD))):
+            expect(line in out, '%s: no "%s" in the dump' % (path, line))
+        # the root directory is listed with the names it has
+        for p in ref.tree:
+            if p.count('/') == 1:
+                expect('File %s ' % p[1:] in out,
+                       '%s: %s is not in the dump' % (path, p))
+
+
+@test('find')
+def find():
+    for path in images():
+        ref = Reference(path)
+        out = run('find', path).splitlines()
+        expect_equal(sorted(out), sorted(ref.tree), path + ': find')
+
+        out = run('find', path, '--name', '*5*', '--min-size', 4000)
+        want = [p for p, x in ref.tree.items() if x[0] == 'f' and
+                x[1] >= 4000 and fnmatch.fnmatchcase(p.split('/')[-1], '*5*')]
+        expect(want, path + ': nothing to find')
+        expect_equal(sorted(out.splitlines()), sorted(want),
+                     path + ': find --name --min-size')
+
+
+def moment(time):
+    """A timeline time in full, a date alone is the start of the day"""
+    date, _, clock = time.partition('T')
+    clock = clock or '00:00:00'
+    return date + 'T' + (clock if '.' in clock else clock + '.00')
+
+
+@test('timeline')
+def timeline():
+    for path in images((12, 32)):
+        ref = Reference(path)
+        rows = list(csv.DictReader(run('timeline', path).splitlines()))
+        expect(rows, path + ': empty timeline')
+        times = [moment(r['time']) for r in rows]
+        expect(times == sorted(times), path + ': not in time order')
+        for r in rows:
+            x = ref.tree.get(r['path'])
+            expect(x is not None, '%s: %s is not on the volume'
+                   % (path, r['path']))
+            expect_equal(int(r['size']), x[1], r['path'] + ' size')
+            expect_equal(int(r['cluster']), x[4][0] if x[4] else 0,
+                         r['path'] + ' cluster')
+        for p in ref.tree:
+            events = sorted(r['event'] for r in rows if r['path'] == p)
+            expect_equal(events, ['accessed', 'created', 'modified'],
+                         path + ': events of ' + p)
+
+        lines = run('timeline', path, '--format', 'ndjson').splitlines()
+        ndjson = [json.loads(line) for line in lines]
+        expect_equal([(r['time'], r['event'], r['path']) for r in ndjson],
+                     [(r['time'], r['event'], r['path']) for r in rows],
+                     path + ': ndjson against csv')
+
+
+def whois_expect(path, unit, answers):
+    out = run('whois', path, '-u', unit, *answers.keys()).splitlines()
+    expect_equal(out, ['%s: %s' % x for x in answers.items()],
+                 '%s: whois -u %s' % (path, unit))
+
+
+@test('whois')
+def whois():
+    for path in images():
+        ref = Reference(path)
+        v = ref.v
+        # a file of two clusters or more, what synth makes of them
+        name, x = next((p, x) for p, x in sorted(ref.files().items())
+                       if len(x[4]) >= 2 and x[1] > v.cs + 512 and
+                       all(len(ref.owners[c]) == 1 for c in x[4]))
+        second = x[4][1]
+        inner = ref.cluster_offset(second) + 7
+        fat2 = v.fat_offset + v.spf * v.bps + 6
+        entry = {12: 4, 16: 3, 32: 1}[v.bits]
+        answers = {
+            '0': 'MBR',
+            str(v.base): 'partition 0, boot sector',
+            str(v.fat_offset): 'partition 0, FAT 1, entry 0',
+            str(fat2): 'partition 0, FAT 2, entry %d' % entry,
+            hex(inner): 'partition 0, cluster %d, %s at %s'
+                        % (second, name, hex(v.cs + 7)),
+            str(os.path.getsize(path)): 'past the end of the image',
+        }
+        if v.bits != 32:
+            answers[str(v.root_offset + 5 * 32)] = (
+                'partition 0, root directory, slot 5')
+        whois_expect(path, 'byte', answers)
+
+        sector = ref.cluster_offset(second) // 512 + 1
+        whois_expect(path, 'sector', {
+            str(v.base // 512): 'partition 0, boot sector',
+            str(sector): 'partition 0, cluster %d, %s at %s'
+                         % (second, name, hex(v.cs + 512)),
+        })
+
+        owners = ref.owners
+        free = next(c for c in range(v.count - 1, 1, -1)
+                    if ref.links[c] == 0)
+        answers = {
+            str(x[4][0]): 'partition 0, cluster %d, %s at 0x0'
+                          % (x[4][0], name),
+            str(free): 'partition 0, cluster %d, free' % free,
+            '1': 'partition 0, no cluster 1',
+            str(v.count): 'partition 0, no cluster %d' % v.count,
+        }
+        bad = [c for c in range(2, v.count) if ref.links[c] == fatcheck.BAD]
+        if bad:
+            answers[str(bad[0])] = 'partition 0, cluster %d, bad' % bad[0]
+        lost = [c for c in range(2, v.count)
+                if ref.links[c] not in (0, fatcheck.BAD) and
+                c not in owners and c not in ref.root]
+        if lost:
+            answers[str(lost[0])] = (
+                'partition 0, cluster %d, allocated, no owner (lost)'
+                % lost[0])
+        whois_expect(path, 'cluster', answers)
+
+        shared = [c for c, o in owners.items() if len(o) > 1]
+        if not shared:
+            continue
+        line = run('whois', path, '-u', 'cluster', shared[0]).strip()
+        expect(line.endswith('(cross-linked)') and
+               all(o in line for o in owners[shared[0]]),
+               '%s: cluster %d is not cross-linked: %s'
+               % (path, shared[0], line))
+
+
+@test('quick')
+def quick():
+    for path in images():
+        out = json.loads(run('-q', path))
+        expect_equal((out['verdict'], out['findings']), ('ok', []),
+                     path + ': verdict')
+
+    # a copy with a broken boot sector signature and one whose FATs differ
+    path = synth('quick', 32)
+    v = fatcheck.Volume(path)
+    with open(path, 'r+b') as f:
+        f.seek(v.base + 510)
+        f.write(b'\0\0')
+    out = json.loads(run('-q', path, code=2))
+    expect_equal(out['verdict'], 'error', 'verdict of a broken signature')
+    expect('boot_signature' in [x['check'] for x in out['findings']],
+           'no boot_signature finding: %s' % out['findings'])
+
+    path = synth('quick', 16)
+    v = fatcheck.Volume(path)
+    with open(path, 'r+b') as f:
+        f.seek(v.fat_offset + v.spf * v.bps + 8)
+        f.write(b'\x34\x12')
+    out = json.loads(run('-q', path, code=1))
+    expect_equal(out['verdict'], 'warning', 'verdict of differing FATs')
+    expect('fat_copies' in [x['check'] for x in out['findings']],
+           'no fat_copies finding: %s' % out['findings'])
+
+
+@test('batch')
+def batch():
+    paths = images((12, 16))
+    out = json.loads(run('batch', *paths))
+    expect_equal([i['path'] for i in out['images']], paths, 'images')
+    for image in out['images']:
+        ref = Reference(image['path'])
+        p = image['partitions'][0]
+        got = {k: p[k] for k in ('fat', 'clusters', 'free', 'bad', 'files',
+                                 'dirs')}
+        want = {'fat': ref.v.bits, 'clusters': ref.v.count - 2,
+                'free': ref.count(0), 'bad': ref.count(fatcheck.BAD),
+                'files': len(ref.files()),
+                'dirs': len(ref.tree) - len(ref.files())}
+        expect_equal(got, want, image['path'])
+
+
+@test('trim_copy')
+def trim_copy():
+    for path in images():
+        ref = Reference(path)
+        # junk in a free cluster, where a deleted file would have been
+        free = next(c for c in range(2, ref.v.count) if ref.links[c] == 0)
+        with open(path, 'r+b') as f:
+            f.seek(ref.cluster_offset(free))
+            f.write(b'deleted' * 64)
+
+        out = work('trimmed.img')
+        if os.path.exists(out):
+            os.unlink(out)
+        run('trim-copy', path, out)
+        expect_equal(os.path.getsize(out), os.path.getsize(path),
+                     path + ': size of the copy')
+        copy = Reference(out)
+        expect_equal(copy.problems, ref.problems, path + ': problems')
+        expect_equal({p: x[:3] for p, x in copy.tree.items()},
+                     {p: x[:3] for p, x in ref.tree.items()},
+                     path + ': the tree of the copy')
+        expect_equal(copy.v.cluster(free), bytes(ref.v.cs),
+                     path + ': free cluster in the copy')
+
+        run('trim-copy', path, '--punch')
+        expect_equal(Reference(path).v.cluster(free), bytes(ref.v.cs),
+                     path + ': punched free cluster')
+
+
+@test('index_verify')
+def index_verify():
+    for path in images((16, 32)):
+        ref = Reference(path)
+        index = work('image.idx')
+        run('index', path, '-o', index)
+        out = run('verify', path, '-i', index)
+        expect('matches' in out, path + ': verify: ' + out)
+
+        name, x = next((p, x) for p, x in sorted(ref.files().items())
+                       if len(x[4]) >= 2 and
+                       all(len(ref.owners[c]) == 1 for c in x[4]))
+        with open(path, 'r+b') as f:
+            f.seek(ref.cluster_offset(x[4][1]) + 100)
+            f.write(b'changed')
+        out = run('verify', path, '-i', index, code=1)
+        expect('differs' in out and
+               'clusters %d of %s' % (x[4][1], name) in out and
+               '1 of ' in out, path + ': verify of a change: ' + out)
+
+
+class Server:
+    """The imager serving something on a socket in the work directory"""
+
+    def __init__(self, *args):
+        self.socket = work('server.sock')
+        if os.path.exists(self.socket):
+            os.unlink(self.socket)
+        self.log = open(work('server.log'), 'w+')
+        self.p = subprocess.Popen([IMAGER] + [str(a) for a in args] +
+                                  ['-s', self.socket],
+                                  stdout=self.log, stderr=subprocess.STDOUT)
+        for _ in range(100):
+            if os.path.exists(self.socket):
+                break
+            expect(self.p.poll() is None, 'the server exited: ' + self.output())
+            time.sleep(0.05)
+        expect(os.path.exists(self.socket), 'the server does not listen')
+
+    def connect(self):
+        s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        s.settimeout(30)
+        s.connect(self.socket)
+        return s
+
+    def output(self):
+        self.log.seek(0)
+        return self.log.read()
+
+    def stop(self):
+        self.p.send_signal(signal.SIGINT)
+        try:
+            code = self.p.wait(30)
+        except subprocess.TimeoutExpired:
+            self.p.kill()
+            raise Failure('the server does not stop')
+        expect_equal(code, 0, 'exit code of the server')
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        if self.p.poll() is None:
+            self.p.kill()
+            self.p.wait()
+
+
+def recv_exactly(f, n, what):
+    data = f.read(n)
+    expect(len(data) == n, 'connection closed in ' + what)
+    return data
+
+
+class Daemon:
+    """A client of the daemon that pipelines requests"""
+
+    def __init__(self, server):
+        self.s = server.connect()
+        self.f = self.s.makefile('rb')
+
+    def ask(self, *requests):
+        """Sends all requests, returns {id: (status, body)}"""
+        lines = ['%d\t%s' % (i, '\t'.join(map(str, r)))
+                 for i, r in enumerate(requests)]
+        self.s.sendall(('\n'.join(lines) + '\n').encode())
+        res = {}
+        for _ in requests:
+            header = self.f.readline().decode()
+            expect(header.endswith('\n'), 'no reply header')
+            id, status, length = header.rstrip('\n').split('\t')
+            res[int(id)] = (status, recv_exactly(self.f, int(length),
+                                                 'a reply'))
+        expect_equal(sorted(res), list(range(len(requests))), 'reply ids')
+        return [res[i] for i in range(len(requests))]
+
+
+@test('daemon')
+def daemon():
+    paths = [synth('fat12', 12, '--long-names'),
+             synth('fat32_broken', 32, *CORRUPT)]
+    refs = [Reference(p) for p in paths]
+    with Server('daemon', *paths) as server:
+        d = Daemon(server)
+        status, body = d.ask(('volumes',))[0]
+        expect_equal(status, 'ok', 'volumes')
+        expect_equal([(x['image'], x['fat'], x['clusters'], x['entries'])
+                      for x in json.loads(body)],
+                     [(p, 'FAT%d' % r.v.bits, r.v.count - 2, len(r.tree))
+                      for p, r in zip(paths, refs)], 'volumes')
+
+        ref = refs[0]
+        name, x = max(ref.files().items(), key=lambda f: f[1][1])
+        root = sorted(p[1:] for p in ref.tree if p.count('/') == 1)
+        data = ref.content(name)
+        replies = d.ask(('stat', 0, name), ('list', 0, '/'),
+                        ('find', 0, '**/*1*.data', 5, 'f'),
+                        ('find', 0, '**/*.data'),
+                        ('read', 0, name, 0, len(data)),
+                        ('read', 0, name, 4000, 5000),
+                        ('health', 1), ('stat', 0, name + '.none'),
+                        ('read', 5, name, 0, 1), ('unknown', 0))
+        expect_equal([r[0] for r in replies], ['ok'] * 7 + ['error'] * 3,
+                     'statuses of %s' % [r[1][:80] for r in replies])
+
+        stat = json.loads(replies[0][1])
+        expect_equal((stat['size'], stat['cluster'], stat['type']),
+                     (x[1], x[4][0], 'file'), 'stat')
+        expect_equal(sorted(e['name'] for e in json.loads(replies[1][1])),
+                     root, 'list /')
+        found = json.loads(replies[2][1])
+        expect(0 < len(found) <= 5 and
+               all(p in ref.tree and fnmatch.fnmatchcase(
+                   p.split('/')[-1], '*1*.data') for p in found),
+               'find: %s' % found)
+        expect_equal(sorted(json.loads(replies[3][1])),
+                     sorted(p for p in ref.tree if p.endswith('.data')),
+                     'find without a limit')
+        expect(replies[4][1] == data, 'read of the whole file')
+        expect(replies[5][1] == data[4000:9000], 'read of a part')
+
+        health = json.loads(replies[6][1])
+        broken = refs[1]
+        expect_equal((health['bad'], health['free'],
+                      health['cross_linked'] > 0),
+                     (broken.count(fatcheck.BAD), broken.count(0), True),
+                     'health')
+        server.stop()
+
+
+# NBD protocol, see
+# https://github.com/NetworkBlockDevice/nbd/blob/master/doc/proto.md
+NBD_MAGIC = 0x4e42444d41474943
+NBD_IHAVEOPT = 0x49484156454f5054
+NBD_OPT_REPLY_MAGIC = 0x3e889045565a9
+NBD_REQUEST_MAGIC = 0x25609513
+NBD_SIMPLE_REPLY_MAGIC = 0x67446698
+NBD_OPT_GO = 7
+NBD_REP_ACK = 1
+NBD_REP_INFO = 3
+NBD_CMD_READ, NBD_CMD_WRITE, NBD_CMD_DISC, NBD_CMD_FLUSH = 0, 1, 2, 3
+
+
+class Nbd:
+    """A client of the NBD server, one request at a time"""
+
+    def __init__(self, server):
+        self.s = server.connect()
+        self.f = self.s.makefile('rb')
+        magic, opt, flags = struct.unpack('>QQH', self.recv(18))
+        expect_equal((magic, opt), (NBD_MAGIC, NBD_IHAVEOPT), 'NBD hello')
+        # fixed newstyle, no zeroes
+        self.s.sendall(struct.pack('>I', 3))
+        self.s.sendall(struct.pack('>QIIIH', NBD_IHAVEOPT, NBD_OPT_GO, 6, 0,
+                                   0))
+        self.size = None
+        while True:
+            magic, opt, kind, length = struct.unpack('>QIII', self.recv(20))
+            expect_equal((magic, opt), (NBD_OPT_REPLY_MAGIC, NBD_OPT_GO),
+                         'NBD option reply')
+            data = self.recv(length)
+            if kind == NBD_REP_INFO and struct.unpack('>H', data[:2])[0] == 0:
+                self.size, self.flags = struct.unpack('>QH', data[2:12])
+            if kind == NBD_REP_ACK:
+                break
+            expect(kind == NBD_REP_INFO, 'NBD_OPT_GO failed with %x' % kind)
+        expect(self.size is not None, 'no export size')
+        self.handle = 0
+
+    def recv(self, n):
+        return recv_exactly(self.f, n, 'NBD')
+
+    def request(self, kind, offset=0, length=0, payload=b''):
+        self.handle += 1
+        self.s.sendall(struct.pack('>IHHQQI', NBD_REQUEST_MAGIC, 0, kind,
+                                   self.handle, offset, length) + payload)
+        if kind == NBD_CMD_DISC:
+            return b''
+        magic, error, handle = struct.unpack('>IIQ', self.recv(16))
+        expect_equal((magic, error, handle),
+                     (NBD_SIMPLE_REPLY_MAGIC, 0, self.handle), 'NBD reply')
+        return self.recv(length) if kind == NBD_CMD_READ else b''
+
+    def read(self, offset, length):
+        return self.request(NBD_CMD_READ, offset, length)
+
+    def write(self, offset, data):
+        self.request(NBD_CMD_WRITE, offset, len(data), data)
+
+    def flush(self):
+        self.request(NBD_CMD_FLUSH)
+
+    def save(self, path):
+        with open(path, 'wb') as f:
+            for off in range(0, self.size, 1 << 20):
+                f.write(self.read(off, min(1 << 20, self.size - off)))
+
+    def close(self):
+        self.request(NBD_CMD_DISC)
+        self.s.close()
+
+
+def host_dir(name):
+    """A directory to serve, {path on the volume: content}"""
+    root = work(name)
+    files = {
+        '/hello.txt': b'hello, world\n',
+        '/empty': b'',
+        '/A file with a long name.txt': b'long name\n' * 1000,
+        '/sub/random.bin': os.urandom(300 * 1024 + 123),
+        '/sub/deeper/note.txt': b'note\n',
+    }
+    for p, data in files.items():
+        os.makedirs(os.path.dirname(root + p), exist_ok=True)
+        with open(root + p, 'wb') as f:
+            f.write(data)
+    return root, files
+
+
+
+@test('nbd_read')
+def nbd_read():
+    root, files = host_dir('host')
+    with Server('nbd', root) as server:
+        nbd = Nbd(server)
+        nbd.save(work('volume.img'))
+        # unaligned reads across sectors
+        whole = open(work('volume.img'), 'rb').read()
+        for off, n in ((1, 1000), (511, 2), (4095, 8193)):
+            expect(nbd.read(off, n) == whole[off:off + n],
+                   'read of %d at %d' % (n, off))
+        nbd.close()
+        server.stop()
+    expect_tree(Reference(work('volume.img')), files, 'served volume')
+
+
+@test('nbd_write')
+def nbd_write():
+    root, files = host_dir('host')
+    with Server('nbd', root, '-w') as server:
+        nbd = Nbd(server)
+        nbd.save(work('volume.img'))
+        ref = Reference(work('volume.img'))
+        # a run across two clusters at an unaligned offset, read back
+        # before and after a flush
+        name = '/sub/random.bin'
+        x = ref.tree[name]
+        base = ref.cluster_offset(x[4][0])
+        expect_equal(x[3], 1, 'fragments of ' + name)
+        data = os.urandom(10000)
+        nbd.write(base + 5000, data)
+        expect(nbd.read(base + 5000, len(data)) == data, 'read after write')
+        nbd.flush()
+        expect(nbd.read(base, 20000)[5000:15000] == data,
+               'read after flush')
+        nbd.close()
+        server.stop()
+    want = bytearray(files[name])
+    want[5000:15000] = data
+    with open(root + name, 'rb') as f:
+        expect(f.read() == want, 'host file after the write')
+
+
+def set_links(nbd, v, links):
+    """Writes FAT32 entries to both FATs a sector at a time, as a host that
+    keeps the FAT in memory does, emfat does not read back what it ignored"""
+    for copy in range(v.nfats):
+        sectors = {}
+        for c, value in links:
+            off = v.fat_offset + copy * v.spf * v.bps + c * 4
+            sector = off - off % 512
+            if sector not in sectors:
+                sectors[sector] = bytearray(nbd.read(sector, 512))
+            struct.pack_into('<I', sectors[sector], off - sector, value)
+        for sector, data in sectors.items():
+            nbd.write(sector, bytes(data))
+
+
+@test('nbd_reserved_tail')
+def nbd_reserved_tail():
+    # clusters a file gives up by truncation are free to the host but still
+    # reserved for the file; another file that takes them must not write
+    # into the host file of the first one, the first one may grow back
+    root = work('host')
+    os.makedirs(root, exist_ok=True)
+    files = {'a.bin': os.urandom(5 * 4096), 'b.bin': os.urandom(4096)}
+    for name, data in files.items():
+        with open(os.path.join(root, name), 'wb') as f:
+            f.write(data)
+
+    def serve(steps):
+        with Server('nbd', root, '-w') as server:
+            nbd = Nbd(server)
+            nbd.save(work('volume.img'))
+            ref = Reference(work('volume.img'))
+            a, b = ref.tree['/a.bin'][4], ref.tree['/b.bin'][4]
+            # the host truncates a.bin to its first cluster
+            set_links(nbd, ref.v, [(a[0], fatcheck.END)] +
+                      [(c, 0) for c in a[1:]])
+            steps(nbd, ref, a, b)
+            nbd.flush()
+            nbd.close()
+            server.stop()
+
+    def host_file(name):
+        with open(os.path.join(root, name), 'rb') as f:
+            return f.read()
+
+    def claim(links_first):
+        def steps(nbd, ref, a, b):
+            links = [(a[1], fatcheck.END), (b[-1], a[1])]
+            data = b'B' * ref.v.cs
+            if links_first:
+                set_links(nbd, ref.v, links)
+            nbd.write(ref.cluster_offset(a[1]), data)
+            if not links_first:
+                set_links(nbd, ref.v, links)
+        return steps
+
+    for links_first in (True, False):
+        serve(claim(links_first))
+        for name, data in files.items():
+            expect(host_file(name) == data,
+                   '%s changed by a cluster b.bin took, links %s' %
+                   (name, 'first' if links_first else 'last'))
+
+    regrown = os.urandom(4096)
+
+    def regrow(nbd, ref, a, b):
+        nbd.write(ref.cluster_offset(a[1]), regrown)
+        set_links(nbd, ref.v, [(a[1], fatcheck.END), (a[0], a[1])])
+
+    serve(regrow)
+    want = files['a.bin'][:4096] + regrown + files['a.bin'][8192:]
+    expect(host_file('a.bin') == want, 'a.bin after growing back')
+
+
+def main(argv):
+    global IMAGER, WORK
+    if len(argv) != 4 or argv[3] not in TESTS:
+        print(__doc__.strip().splitlines()[-2], file=sys.stderr)
+        print('tests:', ' '.join(sorted(TESTS)), file=sys.stderr)
+        return 2
+    IMAGER, WORK = argv[1], os.path.abspath(argv[2])
+    os.makedirs(WORK, exist_ok=True)
+    try:
+        TESTS[argv[3]]()
+    except Failure as e:
+        print('FAILED:', e)
+        return 1
+    print('passed')
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
@@ -0,0 +1,246 @@
+#!/usr/bin/env python3
+"""Consistency check of the first FAT partition of an image, written
+independently of the C++ parser to validate what compact produces where
+fsck.vfat is not at hand.
+
+Checks that the FAT copies are identical, that every chain ends properly
+and is owned by one entry only, that "." and ".." point where they should,
+that file sizes match their chain lengths, that no cluster is lost and
+that the FSInfo free count is right.
+
+Given a second image, checks that too and compares the two trees: every
+path has to be there with the same type, size and content hash, which is
+how a compacted copy is compared with its source.
+
+usage: fatcheck.py <image> [<image to compare with>]
+exit code 0 - consistent (and the same tree), 1 - problems found
+"""
+
+import hashlib
+import mmap
+import struct
+import sys
+
+END = 0x0FFFFFF8
+BAD = 0x0FFFFFF7
+ATTR_VOLUME = 0x08
+ATTR_DIR = 0x10
+ATTR_LFN = 0x0F
+
+
+class Volume:
+    def __init__(self, path):
+        f = open(path, 'rb')
+        self.m = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+        m = self.m
+        self.base = struct.unpack_from('<I', m, 446 + 8)[0] * 512
+        if len(m) < self.base + 512:
+            sys.exit('%s: no FAT volume in the first partition' % path)
+        (self.bps, spc, rsv, self.nfats, self.root_entries, tot16, _,
+         spf16) = struct.unpack_from('<HBHBHHBH', m, self.base + 11)
+        if self.bps == 0 or spc == 0:
+            sys.exit('%s: no FAT volume in the first partition' % path)
+        tot32 = struct.unpack_from('<I', m, self.base + 32)[0]
+        if spf16 == 0:
+            self.spf = struct.unpack_from('<I', m, self.base + 36)[0]
+            self.root = struct.unpack_from('<I', m, self.base + 44)[0]
+            self.fsinfo = struct.unpack_from('<H', m, self.base + 48)[0]
+        else:
+            self.spf, self.root, self.fsinfo = spf16, 0, 0
+        root_sectors = (self.root_entries * 32 + self.bps - 1) // self.bps
+        data_sector = rsv + self.nfats * self.spf + root_sectors
+        self.cs = self.bps * spc
+        self.count = ((tot16 or tot32) - data_sector) // spc + 2
+        if spf16 == 0:
+            self.bits = 32
+        else:
+            self.bits = 12 if self.count - 2 <= 4084 else 16
+        self.fat_offset = self.base + rsv * self.bps
+        self.root_offset = self.fat_offset + self.nfats * self.spf * self.bps
+        self.data = self.base + data_sector * self.bps
+
+    def fat_bytes(self, copy):
+        off = self.fat_offset + copy * self.spf * self.bps
+        return self.m[off:off + self.spf * self.bps]
+
+    # FAT12/16 end and bad marks widened to the FAT32 ones
+    def fat_entry(self, fat, c):
+        if self.bits == 32:
+            return struct.unpack_from('<I', fat, c * 4)[0] & 0x0FFFFFFF
+        if self.bits == 16:
+            x = struct.unpack_from('<H', fat, c * 2)[0]
+            return x | 0x0FFF0000 if x >= 0xFFF7 else x
+        x = struct.unpack_from('<H', fat, c + c // 2)[0]
+        x = x >> 4 if c & 1 else x & 0xFFF
+        return x | 0x0FFFF000 if x >= 0xFF7 else x
+
+    def cluster(self, c, size=None):
+        off = self.data + (c - 2) * self.cs
+        return self.m[off:off + (self.cs if size is None else size)]
+
+
+def fragments(chain):
+    return sum(1 for i, c in enumerate(chain)
+               if i == 0 or chain[i - 1] + 1 != c)
+
+
+def slot_name(e, lfn):
+    if lfn:
+        chars = b''.join(s[1:11] + s[14:26] + s[28:32] for s in reversed(lfn))
+        return chars.decode('utf-16le', 'replace').split('\x00')[0]
+    name = e[0:8].decode('latin1').rstrip()
+    ext = e[8:11].decode('latin1').rstrip()
+    return name + '.' + ext if ext else name
+
+
+def check(path, problems):
+    """Checks the volume, returns {path: (type, size, hash, fragments,
+    clusters)}"""
+    v = Volume(path)
+    fat = v.fat_bytes(0)
+    for k in range(1, v.nfats):
+        if v.fat_bytes(k) != fat:
+            problems.append('FAT copy %d differs' % (k + 1))
+    links = [v.fat_entry(fat, c) for c in range(v.count)]
+    owner = {}
+    tree = {}
+    walked = set()  # first clusters of the directories read
+
+    # A chain is followed on its own to its end or to where it loops back
+    # into itself. Clusters another chain took first are cross-links, they
+    # are reported but still read as part of this chain.
+    def chain(first, who):
+        clusters = []
+        seen = set()
+        crossed = False
+        c = first
+        while True:
+            if c < 2 or c >= v.count:
+                problems.append('%s: bad link %d' % (who, c))
+                break
+            if c in seen:
+                problems.append('%s: loops back to %d' % (who, c))
+                break
+            seen.add(c)
+            if c not in owner:
+                owner[c] = who
+            elif not crossed:
+                problems.append('%s: cross-linked with %s at %d'
+                                % (who, owner[c], c))
+                crossed = True
+            clusters.append(c)
+            n = links[c]
+            if n >= END:
+                break
+            if n == BAD or n == 0:
+                problems.append('%s: chain ends in %x' % (who, n))
+                break
+            c = n
+        return clusters
+
+    def walk(data, dpath, self_first, parent_first):
+        lfn = []
+        for i in range(0, len(data), 32):
+            e = data[i:i + 32]
+            if e[0] == 0:
+                break
+            attr = e[11]
+            if e[0] == 0xE5:
+                lfn = []
+                continue
+            if attr == ATTR_LFN:
+                lfn.append(e)
+                continue
+            name = slot_name(e, lfn)
+            lfn = []
+            first = (struct.unpack_from('<H', e, 20)[0] << 16
+                     | struct.unpack_from('<H', e, 26)[0])
+            size = struct.unpack_from('<I', e, 28)[0]
+            if attr & ATTR_VOLUME:
+                continue
+            if e[0] == 0x2E:
+                want = self_first if e[1] == 0x20 else parent_first
+                if first != want:
+                    problems.append('%s: %r points at %d, not %d'
+                                    % (dpath, name, first, want))
+                continue
+            p = dpath + '/' + name
+            if attr & ATTR_DIR:
+                clusters = chain(first, p)
+                tree[p] = ('d', 0, None, fragments(clusters), clusters)
+                if first in walked:
+                    problems.append('%s: directory read before' % p)
+                    continue
+                walked.add(first)
+                # ".." of a directory in the root is 0
+                walk(b''.join(v.cluster(c) for c in clusters), p, first,
+                     0 if dpath == '' else self_first)
+                continue
+            clusters = chain(first, p) if first else []
+            need = (size + v.cs - 1) // v.cs
+            if len(clusters) != need:
+                problems.append('%s: %d clusters for size %d'
+                                % (p, len(clusters), size))
+            h = hashlib.sha1()
+            left = size
+            for c in clusters:
+                n = min(left, v.cs)
+                h.update(v.cluster(c, n))
+                left -= n
+            tree[p] = ('f', size, h.hexdigest(), fragments(clusters),
+                       clusters)
+
+    if v.bits == 32:
+        clusters = chain(v.root, '/')
+        walked.add(v.root)
+        walk(b''.join(v.cluster(c) for c in clusters), '', v.root, 0)
+    else:
+        walk(v.m[v.root_offset:v.root_offset + v.root_entries * 32],
+             '', 0, 0)
+
+    lost = sum(1 for c in range(2, v.count)
+               if links[c] not in (0, BAD) and c not in owner)
+    if lost:
+        problems.append('%d lost clusters' % lost)
+    if v.bits == 32:
+        free = sum(1 for c in range(2, v.count) if links[c] == 0)
+        fsinfo = v.base + v.fsinfo * v.bps
+        free_count, next_free = struct.unpack_from('<II', v.m, fsinfo + 488)
+        if free_count != free:
+            problems.append('fsinfo free %d, counted %d' % (free_count, free))
+        if next_free != 0xFFFFFFFF and next_free >= v.count:
+            problems.append('fsinfo next %d' % next_free)
+    return tree
+
+
+def report(path):
+    problems = []
+    tree = check(path, problems)
+    print(path, len(tree), 'entries,',
+          sum(x[3] for x in tree.values()), 'fragments,',
+          len(problems), 'problems')
+    for p in problems[:10]:
+        print('  ', p)
+    return tree, problems
+
+
+def main(argv):
+    if len(argv) < 2:
+        print(__doc__.strip().splitlines()[-2], file=sys.stderr)
+        return 2
+    tree, problems = report(argv[1])
+    failed = bool(problems)
+    if len(argv) > 2:
+        other, other_problems = report(argv[2])
+        differ = [k for k in tree
+                  if k not in other or tree[k][:3] != other[k][:3]]
+        differ += [k for k in other if k not in tree]
+        print(len(differ), 'entries differ')
+        for k in differ[:10]:
+            print('  ', k, tree.get(k), other.get(k))
+        failed = failed or bool(other_problems) or bool(differ)
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))